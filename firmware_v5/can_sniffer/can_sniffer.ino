@@ -14,9 +14,46 @@
 ******************************************************************************/
 
 #include <FreematicsPlus.h>
+#include <SD.h>
+
+// print captured frames in candump log format
+#define PRINT_CANDUMP 1
+// log captured frames into binary file on microSD
+#define LOG_TO_SD 1
+#define LOG_FLUSH_INTERVAL 1000 /* ms */
 
 FreematicsESP32 sys;
 COBD obd;
+CCANRing ring;
+CCANFilter filter;
+CCANCapture capture;
+#if LOG_TO_SD
+File logFile;
+uint8_t logBuf[512];
+int logBytes = 0;
+uint32_t logTs = 0;
+uint32_t lastFlush = 0;
+
+bool openLog()
+{
+  SPI.begin();
+  if (!SD.begin(PIN_SD_CS, SPI, SPI_FREQ)) {
+    Serial.println("No SD card");
+    return false;
+  }
+  char path[16];
+  for (int n = 1; n < 1000; n++) {
+    sprintf(path, "/CAN%u.BIN", n);
+    if (!SD.exists(path)) break;
+  }
+  logFile = SD.open(path, FILE_WRITE);
+  if (!logFile) return false;
+  logBytes = writeCANLogHeader(logBuf);
+  Serial.print("Logging to ");
+  Serial.println(path);
+  return true;
+}
+#endif
 
 void setup()
 {
@@ -35,32 +72,47 @@ void setup()
 
   // start on 11-bit/500Kbps CAN bus
   while (!obd.init(PROTO_CAN_11B_500K));
-  
+
+#if LOG_TO_SD
+  openLog();
+#endif
+
   // we are interested in CAN messages with header 7E*
-  obd.setHeaderFilter(0x7E0);
-  obd.setHeaderMask(0xFFFFFFF0);
+  filter.add(0x7E0, 0x7F0);
 
-  // start CAN bus sniffing
-  obd.sniff();
+  // start CAN bus sniffing in background task
+  capture.start(&obd, &ring, &filter);
 }
 
 void loop()
 {
-  byte buf[128];
-  // load one received CAN message into buffer
-  int bytes = obd.receiveCAN(buf, sizeof(buf));
-  if (bytes > 0) {
-    // print timestamp
-    Serial.print('[');
-    Serial.print(millis());
-    Serial.print("] ");
-    // print received CAN message
-    for (int n = 0; n < bytes; n++) {
-      byte d = buf[n];
-      if (d < 0x10) Serial.print('0');
-      Serial.print(d, HEX);
-      Serial.print(' ');
+  CAN_FRAME frames[32];
+  int count = ring.pop(frames, 32);
+  for (int n = 0; n < count; n++) {
+#if PRINT_CANDUMP
+    char line[CAN_CANDUMP_SIZE];
+    formatCandump(frames[n], line);
+    Serial.print(line);
+#endif
+#if LOG_TO_SD
+    if (logFile) {
+      if (logBytes + CAN_MAX_RECORD_SIZE > sizeof(logBuf)) {
+        logFile.write(logBuf, logBytes);
+        logBytes = 0;
+      }
+      logBytes += encodeCANFrame(frames[n], logTs, logBuf + logBytes);
+    }
+#endif
+  }
+#if LOG_TO_SD
+  if (logFile && millis() - lastFlush >= LOG_FLUSH_INTERVAL) {
+    if (logBytes) {
+      logFile.write(logBuf, logBytes);
+      logBytes = 0;
     }
-    Serial.println();
+    logFile.flush();
+    lastFlush = millis();
   }
+#endif
+  if (count == 0) delay(5);
 }
@@ -15,6 +15,17 @@
 * THE SOFTWARE.
 *************************************************************************/
 
+// sparse time index alongside each log file, name not parsed as a log file id
+#define LOG_TS_INDEX_FILE "/DATA/T%u.IDX"
+#define LOG_TS_INDEX_GAP 4096 /* bytes of log between index entries */
+#define LOG_TS_INDEX_BUFFER 16 /* entries kept before appended to file */
+#define LOG_TS_SKEW 1000 /* ms a timestamp may lag behind one logged before */
+
+typedef struct {
+    uint32_t ts;
+    uint32_t offset; /* of timestamp line in log file */
+} LOG_TS_INDEX_ENTRY;
+
 class FileLogger {
 public:
     virtual int begin()
@@ -60,6 +71,7 @@ public:
     {
         char buf[16];
         byte len = sprintf(buf, "0,%u", m_dataTime = ts);
+        if (m_id) indexTime(ts, m_file.position());
         write(buf, len);
     }
     virtual uint32_t open()
@@ -67,7 +79,8 @@ public:
         m_dataCount = 0;
         return 0;
     }
-    void write(const char* buf, byte len)
+    // overridden by loggers and outputters with their own line format
+    virtual void write(const char* buf, byte len)
     {
         if (m_next) m_next->write(buf, len);
         m_file.write((uint8_t*)buf, len);
@@ -80,6 +93,7 @@ public:
     virtual void close()
     {
         m_file.close();
+        flushTimeIndex();
         m_id = 0;
     }
     virtual void flush()
@@ -88,10 +102,36 @@ public:
     }
     virtual uint32_t getDataCount() { return m_dataCount; }
 protected:
+    virtual fs::FS* fs() { return 0; }
+    // notes every LOG_TS_INDEX_GAP bytes where a timestamp line is
+    void indexTime(uint32_t ts, uint32_t offset)
+    {
+        if (m_tsEntries && offset - m_tsOffset < LOG_TS_INDEX_GAP) return;
+        m_tsBuffer[m_tsBuffered].ts = ts;
+        m_tsBuffer[m_tsBuffered].offset = offset;
+        m_tsOffset = offset;
+        m_tsEntries++;
+        if (++m_tsBuffered == LOG_TS_INDEX_BUFFER) flushTimeIndex();
+    }
+    void flushTimeIndex()
+    {
+        if (!m_id || !m_tsBuffered || !fs()) return;
+        char path[24];
+        sprintf(path, LOG_TS_INDEX_FILE, m_id);
+        // file of an earlier log with same id is replaced
+        File file = fs()->open(path, m_tsEntries == m_tsBuffered ? FILE_WRITE : FILE_APPEND);
+        if (file) {
+            file.write((uint8_t*)m_tsBuffer, m_tsBuffered * sizeof(LOG_TS_INDEX_ENTRY));
+            file.close();
+        }
+        m_tsBuffered = 0;
+    }
     int getFileID(File& root)
     {
         int id = 1;
         m_dataCount = 0;
+        m_tsEntries = 0;
+        m_tsBuffered = 0;
         if (root) {
             File file;
             while(file = root.openNextFile()) {
@@ -110,6 +150,10 @@ protected:
     uint32_t m_id = 0;
     File m_file;
     FileLogger* m_next = 0;
+    uint32_t m_tsOffset = 0;
+    uint32_t m_tsEntries = 0;
+    LOG_TS_INDEX_ENTRY m_tsBuffer[LOG_TS_INDEX_BUFFER];
+    byte m_tsBuffered = 0;
 };
 
 class SDLogger : public FileLogger {
@@ -150,6 +194,9 @@ public:
         m_file = SD.open(path, FILE_APPEND);
         if (!m_file) {
             Serial.println("File error");
+        } else {
+            // position is indexed and must be where appended data goes
+            m_file.seek(m_file.size());
         }
     }
     void write(const char* buf, byte len)
@@ -162,8 +209,12 @@ public:
     }
     void setTimestamp(uint32_t ts)
     {
+        // rows of this timestamp start at current position
         m_dataTime = ts;
+        if (m_id) indexTime(ts, m_file.position());
     }
+protected:
+    fs::FS* fs() { return &SD; }
 private:
     uint32_t m_size = 0;
 };
@@ -207,6 +258,8 @@ public:
         }
         return m_id;
     }
+protected:
+    fs::FS* fs() { return &SPIFFS; }
 private:
     void purge()
     {
@@ -227,6 +280,8 @@ private:
             SPIFFS.remove(path);
             Serial.print(path);
             Serial.println(" removed");
+            sprintf(path, LOG_TS_INDEX_FILE, idx);
+            SPIFFS.remove(path);
             sprintf(path, "/DATA/%u.CSV", m_id);
             m_file = SPIFFS.open(path, FILE_APPEND);
             if (!m_file) m_id = 0;
@@ -40,6 +40,7 @@
 #error Unsupported board type
 #endif
 #include "config.h"
+#include "datalogger.h"
 
 #define WIFI_TIMEOUT 5000
 
@@ -98,14 +99,73 @@ int handlerInfo(UrlHandlerParam* param)
 
 #if STORAGE != STORAGE_NONE
 
+#define LOG_READ_BLOCK 512
+
 class LogDataContext {
 public:
     File file;
     uint32_t tsStart;
     uint32_t tsEnd;
     uint16_t pid;
+    // parsing state carried over between calls
+    uint32_t ts;
+    uint32_t duration;
+    uint32_t count;
+    bool done;
+    uint16_t blockLen;
+    uint16_t blockPos;
+    uint8_t lineLen;
+    char line[64];
+    char block[LOG_READ_BLOCK];
 };
 
+// offset in log file from where data of given time on is found, using the sparse time index
+static uint32_t seekLogTime(uint32_t id, uint32_t ts)
+{
+    char path[24];
+    sprintf(path, LOG_TS_INDEX_FILE, id);
+#if STORAGE == STORAGE_SPIFFS
+    File file = SPIFFS.open(path, FILE_READ);
+#else
+    File file = SD.open(path, FILE_READ);
+#endif
+    if (!file) return 0;
+    // last entry before ts less the skew, nothing logged ahead of it can be in range
+    if (ts > LOG_TS_SKEW) ts -= LOG_TS_SKEW; else ts = 0;
+    LOG_TS_INDEX_ENTRY entry;
+    uint32_t lo = 0;
+    uint32_t hi = file.size() / sizeof(entry);
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (!file.seek(mid * sizeof(entry)) || file.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry)) {
+            lo = 0;
+            break;
+        }
+        if (entry.ts < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    uint32_t offset = 0;
+    if (lo > 0 && file.seek((lo - 1) * sizeof(entry)) && file.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry)) {
+        offset = entry.offset;
+    }
+    file.close();
+    return offset;
+}
+
+// takes timestamp of the data that follows, false once nothing further can be in range
+static bool setDataTime(LogDataContext* ctx, uint32_t ts)
+{
+    ctx->ts = ts;
+    if (ctx->duration) {
+        ctx->tsEnd = ctx->ts + ctx->duration;
+        ctx->duration = 0;
+    }
+    return ctx->tsEnd == 0xffffffff || ctx->ts < ctx->tsEnd + LOG_TS_SKEW;
+}
+
 int handlerLogFile(UrlHandlerParam* param)
 {
     LogDataContext* ctx = (LogDataContext*)param->hs->ptr;
@@ -152,7 +212,6 @@ int handlerLogFile(UrlHandlerParam* param)
 
 int handlerLogData(UrlHandlerParam* param)
 {
-    uint32_t duration = 0;
     LogDataContext* ctx = (LogDataContext*)param->hs->ptr;
     param->contentType = HTTPFILETYPE_JSON;
     if (ctx) {
@@ -163,12 +222,15 @@ int handlerLogData(UrlHandlerParam* param)
 			param->hs->ptr = 0;
 			return 0;
 		}
+        if (ctx->done) return 0;
+        param->contentLength = 0;
     } else {
         int id = 0;
         if (param->pucRequest[0] == '/') {
             id = atoi(param->pucRequest + 1);
         }
-        sprintf(param->pucBuffer, "/DATA/%u.CSV", id == 0 ? fileid : id);
+        if (id == 0) id = fileid;
+        sprintf(param->pucBuffer, "/DATA/%u.CSV", id);
         ctx = new LogDataContext;
 #if STORAGE == STORAGE_SPIFFS
         ctx->file = SPIFFS.open(param->pucBuffer, FILE_READ);
@@ -183,57 +245,85 @@ int handlerLogData(UrlHandlerParam* param)
         ctx->pid = mwGetVarValueHex(param->pxVars, "pid", 0);
         ctx->tsStart = mwGetVarValueInt(param->pxVars, "start", 0);
         ctx->tsEnd = 0xffffffff;
-        duration = mwGetVarValueInt(param->pxVars, "duration", 0);
-        if (ctx->tsStart && duration) {
-            ctx->tsEnd = ctx->tsStart + duration;
-            duration = 0;
+        ctx->duration = mwGetVarValueInt(param->pxVars, "duration", 0);
+        if (ctx->tsStart && ctx->duration) {
+            ctx->tsEnd = ctx->tsStart + ctx->duration;
+            ctx->duration = 0;
+        }
+        ctx->ts = 0;
+        ctx->count = 0;
+        ctx->done = false;
+        ctx->blockLen = 0;
+        ctx->blockPos = 0;
+        ctx->lineLen = 0;
+        // jump close to start time
+        if (ctx->tsStart) {
+            uint32_t offset = seekLogTime(id, ctx->tsStart);
+            if (offset && !ctx->file.seek(offset)) ctx->file.seek(0);
         }
         param->hs->ptr = (void*)ctx;
         // JSON head
         param->contentLength = sprintf(param->pucBuffer, "[");
     }
-    
-    int len = 0;
-    char buf[64];
-    uint32_t ts = 0;
-
-    for (;;) {
-        int c = ctx->file.read();
-        if (c == -1) {
-            if (param->contentLength == 0) {
-                // EOF
-                return 0;
+
+    while (param->contentLength + sizeof(ctx->line) + 16 <= param->bufSize) {
+        if (ctx->blockPos == ctx->blockLen) {
+            int bytes = ctx->file.read((uint8_t*)ctx->block, sizeof(ctx->block));
+            if (bytes <= 0) {
+                ctx->done = true;
+                break;
             }
-            // JSON tail
-            if (param->pucBuffer[param->contentLength - 1] == ',') param->contentLength--;
-            param->pucBuffer[param->contentLength++] = ']';
+            ctx->blockLen = bytes;
+            ctx->blockPos = 0;
+        }
+        // split lines out of read block, a line may span two blocks
+        char* p = ctx->block + ctx->blockPos;
+        int avail = ctx->blockLen - ctx->blockPos;
+        char* eol = (char*)memchr(p, '\n', avail);
+        int n = eol ? eol - p : avail;
+        int room = sizeof(ctx->line) - 1 - ctx->lineLen;
+        if (room > n) room = n;
+        memcpy(ctx->line + ctx->lineLen, p, room);
+        ctx->lineLen += room;
+        ctx->blockPos += n;
+        if (!eol) continue;
+        ctx->blockPos++;
+        // line end, process the line
+        ctx->line[ctx->lineLen] = 0;
+        ctx->lineLen = 0;
+        char *value = strchr(ctx->line, ',');
+        if (!value++) continue;
+#if STORAGE == STORAGE_SD
+        // SD rows are ts,pid,value
+        uint32_t ts = atoi(ctx->line);
+        uint16_t pid = hex2uint16(value);
+        if (!(value = strchr(value, ','))) continue;
+        value++;
+        if (ts != ctx->ts && !setDataTime(ctx, ts)) {
+            ctx->done = true;
             break;
         }
-        if (c == '\n') {
-            // line end, process the line
-            buf[len] = 0;
-            char *value = strchr(buf, ',');
-            if (value++) {
-                uint16_t pid = hex2uint16(buf);
-                if (pid == 0) {
-                    // timestamp
-                    ts = atoi(value);
-                    if (duration) {
-                        ctx->tsEnd = ts + duration;
-                        duration = 0;
-                    }
-                } else if (pid == ctx->pid && ts >= ctx->tsStart && ts < ctx->tsEnd) {
-                    // generate json array element
-                    param->contentLength += snprintf(param->pucBuffer + param->contentLength, param->bufSize - param->contentLength,
-                        "[%u,%s],", ts, value);
-                }
+#else
+        uint16_t pid = hex2uint16(ctx->line);
+        if (pid == 0) {
+            // timestamp
+            if (!setDataTime(ctx, atoi(value))) {
+                ctx->done = true;
+                break;
             }
-            len = 0;
-            if (param->contentLength + 32 > param->bufSize) break;
-        } else if (len < sizeof(buf) - 1) {
-            buf[len++] = c;
+            continue;
+        }
+#endif
+        if (pid == ctx->pid && ctx->ts >= ctx->tsStart && ctx->ts < ctx->tsEnd) {
+            // generate json array element
+            param->contentLength += snprintf(param->pucBuffer + param->contentLength, param->bufSize - param->contentLength,
+                ctx->count++ ? ",[%u,%s]" : "[%u,%s]", ctx->ts, value);
         }
     }
+    if (ctx->done) {
+        // JSON tail
+        param->pucBuffer[param->contentLength++] = ']';
+    }
     return FLAG_DATA_STREAM;
 }
 
@@ -293,6 +383,13 @@ int handlerLogDelete(UrlHandlerParam* param)
         bool removal = SD.remove(param->pucBuffer);
 #endif
         if (removal) {
+            char path[24];
+            sprintf(path, LOG_TS_INDEX_FILE, id);
+#if STORAGE == STORAGE_SPIFFS
+            SPIFFS.remove(path);
+#else
+            SD.remove(path);
+#endif
             strcat(param->pucBuffer, " deleted");
         } else {
             strcat(param->pucBuffer, " not found");
@@ -18,6 +18,9 @@
 #define STORAGE_SPIFFS 1
 #define STORAGE_SD 2
 
+#define LOG_FORMAT_CSV 0
+#define LOG_FORMAT_BIN 1
+
 #define PROTOCOL_UDP 1
 #define PROTOCOL_HTTP_GET 2
 #define PROTOCOL_HTTP_POST 3
@@ -31,6 +34,20 @@
 
 // maximum consecutive OBD-II access errors before entering standby
 #define MAX_OBD_ERRORS 5
+// time budget of each OBD-II polling cycle
+#define OBD_CYCLE_BUDGET 250 /* ms */
+
+// capture CAN bus traffic and forward frames to server instead of polling PIDs
+#ifndef ENABLE_CAN_CAPTURE
+#define ENABLE_CAN_CAPTURE 0
+#endif
+// captured frame header filter and mask (mask 0 for all frames)
+#define CAN_CAPTURE_FILTER 0x7E0
+#define CAN_CAPTURE_MASK 0x7F0
+// set to 1 for 29-bit CAN identifiers
+#define CAN_CAPTURE_EXTENDED 0
+// maximum frames in one forwarded packet
+#define CAN_FORWARD_BATCH 16
 
 /**************************************
 * Networking configurations
@@ -60,9 +77,28 @@
 
 #define SERVER_PATH "/api/post"
 
+// enable compact binary data protocol (UDP only, negotiated at login)
+#ifndef ENABLE_BINARY_PROTOCOL
+#define ENABLE_BINARY_PROTOCOL 1
+#endif
+// send only changed values as deltas over binary protocol (negotiated at login)
+#ifndef ENABLE_DELTA_ENCODING
+#define ENABLE_DELTA_ENCODING 1
+#endif
+// packets between full (keyframe) ones in delta encoding
+#define DELTA_KEYFRAME_INTERVAL 10
+// default deadband in encoded units (0.01 for float, 0.000001 for coordinates), 0 for any change
+#define DELTA_DEADBAND 0
+
 #define WIFI_AP_SSID "TELELOGGER"
 #define WIFI_AP_PASSWORD "PASSWORD"
 
+// send data in a separate task so that data collection is not held up by network
+#ifndef ENABLE_NET_TASK
+#define ENABLE_NET_TASK 1
+#endif
+#define NET_TASK_STACK_SIZE 4096 /* bytes */
+
 // maximum consecutive communication errors before reconnecting
 #define MAX_CONN_ERRORS_RECONNECT 3
 // maximum allowed connecting time
@@ -87,6 +123,26 @@
 
 #define RAM_CACHE_SIZE 1024 /* bytes */
 
+// log file format, binary files are converted to CSV when downloaded
+#ifndef LOG_FORMAT
+#define LOG_FORMAT LOG_FORMAT_CSV
+#endif
+
+// preallocate SD log file as contiguous space written in whole sectors (MB, 0 for regular file writes)
+#define SD_PREALLOC_SIZE 0
+
+// keep data packets not delivered to server in storage and send them later (UDP only)
+#ifndef ENABLE_BACKLOG
+#if STORAGE != STORAGE_NONE && SERVER_PROTOCOL == PROTOCOL_UDP
+#define ENABLE_BACKLOG 1
+#else
+#define ENABLE_BACKLOG 0
+#endif
+#endif
+#define BACKLOG_MAX_SIZE (1024L * 1024) /* bytes */
+// maximum backlog packets sent per data sending
+#define BACKLOG_DRAIN_COUNT 4
+
 /**************************************
 * MEMS sensors
 **************************************/
@@ -94,6 +150,18 @@
 #ifndef MEMS_MODE
 #define MEMS_MODE MEMS_9DOF
 #endif
+// accelerometer FIFO sample rate (Hz) for full rate motion features and events, 0 to disable
+#define MEMS_FIFO_ODR 0
+// acceleration magnitude (G) logged as event with surrounding samples
+#define MEMS_EVENT_THRESHOLD 0.8f
+#define MEMS_FIFO_INTERVAL 20 /* ms */
+
+// orientation is fused at full rate from FIFO samples, which needs gyroscope (9DOF)
+#if MEMS_FIFO_ODR && (MEMS_MODE == MEMS_9DOF || (MEMS_MODE == MEMS_ACC && !ENABLE_ORIENTATION))
+#define ENABLE_MEMS_FIFO 1
+#else
+#define ENABLE_MEMS_FIFO 0
+#endif
 
 /**************************************
 * GPS
@@ -104,6 +172,8 @@
 #endif
 #define GPS_SERIAL_BAUDRATE 115200L
 #define GPS_MOTION_TIMEOUT 180 /* seconds */
+// switch u-blox receiver to UBX NAV-PVT output at this interval (0 to keep NMEA)
+#define GPS_BINARY_INTERVAL 0 /* ms */
 
 /**************************************
 * Standby/wakeup
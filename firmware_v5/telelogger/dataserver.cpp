@@ -18,7 +18,7 @@
 * /api/live - live data (OBD/GPS/MEMS)
 * /api/control - issue a control command
 * /api/list - list of log files
-* /api/log/<file #> - raw CSV format log file
+* /api/log/<file #> - log file in CSV format (binary log files converted)
 * /api/delete/<file #> - delete file
 * /api/data/<file #>?pid=<PID in hex> - JSON array of PID data
 *************************************************************************/
@@ -36,6 +36,7 @@
 #include <esp_err.h>
 #include <httpd.h>
 #include "config.h"
+#include "telelogger.h"
 
 #if ENABLE_HTTPD
 
@@ -92,14 +93,126 @@ int handlerInfo(UrlHandlerParam* param)
     return FLAG_DATA_RAW;
 }
 
+#define LOG_READ_BLOCK 512
+
 class LogDataContext {
 public:
     File file;
     uint32_t tsStart;
     uint32_t tsEnd;
     uint16_t pid;
+    // parsing state carried over between calls
+    uint32_t ts;
+    uint32_t duration;
+    uint32_t count;
+    bool done;
+    bool binary;
+    uint32_t recordTs;
+    uint16_t blockLen;
+    uint16_t blockPos;
+    uint8_t lineLen;
+    char line[64];
+    char block[LOG_READ_BLOCK];
 };
 
+// offset in log file from where data of given time on is found, using the sparse time index
+static uint32_t seekLogTime(uint32_t id, uint32_t ts)
+{
+    char path[24];
+    sprintf(path, LOG_TS_INDEX_FILE, id);
+#if STORAGE == STORAGE_SPIFFS
+    File file = SPIFFS.open(path, FILE_READ);
+#else
+    File file = SD.open(path, FILE_READ);
+#endif
+    if (!file) return 0;
+    // last entry before ts less the skew, nothing logged ahead of it can be in range
+    if (ts > LOG_TS_SKEW) ts -= LOG_TS_SKEW; else ts = 0;
+    LOG_TS_INDEX_ENTRY entry;
+    uint32_t lo = 0;
+    uint32_t hi = file.size() / sizeof(entry);
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (!file.seek(mid * sizeof(entry)) || file.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry)) {
+            lo = 0;
+            break;
+        }
+        if (entry.ts < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    uint32_t offset = 0;
+    if (lo > 0 && file.seek((lo - 1) * sizeof(entry)) && file.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry)) {
+        offset = entry.offset;
+    }
+    file.close();
+    return offset;
+}
+
+// resets parsing state, binary log files are recognized by their header
+static void beginLogData(LogDataContext* ctx)
+{
+    ctx->ts = 0;
+    ctx->count = 0;
+    ctx->done = false;
+    ctx->recordTs = 0;
+    ctx->blockLen = 0;
+    ctx->blockPos = 0;
+    ctx->lineLen = 0;
+    char magic[LOG_BIN_HEADER_SIZE];
+    ctx->binary = ctx->file.read((uint8_t*)magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, LOG_BIN_MAGIC, sizeof(magic));
+    if (!ctx->binary) ctx->file.seek(0);
+}
+
+// reads next line of log file into ctx->line, binary records are turned into CSV lines
+// returns line length or -1 at end of data
+static int readLogLine(LogDataContext* ctx)
+{
+    for (;;) {
+        if (ctx->binary) {
+            byte len;
+            int n = decodeLogRecord((uint8_t*)ctx->block + ctx->blockPos, ctx->blockLen - ctx->blockPos, ctx->recordTs, ctx->line, len);
+            if (n > 0) {
+                ctx->blockPos += n;
+                return len;
+            }
+            if (n < 0) return -1;
+            // record spans two blocks, keep its head
+            ctx->blockLen -= ctx->blockPos;
+            memmove(ctx->block, ctx->block + ctx->blockPos, ctx->blockLen);
+            ctx->blockPos = 0;
+            int bytes = ctx->file.read((uint8_t*)ctx->block + ctx->blockLen, sizeof(ctx->block) - ctx->blockLen);
+            if (bytes <= 0) return -1;
+            ctx->blockLen += bytes;
+            continue;
+        }
+        if (ctx->blockPos == ctx->blockLen) {
+            int bytes = ctx->file.read((uint8_t*)ctx->block, sizeof(ctx->block));
+            if (bytes <= 0) return -1;
+            ctx->blockLen = bytes;
+            ctx->blockPos = 0;
+        }
+        // split lines out of read block, a line may span two blocks
+        char* p = ctx->block + ctx->blockPos;
+        int avail = ctx->blockLen - ctx->blockPos;
+        char* eol = (char*)memchr(p, '\n', avail);
+        int n = eol ? eol - p : avail;
+        int room = sizeof(ctx->line) - 1 - ctx->lineLen;
+        if (room > n) room = n;
+        memcpy(ctx->line + ctx->lineLen, p, room);
+        ctx->lineLen += room;
+        ctx->blockPos += n;
+        if (!eol) continue;
+        ctx->blockPos++;
+        int len = ctx->lineLen;
+        ctx->line[len] = 0;
+        ctx->lineLen = 0;
+        return len;
+    }
+}
+
 int handlerLogFile(UrlHandlerParam* param)
 {
     LogDataContext* ctx = (LogDataContext*)param->hs->ptr;
@@ -117,7 +230,7 @@ int handlerLogFile(UrlHandlerParam* param)
         if (param->pucRequest[0] == '/') {
             id = atoi(param->pucRequest + 1);
         }
-        sprintf(param->pucBuffer, "/DATA/%u.CSV", id == 0 ? fileid : id);
+        sprintf(param->pucBuffer, LOG_FILE_PATH, id == 0 ? fileid : id);
         ctx = new LogDataContext;
 #if STORAGE == STORAGE_SPIFFS
         ctx->file = SPIFFS.open(param->pucBuffer, FILE_READ);
@@ -130,9 +243,25 @@ int handlerLogFile(UrlHandlerParam* param)
             delete ctx;
             return FLAG_DATA_RAW;
         }
+        beginLogData(ctx);
         param->hs->ptr = (void*)ctx;
     }
 
+    if (ctx->binary) {
+        // converted to CSV on the fly
+        param->contentLength = 0;
+        while (!ctx->done && param->contentLength + sizeof(ctx->line) + 1 <= param->bufSize) {
+            int len = readLogLine(ctx);
+            if (len < 0) {
+                ctx->done = true;
+                break;
+            }
+            memcpy(param->pucBuffer + param->contentLength, ctx->line, len);
+            param->contentLength += len;
+            param->pucBuffer[param->contentLength++] = '\n';
+        }
+        return param->contentLength ? FLAG_DATA_STREAM : 0;
+    }
     if (!ctx->file.available()) {
         // EOF
         return 0;
@@ -144,7 +273,6 @@ int handlerLogFile(UrlHandlerParam* param)
 
 int handlerLogData(UrlHandlerParam* param)
 {
-    uint32_t duration = 0;
     LogDataContext* ctx = (LogDataContext*)param->hs->ptr;
     param->contentType = HTTPFILETYPE_JSON;
     if (ctx) {
@@ -155,12 +283,15 @@ int handlerLogData(UrlHandlerParam* param)
 			param->hs->ptr = 0;
 			return 0;
 		}
+        if (ctx->done) return 0;
+        param->contentLength = 0;
     } else {
         int id = 0;
         if (param->pucRequest[0] == '/') {
             id = atoi(param->pucRequest + 1);
         }
-        sprintf(param->pucBuffer, "/DATA/%u.CSV", id == 0 ? fileid : id);
+        if (id == 0) id = fileid;
+        sprintf(param->pucBuffer, LOG_FILE_PATH, id);
         ctx = new LogDataContext;
 #if STORAGE == STORAGE_SPIFFS
         ctx->file = SPIFFS.open(param->pucBuffer, FILE_READ);
@@ -175,57 +306,53 @@ int handlerLogData(UrlHandlerParam* param)
         ctx->pid = mwGetVarValueHex(param->pxVars, "pid", 0);
         ctx->tsStart = mwGetVarValueInt(param->pxVars, "start", 0);
         ctx->tsEnd = 0xffffffff;
-        duration = mwGetVarValueInt(param->pxVars, "duration", 0);
-        if (ctx->tsStart && duration) {
-            ctx->tsEnd = ctx->tsStart + duration;
-            duration = 0;
+        ctx->duration = mwGetVarValueInt(param->pxVars, "duration", 0);
+        if (ctx->tsStart && ctx->duration) {
+            ctx->tsEnd = ctx->tsStart + ctx->duration;
+            ctx->duration = 0;
+        }
+        beginLogData(ctx);
+        // jump close to start time
+        if (ctx->tsStart) {
+            uint32_t offset = seekLogTime(id, ctx->tsStart);
+            if (offset && !ctx->file.seek(offset)) ctx->file.seek(ctx->binary ? LOG_BIN_HEADER_SIZE : 0);
         }
         param->hs->ptr = (void*)ctx;
         // JSON head
         param->contentLength = sprintf(param->pucBuffer, "[");
     }
-    
-    int len = 0;
-    char buf[64];
-    uint32_t ts = 0;
 
-    for (;;) {
-        int c = ctx->file.read();
-        if (c == -1) {
-            if (param->contentLength == 0) {
-                // EOF
-                return 0;
-            }
-            // JSON tail
-            if (param->pucBuffer[param->contentLength - 1] == ',') param->contentLength--;
-            param->pucBuffer[param->contentLength++] = ']';
+    while (param->contentLength + sizeof(ctx->line) + 16 <= param->bufSize) {
+        if (readLogLine(ctx) < 0) {
+            ctx->done = true;
             break;
         }
-        if (c == '\n') {
-            // line end, process the line
-            buf[len] = 0;
-            char *value = strchr(buf, ',');
-            if (value++) {
-                uint16_t pid = hex2uint16(buf);
-                if (pid == 0) {
-                    // timestamp
-                    ts = atoi(value);
-                    if (duration) {
-                        ctx->tsEnd = ts + duration;
-                        duration = 0;
-                    }
-                } else if (pid == ctx->pid && ts >= ctx->tsStart && ts < ctx->tsEnd) {
-                    // generate json array element
-                    param->contentLength += snprintf(param->pucBuffer + param->contentLength, param->bufSize - param->contentLength,
-                        "[%u,%s],", ts, value);
+        char *value = strchr(ctx->line, ',');
+        if (value++) {
+            uint16_t pid = hex2uint16(ctx->line);
+            if (pid == 0) {
+                // timestamp
+                ctx->ts = atoi(value);
+                if (ctx->duration) {
+                    ctx->tsEnd = ctx->ts + ctx->duration;
+                    ctx->duration = 0;
+                }
+                if (ctx->tsEnd != 0xffffffff && ctx->ts >= ctx->tsEnd + LOG_TS_SKEW) {
+                    // nothing further in range
+                    ctx->done = true;
+                    break;
                 }
+            } else if (pid == ctx->pid && ctx->ts >= ctx->tsStart && ctx->ts < ctx->tsEnd) {
+                // generate json array element
+                param->contentLength += snprintf(param->pucBuffer + param->contentLength, param->bufSize - param->contentLength,
+                    ctx->count++ ? ",[%u,%s]" : "[%u,%s]", ctx->ts, value);
             }
-            len = 0;
-            if (param->contentLength + 32 > param->bufSize) break;
-        } else if (len < sizeof(buf) - 1) {
-            buf[len++] = c;
         }
     }
+    if (ctx->done) {
+        // JSON tail
+        param->pucBuffer[param->contentLength++] = ']';
+    }
     return FLAG_DATA_STREAM;
 }
 
@@ -233,36 +360,39 @@ int handlerLogList(UrlHandlerParam* param)
 {
     char *buf = param->pucBuffer;
     int bufsize = param->bufSize;
-    File file;
+    int n = snprintf(buf, bufsize, "[");
+    // listed from log index, sizes of active file taken from file system
+    LOG_INDEX_ENTRY entries[16];
+    int count;
+    for (uint32_t pos = logIndex.first(); (count = logIndex.read(pos, entries, 16)) > 0 && n < bufsize; pos += count) {
+        for (int i = 0; i < count; i++) {
+            LOG_INDEX_ENTRY& entry = entries[i];
+            if (!entry.id) continue;
+            if (entry.id == fileid) {
+                char path[24];
+                sprintf(path, LOG_FILE_PATH, entry.id);
 #if STORAGE == STORAGE_SPIFFS
-    File root = SPIFFS.open("/");
-#elif STORAGE == STORAGE_SD
-    File root = SD.open("/DATA");
+                File file = SPIFFS.open(path, FILE_READ);
+#else
+                File file = SD.open(path, FILE_READ);
 #endif
-    int n = snprintf(buf, bufsize, "[");
-    if (root) {
-        while(file = root.openNextFile()) {
-            const char *fn = file.name();
-            if (!strncmp(fn, "/DATA/", 6)) {
-                fn += 6;
-                unsigned int size = file.size();
-                Serial.print(fn);
-                Serial.print(' ');
-                Serial.print(size);
-                Serial.println(" bytes");
-                unsigned int id = atoi(fn);
-                if (id) {
-                    n += snprintf(buf + n, bufsize - n, "{\"id\":%u,\"size\":%u",
-                        id, size);
-                    if (id == fileid) {
-                        n += snprintf(buf + n, bufsize - n, ",\"active\":true");
-                    }
-                    n += snprintf(buf + n, bufsize - n, "},");
+                if (file) {
+                    entry.size = file.size();
+                    file.close();
                 }
             }
+            n += snprintf(buf + n, bufsize - n, "{\"id\":%u,\"size\":%u",
+                entry.id, entry.size);
+            if (entry.tsEnd) {
+                n += snprintf(buf + n, bufsize - n, ",\"start\":%u,\"end\":%u", entry.tsStart, entry.tsEnd);
+            }
+            if (entry.id == fileid) {
+                n += snprintf(buf + n, bufsize - n, ",\"active\":true");
+            }
+            n += snprintf(buf + n, bufsize - n, "},");
         }
-        if (buf[n - 1] == ',') n--;
     }
+    if (buf[n - 1] == ',') n--;
     n += snprintf(buf + n, bufsize - n, "]");
     param->contentType=HTTPFILETYPE_JSON;
     param->contentLength = n;
@@ -275,7 +405,7 @@ int handlerLogDelete(UrlHandlerParam* param)
     if (param->pucRequest[0] == '/') {
         id = atoi(param->pucRequest + 1);
     }
-    sprintf(param->pucBuffer, "/DATA/%u.CSV", id);
+    sprintf(param->pucBuffer, LOG_FILE_PATH, id);
     if (id == fileid) {
         strcat(param->pucBuffer, " still active");
     } else {
@@ -285,6 +415,14 @@ int handlerLogDelete(UrlHandlerParam* param)
         bool removal = SD.remove(param->pucBuffer);
 #endif
         if (removal) {
+            logIndex.remove(id);
+            char path[24];
+            sprintf(path, LOG_TS_INDEX_FILE, id);
+#if STORAGE == STORAGE_SPIFFS
+            SPIFFS.remove(path);
+#else
+            SD.remove(path);
+#endif
             strcat(param->pucBuffer, " deleted");
         } else {
             strcat(param->pucBuffer, " not found");
@@ -16,6 +16,7 @@
 ******************************************************************************/
 
 #include <FreematicsPlus.h>
+#include "config.h"
 #include "telelogger.h"
 #include "teleclient.h"
 
@@ -55,6 +56,17 @@ bool TeleClientUDP::notify(byte event, const char* payload)
     len = sprintf(buf, "VIN=%s", vin);
     netbuf.dispatch(buf, len);
   }
+#if ENABLE_BINARY_PROTOCOL
+  if (event == EVENT_LOGIN) {
+    // offer binary data protocol
+    len = sprintf(buf, "PV=%u", ENABLE_DELTA_ENCODING ? 3 : 2);
+    netbuf.dispatch(buf, len);
+  }
+#endif
+  if (event == EVENT_LOGIN) {
+    // retransmitted commands are recognized, batched commands accepted
+    netbuf.dispatch("CQ=1", 4);
+  }
   if (payload) {
     netbuf.dispatch(payload, strlen(payload));
   }
@@ -106,6 +118,11 @@ bool TeleClientUDP::notify(byte event, const char* payload)
         char *q = strchr(p, ',');
         if (q) *q = 0;
       }
+      // binary protocol is used only when accepted by server
+      p = strstr(data, "PV=");
+      protocol = p ? atoi(p + 3) : 1;
+      // delta encoding starts over in new session
+      resync = true;
       feedid = hex2uint16(data);
       login = true;
     } else if (event == EVENT_LOGOUT) {
@@ -174,40 +191,106 @@ bool TeleClientUDP::transmit(const char* packetBuffer, unsigned int packetSize)
   return false;
 }
 
-void TeleClientUDP::inbound()
+bool TeleClientUDP::transmitBacklog(char* packet, unsigned int len, uint32_t seq)
 {
-  // check incoming datagram
+  packet[0] = BACKLOG_MAGIC;
+  packet[1] = (char)(feedid >> 8);
+  packet[2] = (char)feedid;
+  packet[3] = (char)(seq >> 24);
+  packet[4] = (char)(seq >> 16);
+  packet[5] = (char)(seq >> 8);
+  packet[6] = (char)seq;
+  if (!net.send(packet, len)) return false;
+  txBytes += len;
+  txCount++;
+  // wait for acknowledgement of the sequence number
+  char pattern[16];
+  sprintf(pattern, "EV=%u", EVENT_BACKLOG);
+  uint32_t t = millis();
   do {
-    int len = 0;
-    char *data = net.receive(&len, 0);
-    if (!data) break;
-    data[len] = 0;
-    rxBytes += len;
-    if (!verifyChecksum(data)) {
-      Serial.print("Checksum mismatch:");
-      Serial.println(data);
-      break;
+    int bytes = 0;
+    char *data = net.receive(&bytes, 0);
+    if (!data) {
+      delay(50);
+      continue;
     }
-    char *p = strstr(data, "EV=");
-    if (!p) break;
-    int eventID = atoi(p + 3);
-    switch (eventID) {
-    case EVENT_COMMAND:
-      processCommand(data);
-      break;
-    case EVENT_SYNC:
-        {
-          uint16_t id = hex2uint16(data);
-          if (id && id != feedid) {
-            feedid = id;
-            Serial.print("FEED ID:");
-            Serial.println(feedid);
-          }
-        }
-        break;
+    data[bytes] = 0;
+    rxBytes += bytes;
+    if (!verifyChecksum(data)) continue;
+    // keyframe request is honoured whichever datagram carries it
+    if (strstr(data, "KF=1")) resync = true;
+    char *p = strstr(data, "SQ=");
+    if (strstr(data, pattern) && p && strtoul(p + 3, 0, 10) == seq) {
+      lastSyncTime = millis();
+      return true;
+    }
+    // other datagrams (commands, sync) are left for inbound()
+    if (!pendingBytes && bytes < (int)sizeof(pending)) {
+      // copied before marked, inbound() is called by main loop while not sending
+      strcpy(pending, data);
+      pendingBytes = strlen(pending);
+    } else {
+      Serial.println("Datagram dropped");
     }
-    lastSyncTime = millis();
-  } while(0);
+  } while (millis() - t < DATA_RECEIVING_TIMEOUT);
+  Serial.println("Backlog not acknowledged");
+  return false;
+}
+
+void TeleClientUDP::inbound()
+{
+  // datagram received while waiting for backlog acknowledgement goes first
+  if (pendingBytes) {
+    processDatagram(pending);
+    pendingBytes = 0;
+    return;
+  }
+  // check incoming datagram
+  int len = 0;
+  char *data = net.receive(&len, 0);
+  if (!data) return;
+  data[len] = 0;
+  rxBytes += len;
+  if (!verifyChecksum(data)) {
+    Serial.print("Checksum mismatch:");
+    Serial.println(data);
+    return;
+  }
+  processDatagram(data);
+}
+
+void TeleClientUDP::processDatagram(char* data)
+{
+  // commands may follow the header, one per line
+  char *cmds = strchr(data, '\n');
+  if (cmds) *(cmds++) = 0;
+  char *p = strstr(data, "EV=");
+  if (!p) return;
+  int eventID = atoi(p + 3);
+  switch (eventID) {
+  case EVENT_COMMAND:
+    if (!cmds) processCommand(data);
+    break;
+  case EVENT_SYNC:
+      {
+        uint16_t id = hex2uint16(data);
+        if (id && id != feedid) {
+          feedid = id;
+          Serial.print("FEED ID:");
+          Serial.println(feedid);
+        }
+      }
+      // server lost track of delta encoded data
+      if (strstr(data, "KF=1")) resync = true;
+      break;
+  }
+  while (cmds) {
+    char *next = strchr(cmds, '\n');
+    if (next) *(next++) = 0;
+    processCommand(cmds);
+    cmds = next;
+  }
+  lastSyncTime = millis();
 }
 
 bool TeleClientHTTP::transmit(const char* packetBuffer, unsigned int packetSize)
@@ -1,3 +1,4 @@
+#include <atomic>
 #include "config.h"
 
 #define EVENT_LOGIN 1
@@ -7,6 +8,11 @@
 #define EVENT_COMMAND 5
 #define EVENT_ACK 6
 #define EVENT_PING 7
+#define EVENT_BACKLOG 8
+
+// backlog packet header: magic, feed ID (16-bit), sequence number (32-bit)
+#define BACKLOG_MAGIC 0xBA
+#define BACKLOG_HEADER_SIZE 7
 
 class TeleClient
 {
@@ -17,6 +23,8 @@ public:
         txBytes = 0;
         rxBytes = 0;
         login = false;
+        protocol = 1;
+        resync = false;
     }
     virtual bool notify(byte event, const char* payload = 0) { return true; }
     virtual bool connect() { return true; }
@@ -31,6 +39,10 @@ public:
     uint16_t feedid = 0;
     uint32_t startTime = 0;
     bool login = false;
+    // data protocol version agreed with server (1: text, 2: binary, 3: binary delta)
+    byte protocol = 1;
+    // keyframe requested by server, set by network task and taken by main loop
+    std::atomic<bool> resync {false};
 };
 
 class TeleClientUDP : public TeleClient
@@ -41,7 +53,11 @@ public:
     bool transmit(const char* packetBuffer, unsigned int packetSize);
     bool ping();
     void inbound();
+    // sends a backlog packet and waits for acknowledgement, header space is reserved ahead of packet
+    bool transmitBacklog(char* packet, unsigned int len, uint32_t seq);
     bool verifyChecksum(char* data);
+    // handles a checksum verified datagram from server (commands, sync)
+    void processDatagram(char* data);
 #if NET_DEVICE == NET_WIFI
     UDPClientWIFI net;
 #elif NET_DEVICE == NET_SIM800
@@ -53,6 +69,10 @@ public:
 #else
     NullClient net;
 #endif
+private:
+    // datagram received by transmitBacklog() in network task, handled by inbound()
+    char pending[256];
+    volatile uint16_t pendingBytes = 0;
 };
 
 class TeleClientHTTP : public TeleClient
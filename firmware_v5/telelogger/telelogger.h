@@ -2,6 +2,287 @@
 #include <FS.h>
 #include <SD.h>
 #include <SPIFFS.h>
+#if SD_PREALLOC_SIZE
+#include <utility/SdFat.h>
+#endif
+
+// binary data protocol (v2) definitions
+#define PROTOCOL_V2_MAGIC 0xB2
+#define BIN_TYPE_INT 0 /* zigzag varint */
+#define BIN_TYPE_UINT 1 /* varint */
+#define BIN_TYPE_FIXED2 2 /* zigzag varint of value x 100 */
+#define BIN_TYPE_FIXED6 3 /* zigzag varint of value x 1000000 */
+#define BIN_TYPE_TRIPLE 4 /* 3 zigzag varints */
+#define BIN_TYPE_TS_DELTA 5 /* zigzag varint of delta from previous timestamp */
+#define BIN_TYPE_TEXT 6 /* varint length and characters, never delta encoded */
+
+// delta data protocol (v3) definitions
+#define PROTOCOL_V3_MAGIC 0xB3
+#define DELTA_FLAG_KEYFRAME 0x1
+#define DELTA_MAX_PIDS 64 /* must match server */
+#define DELTA_MAX_BANDS 8
+
+#ifndef DELTA_KEYFRAME_INTERVAL
+#define DELTA_KEYFRAME_INTERVAL 10
+#endif
+#ifndef DELTA_DEADBAND
+#define DELTA_DEADBAND 0
+#endif
+
+// store-and-forward backlog
+#define BACKLOG_FILE "/BACKLOG.DAT"
+#define BACKLOG_STATE_FILE "/BACKLOG.POS"
+#define BACKLOG_TEMP_FILE "/BACKLOG.TMP"
+#ifndef BACKLOG_MAX_SIZE
+#define BACKLOG_MAX_SIZE (1024L * 1024)
+#endif
+
+// log file format
+#ifndef LOG_FORMAT
+#define LOG_FORMAT LOG_FORMAT_CSV
+#endif
+#if LOG_FORMAT == LOG_FORMAT_BIN
+#define LOG_FILE_EXT "BIN"
+#else
+#define LOG_FILE_EXT "CSV"
+#endif
+#define LOG_FILE_PATH "/DATA/%u." LOG_FILE_EXT
+#define LOG_BIN_MAGIC "FLB\x01"
+#define LOG_BIN_HEADER_SIZE 4
+#define LOG_MAX_RECORD_SIZE 24 /* key and three 5-byte varints */
+
+// log file catalogue
+#define LOG_INDEX_FILE "/DATA.IDX"
+#define LOG_INDEX_TEMP_FILE "/DATA.TMP"
+#define LOG_INDEX_MAGIC 0x3158444C /* "LDX1" */
+#define LOG_INDEX_COMPACT 64 /* removed entries before index is compacted */
+// sparse time index alongside each log file, name not parsed as a log file id
+#define LOG_TS_INDEX_FILE "/DATA/T%u.IDX"
+#define LOG_TS_INDEX_GAP 4096 /* bytes of log between index entries */
+#define LOG_TS_INDEX_BUFFER 16 /* entries kept before appended to file */
+#define LOG_TS_SKEW 1000 /* ms a timestamp may lag behind one logged before (batched sensor samples) */
+
+// contiguous SD log file
+#define SD_LOG_STATE_FILE "/LOGSTATE.DAT"
+#ifndef SD_SECTOR_BUFFER
+#define SD_SECTOR_BUFFER 4096 /* bytes staged before a multi-block write, multiple of 512 */
+#endif
+#ifndef SD_SYNC_INTERVAL
+#define SD_SYNC_INTERVAL 5000 /* ms, longest time data stays in RAM */
+#endif
+#define SD_CHECKPOINT_SIZE 65536 /* bytes written between saved positions */
+#define SD_CHECKPOINT_MAGIC 0x31504B43 /* "CKP1" */
+
+// OBD-II polling scheduler
+#ifndef OBD_CYCLE_BUDGET
+#define OBD_CYCLE_BUDGET 250 /* ms */
+#endif
+#define OBD_DEFAULT_LATENCY 50 /* ms, until measured */
+#define OBD_MAX_BACKOFF 5 /* period x 32 */
+#define OBD_MAX_STRETCH 2 /* period multiplier for steady values */
+#define OBD_RATE_HIGH 0.02f /* relative change per second polled at target period */
+
+// high rate motion analysis
+#ifndef MEMS_SNIPPET_SAMPLES
+#define MEMS_SNIPPET_SAMPLES 32 /* samples around an event, half before trigger */
+#endif
+#define MEMS_EVENT_HOLDOFF 1000 /* ms between events */
+
+static inline uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline byte encodeVarint(uint8_t* buf, uint32_t v)
+{
+    byte n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return n;
+}
+
+static inline int32_t toFixed(float value, int32_t scale)
+{
+    return (int32_t)(value * scale + (value < 0 ? -0.5f : 0.5f));
+}
+
+// scaled in double, as float would alter the 6th decimal of coordinates
+static inline int32_t toFixed6(float value)
+{
+    return (int32_t)((double)value * 1000000 + (value < 0 ? -0.5 : 0.5));
+}
+
+static uint16_t crc16(const uint8_t* data, int len)
+{
+    // CRC-16/CCITT
+    uint16_t crc = 0xffff;
+    for (int i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (byte n = 0; n < 8; n++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// sample value formatters, equivalent to %X, %u, %d and %.nf of sprintf
+static byte formatHex(char* buf, uint16_t v)
+{
+    byte n = 0;
+    for (int8_t shift = 12; shift >= 0; shift -= 4) {
+        byte d = (v >> shift) & 0xf;
+        if (d || n || shift == 0) buf[n++] = d < 10 ? '0' + d : 'A' + d - 10;
+    }
+    return n;
+}
+
+static byte formatUint(char* buf, uint32_t v)
+{
+    char tmp[10];
+    byte n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    for (byte i = 0; i < n; i++) buf[i] = tmp[n - 1 - i];
+    return n;
+}
+
+static byte formatInt(char* buf, int32_t v)
+{
+    if (v >= 0) return formatUint(buf, v);
+    buf[0] = '-';
+    return formatUint(buf + 1, -(uint32_t)v) + 1;
+}
+
+static byte formatFixed(char* buf, float value, byte digits)
+{
+    static const uint32_t scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    if (!(value > -4e9f && value < 4e9f) || digits > 6) {
+        // out of range or NaN
+        return sprintf(buf, "%.*f", digits, value);
+    }
+    byte n = 0;
+    if (value < 0) {
+        buf[n++] = '-';
+        value = -value;
+    }
+    // fraction is taken apart as 32-bit binary fixed-point, which is exact, then scaled and rounded half to even
+    uint32_t ip = (uint32_t)value;
+    uint32_t scale = scales[digits];
+    uint64_t x = (uint64_t)((value - ip) * 4294967296.0f) * scale;
+    uint32_t fp = (uint32_t)(x >> 32);
+    uint32_t rem = (uint32_t)x;
+    if (rem > 0x80000000 || (rem == 0x80000000 && (fp & 1))) fp++;
+    if (fp >= scale) {
+        ip++;
+        fp -= scale;
+    }
+    n += formatUint(buf + n, ip);
+    if (digits) {
+        buf[n++] = '.';
+        for (byte i = digits; i > 0; i--) {
+            buf[n + i - 1] = '0' + fp % 10;
+            fp /= 10;
+        }
+        n += digits;
+    }
+    return n;
+}
+
+static inline byte decodeVarint(const uint8_t* buf, int len, uint32_t& v)
+{
+    v = 0;
+    for (byte n = 0; n < len && n < 5; n++) {
+        v |= (uint32_t)(buf[n] & 0x7f) << (n * 7);
+        if (!(buf[n] & 0x80)) return n + 1;
+    }
+    return 0;
+}
+
+static byte formatScaled(char* buf, int32_t v, uint32_t scale, byte digits)
+{
+    byte n = 0;
+    uint32_t u = v;
+    if (v < 0) {
+        buf[n++] = '-';
+        u = -(uint32_t)v;
+    }
+    n += formatUint(buf + n, u / scale);
+    buf[n++] = '.';
+    u %= scale;
+    for (byte i = digits; i > 0; i--) {
+        buf[n + i - 1] = '0' + u % 10;
+        u /= 10;
+    }
+    return n + digits;
+}
+
+/*
+  Binary log record, same encoding as the v2 data protocol:
+  varint key (PID << 3 | type) followed by value(s)
+  Timestamps (PID 0) are deltas from the previous one (BIN_TYPE_TS_DELTA) except
+  at time index points where they are absolute (BIN_TYPE_UINT), so decoding can
+  start there. A zero byte where a record starts marks the end of data.
+  Decodes one record into a CSV line, returns bytes consumed, 0 if the record
+  is incomplete or -1 at end of data.
+*/
+static int decodeLogRecord(const uint8_t* buf, int len, uint32_t& ts, char* line, byte& lineLen)
+{
+    if (len <= 0) return 0;
+    if (buf[0] == 0) return -1;
+    uint32_t key;
+    int n = decodeVarint(buf, len, key);
+    if (!n) return len >= 5 ? -1 : 0;
+    uint16_t pid = key >> 3;
+    byte type = key & 0x7;
+    byte count = type == BIN_TYPE_TRIPLE ? 3 : 1;
+    if (type > BIN_TYPE_TS_DELTA || (pid == 0 && type != BIN_TYPE_UINT && type != BIN_TYPE_TS_DELTA) || (pid != 0 && type == BIN_TYPE_TS_DELTA)) return -1;
+    uint32_t v[3];
+    for (byte i = 0; i < count; i++) {
+        byte m = decodeVarint(buf + n, len - n, v[i]);
+        if (!m) return len - n >= 5 ? -1 : 0;
+        n += m;
+    }
+    byte k = formatHex(line, pid);
+    line[k++] = ',';
+    switch (type) {
+    case BIN_TYPE_INT:
+        k += formatInt(line + k, unzigzag(v[0]));
+        break;
+    case BIN_TYPE_UINT:
+        if (pid == 0) ts = v[0];
+        k += formatUint(line + k, v[0]);
+        break;
+    case BIN_TYPE_FIXED2:
+        k += formatScaled(line + k, unzigzag(v[0]), 100, 2);
+        break;
+    case BIN_TYPE_FIXED6:
+        k += formatScaled(line + k, unzigzag(v[0]), 1000000, 6);
+        break;
+    case BIN_TYPE_TRIPLE:
+        for (byte i = 0; i < 3; i++) {
+            if (i) line[k++] = ';';
+            k += formatInt(line + k, unzigzag(v[i]));
+        }
+        break;
+    case BIN_TYPE_TS_DELTA:
+        ts += unzigzag(v[0]);
+        k += formatUint(line + k, ts);
+        break;
+    }
+    line[k] = 0;
+    lineLen = k;
+    return n;
+}
 
 class CStorageNull;
 
@@ -11,32 +292,41 @@ public:
     virtual void uninit() {}
     virtual void log(uint16_t pid, int value)
     {
-        char buf[24];
-        byte len = sprintf(buf, "%X%c%d", pid, m_delimiter, value);
+        char* buf = reserve(24);
+        byte len = formatKey(buf, pid);
+        len += formatInt(buf + len, value);
         dispatch(buf, len);
     }
     virtual void log(uint16_t pid, unsigned int value)
     {
-        char buf[24];
-        byte len = sprintf(buf, "%X%c%u", pid, m_delimiter, value);
+        char* buf = reserve(24);
+        byte len = formatKey(buf, pid);
+        len += formatUint(buf + len, value);
         dispatch(buf, len);
     }
     virtual void log(uint16_t pid, float value)
     {
-        char buf[24];
-        byte len = sprintf(buf, "%X%c%.2f", pid, m_delimiter, value);
+        char* buf = reserve(24);
+        byte len = formatKey(buf, pid);
+        len += formatFixed(buf + len, value, 2);
         dispatch(buf, len);
     }
     virtual void log(uint16_t pid, int value1, int value2, int value3)
     {
-        char buf[48];
-        byte len = sprintf(buf, "%X%c%d;%d;%d", pid, m_delimiter, value1, value2, value3);
+        char* buf = reserve(48);
+        byte len = formatKey(buf, pid);
+        len += formatInt(buf + len, value1);
+        buf[len++] = ';';
+        len += formatInt(buf + len, value2);
+        buf[len++] = ';';
+        len += formatInt(buf + len, value3);
         dispatch(buf, len);
     }
     virtual void logFloat(uint16_t pid, float value)
     {
-        char buf[32];
-        byte len = sprintf(buf, "%X%c%f", pid, m_delimiter, value);
+        char* buf = reserve(32);
+        byte len = formatKey(buf, pid);
+        len += formatFixed(buf + len, value, 6);
         dispatch(buf, len);
     }
     virtual void timestamp(uint32_t ts)
@@ -61,11 +351,20 @@ protected:
         for (int i = 0; i < len; i++) sum += data[i];
         return sum;
     }
+    // returns where a sample of up to specified size is formatted before dispatched
+    virtual char* reserve(byte size) { return m_scratch; }
+    byte formatKey(char* buf, uint16_t pid)
+    {
+        byte len = formatHex(buf, pid);
+        buf[len++] = m_delimiter;
+        return len;
+    }
     virtual void header(const char* devid) {}
     virtual void tailer() {}
     uint16_t m_samples = 0;
     char m_delimiter = ':';
     CStorageNull* m_next = 0;
+    char m_scratch[48];
 };
 
 class CStorageRAM: public CStorageNull {
@@ -81,14 +380,139 @@ public:
     void uninit()
     {
         if (m_cache) {
-            delete m_cache;
+            delete[] m_cache;
             m_cache = 0;
             m_cacheSize = 0;
         }
+        if (m_refs) {
+            delete[] m_refs;
+            m_refs = 0;
+        }
     }
     void purge() { m_cacheBytes = 0; m_samples = 0; }
     unsigned int length() { return m_cacheBytes; }
     char* buffer() { return m_cache; }
+    // switch between text (1), binary (2) and delta (3) protocol, takes effect from next header
+    void setProtocol(byte protocol, uint16_t feedid = 0)
+    {
+        if (protocol != m_protocol) m_keyframe = true;
+        m_protocol = protocol;
+        m_feedid = feedid;
+        if (m_protocol >= 3 && !m_refs) {
+            m_refs = new DELTA_REF[DELTA_MAX_PIDS];
+        }
+    }
+    byte protocol() { return m_protocol; }
+    // have next packet carry absolute values (protocol v3)
+    void requestKeyframe() { m_keyframe = true; }
+    // values of a PID changing no more than the deadband (in encoded units) are not sent (protocol v3)
+    void setDeadband(uint16_t pid, uint16_t band)
+    {
+        for (byte i = 0; i < DELTA_MAX_BANDS; i++) {
+            if (m_bands[i].band == 0 || m_bands[i].pid == pid) {
+                m_bands[i].pid = pid;
+                m_bands[i].band = band;
+                return;
+            }
+        }
+    }
+    void log(uint16_t pid, int value)
+    {
+        if (m_next) m_next->log(pid, value);
+        if (m_protocol < 2) {
+            CStorageNull::log(pid, value);
+            return;
+        }
+        int32_t v = value;
+        if (!delta(pid, &v, 1)) return;
+        uint8_t buf[12];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_INT);
+        len += encodeVarint(buf + len, zigzag(v));
+        store(buf, len);
+    }
+    void log(uint16_t pid, unsigned int value)
+    {
+        if (m_next) m_next->log(pid, value);
+        if (m_protocol < 2) {
+            CStorageNull::log(pid, value);
+            return;
+        }
+        if (pid == 0) {
+            // timestamp is stored along with the next sample
+            m_pendingTs = value;
+            m_tsPending = true;
+            m_samples++;
+            return;
+        }
+        int32_t v = (int32_t)value;
+        if (!delta(pid, &v, 1)) return;
+        uint8_t buf[12];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_UINT);
+        // unsigned value is sent as is in v2, as signed delta in v3
+        len += encodeVarint(buf + len, m_protocol >= 3 ? zigzag(v) : value);
+        store(buf, len);
+    }
+    void log(uint16_t pid, float value)
+    {
+        if (m_next) m_next->log(pid, value);
+        if (m_protocol < 2) {
+            CStorageNull::log(pid, value);
+            return;
+        }
+        int32_t v = toFixed(value, 100);
+        if (!delta(pid, &v, 1)) return;
+        uint8_t buf[12];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_FIXED2);
+        len += encodeVarint(buf + len, zigzag(v));
+        store(buf, len);
+    }
+    void log(uint16_t pid, int value1, int value2, int value3)
+    {
+        if (m_next) m_next->log(pid, value1, value2, value3);
+        if (m_protocol < 2) {
+            CStorageNull::log(pid, value1, value2, value3);
+            return;
+        }
+        int32_t v[3] = {value1, value2, value3};
+        if (!delta(pid, v, 3)) return;
+        uint8_t buf[20];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_TRIPLE);
+        len += encodeVarint(buf + len, zigzag(v[0]));
+        len += encodeVarint(buf + len, zigzag(v[1]));
+        len += encodeVarint(buf + len, zigzag(v[2]));
+        store(buf, len);
+    }
+    void logFloat(uint16_t pid, float value)
+    {
+        if (m_next) m_next->logFloat(pid, value);
+        if (m_protocol < 2) {
+            CStorageNull::logFloat(pid, value);
+            return;
+        }
+        int32_t v = toFixed6(value);
+        if (!delta(pid, &v, 1)) return;
+        uint8_t buf[12];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_FIXED6);
+        len += encodeVarint(buf + len, zigzag(v));
+        store(buf, len);
+    }
+    // text value (e.g. a CAN frame), not forwarded to storage
+    void logText(uint16_t pid, const char* text, byte len)
+    {
+        if (len > 40) return;
+        if (m_protocol < 2) {
+            char* buf = reserve(len + 8);
+            byte n = formatKey(buf, pid);
+            memcpy(buf + n, text, len);
+            dispatch(buf, n + len);
+            return;
+        }
+        uint8_t buf[48];
+        byte n = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_TEXT);
+        n += encodeVarint(buf + n, len);
+        memcpy(buf + n, text, len);
+        store(buf, n + len);
+    }
     void dispatch(const char* buf, byte len)
     {
         // reserve some space for checksum
@@ -97,25 +521,64 @@ public:
           // m_cache full
           return;
         }
-        // store data in m_cache
-        memcpy(m_cache + m_cacheBytes, buf, len);
+        // store data in m_cache unless formatted right there
+        if (buf != m_cache + m_cacheBytes) memcpy(m_cache + m_cacheBytes, buf, len);
         m_cacheBytes += len;
         m_cache[m_cacheBytes++] = ',';
         m_samples++;
-        if (m_next) m_next->dispatch(buf, len);
     }
 
     void header(const char* devid)
     {
+        m_tsPending = false;
+        m_full = false;
+        if (m_protocol >= 3) {
+            // magic byte, feed ID, sequence number and flags
+            if (++m_packets >= DELTA_KEYFRAME_INTERVAL) m_keyframe = true;
+            if (m_keyframe) {
+                // start over from absolute values
+                m_refCount = 0;
+                m_lastTs = 0;
+                m_packets = 0;
+            }
+            m_cache[0] = PROTOCOL_V3_MAGIC;
+            m_cache[1] = (char)(m_feedid >> 8);
+            m_cache[2] = (char)m_feedid;
+            m_cache[3] = (char)(++m_seq);
+            m_cache[4] = m_keyframe ? DELTA_FLAG_KEYFRAME : 0;
+            m_cacheBytes = 5;
+            m_keyframe = false;
+            return;
+        }
+        if (m_protocol >= 2) {
+            // magic byte followed by feed ID
+            m_cache[0] = PROTOCOL_V2_MAGIC;
+            m_cache[1] = (char)(m_feedid >> 8);
+            m_cache[2] = (char)m_feedid;
+            m_cacheBytes = 3;
+            m_lastTs = 0;
+            return;
+        }
         m_cacheBytes = sprintf(m_cache, "%s#", devid);
     }
     void tailer()
     {
+        if (m_protocol >= 2) {
+            storeTimestamp();
+            uint16_t crc = crc16((uint8_t*)m_cache, m_cacheBytes);
+            m_cache[m_cacheBytes++] = (char)(crc >> 8);
+            m_cache[m_cacheBytes++] = (char)crc;
+            return;
+        }
         if (m_cache[m_cacheBytes - 1] == ',') m_cacheBytes--;
         m_cacheBytes += sprintf(m_cache + m_cacheBytes, "*%X", (unsigned int)checksum(m_cache, m_cacheBytes));
     }
     void untailer()
     {
+        if (m_protocol >= 2) {
+            if (m_cacheBytes >= (m_protocol >= 3 ? 7 : 5)) m_cacheBytes -= 2;
+            return;
+        }
         char *p = strrchr(m_cache, '*');
         if (p) {
             *p = ',';
@@ -123,11 +586,405 @@ public:
         }
     }
 protected:
+    char* reserve(byte size)
+    {
+        // format sample in place when it fits in m_cache
+        if (m_cacheBytes + size + 3 <= m_cacheSize) return m_cache + m_cacheBytes;
+        return m_scratch;
+    }
+    typedef struct {
+        uint16_t pid;
+        int32_t value[3];
+    } DELTA_REF;
+    typedef struct {
+        uint16_t pid;
+        uint16_t band;
+    } DELTA_BAND;
+    // turn values into deltas from those last sent for the PID, returns false if within deadband (protocol v3)
+    bool delta(uint16_t pid, int32_t* v, byte count)
+    {
+        if (m_protocol < 3) return true;
+        DELTA_REF* ref = 0;
+        for (byte i = 0; i < m_refCount; i++) {
+            if (m_refs[i].pid == pid) {
+                ref = m_refs + i;
+                break;
+            }
+        }
+        if (!ref) {
+            // first value of the PID since keyframe is sent as is
+            if (m_refCount < DELTA_MAX_PIDS) {
+                ref = m_refs + (m_refCount++);
+                ref->pid = pid;
+                for (byte n = 0; n < count; n++) ref->value[n] = v[n];
+            }
+            return true;
+        }
+        uint16_t band = DELTA_DEADBAND;
+        for (byte i = 0; i < DELTA_MAX_BANDS && m_bands[i].band; i++) {
+            if (m_bands[i].pid == pid) {
+                band = m_bands[i].band;
+                break;
+            }
+        }
+        bool changed = false;
+        for (byte n = 0; n < count; n++) {
+            int32_t d = v[n] - ref->value[n];
+            if (d > (int32_t)band || d < -(int32_t)band) changed = true;
+        }
+        if (!changed) return false;
+        for (byte n = 0; n < count; n++) {
+            int32_t value = v[n];
+            v[n] -= ref->value[n];
+            ref->value[n] = value;
+        }
+        return true;
+    }
+    bool append(const uint8_t* buf, byte len)
+    {
+        // reserve space for CRC
+        if (m_full || m_cacheBytes + len + 2 > m_cacheSize) {
+            // m_cache full, no more data for this packet as later deltas would refer to dropped ones
+            m_full = true;
+            return false;
+        }
+        memcpy(m_cache + m_cacheBytes, buf, len);
+        m_cacheBytes += len;
+        return true;
+    }
+    void storeTimestamp()
+    {
+        if (!m_tsPending) return;
+        // timestamp encoded as delta from the previous one (within packet for v2, since keyframe for v3)
+        uint8_t buf[8];
+        byte len = encodeVarint(buf, BIN_TYPE_TS_DELTA);
+        len += encodeVarint(buf + len, zigzag((int32_t)(m_pendingTs - m_lastTs)));
+        if (append(buf, len)) {
+            m_lastTs = m_pendingTs;
+            m_tsPending = false;
+        }
+    }
+    void store(const uint8_t* buf, byte len)
+    {
+        storeTimestamp();
+        if (append(buf, len)) {
+            m_samples++;
+        } else if (m_protocol >= 3) {
+            // delta references no longer match those of server
+            m_keyframe = true;
+        }
+    }
     unsigned int m_cacheSize = 0;
     unsigned int m_cacheBytes = 0;
     char* m_cache = 0;
+    uint32_t m_lastTs = 0;
+    uint32_t m_pendingTs = 0;
+    bool m_tsPending = false;
+    bool m_full = false;
+    uint16_t m_feedid = 0;
+    byte m_protocol = 1;
+    // delta encoding states (protocol v3)
+    DELTA_REF* m_refs = 0;
+    byte m_refCount = 0;
+    DELTA_BAND m_bands[DELTA_MAX_BANDS] = {0};
+    byte m_seq = 0;
+    byte m_packets = 0;
+    bool m_keyframe = true;
+};
+
+// RAM cache with a second buffer holding data being sent, so caching continues while sending
+class CStorageRAMDual: public CStorageRAM {
+public:
+    bool init(unsigned int cacheSize)
+    {
+        if (m_cacheSize != cacheSize) {
+            uninit();
+            m_cache = new char[cacheSize];
+            m_sending = new char[cacheSize];
+            m_cacheSize = cacheSize;
+        }
+        return true;
+    }
+    void uninit()
+    {
+        CStorageRAM::uninit();
+        if (m_sending) {
+            delete[] m_sending;
+            m_sending = 0;
+        }
+        m_sendingBytes = 0;
+    }
+    // hand over cached data (with tailer) for sending and start over with empty cache
+    // fails if data handed over previously is not sent yet
+    bool swap()
+    {
+        if (m_sendingBytes) return false;
+        char* p = m_sending;
+        m_sending = m_cache;
+        m_cache = p;
+        m_sendingBytes = m_cacheBytes;
+        purge();
+        return true;
+    }
+    char* sendingBuffer() { return m_sending; }
+    unsigned int sendingLength() { return m_sendingBytes; }
+    // called when handed over data is sent (or given up)
+    void sent() { m_sendingBytes = 0; }
+protected:
+    char* m_sending = 0;
+    volatile unsigned int m_sendingBytes = 0;
+};
+
+typedef struct {
+    uint32_t ts;
+    uint32_t offset; /* of timestamp line (or absolute timestamp record) in log file */
+} LOG_TS_INDEX_ENTRY;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t lastId;
+    uint32_t first; /* entries before this one are all removed */
+    uint32_t removed;
+} LOG_INDEX_HEADER;
+
+typedef struct {
+    uint32_t id; /* 0 when removed */
+    uint32_t size;
+    uint32_t tsStart;
+    uint32_t tsEnd;
+} LOG_INDEX_ENTRY;
+
+/*
+  Catalogue of log files, a header followed by one fixed size entry per file in
+  ascending id order. New files are appended and entries are changed in place,
+  so allocating, purging and listing need no directory scan. The index is only
+  rebuilt from the directory when it is missing or does not add up.
+*/
+class CLogIndex {
+public:
+    // loads index header, rebuilding index from files in dir if needed
+    bool open(fs::FS& fs, const char* dir)
+    {
+        m_fs = &fs;
+        File file = fs.open(LOG_INDEX_FILE, FILE_READ);
+        if (file) {
+            uint32_t size = file.size();
+            bool valid = size >= sizeof(m_hdr) && (size - sizeof(m_hdr)) % sizeof(LOG_INDEX_ENTRY) == 0
+                && file.read((uint8_t*)&m_hdr, sizeof(m_hdr)) == sizeof(m_hdr) && m_hdr.magic == LOG_INDEX_MAGIC;
+            file.close();
+            m_count = (size - sizeof(m_hdr)) / sizeof(LOG_INDEX_ENTRY);
+            if (valid && m_hdr.first <= m_count && m_hdr.removed <= m_count) {
+                // header may lag behind an entry appended right before power loss
+                LOG_INDEX_ENTRY entry;
+                if (last(entry) && entry.id > m_hdr.lastId) m_hdr.lastId = entry.id;
+                return true;
+            }
+        }
+        Serial.println("Rebuilding log index");
+        return rebuild(dir);
+    }
+    uint32_t nextId() { return m_hdr.lastId + 1; }
+    // number of files listed
+    uint32_t count() { return m_count - m_hdr.removed; }
+    // position of first entry for read()
+    uint32_t first() { return m_hdr.first; }
+    // records a new file, ids must be ascending
+    bool add(uint32_t id)
+    {
+        LOG_INDEX_ENTRY entry;
+        if (last(entry) && entry.id == id) return true;
+        if (id <= m_hdr.lastId) return false;
+        entry = {id, 0, 0, 0};
+        File file = m_fs->open(LOG_INDEX_FILE, FILE_APPEND);
+        if (!file) return false;
+        bool success = file.write((uint8_t*)&entry, sizeof(entry)) == sizeof(entry);
+        file.close();
+        if (!success) return false;
+        m_count++;
+        m_hdr.lastId = id;
+        return writeHeader();
+    }
+    // sets size and time range of a file
+    bool update(uint32_t id, uint32_t size, uint32_t tsStart, uint32_t tsEnd)
+    {
+        File file = m_fs->open(LOG_INDEX_FILE, "r+");
+        if (!file) return false;
+        LOG_INDEX_ENTRY entry;
+        int32_t n = locate(file, id, entry);
+        bool success = false;
+        if (n >= 0) {
+            entry.size = size;
+            entry.tsStart = tsStart;
+            entry.tsEnd = tsEnd;
+            success = file.seek(offset(n)) && file.write((uint8_t*)&entry, sizeof(entry)) == sizeof(entry);
+        }
+        file.close();
+        return success;
+    }
+    bool remove(uint32_t id)
+    {
+        File file = m_fs->open(LOG_INDEX_FILE, "r+");
+        if (!file) return false;
+        LOG_INDEX_ENTRY entry;
+        int32_t n = locate(file, id, entry);
+        bool success = false;
+        if (n >= 0) {
+            entry.id = 0;
+            success = file.seek(offset(n)) && file.write((uint8_t*)&entry, sizeof(entry)) == sizeof(entry);
+        }
+        if (success) {
+            m_hdr.removed++;
+            // skip over removed entries at head
+            if (n == m_hdr.first) {
+                while (++m_hdr.first < m_count && file.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry) && entry.id == 0);
+            }
+        }
+        file.close();
+        if (!success) return false;
+        if (m_hdr.removed >= LOG_INDEX_COMPACT && m_hdr.removed * 2 > m_count) {
+            return compact();
+        }
+        return writeHeader();
+    }
+    // id of oldest file, 0 if none
+    uint32_t oldest()
+    {
+        LOG_INDEX_ENTRY entries[8];
+        for (uint32_t pos = m_hdr.first; pos < m_count; pos += 8) {
+            int count = read(pos, entries, 8);
+            for (int i = 0; i < count; i++) {
+                if (entries[i].id) return entries[i].id;
+            }
+            if (count < 8) break;
+        }
+        return 0;
+    }
+    bool last(LOG_INDEX_ENTRY& entry)
+    {
+        return m_count && read(m_count - 1, &entry, 1) == 1;
+    }
+    // reads entries from given position, removed ones included with id 0
+    int read(uint32_t pos, LOG_INDEX_ENTRY* entries, int maxCount)
+    {
+        if (pos >= m_count) return 0;
+        if ((uint32_t)maxCount > m_count - pos) maxCount = m_count - pos;
+        File file = m_fs->open(LOG_INDEX_FILE, FILE_READ);
+        if (!file) return 0;
+        int count = 0;
+        if (file.seek(offset(pos))) {
+            count = file.read((uint8_t*)entries, maxCount * sizeof(LOG_INDEX_ENTRY)) / sizeof(LOG_INDEX_ENTRY);
+        }
+        file.close();
+        return count;
+    }
+private:
+    uint32_t offset(uint32_t n) { return sizeof(m_hdr) + n * sizeof(LOG_INDEX_ENTRY); }
+    // binary search for entry of id, returns its position or -1
+    int32_t locate(File& file, uint32_t id, LOG_INDEX_ENTRY& entry)
+    {
+        // removed entries have lost their id, search over neighbouring ones
+        int32_t lo = m_hdr.first;
+        int32_t hi = (int32_t)m_count - 1;
+        while (lo <= hi) {
+            int32_t mid = (lo + hi) / 2;
+            int32_t n = mid;
+            do {
+                if (!file.seek(offset(n)) || file.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry)) return -1;
+            } while (entry.id == 0 && ++n <= hi);
+            if (entry.id == id) return n;
+            if (entry.id == 0 || entry.id > id) {
+                hi = mid - 1;
+            } else {
+                lo = n + 1;
+            }
+        }
+        return -1;
+    }
+    bool writeHeader()
+    {
+        File file = m_fs->open(LOG_INDEX_FILE, "r+");
+        if (!file) return false;
+        bool success = file.write((uint8_t*)&m_hdr, sizeof(m_hdr)) == sizeof(m_hdr);
+        file.close();
+        return success;
+    }
+    // rewrites index with removed entries dropped
+    bool compact()
+    {
+        File src = m_fs->open(LOG_INDEX_FILE, FILE_READ);
+        File dst = m_fs->open(LOG_INDEX_TEMP_FILE, FILE_WRITE);
+        LOG_INDEX_HEADER hdr = {LOG_INDEX_MAGIC, m_hdr.lastId, 0, 0};
+        bool success = src && dst && src.seek(offset(m_hdr.first)) && dst.write((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr);
+        uint32_t count = 0;
+        LOG_INDEX_ENTRY entries[8];
+        while (success) {
+            int n = src.read((uint8_t*)entries, sizeof(entries)) / sizeof(LOG_INDEX_ENTRY);
+            if (n <= 0) break;
+            for (int i = 0; i < n && success; i++) {
+                if (entries[i].id == 0) continue;
+                success = dst.write((uint8_t*)&entries[i], sizeof(LOG_INDEX_ENTRY)) == sizeof(LOG_INDEX_ENTRY);
+                count++;
+            }
+        }
+        if (src) src.close();
+        if (dst) dst.close();
+        if (!success) {
+            m_fs->remove(LOG_INDEX_TEMP_FILE);
+            return writeHeader();
+        }
+        m_fs->remove(LOG_INDEX_FILE);
+        m_fs->rename(LOG_INDEX_TEMP_FILE, LOG_INDEX_FILE);
+        m_hdr = hdr;
+        m_count = count;
+        return true;
+    }
+    static int compare(const void* a, const void* b)
+    {
+        uint32_t x = ((const LOG_INDEX_ENTRY*)a)->id;
+        uint32_t y = ((const LOG_INDEX_ENTRY*)b)->id;
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    // lists log files in dir, sizes are known but not time ranges
+    bool rebuild(const char* dir)
+    {
+        LOG_INDEX_ENTRY* entries = 0;
+        uint32_t count = 0;
+        uint32_t capacity = 0;
+        File root = m_fs->open(dir);
+        if (root) {
+            File file;
+            while (file = root.openNextFile()) {
+                if (strncmp(file.name(), "/DATA/", 6)) continue;
+                uint32_t id = atoi(file.name() + 6);
+                if (!id) continue;
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    LOG_INDEX_ENTRY* p = (LOG_INDEX_ENTRY*)realloc(entries, capacity * sizeof(LOG_INDEX_ENTRY));
+                    if (!p) break;
+                    entries = p;
+                }
+                entries[count++] = {id, (uint32_t)file.size(), 0, 0};
+            }
+        }
+        if (count) qsort(entries, count, sizeof(LOG_INDEX_ENTRY), compare);
+        // ids keep counting up from existing files even if index cannot be saved
+        m_hdr = {LOG_INDEX_MAGIC, count ? entries[count - 1].id : 0, 0, 0};
+        m_count = 0;
+        File file = m_fs->open(LOG_INDEX_FILE, FILE_WRITE);
+        bool success = file && file.write((uint8_t*)&m_hdr, sizeof(m_hdr)) == sizeof(m_hdr)
+            && (count == 0 || file.write((uint8_t*)entries, count * sizeof(LOG_INDEX_ENTRY)) == count * sizeof(LOG_INDEX_ENTRY));
+        if (file) file.close();
+        if (entries) free(entries);
+        if (success) m_count = count;
+        return success;
+    }
+    fs::FS* m_fs = 0;
+    LOG_INDEX_HEADER m_hdr = {0};
+    uint32_t m_count = 0;
 };
 
+extern CLogIndex logIndex;
+
 class FileLogger : public CStorageNull {
 public:
     FileLogger() { m_delimiter = ','; }
@@ -136,54 +993,373 @@ public:
         if (m_next) m_next->dispatch(buf, len);
         if (m_id == 0) return;
 
-        if (m_file.write((uint8_t*)buf, len) != len) {
-            // try again
-            if (m_file.write((uint8_t*)buf, len) != len) {
-                Serial.println("Error writing. End file logging.");
-                end();
-                return;
-            }
+        // line and terminator in one write call
+        char line[256];
+        memcpy(line, buf, len);
+        line[len] = '\n';
+        // newline ends the timestamp parsed by track()
+        if (append((uint8_t*)line, len + 1)) track(line, len);
+    }
+#if LOG_FORMAT == LOG_FORMAT_BIN
+    // samples are stored as binary records (see decodeLogRecord) instead of text lines
+    void log(uint16_t pid, int value)
+    {
+        if (m_next) m_next->log(pid, value);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_INT);
+        len += encodeVarint(buf + len, zigzag(value));
+        append(buf, len);
+    }
+    void log(uint16_t pid, unsigned int value)
+    {
+        if (m_next) m_next->log(pid, value);
+        if (pid == 0) {
+            logTimestamp(value);
+            return;
         }
-        m_file.write('\n');
-        m_size += (len + 1);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_UINT);
+        len += encodeVarint(buf + len, value);
+        append(buf, len);
+    }
+    void log(uint16_t pid, float value)
+    {
+        if (m_next) m_next->log(pid, value);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_FIXED2);
+        len += encodeVarint(buf + len, zigzag(toFixed(value, 100)));
+        append(buf, len);
+    }
+    void log(uint16_t pid, int value1, int value2, int value3)
+    {
+        if (m_next) m_next->log(pid, value1, value2, value3);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_TRIPLE);
+        len += encodeVarint(buf + len, zigzag(value1));
+        len += encodeVarint(buf + len, zigzag(value2));
+        len += encodeVarint(buf + len, zigzag(value3));
+        append(buf, len);
+    }
+    void logFloat(uint16_t pid, float value)
+    {
+        if (m_next) m_next->logFloat(pid, value);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len = encodeVarint(buf, ((uint32_t)pid << 3) | BIN_TYPE_FIXED6);
+        len += encodeVarint(buf + len, zigzag(toFixed6(value)));
+        append(buf, len);
     }
+#endif
     virtual uint32_t size()
     {
         return m_size;
     }
     virtual void end()
     {
+        m_lock.lock();
         m_file.close();
+        flushTimeIndex();
+        if (m_id) logIndex.update(m_id, m_size, m_tsStart, m_tsEnd);
         m_id = 0;
         m_size = 0;
+        m_lock.unlock();
     }
     virtual void flush()
     {
+        m_lock.lock();
         m_file.flush();
+        m_lock.unlock();
+    }
+    // store-and-forward queue of data packets not delivered to server, used by network task
+    bool backlogAppend(const char* buf, unsigned int len)
+    {
+        m_lock.lock();
+        // sent packets still in file do not count
+        if (m_backlogTail - m_backlogHead + len + 6 > BACKLOG_MAX_SIZE) {
+            m_lock.unlock();
+            Serial.println("Backlog full");
+            return false;
+        }
+        File file = fs().open(BACKLOG_FILE, FILE_APPEND);
+        bool success = false;
+        if (file) {
+            uint8_t hdr[6];
+            uint32_t seq = m_backlogSeq + 1;
+            memcpy(hdr, &seq, 4);
+            hdr[4] = (uint8_t)len;
+            hdr[5] = (uint8_t)(len >> 8);
+            success = file.write(hdr, 6) == 6 && file.write((uint8_t*)buf, len) == len;
+            file.close();
+            if (success) {
+                m_backlogSeq = seq;
+                m_backlogTail += len + 6;
+                saveBacklogState();
+            }
+        }
+        m_lock.unlock();
+        return success;
+    }
+    // reads oldest packet in queue, returns its length (0 if queue is empty)
+    unsigned int backlogPeek(char* buf, unsigned int bufsize, uint32_t* seq)
+    {
+        m_lock.lock();
+        if (m_backlogHead >= m_backlogTail) {
+            m_lock.unlock();
+            return 0;
+        }
+        File file = fs().open(BACKLOG_FILE, FILE_READ);
+        if (!file) {
+            m_lock.unlock();
+            return 0;
+        }
+        uint8_t hdr[6];
+        unsigned int len = 0;
+        if (file.seek(m_backlogHead) && file.read(hdr, 6) == 6) {
+            memcpy(seq, hdr, 4);
+            len = hdr[4] | ((unsigned int)hdr[5] << 8);
+            if (len > bufsize || file.read((uint8_t*)buf, len) != len) {
+                // broken record, drop the rest of queue
+                Serial.println("Backlog corrupted");
+                len = 0;
+                m_backlogHead = m_backlogTail;
+            }
+        }
+        file.close();
+        m_lock.unlock();
+        if (!len) backlogPop();
+        return len;
+    }
+    // removes oldest packet from queue
+    void backlogPop()
+    {
+        m_lock.lock();
+        File file = fs().open(BACKLOG_FILE, FILE_READ);
+        uint8_t hdr[6];
+        if (file && file.seek(m_backlogHead) && file.read(hdr, 6) == 6) {
+            m_backlogHead += 6 + (hdr[4] | ((unsigned int)hdr[5] << 8));
+        } else {
+            m_backlogHead = m_backlogTail;
+        }
+        if (file) file.close();
+        if (m_backlogHead >= m_backlogTail) {
+            // all sent
+            fs().remove(BACKLOG_FILE);
+            m_backlogHead = 0;
+            m_backlogTail = 0;
+        } else if (m_backlogHead >= BACKLOG_MAX_SIZE / 2 && m_backlogHead >= m_backlogTail - m_backlogHead) {
+            // a queue that never drains completely would grow with sent packets
+            compactBacklog();
+        }
+        saveBacklogState();
+        m_lock.unlock();
+    }
+    bool backlogEmpty()
+    {
+        m_lock.lock();
+        bool empty = m_backlogHead >= m_backlogTail;
+        m_lock.unlock();
+        return empty;
     }
 protected:
-    int getFileID(File& root)
+    virtual fs::FS& fs() = 0;
+    void loadBacklog()
+    {
+        // restore queue left from last run
+        m_lock.lock();
+        m_backlogHead = 0;
+        m_backlogTail = 0;
+        File file = fs().open(BACKLOG_STATE_FILE, FILE_READ);
+        if (file) {
+            uint32_t state[2];
+            if (file.read((uint8_t*)state, sizeof(state)) == sizeof(state)) {
+                m_backlogHead = state[0];
+                m_backlogSeq = state[1];
+            }
+            file.close();
+        }
+        if (fs().exists(BACKLOG_TEMP_FILE)) {
+            if (fs().exists(BACKLOG_FILE)) {
+                // compaction did not complete
+                fs().remove(BACKLOG_TEMP_FILE);
+            } else if (fs().rename(BACKLOG_TEMP_FILE, BACKLOG_FILE)) {
+                // compacted queue was not yet renamed
+                m_backlogHead = 0;
+            }
+        }
+        file = fs().open(BACKLOG_FILE, FILE_READ);
+        if (file) {
+            m_backlogTail = file.size();
+            file.close();
+        }
+        if (m_backlogHead > m_backlogTail) m_backlogHead = m_backlogTail;
+        if (m_backlogHead < m_backlogTail) {
+            Serial.print("Backlog:");
+            Serial.print(m_backlogTail - m_backlogHead);
+            Serial.println(" bytes");
+        }
+        m_lock.unlock();
+    }
+    // moves unsent packets to start of a new file, called with m_lock held
+    void compactBacklog()
+    {
+        File src = fs().open(BACKLOG_FILE, FILE_READ);
+        File dst = fs().open(BACKLOG_TEMP_FILE, FILE_WRITE);
+        bool success = src && dst && src.seek(m_backlogHead);
+        uint8_t buf[256];
+        for (uint32_t left = m_backlogTail - m_backlogHead; success && left; ) {
+            unsigned int n = left < sizeof(buf) ? left : sizeof(buf);
+            success = src.read(buf, n) == n && dst.write(buf, n) == n;
+            left -= n;
+        }
+        if (src) src.close();
+        if (dst) dst.close();
+        if (!success || !fs().remove(BACKLOG_FILE)) {
+            fs().remove(BACKLOG_TEMP_FILE);
+            return;
+        }
+        // state is saved first, loadBacklog() finishes an interrupted rename
+        m_backlogTail -= m_backlogHead;
+        m_backlogHead = 0;
+        saveBacklogState();
+        if (!fs().rename(BACKLOG_TEMP_FILE, BACKLOG_FILE)) {
+            Serial.println("Backlog lost");
+            m_backlogTail = 0;
+        }
+    }
+    // called with m_lock held
+    void saveBacklogState()
+    {
+        File file = fs().open(BACKLOG_STATE_FILE, FILE_WRITE);
+        if (file) {
+            uint32_t state[2] = {m_backlogHead, m_backlogSeq};
+            file.write((uint8_t*)state, sizeof(state));
+            file.close();
+        }
+    }
+    // writes to log file, ends file logging on error
+    virtual bool append(const uint8_t* data, unsigned int len)
+    {
+        if (m_id == 0) return false;
+        m_lock.lock();
+        // try again once
+        bool success = m_file.write(data, len) == len || m_file.write(data, len) == len;
+        m_lock.unlock();
+        if (!success) {
+            Serial.println("Error writing. End file logging.");
+            end();
+            return false;
+        }
+        m_size += len;
+        return true;
+    }
+    void writeFileHeader()
+    {
+#if LOG_FORMAT == LOG_FORMAT_BIN
+        append((const uint8_t*)LOG_BIN_MAGIC, LOG_BIN_HEADER_SIZE);
+#endif
+    }
+    // next file id from log index, settling entry of a file left unfinished by power loss
+    uint32_t getFileID(const char* dir)
     {
-        int id = 0;
         m_dataCount = 0;
-        if (root) {
-            File file;
-            while(file = root.openNextFile()) {
-                Serial.println(file.name());
-                if (!strncmp(file.name(), "/DATA/", 6)) {
-                    unsigned int n = atoi(file.name() + 6);
-                    if (n > id) id = n;
-                }
+        m_tsStart = 0;
+        m_tsEnd = 0;
+        m_tsOffset = 0;
+        m_tsEntries = 0;
+        m_tsBuffered = 0;
+        logIndex.open(fs(), dir);
+        LOG_INDEX_ENTRY entry;
+        if (logIndex.last(entry) && entry.size == 0) {
+            char path[24];
+            sprintf(path, LOG_FILE_PATH, entry.id);
+            File file = fs().open(path, FILE_READ);
+            if (file) {
+                logIndex.update(entry.id, file.size(), entry.tsStart, entry.tsEnd);
+                file.close();
+            } else {
+                logIndex.remove(entry.id);
             }
-            id++;
         }
-        return id;
+        return logIndex.nextId();
+    }
+    // keeps time range of data in file for log index, and every LOG_TS_INDEX_GAP
+    // bytes where a timestamp line is for the file's time index
+    void track(const char* buf, byte len)
+    {
+        if (len > 2 && buf[0] == '0' && (buf[1] == ',' || buf[1] == ':')) {
+            m_tsEnd = atoi(buf + 2);
+            if (!m_tsStart) m_tsStart = m_tsEnd;
+            uint32_t offset = m_size - len - 1;
+            if (indexDue(offset)) indexTime(m_tsEnd, offset);
+        }
+    }
+    bool indexDue(uint32_t offset)
+    {
+        return m_tsEntries == 0 || offset - m_tsOffset >= LOG_TS_INDEX_GAP;
+    }
+    void indexTime(uint32_t ts, uint32_t offset)
+    {
+        m_tsBuffer[m_tsBuffered].ts = ts;
+        m_tsBuffer[m_tsBuffered].offset = offset;
+        m_tsOffset = offset;
+        m_tsEntries++;
+        if (++m_tsBuffered == LOG_TS_INDEX_BUFFER) {
+            m_lock.lock();
+            flushTimeIndex();
+            m_lock.unlock();
+        }
+    }
+#if LOG_FORMAT == LOG_FORMAT_BIN
+    void logTimestamp(uint32_t ts)
+    {
+        if (m_id == 0) return;
+        uint32_t offset = m_size;
+        bool absolute = indexDue(offset);
+        uint8_t buf[LOG_MAX_RECORD_SIZE];
+        byte len;
+        if (absolute) {
+            // decoding can start from an indexed timestamp
+            len = encodeVarint(buf, BIN_TYPE_UINT);
+            len += encodeVarint(buf + len, ts);
+        } else {
+            len = encodeVarint(buf, BIN_TYPE_TS_DELTA);
+            len += encodeVarint(buf + len, zigzag((int32_t)(ts - m_tsEnd)));
+        }
+        if (!append(buf, len)) return;
+        m_tsEnd = ts;
+        if (!m_tsStart) m_tsStart = ts;
+        if (absolute) indexTime(ts, offset);
+    }
+#endif
+    // called with m_lock held
+    void flushTimeIndex()
+    {
+        if (!m_id || !m_tsBuffered) return;
+        char path[24];
+        sprintf(path, LOG_TS_INDEX_FILE, m_id);
+        // file of an earlier log with same id is replaced
+        File file = fs().open(path, m_tsEntries == m_tsBuffered ? FILE_WRITE : FILE_APPEND);
+        if (file) {
+            file.write((uint8_t*)m_tsBuffer, m_tsBuffered * sizeof(LOG_TS_INDEX_ENTRY));
+            file.close();
+        }
+        m_tsBuffered = 0;
     }
     uint32_t m_dataTime = 0;
     uint32_t m_dataCount = 0;
     uint32_t m_size = 0;
     uint32_t m_id = 0;
+    uint32_t m_tsStart = 0;
+    uint32_t m_tsEnd = 0;
+    uint32_t m_tsOffset = 0;
+    uint32_t m_tsEntries = 0;
+    LOG_TS_INDEX_ENTRY m_tsBuffer[LOG_TS_INDEX_BUFFER];
+    byte m_tsBuffered = 0;
     File m_file;
+    uint32_t m_backlogHead = 0;
+    uint32_t m_backlogTail = 0;
+    uint32_t m_backlogSeq = 0;
+    // file system is used by main loop logging and by network task for backlog
+    Mutex m_lock;
 };
 
 class SDLogger : public FileLogger {
@@ -197,6 +1373,7 @@ public:
             Serial.print(" MB total, ");
             Serial.print((unsigned int)(SD.usedBytes() >> 20));
             Serial.println(" MB used");
+            loadBacklog();
             return true;
         } else {
             Serial.println("NO CARD");
@@ -205,31 +1382,343 @@ public:
     }
     uint32_t begin()
     {
-        File root = SD.open("/DATA");
-        m_id = getFileID(root);
+        m_lock.lock();
         SD.mkdir("/DATA");
+        m_id = getFileID("/DATA");
         char path[24];
-        sprintf(path, "/DATA/%u.CSV", m_id);
+        sprintf(path, LOG_FILE_PATH, m_id);
         Serial.print("File: ");
         Serial.println(path);
         m_file = SD.open(path, FILE_WRITE);
         if (!m_file) {
             Serial.println("File error");
             m_id = 0;
+        } else {
+            logIndex.add(m_id);
         }
+        m_lock.unlock();
+        if (m_id) writeFileHeader();
         return m_id;
     }
     void flush()
     {
         char path[24];
-        sprintf(path, "/DATA/%u.CSV", m_id);
+        sprintf(path, LOG_FILE_PATH, m_id);
+        m_lock.lock();
         m_file.close();
         m_file = SD.open(path, FILE_APPEND);
+        m_lock.unlock();
         if (!m_file) {
             Serial.println("File error");
         }
     }
+protected:
+    fs::FS& fs() { return SD; }
+};
+
+#if SD_PREALLOC_SIZE
+/*
+  Log file preallocated as one contiguous run of clusters and written as raw
+  512-byte sectors with multi-block writes, no FAT or directory update per write.
+  Each write also writes the current partial sector padded with zeros, so data
+  always ends with a zero byte on card. The position is checkpointed every
+  SD_CHECKPOINT_SIZE bytes in the last sector of the file, reserved for it, so
+  after a power loss the end of data is found by scanning at most that many
+  bytes. Allocation and the final file size are done through SdVolume while
+  the FAT file system is not mounted.
+*/
+class SDContiguousLogger : public SDLogger {
+public:
+    bool init()
+    {
+        // FAT file system stays mounted after a run without preallocated file,
+        // it must not be in use while SdVolume writes to card
+        SD.end();
+        SPI.begin();
+        m_nextId = 0;
+        if (m_card.init(SPI_FULL_SPEED, PIN_SD_CS) && m_volume.init(&m_card)) {
+            // finish file left by power loss before a new one is allocated
+            uint32_t state[2];
+            if (readState(state)) {
+                finalize(state[0], state[1], true);
+            }
+            prepare();
+        }
+        return SDLogger::init();
+    }
+    uint32_t begin()
+    {
+        if (!m_nextId) {
+            // regular file writes when no space was preallocated
+            m_contiguous = false;
+            return SDLogger::begin();
+        }
+        // load index, then list the preallocated file
+        m_lock.lock();
+        getFileID("/DATA");
+        m_id = m_fileId = m_nextId;
+        m_nextId = 0;
+        logIndex.add(m_id);
+        m_lock.unlock();
+        m_contiguous = true;
+        m_block = m_bgnBlock;
+        m_buffered = 0;
+        m_size = 0;
+        m_checkpoint = 0;
+        m_lastWrite = millis();
+        writeFileHeader();
+        Serial.print("File: /DATA/");
+        Serial.print(m_id);
+        Serial.print("." LOG_FILE_EXT ", ");
+        Serial.print((m_endBlock - m_bgnBlock + 1) >> 11);
+        Serial.println(" MB contiguous");
+        return m_id;
+    }
+    void flush()
+    {
+        if (!m_contiguous) {
+            SDLogger::flush();
+            return;
+        }
+        // staged data is written when buffer fills up, or here once held too long
+        if (m_id && m_buffered && millis() - m_lastWrite >= SD_SYNC_INTERVAL) {
+            m_lock.lock();
+            writeSectors();
+            m_lock.unlock();
+        }
+    }
+    void end()
+    {
+        if (!m_contiguous) {
+            FileLogger::end();
+            return;
+        }
+        m_lock.lock();
+        if (m_id) writeSectors();
+        m_id = m_fileId;
+        flushTimeIndex();
+        uint32_t length = ((m_block - m_bgnBlock) << 9) + m_buffered;
+        if (length) {
+            logIndex.update(m_fileId, length, m_tsStart, m_tsEnd);
+        } else {
+            logIndex.remove(m_fileId);
+        }
+        // set final size with FAT file system unmounted
+        SD.end();
+        if (m_volume.init(&m_card)) {
+            finalize(m_fileId, length, false);
+        }
+        m_contiguous = false;
+        m_fileId = 0;
+        m_id = 0;
+        m_size = 0;
+        m_lock.unlock();
+    }
+protected:
+    bool append(const uint8_t* data, unsigned int len)
+    {
+        if (!m_contiguous) return SDLogger::append(data, len);
+        if (m_id == 0) return false;
+        if (m_buffered + len > SD_SECTOR_BUFFER) {
+            m_lock.lock();
+            bool success = writeSectors();
+            m_lock.unlock();
+            if (!success) return false;
+        }
+        // keep one sector for the zero end mark
+        if (((m_block - m_bgnBlock) << 9) + m_buffered + len + 512 > ((m_endBlock - m_bgnBlock + 1) << 9)) {
+            m_lock.lock();
+            writeSectors();
+            m_lock.unlock();
+            Serial.println("File full. End file logging.");
+            m_id = 0;
+            return false;
+        }
+        memcpy(m_buffer + m_buffered, data, len);
+        m_buffered += len;
+        m_size += len;
+        return true;
+    }
+private:
+    // called with m_lock held
+    bool writeSectors()
+    {
+        uint16_t full = m_buffered >> 9;
+        uint16_t tail = m_buffered & 511;
+        // partial sector (or an empty one) zero padded as end mark, unless at end of file
+        uint16_t count = full;
+        if (m_block + full <= m_endBlock) {
+            memset(m_buffer + m_buffered, 0, 512 - tail);
+            count++;
+        }
+        if (count == 0) return true;
+        bool success = m_card.writeStart(m_block, count);
+        for (uint16_t n = 0; success && n < count; n++) {
+            success = m_card.writeData(m_buffer + (n << 9));
+        }
+        if (success) success = m_card.writeStop();
+        if (!success) {
+            Serial.println("Error writing. End file logging.");
+            m_id = 0;
+            return false;
+        }
+        m_block += full;
+        if (full) memmove(m_buffer, m_buffer + (full << 9), tail);
+        m_buffered = tail;
+        m_lastWrite = millis();
+        // data is on card up to a record boundary
+        if (m_size - m_checkpoint >= SD_CHECKPOINT_SIZE) {
+            m_checkpoint = m_size;
+            writeCheckpoint(m_fileId, m_checkpoint);
+        }
+        return true;
+    }
+    // raw write of the sector reserved after data blocks, no file system involved
+    bool writeCheckpoint(uint32_t id, uint32_t length)
+    {
+        // spare sector at end of buffer is free between writes
+        uint8_t* block = m_buffer + SD_SECTOR_BUFFER;
+        uint32_t state[3] = {SD_CHECKPOINT_MAGIC, id, length};
+        memset(block, 0, 512);
+        memcpy(block, state, sizeof(state));
+        return m_card.writeBlock(m_endBlock + 1, block);
+    }
+    // allocates next log file and records it in state file
+    void prepare()
+    {
+        SdFile root;
+        SdFile dir;
+        if (!root.openRoot(&m_volume)) return;
+        if (!dir.open(&root, "DATA", SD_O_READ) && !dir.makeDir(&root, "DATA")) return;
+        // next file number from log index, or after those already in /DATA
+        uint32_t id = 0;
+        SdFile index;
+        LOG_INDEX_HEADER hdr;
+        if (index.open(&root, LOG_INDEX_FILE + 1, SD_O_READ) && index.read(&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == LOG_INDEX_MAGIC) {
+            id = hdr.lastId;
+            LOG_INDEX_ENTRY last;
+            uint32_t size = index.fileSize();
+            if (size >= sizeof(hdr) + sizeof(last) && index.seekSet(size - sizeof(last))
+                && index.read(&last, sizeof(last)) == sizeof(last) && last.id > id) id = last.id;
+        } else {
+            dir_t entry;
+            dir.rewind();
+            while (dir.readDir(&entry) > 0) {
+                char name[9];
+                memcpy(name, entry.name, 8);
+                name[8] = 0;
+                uint32_t n = atoi(name);
+                if (n > id) id = n;
+            }
+        }
+        if (index.isOpen()) index.close();
+        id++;
+        char path[16];
+        sprintf(path, "%u." LOG_FILE_EXT, id);
+        SdFile file;
+        if (!file.createContiguous(&dir, path, (uint32_t)SD_PREALLOC_SIZE << 20)) {
+            Serial.println("No contiguous space");
+            return;
+        }
+        bool success = file.contiguousRange(&m_bgnBlock, &m_endBlock);
+        file.close();
+        // last sector keeps checkpoint, cleared of anything left on card
+        m_endBlock--;
+        if (success) success = writeCheckpoint(id, 0);
+        uint32_t state[2] = {id, 0};
+        if (success && writeState(&root, state)) {
+            m_nextId = id;
+        }
+    }
+    // truncate log file to its data length, scanning for zero end mark if length is not known
+    void finalize(uint32_t id, uint32_t length, bool scan)
+    {
+        SdFile root;
+        SdFile dir;
+        SdFile file;
+        char path[16];
+        sprintf(path, "%u." LOG_FILE_EXT, id);
+        if (root.openRoot(&m_volume) && dir.open(&root, "DATA", SD_O_READ) && file.open(&dir, path, SD_O_RDWR)) {
+            uint32_t bgn, end;
+            if (scan && file.contiguousRange(&bgn, &end)) {
+                // data is known to reach checkpoint in last sector
+                uint32_t state[3];
+                if (m_card.readBlock(end, m_buffer)) {
+                    memcpy(state, m_buffer, sizeof(state));
+                    if (state[0] == SD_CHECKPOINT_MAGIC && state[1] == id && state[2] > length) length = state[2];
+                }
+                end--;
+#if LOG_FORMAT == LOG_FORMAT_BIN
+                // records are decoded from checkpoint on until one is not valid
+                if (length < LOG_BIN_HEADER_SIZE) length = LOG_BIN_HEADER_SIZE;
+                uint16_t pos = length & 511;
+                uint16_t bytes = 0;
+                uint32_t ts = 0;
+                char line[64];
+                byte lineLen;
+                for (uint32_t block = bgn + (length >> 9); block <= end; block++) {
+                    if (!m_card.readBlock(block, m_buffer + bytes)) break;
+                    bytes += 512;
+                    int n;
+                    while ((n = decodeLogRecord(m_buffer + pos, bytes - pos, ts, line, lineLen)) > 0) {
+                        pos += n;
+                        length += n;
+                    }
+                    if (n < 0) break;
+                    // carry incomplete record over to next block
+                    bytes -= pos;
+                    memmove(m_buffer, m_buffer + pos, bytes);
+                    pos = 0;
+                }
+#else
+                length &= ~511;
+                for (uint32_t block = bgn + (length >> 9); block <= end; block++) {
+                    if (!m_card.readBlock(block, m_buffer)) break;
+                    uint8_t* p = (uint8_t*)memchr(m_buffer, 0, 512);
+                    if (p) {
+                        length += p - m_buffer;
+                        break;
+                    }
+                    length += 512;
+                }
+#endif
+            }
+            if (length) {
+                file.truncate(length);
+                file.close();
+            } else {
+                file.remove();
+            }
+        }
+        if (root.isOpen()) SdFile::remove(&root, SD_LOG_STATE_FILE + 1);
+    }
+    bool readState(uint32_t* state)
+    {
+        SdFile root;
+        SdFile file;
+        return root.openRoot(&m_volume) && file.open(&root, SD_LOG_STATE_FILE + 1, SD_O_READ) && file.read(state, 8) == 8;
+    }
+    bool writeState(SdFile* root, uint32_t* state)
+    {
+        SdFile file;
+        if (!file.open(root, SD_LOG_STATE_FILE + 1, SD_O_CREAT | SD_O_WRITE | SD_O_TRUNC)) return false;
+        bool success = file.write(state, 8) == 8;
+        return file.close() && success;
+    }
+    Sd2Card m_card;
+    SdVolume m_volume;
+    uint8_t m_buffer[SD_SECTOR_BUFFER + 512];
+    uint16_t m_buffered = 0;
+    uint32_t m_bgnBlock = 0;
+    uint32_t m_endBlock = 0;
+    uint32_t m_block = 0;
+    uint32_t m_checkpoint = 0;
+    uint32_t m_lastWrite = 0;
+    uint32_t m_fileId = 0;
+    uint32_t m_nextId = 0;
+    bool m_contiguous = false;
 };
+#endif
 
 class SPIFFSLogger : public FileLogger {
 public:
@@ -246,6 +1735,7 @@ public:
             Serial.print(" bytes total, ");
             Serial.print(SPIFFS.usedBytes());
             Serial.println(" bytes used");
+            loadBacklog();
         } else {
             Serial.println("failed");
         }
@@ -253,42 +1743,272 @@ public:
     }
     uint32_t begin()
     {
-        File root = SPIFFS.open("/");
-        m_id = getFileID(root);
+        m_lock.lock();
+        m_id = getFileID("/");
         char path[24];
-        sprintf(path, "/DATA/%u.CSV", m_id);
+        sprintf(path, LOG_FILE_PATH, m_id);
         Serial.print("File: ");
         Serial.println(path);
         m_file = SPIFFS.open(path, FILE_WRITE);
         if (!m_file) {
             Serial.println("File error");
             m_id = 0;
+        } else {
+            logIndex.add(m_id);
         }
+        m_lock.unlock();
+        if (m_id) writeFileHeader();
         return m_id;
     }
+protected:
+    fs::FS& fs() { return SPIFFS; }
 private:
     void purge()
     {
         // remove oldest file when unused space is insufficient
-        File root = SPIFFS.open("/");
-        File file;
-        int idx = 0;
-        while(file = root.openNextFile()) {
-            if (!strncmp(file.name(), "/DATA/", 6)) {
-                unsigned int n = atoi(file.name() + 6);
-                if (n != 0 && (idx == 0 || n < idx)) idx = n;
-            }
-        }
+        uint32_t idx = logIndex.oldest();
+        if (idx == m_id) idx = 0;
         if (idx) {
             m_file.close();
             char path[32];
-            sprintf(path, "/DATA/%u.CSV", idx);
+            sprintf(path, LOG_FILE_PATH, idx);
+            SPIFFS.remove(path);
+            logIndex.remove(idx);
+            sprintf(path, LOG_TS_INDEX_FILE, idx);
             SPIFFS.remove(path);
             Serial.print(path);
             Serial.println(" removed");
-            sprintf(path, "/DATA/%u.CSV", m_id);
+            sprintf(path, LOG_FILE_PATH, m_id);
             m_file = SPIFFS.open(path, FILE_APPEND);
             if (!m_file) m_id = 0;
         }
     }
 };
+
+typedef struct {
+    byte pid;
+    uint16_t period; /* target sampling period in ms */
+    int value;
+    uint32_t ts;
+    // scheduling state
+    uint32_t due;
+    uint16_t latency; /* ms per PID, shared when requested together */
+    uint16_t cycle;
+    uint8_t backoff;
+    float mean;
+    float rate; /* smoothed relative change per second */
+} PID_POLLING_INFO;
+
+// picks PIDs by earliest deadline within a time budget per polling cycle
+class CPIDScheduler {
+public:
+    CPIDScheduler(PID_POLLING_INFO* info, byte count):m_info(info),m_count(count) {}
+    void begin(uint32_t now)
+    {
+        m_start = now;
+        m_cycle++;
+        m_picked = 0;
+    }
+    // fill slots with indexes of next PIDs to request, returns 0 when done for this cycle
+    byte next(uint32_t now, byte slots[], byte maxCount, bool (*valid)(byte pid))
+    {
+        int remaining = OBD_CYCLE_BUDGET - (int)(now - m_start);
+        int cost = 0;
+        byte n = 0;
+        while (n < maxCount) {
+            int best = -1;
+            for (byte i = 0; i < m_count; i++) {
+                PID_POLLING_INFO* p = m_info + i;
+                // each PID at most once per cycle, eligible when due before the cycle budget ends
+                if (p->cycle == m_cycle || (int32_t)(p->due - (m_start + OBD_CYCLE_BUDGET)) > 0) continue;
+                if (best >= 0 && (int32_t)(p->due - m_info[best].due) >= 0) continue;
+                if (!valid(p->pid)) {
+                    p->cycle = m_cycle;
+                    continue;
+                }
+                best = i;
+            }
+            if (best < 0) break;
+            int latency = m_info[best].latency ? m_info[best].latency : OBD_DEFAULT_LATENCY;
+            // first request of a cycle always goes out so no PID starves on a tight budget
+            if (cost + latency > remaining && (n > 0 || m_picked > 0)) break;
+            cost += latency;
+            m_info[best].cycle = m_cycle;
+            slots[n++] = best;
+        }
+        m_picked += n;
+        return n;
+    }
+    // account results of requested PIDs, elapsed is time taken by the request
+    void update(const byte slots[], byte count, const int values[], const bool obtained[], uint32_t now, uint32_t elapsed)
+    {
+        int share = count ? elapsed / count : 0;
+        for (byte n = 0; n < count; n++) {
+            PID_POLLING_INFO* p = m_info + slots[n];
+            p->latency = p->latency ? p->latency + (share - (int)p->latency) / 4 : share;
+            if (!obtained[n]) {
+                // back off a failing PID without holding up others
+                if (p->backoff < OBD_MAX_BACKOFF) p->backoff++;
+                p->due = now + ((uint32_t)p->period << p->backoff);
+                continue;
+            }
+            if (p->ts && now != p->ts) {
+                float r = (float)abs(values[n] - p->value) / (fabs(p->mean) + 1) * 1000 / (now - p->ts);
+                p->rate += (r - p->rate) / 4;
+                p->mean += (values[n] - p->mean) / 4;
+            } else {
+                p->mean = values[n];
+            }
+            p->value = values[n];
+            p->ts = now;
+            p->backoff = 0;
+            // steady values are polled less often, up to OBD_MAX_STRETCH x period
+            float activity = p->rate < OBD_RATE_HIGH ? p->rate / OBD_RATE_HIGH : 1;
+            p->due = now + (uint32_t)(p->period * (OBD_MAX_STRETCH - (OBD_MAX_STRETCH - 1) * activity));
+        }
+    }
+private:
+    PID_POLLING_INFO* m_info;
+    byte m_count;
+    uint32_t m_start = 0;
+    uint16_t m_cycle = 0;
+    byte m_picked = 0;
+};
+
+typedef struct {
+    // acceleration with reference removed, in G
+    float mean[3];
+    float min[3];
+    float max[3];
+    float rms[3];
+    float peak; /* largest magnitude */
+    float peakJerk; /* G/s */
+    uint16_t count;
+} MOTION_FEATURES;
+
+// reduces full rate accelerometer samples to per-window features and event snippets
+class CMotionAnalyzer {
+public:
+    void begin(uint16_t odr, const float* ref, float threshold)
+    {
+        m_period = 1000.0f / odr;
+        for (byte i = 0; i < 3; i++) m_ref[i] = ref[i];
+        m_threshold = threshold;
+        m_historyPos = 0;
+        m_postRemain = 0;
+        m_snippetReady = false;
+        m_lastEvent = 0;
+        m_hasLast = false;
+        resetWindow();
+    }
+    // feed consecutive samples, ts is the time of the last one
+    void add(const float (*acc)[3], int count, uint32_t ts)
+    {
+        for (int n = 0; n < count; n++) {
+            uint32_t t = ts - (uint32_t)((count - 1 - n) * m_period);
+            float a[3];
+            float mag = 0;
+            for (byte i = 0; i < 3; i++) {
+                a[i] = acc[n][i] - m_ref[i];
+                m_sum[i] += a[i];
+                m_sumSq[i] += a[i] * a[i];
+                if (a[i] < m_min[i]) m_min[i] = a[i];
+                if (a[i] > m_max[i]) m_max[i] = a[i];
+                mag += a[i] * a[i];
+            }
+            mag = sqrt(mag);
+            if (mag > m_peak) m_peak = mag;
+            if (m_hasLast) {
+                float d = 0;
+                for (byte i = 0; i < 3; i++) d += (a[i] - m_last[i]) * (a[i] - m_last[i]);
+                float jerk = sqrt(d) * 1000 / m_period;
+                if (jerk > m_peakJerk) m_peakJerk = jerk;
+            }
+            for (byte i = 0; i < 3; i++) m_last[i] = a[i];
+            m_hasLast = true;
+            m_count++;
+            record(a, t, mag);
+        }
+    }
+    // features since last call, false if no sample came in
+    bool features(MOTION_FEATURES& f)
+    {
+        if (m_count == 0) return false;
+        for (byte i = 0; i < 3; i++) {
+            f.mean[i] = m_sum[i] / m_count;
+            f.min[i] = m_min[i];
+            f.max[i] = m_max[i];
+            f.rms[i] = sqrt(m_sumSq[i] / m_count);
+        }
+        f.peak = m_peak;
+        f.peakJerk = m_peakJerk;
+        f.count = m_count;
+        resetWindow();
+        return true;
+    }
+    // take completed event snippet (0.01G per axis), returns number of samples
+    int snippet(int16_t (*samples)[3], uint32_t& ts)
+    {
+        if (!m_snippetReady) return 0;
+        memcpy(samples, m_snippet, sizeof(m_snippet));
+        ts = m_snippetTs;
+        m_snippetReady = false;
+        return MEMS_SNIPPET_SAMPLES;
+    }
+    float period() { return m_period; }
+private:
+    void resetWindow()
+    {
+        for (byte i = 0; i < 3; i++) {
+            m_sum[i] = 0;
+            m_sumSq[i] = 0;
+            m_min[i] = 1000;
+            m_max[i] = -1000;
+        }
+        m_peak = 0;
+        m_peakJerk = 0;
+        m_count = 0;
+    }
+    void record(const float* a, uint32_t ts, float mag)
+    {
+        int16_t* h = m_history[m_historyPos % MEMS_SNIPPET_SAMPLES];
+        for (byte i = 0; i < 3; i++) h[i] = (int16_t)(a[i] * 100);
+        m_historyPos++;
+        if (m_postRemain) {
+            // event snippet completes once enough samples after the trigger are in
+            if (--m_postRemain == 0) {
+                for (int n = 0; n < MEMS_SNIPPET_SAMPLES; n++) {
+                    memcpy(m_snippet[n], m_history[(m_historyPos + n) % MEMS_SNIPPET_SAMPLES], sizeof(m_snippet[n]));
+                }
+                m_snippetTs = ts - (uint32_t)((MEMS_SNIPPET_SAMPLES - 1) * m_period);
+                m_snippetReady = true;
+            }
+            return;
+        }
+        if (mag >= m_threshold && !m_snippetReady && (m_lastEvent == 0 || ts - m_lastEvent >= MEMS_EVENT_HOLDOFF)) {
+            m_lastEvent = ts ? ts : 1;
+            m_postRemain = MEMS_SNIPPET_SAMPLES / 2;
+        }
+    }
+    float m_period = 1;
+    float m_ref[3] = {0};
+    float m_threshold = 1;
+    // current window
+    float m_sum[3];
+    float m_sumSq[3];
+    float m_min[3];
+    float m_max[3];
+    float m_peak;
+    float m_peakJerk;
+    uint16_t m_count;
+    float m_last[3];
+    bool m_hasLast = false;
+    // recent samples and event capture
+    int16_t m_history[MEMS_SNIPPET_SAMPLES][3];
+    uint32_t m_historyPos = 0;
+    uint16_t m_postRemain = 0;
+    uint32_t m_lastEvent = 0;
+    int16_t m_snippet[MEMS_SNIPPET_SAMPLES][3];
+    uint32_t m_snippetTs = 0;
+    bool m_snippetReady = false;
+};
@@ -38,24 +38,26 @@
 #define STATE_OBD_FOUND 0x80
 #define STATE_STANDBY 0x100
 
-typedef struct {
-  byte pid;
-  byte tier;
-  int value;
-  uint32_t ts;
-} PID_POLLING_INFO;
-
+// target sampling periods (ms)
 PID_POLLING_INFO obdData[]= {
-  {PID_SPEED, 1},
-  {PID_RPM, 1},
-  {PID_THROTTLE, 1},
-  {PID_ENGINE_LOAD, 1},
-  {PID_FUEL_PRESSURE, 2},
-  {PID_TIMING_ADVANCE, 2},
-  {PID_COOLANT_TEMP, 3},
-  {PID_INTAKE_TEMP, 3},
+  {PID_SPEED, 500},
+  {PID_RPM, 500},
+  {PID_THROTTLE, 500},
+  {PID_ENGINE_LOAD, 1000},
+  {PID_FUEL_PRESSURE, 5000},
+  {PID_TIMING_ADVANCE, 2000},
+  {PID_COOLANT_TEMP, 10000},
+  {PID_INTAKE_TEMP, 10000},
 };
 
+CPIDScheduler pidScheduler(obdData, sizeof(obdData) / sizeof(obdData[0]));
+
+#if ENABLE_CAN_CAPTURE
+CCANRing canRing;
+CCANFilter canFilter;
+CCANCapture canCapture;
+#endif
+
 #if MEMS_MODE
 float accBias[3] = {0}; // calibrated reference accelerometer data
 float accSum[3] = {0};
@@ -88,10 +90,13 @@ uint32_t dataIntervals[] = DATA_INTERVAL_TABLE;
 
 #if STORAGE != STORAGE_NONE
 int fileid = 0;
+CLogIndex logIndex;
 static uint8_t lastSizeKB = 0;
 #endif
 
-uint32_t lastCmdToken = 0;
+// tokens of recently executed commands for recognizing retransmissions
+uint32_t cmdTokens[8] = {0};
+byte cmdTokenIndex = 0;
 String serialCommand;
 
 byte ledMode = 0;
@@ -136,10 +141,33 @@ MPU9250_9DOF mems;
 #elif MEMS_MODE == MEMS_DMP
 MPU9250_DMP mems;
 #endif
+#if ENABLE_MEMS_FIFO
+// FIFO is drained by MEMS task, analyzer state is shared with main loop
+CMotionAnalyzer motion;
+Task taskMEMS;
+Mutex memsLock;
+// held by MEMS task while accessing sensor
+Mutex memsBusLock;
+volatile bool memsCapture = false;
+volatile int16_t memsTemp = 0;
+uint32_t overflowsMEMS = 0;
+#if ENABLE_ORIENTATION
+CQuaterion fusion;
+#endif
+#endif
 
+#if ENABLE_NET_TASK
+// network module is used by network task only while it holds data being sent
+CStorageRAMDual cache;
+Task taskNet;
+Mutex cacheLock;
+#else
 CStorageRAM cache;
+#endif
 #if STORAGE == STORAGE_SPIFFS
 SPIFFSLogger store;
+#elif STORAGE == STORAGE_SD && SD_PREALLOC_SIZE
+SDContiguousLogger store;
 #elif STORAGE == STORAGE_SD
 SDLogger store;
 #endif
@@ -230,44 +258,91 @@ int handlerControl(UrlHandlerParam* param)
   Reading and processing OBD data
 *******************************************************************************/
 #if ENABLE_OBD
+bool isValidPID(byte pid)
+{
+  return obd.isValidPID(pid);
+}
+
 void processOBD()
 {
-  static int idx[2] = {0, 0};
-  int tier = 1;
-  for (byte i = 0; i < sizeof(obdData) / sizeof(obdData[0]); i++) {
-    if (obdData[i].tier > tier) {
-        // reset previous tier index
-        idx[tier - 2] = 0;
-        // keep new tier number
-        tier = obdData[i].tier;
-        // move up current tier index
-        i += idx[tier - 2]++;
-        // check if into next tier
-        if (obdData[i].tier != tier) {
-            idx[tier - 2]= 0;
-            i--;
-            continue;
-        }
-    }
-    byte pid = obdData[i].pid;
-    if (!obd.isValidPID(pid)) continue;
-    int value;
-    if (obd.readPID(pid, value)) {
-        obdData[i].ts = millis();
-        obdData[i].value = value;
-        cache.log((uint16_t)pid | 0x100, value);
-    } else {
-        timeoutsOBD++;
-        printTimeoutStats();
-        break;
+  byte slots[OBD_MAX_MULTI_PIDS];
+  byte pids[OBD_MAX_MULTI_PIDS];
+  int values[OBD_MAX_MULTI_PIDS];
+  bool obtained[OBD_MAX_MULTI_PIDS];
+  bool failed = false;
+  byte count;
+  pidScheduler.begin(millis());
+  // PIDs due are requested together, earliest deadline first, within cycle budget
+  while ((count = pidScheduler.next(millis(), slots, OBD_MAX_MULTI_PIDS, isValidPID))) {
+    for (byte n = 0; n < count; n++) pids[n] = obdData[slots[n]].pid;
+    uint32_t t = millis();
+    obd.readPID(pids, count, values, obtained);
+    pidScheduler.update(slots, count, values, obtained, millis(), millis() - t);
+    for (byte n = 0; n < count; n++) {
+      if (obtained[n]) {
+        cache.log((uint16_t)pids[n] | 0x100, values[n]);
+      } else {
+        failed = true;
+      }
     }
-    if (tier > 1) break;
+  }
+  if (failed) {
+    timeoutsOBD++;
+    printTimeoutStats();
   }
   int kph = obdData[0].value;
   if (kph >= 1) lastMotionTime = millis();
 }
 #endif
 
+#if ENABLE_CAN_CAPTURE
+/*******************************************************************************
+  Forwarding captured CAN frames to server
+*******************************************************************************/
+void forwardCAN()
+{
+  // stateless binary (v2) at most, keeping delta states of data packets intact
+  static CStorageRAM canbuf;
+  canbuf.init(32 + CAN_FORWARD_BATCH * 44);
+  canbuf.setProtocol(teleClient.protocol >= 2 ? 2 : 1, teleClient.feedid);
+  // frames captured so far, newer ones wait for next time
+  int left = canRing.available();
+  while (left > 0) {
+    CAN_FRAME frames[CAN_FORWARD_BATCH];
+    int count = canRing.pop(frames, min(left, CAN_FORWARD_BATCH));
+    if (count == 0) break;
+    left -= count;
+    // frames as 84:<ID>;<data> following their timestamp
+    canbuf.header(devid);
+    uint32_t ts = 0;
+    for (int n = 0; n < count; n++) {
+      const CAN_FRAME& frame = frames[n];
+      if (frame.ts != ts) {
+        ts = frame.ts;
+        canbuf.timestamp(ts);
+      }
+      char buf[32];
+      int len;
+      if (frame.id & CAN_ID_EXTENDED) {
+        len = sprintf(buf, "%08X;", frame.id & CAN_ID_MASK);
+      } else {
+        len = sprintf(buf, "%03X;", frame.id);
+      }
+      for (byte i = 0; i < frame.len; i++) {
+        len += sprintf(buf + len, "%02X", frame.data[i]);
+      }
+      canbuf.logText(PID_CAN_FRAME, buf, len);
+    }
+    canbuf.tailer();
+    if (!teleClient.transmit(canbuf.buffer(), canbuf.length())) {
+      timeoutsNet++;
+      printTimeoutStats();
+      break;
+    }
+  }
+}
+#endif
+
 bool processGPS()
 {
   if (state.check(STATE_GPS_READY)) {
@@ -277,6 +352,10 @@ bool processGPS()
     }
   } else {
 #if NET_DEVICE == NET_SIM5360 || NET_DEVICE == NET_SIM7600
+#if ENABLE_NET_TASK
+    // network module busy with sending data
+    if (cache.sendingLength()) return false;
+#endif
     if (!teleClient.net.getLocation(&gd)) {
       return false;
     }
@@ -345,6 +424,126 @@ bool waitMotionGPS(int timeout)
 }
 
 #if MEMS_MODE
+#if ENABLE_MEMS_FIFO
+/*******************************************************************************
+  Full rate accelerometer capture from sensor FIFO
+*******************************************************************************/
+void memsTask(void* inst)
+{
+  float acc[FIFO_READ_SAMPLES][3];
+#if ENABLE_ORIENTATION
+  float gyr[FIFO_READ_SAMPLES][3];
+  float mag[3];
+#endif
+  uint32_t lastTemp = 0;
+  for (;;) {
+    memsBusLock.lock();
+    if (!memsCapture) {
+      memsBusLock.unlock();
+      taskMEMS.sleep(100);
+      continue;
+    }
+#if ENABLE_ORIENTATION
+    int count = mems.readFIFO(acc, gyr, FIFO_READ_SAMPLES);
+    // magnetometer updates at a few Hz, one reading per drained block
+    mems.read(0, 0, mag);
+#else
+    int count = mems.readFIFO(acc, FIFO_READ_SAMPLES);
+#endif
+    uint32_t t = millis();
+    if (t - lastTemp >= 1000) {
+      int16_t temp = 0;
+      mems.read(0, 0, 0, &temp);
+      memsTemp = temp;
+      lastTemp = t;
+    }
+    memsBusLock.unlock();
+    if (count > 0) {
+      memsLock.lock();
+      motion.add(acc, count, t);
+#if ENABLE_ORIENTATION
+      // samples are evenly spaced by sensor clock
+      fusion.updateBatch(acc, gyr, count, 1.0f / MEMS_FIFO_ODR, mag);
+#endif
+      memsLock.unlock();
+    } else if (count < 0) {
+      overflowsMEMS++;
+    }
+    // keep draining while a full burst was read, FIFO holds about 85 samples
+    if (count < FIFO_READ_SAMPLES) taskMEMS.sleep(MEMS_FIFO_INTERVAL);
+  }
+}
+
+void startMEMSCapture()
+{
+  if (memsCapture) return;
+  motion.begin(MEMS_FIFO_ODR, accBias, MEMS_EVENT_THRESHOLD);
+  memsBusLock.lock();
+  memsCapture = mems.beginFIFO(MEMS_FIFO_ODR, ENABLE_ORIENTATION);
+  memsBusLock.unlock();
+  if (memsCapture && !taskMEMS.running()) {
+    taskMEMS.create(memsTask, "MEMS", 1, ENABLE_ORIENTATION ? 4096 : 3072);
+  }
+}
+
+void stopMEMSCapture()
+{
+  if (!memsCapture) return;
+  // sensor is free for direct reads once FIFO is off
+  memsBusLock.lock();
+  memsCapture = false;
+  mems.endFIFO();
+  memsBusLock.unlock();
+}
+
+void processMEMS(bool process)
+{
+  if (!state.check(STATE_MEMS_READY) || !process) return;
+  MOTION_FEATURES f;
+  int16_t samples[MEMS_SNIPPET_SAMPLES][3];
+  uint32_t ts = 0;
+  memsLock.lock();
+  bool hasFeatures = motion.features(f);
+  int count = motion.snippet(samples, ts);
+#if ENABLE_ORIENTATION
+  ORIENTATION ori;
+  fusion.getOrientation(&ori);
+#endif
+  memsLock.unlock();
+
+  if (hasFeatures) {
+    cache.log(PID_ACC, (int16_t)(f.mean[0] * 100), (int16_t)(f.mean[1] * 100), (int16_t)(f.mean[2] * 100));
+    cache.log(PID_ACC_MIN, (int16_t)(f.min[0] * 100), (int16_t)(f.min[1] * 100), (int16_t)(f.min[2] * 100));
+    cache.log(PID_ACC_MAX, (int16_t)(f.max[0] * 100), (int16_t)(f.max[1] * 100), (int16_t)(f.max[2] * 100));
+    cache.log(PID_ACC_RMS, (int16_t)(f.rms[0] * 100), (int16_t)(f.rms[1] * 100), (int16_t)(f.rms[2] * 100));
+    cache.log(PID_ACC_PEAK, (int)(f.peak * 100));
+    cache.log(PID_ACC_JERK, (int)f.peakJerk);
+#if ENABLE_ORIENTATION
+    cache.log(PID_ORIENTATION, (int16_t)(ori.yaw * 100), (int16_t)(ori.pitch * 100), (int16_t)(ori.roll * 100));
+#endif
+    // same motion criteria as averaged reading
+    float m = f.mean[0] * f.mean[0] + f.mean[1] * f.mean[1] + f.mean[2] * f.mean[2];
+    if (m >= MOTION_THRESHOLD * MOTION_THRESHOLD) {
+      lastMotionTime = millis();
+    }
+    // keep figures available for status query
+    for (byte i = 0; i < 3; i++) accSum[i] = f.mean[i] + accBias[i];
+    accCount = 1;
+  }
+  int16_t temp = memsTemp / 10;
+  if (temp && temp != deviceTemp) {
+    cache.log(PID_DEVICE_TEMP, deviceTemp = temp);
+  }
+  if (count) {
+    // event samples carry their own timestamps
+    for (int n = 0; n < count; n++) {
+      cache.timestamp(ts + (uint32_t)(n * motion.period()));
+      cache.log(PID_ACC_EVENT, samples[n][0], samples[n][1], samples[n][2]);
+    }
+    cache.timestamp(millis());
+  }
+}
+#else
 void processMEMS(bool process)
 {
   if (!state.check(STATE_MEMS_READY)) return;
@@ -394,6 +593,7 @@ void processMEMS(bool process)
     accCount = 0;
   }
 }
+#endif
 
 void calibrateMEMS()
 {
@@ -448,7 +648,13 @@ bool initialize(bool wait = false)
 
 #if MEMS_MODE
   if (state.check(STATE_MEMS_READY)) {
+#if ENABLE_MEMS_FIFO
+    stopMEMSCapture();
+#endif
     calibrateMEMS();
+#if ENABLE_MEMS_FIFO
+    startMEMSCapture();
+#endif
   }
 #endif
 
@@ -458,6 +664,9 @@ bool initialize(bool wait = false)
     Serial.print("GPS...");
     if (sys.gpsBegin(GPS_SERIAL_BAUDRATE, false)) {
       state.set(STATE_GPS_READY);
+#if GPS_BINARY_INTERVAL
+      if (sys.gpsSetBinary(GPS_BINARY_INTERVAL)) Serial.print("UBX ");
+#endif
       Serial.println("OK");
 #if ENABLE_OLED
       oled.println("GPS OK");
@@ -476,6 +685,13 @@ bool initialize(bool wait = false)
     if (obd.init()) {
       Serial.println("OK");
       state.set(STATE_OBD_READY | STATE_OBD_FOUND);
+#if ENABLE_CAN_CAPTURE
+      canFilter.clear();
+      if (CAN_CAPTURE_MASK) canFilter.add(CAN_CAPTURE_FILTER, CAN_CAPTURE_MASK);
+      canRing.clear();
+      Serial.print("CAN capture...");
+      Serial.println(canCapture.start(&obd, &canRing, &canFilter, CAN_CAPTURE_EXTENDED) ? "OK" : "NO");
+#endif
 #if ENABLE_OLED
       oled.println("OBD OK");
 #endif
@@ -767,9 +983,17 @@ bool processCommand(char* data)
   if (!(p = strstr(data, "CMD="))) return false;
   char *cmd = p + 4;
 
-  if (token > lastCmdToken) {
+  bool executed = false;
+  for (byte n = 0; n < sizeof(cmdTokens) / sizeof(cmdTokens[0]); n++) {
+    if (cmdTokens[n] == token) executed = true;
+  }
+  if (!executed) {
     // new command
-    String result = executeCommand(cmd);
+    cmdTokens[cmdTokenIndex] = token;
+    cmdTokenIndex = (cmdTokenIndex + 1) % (sizeof(cmdTokens) / sizeof(cmdTokens[0]));
+    // response to REBOOT is sent before it is executed
+    bool reboot = !strcmp(cmd, "REBOOT");
+    String result = reboot ? "OK" : executeCommand(cmd);
     // send command response
     char buf[256];
     snprintf(buf, sizeof(buf), "TK=%u,MSG=%s", token, result.c_str());
@@ -780,6 +1004,7 @@ bool processCommand(char* data)
         break;
       }
     }
+    if (reboot) executeCommand(cmd);
   } else {
     // previously executed command
     char buf[64];
@@ -826,6 +1051,85 @@ void showStats()
 #endif
 }
 
+/*******************************************************************************
+  Sending data, with undelivered data kept in backlog
+*******************************************************************************/
+#if ENABLE_BACKLOG
+bool drainBacklog()
+{
+  static char buf[BACKLOG_HEADER_SIZE + RAM_CACHE_SIZE];
+  bool success = store.backlogEmpty();
+  for (byte n = 0; n < BACKLOG_DRAIN_COUNT && !store.backlogEmpty(); n++) {
+    uint32_t seq;
+    unsigned int len = store.backlogPeek(buf + BACKLOG_HEADER_SIZE, RAM_CACHE_SIZE, &seq);
+    if (!len) continue;
+    if (!teleClient.transmitBacklog(buf, BACKLOG_HEADER_SIZE + len, seq)) break;
+    store.backlogPop();
+    success = true;
+  }
+  return success;
+}
+#endif
+
+bool transmitData(const char* buf, unsigned int len)
+{
+#if ENABLE_BACKLOG
+  if (state.check(STATE_STORAGE_READY)) {
+    if (!store.backlogEmpty()) {
+      // data goes after those undelivered earlier
+      store.backlogAppend(buf, len);
+      return drainBacklog();
+    }
+    if (teleClient.transmit(buf, len)) return true;
+    if (store.backlogAppend(buf, len)) Serial.println("Data kept in backlog");
+    return false;
+  }
+#endif
+  return teleClient.transmit(buf, len);
+}
+
+#if ENABLE_NET_TASK
+/*******************************************************************************
+  Sending cached data in a separate task
+*******************************************************************************/
+void netTask(void* inst)
+{
+  for (;;) {
+    if (!cache.sendingLength()) {
+      taskNet.sleep(20);
+      continue;
+    }
+    if (ledMode == 0) digitalWrite(PIN_LED, HIGH);
+    bool success = transmitData(cache.sendingBuffer(), cache.sendingLength());
+    if (success) {
+      connErrors = 0;
+      showStats();
+    } else {
+      connErrors++;
+      timeoutsNet++;
+      printTimeoutStats();
+      // data not sent is not known to server
+      teleClient.resync = true;
+    }
+#if ENABLE_CAN_CAPTURE
+    // network module is still ours until data is marked sent
+    if (success) forwardCAN();
+#endif
+    if (ledMode == 0) digitalWrite(PIN_LED, LOW);
+    cacheLock.lock();
+    cache.sent();
+    cacheLock.unlock();
+    if (!success) taskNet.sleep(1000L * connErrors);
+  }
+}
+
+void waitSending()
+{
+  // wait for network task to finish sending before using network module
+  while (cache.sendingLength()) delay(10);
+}
+#endif
+
 bool waitMotion(unsigned long timeout)
 {
   unsigned long t = millis();
@@ -882,10 +1186,19 @@ void process()
 #if ENABLE_OBD
   // process OBD data if connected
   if (state.check(STATE_OBD_READY)) {
+#if ENABLE_CAN_CAPTURE
+    // link is taken by CAN capture, frames go out in their own packets
+#if !ENABLE_NET_TASK
+    forwardCAN();
+#endif
+#else
     processOBD();
     if (obd.errors >= MAX_OBD_ERRORS) {
       if (!obd.init()) {
         Serial.println("ECU OFF");
+#if ENABLE_NET_TASK
+        waitSending();
+#endif
         Serial.print("Logout...");
         if (teleClient.notify(EVENT_LOGOUT)) Serial.print("OK");
         Serial.println();
@@ -894,12 +1207,13 @@ void process()
         return;
       }
     }
+#endif
   }
 #else
   cache.log(PID_DEVICE_HALL, readChipHallSensor() / 200);
 #endif
 
-#if ENABLE_OBD
+#if ENABLE_OBD && !ENABLE_CAN_CAPTURE
   if (sys.getVersion() >= 13) {
       batteryVoltage = (float)(analogRead(A0) * 11 * 370) / 4095;
       cache.log(PID_BATTERY_VOLTAGE, batteryVoltage);
@@ -942,6 +1256,27 @@ void process()
     timeoutsNet++;
     printTimeoutStats();
   }
+#if ENABLE_NET_TASK
+  if (millis() - lastSentTime >= sendingInterval && cache.samples() > 0) {
+    // hand over data to network task unless previous data is still being sent
+    cacheLock.lock();
+    if (!cache.sendingLength()) {
+#if SERVER_PROTOCOL == PROTOCOL_UDP
+      cache.tailer();
+#endif
+      cache.swap();
+      lastSentTime = millis();
+#if SERVER_PROTOCOL == PROTOCOL_UDP
+      if (teleClient.resync.exchange(false)) {
+        cache.requestKeyframe();
+      }
+      cache.setProtocol(teleClient.protocol, teleClient.feedid);
+      cache.header(devid);
+#endif
+    }
+    cacheLock.unlock();
+  }
+#else
   if (millis() - lastSentTime >= sendingInterval && cache.samples() > 0) {
     // some data only need once for a transmission
 #if SERVER_PROTOCOL == PROTOCOL_UDP
@@ -950,7 +1285,7 @@ void process()
     // start transmission
     if (ledMode == 0) digitalWrite(PIN_LED, HIGH);
 
-    if (teleClient.transmit(cache.buffer(), cache.length())) {
+    if (transmitData(cache.buffer(), cache.length())) {
       // successfully sent
       connErrors = 0;
       showStats();
@@ -959,19 +1294,32 @@ void process()
       connErrors++;
       timeoutsNet++;
       printTimeoutStats();
+      // data not sent is not known to server
+      cache.requestKeyframe();
     }
     // purge cache
     cache.purge();
 #if SERVER_PROTOCOL == PROTOCOL_UDP
+    if (teleClient.resync.exchange(false)) {
+      cache.requestKeyframe();
+    }
+    cache.setProtocol(teleClient.protocol, teleClient.feedid);
     cache.header(devid);
 #endif
     if (ledMode == 0) digitalWrite(PIN_LED, LOW);
   }
+#endif
 
   if (connErrors >= MAX_CONN_ERRORS_RECONNECT) {
+#if ENABLE_NET_TASK
+    waitSending();
+#endif
     if (teleClient.connect()) {
       Serial.println("Reconnected");
       connErrors = 0;
+#if ENABLE_BACKLOG
+      if (state.check(STATE_STORAGE_READY)) drainBacklog();
+#endif
     } else {
       // unable to reconnect
       Serial.println("Re-init network");
@@ -981,9 +1329,12 @@ void process()
       digitalWrite(PIN_LED, LOW);
       return;
     }
-  } else {
+  }
+#if !ENABLE_NET_TASK
+  else {
     delay(1000L * connErrors);
   }
+#endif
 
 #if ENABLE_OBD || ENABLE_GPS || MEMS_MODE
   // motion adaptive data interval control
@@ -1002,6 +1353,9 @@ void process()
       Serial.print("Stationary for ");
       Serial.print(motionless);
       Serial.println(" secs");
+#if ENABLE_NET_TASK
+      waitSending();
+#endif
       Serial.print("Logout...");
       if (teleClient.notify(EVENT_LOGOUT)) Serial.print("OK");
       Serial.println();
@@ -1033,6 +1387,9 @@ void process()
 *******************************************************************************/
 void standby()
 {
+#if ENABLE_NET_TASK
+  waitSending();
+#endif
 #if STORAGE != STORAGE_NONE
   if (state.check(STATE_STORAGE_READY)) {
     store.end();
@@ -1049,6 +1406,9 @@ void standby()
 #endif
 #if ENABLE_OBD
 if (state.check(STATE_OBD_READY)) {
+#if ENABLE_CAN_CAPTURE
+    canCapture.stop();
+#endif
     obd.reset();
     obd.enterLowPowerMode();
     state.clear(STATE_OBD_READY);
@@ -1062,11 +1422,17 @@ if (state.check(STATE_OBD_READY)) {
   oled.clear();
 #endif
 #if MEMS_MODE
+#if ENABLE_MEMS_FIFO
+  stopMEMSCapture();
+#endif
   calibrateMEMS();
   for (;;) {
     shutDownNet();
     cache.purge();
 #if SERVER_PROTOCOL == PROTOCOL_UDP
+    // ping back data is sent in separate sessions
+    cache.requestKeyframe();
+    cache.setProtocol(teleClient.protocol, teleClient.feedid);
     cache.header(devid);
 #endif
     if (waitMotion(1000L * PING_BACK_INTERVAL)) {
@@ -1134,7 +1500,12 @@ if (state.check(STATE_OBD_READY)) {
 *******************************************************************************/
 void idleTasks()
 {
+#if ENABLE_NET_TASK
+  // network module busy with sending data
+  if (!cache.sendingLength()) teleClient.inbound();
+#else
   teleClient.inbound();
+#endif
 
   // check serial input for command
   while (Serial.available()) {
@@ -1320,7 +1691,8 @@ void setup()
 #if MEMS_MODE
   if (!state.check(STATE_MEMS_READY)) {
     Serial.print("MEMS...");
-    byte ret = mems.begin(ENABLE_ORIENTATION);
+    // with FIFO capture orientation is fused by MEMS task
+    byte ret = mems.begin(ENABLE_ORIENTATION && !ENABLE_MEMS_FIFO);
     if (ret) {
       state.set(STATE_MEMS_READY);
       if (ret == 2) Serial.print("9-DOF ");
@@ -1347,6 +1719,12 @@ void setup()
 
     // allocate for data cache
     cache.init(RAM_CACHE_SIZE);
+    // ignore small fluctuations of noisy values in delta encoding
+    cache.setDeadband(PID_BATTERY_VOLTAGE, 5); /* 0.05V */
+    cache.setDeadband(PID_ACC, 2); /* 0.02G */
+#if ENABLE_NET_TASK
+    taskNet.create(netTask, "NET", 1, NET_TASK_STACK_SIZE);
+#endif
 
     // reset client stats
     teleClient.reset();
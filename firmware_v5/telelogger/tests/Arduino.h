@@ -0,0 +1,45 @@
+// minimal Arduino environment for building telelogger.h on host
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <mutex>
+#include <algorithm>
+
+typedef uint8_t byte;
+using std::min;
+using std::max;
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+struct HostSerial {
+    void print(const char* s) { fputs(s, stdout); }
+    void print(char c) { putchar(c); }
+    void print(int v) { printf("%d", v); }
+    void print(unsigned int v) { printf("%u", v); }
+    void print(long v) { printf("%ld", v); }
+    void print(unsigned long v) { printf("%lu", v); }
+    void print(float v, int digits = 2) { printf("%.*f", digits, v); }
+    void println(const char* s = "") { puts(s); }
+    void println(char c) { printf("%c\n", c); }
+    void println(int v) { printf("%d\n", v); }
+    void println(unsigned int v) { printf("%u\n", v); }
+    void write(const uint8_t* buf, int len) { fwrite(buf, 1, len, stdout); }
+    void write(char c) { putchar(c); }
+};
+extern HostSerial Serial;
+
+class Mutex {
+public:
+    void lock() { m.lock(); }
+    void unlock() { m.unlock(); }
+private:
+    std::mutex m;
+};
+
+#define PIN_SD_CS 5
+#define SPI_FREQ 1000000
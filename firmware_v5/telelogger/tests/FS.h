@@ -0,0 +1,66 @@
+// files of host FS live under FS_ROOT
+#pragma once
+#include "Arduino.h"
+#include <string>
+
+#ifndef FS_ROOT
+#define FS_ROOT "fs"
+#endif
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+#define FILE_READ "r"
+
+class File {
+public:
+    operator bool() const { return fp != 0; }
+    size_t write(const uint8_t* buf, size_t len) { return fwrite(buf, 1, len, fp); }
+    size_t write(uint8_t c) { return fwrite(&c, 1, 1, fp); }
+    int read() { return fgetc(fp); }
+    size_t read(uint8_t* buf, size_t len) { return fread(buf, 1, len, fp); }
+    size_t readBytes(char* buf, size_t len) { return fread(buf, 1, len, fp); }
+    bool seek(uint32_t pos) { return fseek(fp, pos, SEEK_SET) == 0; }
+    size_t position() { return ftell(fp); }
+    size_t size()
+    {
+        long pos = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, pos, SEEK_SET);
+        return size;
+    }
+    int available() { return size() - position(); }
+    void flush() { fflush(fp); }
+    void close() { if (fp) fclose(fp); fp = 0; }
+    const char* name() { return path.c_str(); }
+    File openNextFile() { return File(); }
+    FILE* fp = 0;
+    std::string path;
+};
+
+namespace fs {
+class FS {
+public:
+    File open(const char* path, const char* mode = FILE_READ)
+    {
+        File file;
+        file.fp = fopen(host(path).c_str(), !strcmp(mode, "w") ? "w+b" : !strcmp(mode, "a") ? "a+b" : "rb");
+        file.path = path;
+        return file;
+    }
+    bool begin(...) { return true; }
+    void end() {}
+    bool mkdir(const char* path) { return true; }
+    bool remove(const char* path) { return ::remove(host(path).c_str()) == 0; }
+    bool rename(const char* from, const char* to) { return ::rename(host(from).c_str(), host(to).c_str()) == 0; }
+    bool exists(const char* path)
+    {
+        FILE* fp = fopen(host(path).c_str(), "rb");
+        if (fp) fclose(fp);
+        return fp != 0;
+    }
+    uint64_t totalBytes() { return 0; }
+    uint64_t usedBytes() { return 0; }
+private:
+    std::string host(const char* path) { return std::string(FS_ROOT) + path; }
+};
+}
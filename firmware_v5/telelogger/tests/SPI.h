@@ -0,0 +1,3 @@
+#pragma once
+struct HostSPI { void begin() {} };
+extern HostSPI SPI;
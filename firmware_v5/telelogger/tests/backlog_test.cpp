@@ -0,0 +1,123 @@
+/*
+  Store-and-forward backlog of FileLogger on host files: order and sequence
+  numbers across restarts, a queue that is never fully drained staying within
+  its size, and recovery from an interrupted compaction
+*/
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#define BACKLOG_MAX_SIZE 4096
+#include "../telelogger.h"
+#include "test.h"
+#include <deque>
+
+CLogIndex logIndex;
+
+static long fileSize(const char* path)
+{
+    File file = SPIFFS.open(path, FILE_READ);
+    long size = file ? (long)file.size() : -1;
+    file.close();
+    return size;
+}
+
+int main()
+{
+    SPIFFS.remove(BACKLOG_FILE);
+    SPIFFS.remove(BACKLOG_STATE_FILE);
+    SPIFFS.remove(BACKLOG_TEMP_FILE);
+    char buf[128];
+    uint32_t seq;
+    unsigned int len;
+
+    // packets come out in order and survive a restart
+    {
+        SPIFFSLogger store;
+        store.init();
+        CHECK(store.backlogEmpty());
+        for (int i = 0; i < 3; i++) {
+            int n = sprintf(buf, "packet %d", i);
+            CHECK(store.backlogAppend(buf, n));
+        }
+        len = store.backlogPeek(buf, sizeof(buf), &seq);
+        CHECK(len == 8 && !memcmp(buf, "packet 0", 8) && seq == 1);
+        store.backlogPop();
+    }
+    {
+        SPIFFSLogger store;
+        store.init();
+        for (int i = 1; i < 3; i++) {
+            len = store.backlogPeek(buf, sizeof(buf), &seq);
+            CHECK(len == 8 && buf[7] == '0' + i && seq == (uint32_t)i + 1);
+            store.backlogPop();
+        }
+        CHECK(store.backlogEmpty() && fileSize(BACKLOG_FILE) < 0);
+    }
+
+    // a queue sent slower than it fills never drains, sent packets are compacted away
+    {
+        SPIFFSLogger store;
+        store.init();
+        std::deque<uint32_t> queued;
+        uint32_t next = 0;
+        bool ordered = true, appended = true;
+        long maxSize = 0;
+        for (int round = 0; round < 500; round++) {
+            for (int k = 0; k < 3; k++) {
+                int n = sprintf(buf, "%08u", next);
+                if (store.backlogAppend(buf, n)) {
+                    queued.push_back(next);
+                } else {
+                    appended = false;
+                }
+                next++;
+            }
+            for (int k = 0; k < 2; k++) {
+                len = store.backlogPeek(buf, sizeof(buf), &seq);
+                buf[len] = 0;
+                if (len != 8 || (uint32_t)atoi(buf) != queued.front()) ordered = false;
+                queued.pop_front();
+                store.backlogPop();
+            }
+            long size = fileSize(BACKLOG_FILE);
+            if (size > maxSize) maxSize = size;
+        }
+        // the live part alone grows to the limit after a while
+        CHECK(!appended && queued.size() * (6 + 8) > BACKLOG_MAX_SIZE - 3 * (6 + 8));
+        CHECK(ordered && maxSize <= 2 * BACKLOG_MAX_SIZE);
+    }
+
+    // interrupted compaction: old file removed, compacted one not yet renamed
+    {
+        SPIFFSLogger store;
+        store.init();
+        while (!store.backlogEmpty()) store.backlogPop();
+        for (int i = 0; i < 4; i++) {
+            int n = sprintf(buf, "packet %d", i);
+            store.backlogAppend(buf, n);
+        }
+        store.backlogPop();
+        store.backlogPop();
+    }
+    {
+        File src = SPIFFS.open(BACKLOG_FILE, FILE_READ);
+        File dst = SPIFFS.open(BACKLOG_TEMP_FILE, FILE_WRITE);
+        src.seek(2 * (6 + 8));
+        uint8_t data[2 * (6 + 8)];
+        CHECK(src.read(data, sizeof(data)) == sizeof(data) && dst.write(data, sizeof(data)) == sizeof(data));
+        src.close();
+        dst.close();
+        SPIFFS.remove(BACKLOG_FILE);
+        SPIFFSLogger store;
+        store.init();
+        len = store.backlogPeek(buf, sizeof(buf), &seq);
+        CHECK(len == 8 && !memcmp(buf, "packet 2", 8));
+        store.backlogPop();
+        len = store.backlogPeek(buf, sizeof(buf), &seq);
+        CHECK(len == 8 && !memcmp(buf, "packet 3", 8));
+        store.backlogPop();
+        CHECK(store.backlogEmpty() && fileSize(BACKLOG_TEMP_FILE) < 0);
+    }
+    return report("backlog_test");
+}
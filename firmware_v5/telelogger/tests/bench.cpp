@@ -0,0 +1,67 @@
+/*
+  Per sample cost of logging into CStorageRAM, formatted with sprintf into a
+  stack buffer as before against the formatters writing in place
+*/
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#include "../telelogger.h"
+#include <chrono>
+
+// sample formatting as it was done with sprintf
+class CStorageRAMPrintf : public CStorageRAM {
+public:
+    void log(uint16_t pid, int value)
+    {
+        char buf[24];
+        byte len = sprintf(buf, "%X%c%d", pid, m_delimiter, value);
+        dispatch(buf, len);
+    }
+    void log(uint16_t pid, float value)
+    {
+        char buf[24];
+        byte len = sprintf(buf, "%X%c%.2f", pid, m_delimiter, value);
+        dispatch(buf, len);
+    }
+    void log(uint16_t pid, int value1, int value2, int value3)
+    {
+        char buf[48];
+        byte len = sprintf(buf, "%X%c%d;%d;%d", pid, m_delimiter, value1, value2, value3);
+        dispatch(buf, len);
+    }
+    void logFloat(uint16_t pid, float value)
+    {
+        char buf[32];
+        byte len = sprintf(buf, "%X%c%f", pid, m_delimiter, value);
+        dispatch(buf, len);
+    }
+};
+
+static double run(CStorageRAM& store, int count)
+{
+    store.init(4096);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        if ((i & 63) == 0) store.purge();
+        switch (i & 3) {
+        case 0: store.log(0x10C, i); break;
+        case 1: store.log(0x24, (float)i * 0.01f); break;
+        case 2: store.logFloat(0xA, -33.867487f + i * 1e-6f); break;
+        case 3: store.log(0x20, i, -i, i & 255); break;
+        }
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main()
+{
+    const int count = 2000000;
+    CStorageRAMPrintf before;
+    CStorageRAM after;
+    double a = run(before, count);
+    double b = run(after, count);
+    printf("sprintf: %.1f ns/sample\n", a);
+    printf("formatters: %.1f ns/sample (%.1fx)\n", b, a / b);
+    return 0;
+}
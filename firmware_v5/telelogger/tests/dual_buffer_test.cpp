@@ -0,0 +1,81 @@
+/*
+  Double buffered cache of CStorageRAMDual: handing data over for sending,
+  refusing a hand over while a send is in progress, and a main loop and a
+  network task exchanging packets under a lock as in telelogger.ino
+*/
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#include "../telelogger.h"
+#include "test.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+int main()
+{
+    CStorageRAMDual cache;
+    CHECK(cache.init(256));
+    CHECK(cache.sendingLength() == 0);
+
+    // swap hands over cached data and starts over with an empty cache
+    cache.log(0x10D, 50);
+    cache.log(0x10C, 1200);
+    std::string first(cache.buffer(), cache.length());
+    CHECK(first == "10D:50,10C:1200,");
+    CHECK(cache.swap());
+    CHECK(cache.sendingLength() == first.size());
+    CHECK(std::string(cache.sendingBuffer(), cache.sendingLength()) == first);
+    CHECK(cache.length() == 0 && cache.samples() == 0);
+
+    // no hand over while data is being sent, cached data stays
+    cache.log(0x111, 30);
+    CHECK(!cache.swap());
+    CHECK(std::string(cache.sendingBuffer(), cache.sendingLength()) == first);
+    CHECK(std::string(cache.buffer(), cache.length()) == "111:30,");
+
+    // once sent, next data is handed over
+    cache.sent();
+    CHECK(cache.sendingLength() == 0);
+    CHECK(cache.swap());
+    CHECK(std::string(cache.sendingBuffer(), cache.sendingLength()) == "111:30,");
+    cache.sent();
+
+    // main loop logging and handing over, network task sending
+    Mutex lock;
+    const int packets = 20000;
+    std::vector<int> received;
+    std::thread net([&] {
+        while ((int)received.size() < packets) {
+            lock.lock();
+            unsigned int len = cache.sendingLength();
+            lock.unlock();
+            if (!len) {
+                std::this_thread::yield();
+                continue;
+            }
+            // buffer is not touched by main loop until marked sent
+            received.push_back(atoi(std::string(cache.sendingBuffer(), len).substr(4).c_str()));
+            lock.lock();
+            cache.sent();
+            lock.unlock();
+        }
+    });
+    for (int n = 0; n < packets; ) {
+        if (cache.samples() == 0) cache.log(0x100, n);
+        lock.lock();
+        if (!cache.sendingLength()) {
+            CHECK(cache.swap());
+            n++;
+        }
+        lock.unlock();
+    }
+    net.join();
+    bool ordered = true;
+    for (int n = 0; n < packets; n++) {
+        if (received[n] != n) ordered = false;
+    }
+    CHECK(ordered);
+    return report("dual_buffer_test");
+}
@@ -0,0 +1,65 @@
+/*
+  Sample formatters of telelogger.h against printf output, and a text packet
+  built with them
+*/
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#include "../telelogger.h"
+#include "test.h"
+#include <random>
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> fd(-200, 200);
+    std::uniform_int_distribution<int> id(-100000, 100000);
+    int mismatches = 0;
+    for (int i = 0; i < 1000000; i++) {
+        char a[64], b[64];
+        float f = fd(rng);
+        int v = id(rng);
+        sprintf(a, "%.2f", f);
+        b[formatFixed(b, f, 2)] = 0;
+        if (strcmp(a, b)) mismatches++;
+        sprintf(a, "%f", f);
+        b[formatFixed(b, f, 6)] = 0;
+        if (strcmp(a, b)) mismatches++;
+        sprintf(a, "%d", v);
+        b[formatInt(b, v)] = 0;
+        if (strcmp(a, b)) mismatches++;
+        sprintf(a, "%u", (unsigned int)v);
+        b[formatUint(b, v)] = 0;
+        if (strcmp(a, b)) mismatches++;
+        sprintf(a, "%X", (uint16_t)v);
+        b[formatHex(b, (uint16_t)v)] = 0;
+        if (strcmp(a, b)) mismatches++;
+    }
+    CHECK(mismatches == 0);
+
+    // halfway and edge values (negative zero is printed without sign)
+    float edges[] = {0.125f, -0.125f, 0.375f, 1e-7f, 0.9999999f, 123456.789f};
+    for (float f : edges) {
+        char a[64], b[64];
+        sprintf(a, "%.2f|%f", f, f);
+        int n = formatFixed(b, f, 2);
+        b[n++] = '|';
+        n += formatFixed(b + n, f, 6);
+        b[n] = 0;
+        CHECK(!strcmp(a, b));
+    }
+
+    CStorageRAM cache;
+    cache.init(256);
+    cache.header("DEV");
+    cache.timestamp(1234);
+    cache.log(0x10D, (unsigned int)5);
+    cache.log(0x24, 12.5f);
+    cache.logFloat(0xA, -33.5f);
+    cache.log(0x20, 1, -2, 3);
+    cache.tailer();
+    const char* expected = "DEV#0:1234,10D:5,24:12.50,A:-33.500000,20:1;-2;3";
+    CHECK(cache.length() > strlen(expected) && !memcmp(cache.buffer(), expected, strlen(expected)));
+    return report("format_test");
+}
@@ -0,0 +1,19 @@
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#include <time.h>
+
+HostSerial Serial;
+fs::FS SD;
+fs::FS SPIFFS;
+HostSPI SPI;
+
+unsigned long millis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void delay(unsigned long ms) {}
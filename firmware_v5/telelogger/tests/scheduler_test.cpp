@@ -0,0 +1,196 @@
+/*
+  OBD PID scheduler of telelogger.h over a simulated drive against the
+  original tiered polling loop, with all PIDs answering and with one PID
+  timing out
+*/
+#include "Arduino.h"
+#include "SD.h"
+#include "SPIFFS.h"
+#include "SPI.h"
+#define OBD_MAX_MULTI_PIDS 6
+#include "../telelogger.h"
+#include "test.h"
+
+static uint32_t now = 0;
+static bool deadFuel = false;
+static int requests = 0;
+
+// simulated ECU values over time
+int ecuValue(byte pid, uint32_t t)
+{
+    float s = t / 1000.0f;
+    switch (pid) {
+    case 0x0D: return (int)(50 + 40 * sin(s / 20));
+    case 0x0C: return (int)(1500 + 800 * sin(s / 3) + (rand() % 50));
+    case 0x11: return (int)(20 + 15 * sin(s / 2));
+    case 0x04: return (int)(40 + 10 * sin(s / 5));
+    case 0x0A: return 300;
+    case 0x0E: return (int)(10 + 2 * sin(s / 10));
+    case 0x05: return 90;
+    case 0x0F: return 30;
+    }
+    return 0;
+}
+
+const unsigned RTT = 45, TIMEOUT = 1000;
+
+bool available(byte pid) { return !(deadFuel && pid == 0x0A); }
+
+// costs of COBD::readPID(pid[], ...): one round trip per multi-PID request, single requests as fallback
+byte readPIDs(const byte* pid, byte count, int* values, bool* ok)
+{
+    byte got = 0;
+    for (byte i = 0; i < count; i++) ok[i] = false;
+    if (count > 1) {
+        now += RTT;
+        requests++;
+        for (byte i = 0; i < count; i++) {
+            if (available(pid[i])) {
+                values[i] = ecuValue(pid[i], now);
+                ok[i] = true;
+                got++;
+            }
+        }
+    }
+    if (got < 2) {
+        for (byte i = 0; i < count; i++) {
+            if (ok[i]) continue;
+            requests++;
+            if (available(pid[i])) {
+                now += RTT;
+                values[i] = ecuValue(pid[i], now);
+                ok[i] = true;
+                got++;
+            } else {
+                now += TIMEOUT;
+            }
+        }
+    }
+    return got;
+}
+
+bool readPID(byte pid, int& v)
+{
+    requests++;
+    if (!available(pid)) {
+        now += TIMEOUT;
+        return false;
+    }
+    now += RTT;
+    v = ecuValue(pid, now);
+    return true;
+}
+
+bool validAll(byte) { return true; }
+
+const byte PIDS[] = {0x0D, 0x0C, 0x11, 0x04, 0x0A, 0x0E, 0x05, 0x0F};
+const byte TIERS[] = {1, 1, 1, 1, 2, 2, 3, 3};
+const uint16_t PERIODS[] = {500, 500, 500, 1000, 5000, 2000, 10000, 10000};
+const uint32_t DURATION = 600000, INTERVAL = 500;
+
+struct RUN {
+    int samples[8];
+    uint32_t obdTime;
+    uint32_t maxCycle;
+    int requests;
+};
+
+void endCycle(RUN& r, uint32_t start)
+{
+    r.obdTime += now - start;
+    if (now - start > r.maxCycle) r.maxCycle = now - start;
+    if (now - start < INTERVAL) now = start + INTERVAL;
+}
+
+// original loop: all of tier 1 each cycle, one tier 2/3 PID per cycle, stops at first failure
+void runTiered(RUN& r)
+{
+    int idx[2] = {0, 0};
+    memset(&r, 0, sizeof(r));
+    now = 0;
+    requests = 0;
+    while (now < DURATION) {
+        uint32_t start = now;
+        int tier = 1;
+        for (byte i = 0; i < 8; i++) {
+            if (TIERS[i] > tier) {
+                idx[tier - 2] = 0;
+                tier = TIERS[i];
+                i += idx[tier - 2]++;
+                if (i >= 8 || TIERS[i] != tier) {
+                    idx[tier - 2] = 0;
+                    i--;
+                    continue;
+                }
+            }
+            int v;
+            if (!readPID(PIDS[i], v)) break;
+            r.samples[i]++;
+            if (tier > 1) break;
+        }
+        endCycle(r, start);
+    }
+    r.requests = requests;
+}
+
+void runScheduler(RUN& r)
+{
+    PID_POLLING_INFO info[8];
+    memset(info, 0, sizeof(info));
+    for (int i = 0; i < 8; i++) {
+        info[i].pid = PIDS[i];
+        info[i].period = PERIODS[i];
+    }
+    CPIDScheduler sched(info, 8);
+    memset(&r, 0, sizeof(r));
+    now = 0;
+    requests = 0;
+    while (now < DURATION) {
+        uint32_t start = now;
+        byte slots[OBD_MAX_MULTI_PIDS], pids[OBD_MAX_MULTI_PIDS];
+        int values[OBD_MAX_MULTI_PIDS];
+        bool ok[OBD_MAX_MULTI_PIDS];
+        byte n;
+        sched.begin(now);
+        while ((n = sched.next(now, slots, OBD_MAX_MULTI_PIDS, validAll))) {
+            for (byte k = 0; k < n; k++) pids[k] = info[slots[k]].pid;
+            uint32_t t = now;
+            readPIDs(pids, n, values, ok);
+            sched.update(slots, n, values, ok, now, now - t);
+            for (byte k = 0; k < n; k++) {
+                if (ok[k]) r.samples[slots[k]]++;
+            }
+        }
+        endCycle(r, start);
+    }
+    r.requests = requests;
+}
+
+int main()
+{
+    RUN tiered[2], sched[2];
+    for (int dead = 0; dead < 2; dead++) {
+        deadFuel = dead;
+        srand(1);
+        runTiered(tiered[dead]);
+        srand(1);
+        runScheduler(sched[dead]);
+        RUN& r = sched[dead];
+        // cycles stay within budget even with a PID timing out
+        CHECK(r.maxCycle <= OBD_CYCLE_BUDGET);
+        CHECK(r.obdTime < tiered[dead].obdTime && r.requests < tiered[dead].requests);
+        for (int i = 0; i < 8; i++) {
+            if (dead && PIDS[i] == 0x0A) continue;
+            // every PID polled at least at its stretched period
+            CHECK(r.samples[i] * (uint32_t)PERIODS[i] * OBD_MAX_STRETCH >= DURATION * 9 / 10);
+        }
+    }
+    // the failing PID does not hold up others
+    CHECK(tiered[1].maxCycle > TIMEOUT);
+    for (int i = 0; i < 8; i++) {
+        if (PIDS[i] == 0x0A) continue;
+        CHECK(abs(sched[1].samples[i] - sched[0].samples[i]) * 20 <= sched[0].samples[i]);
+    }
+    CHECK(sched[1].samples[4] == 0);
+    return report("scheduler_test");
+}
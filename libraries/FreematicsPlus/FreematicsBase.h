@@ -26,6 +26,12 @@
 #define PID_MEMS_TEMP 0x23
 #define PID_BATTERY_VOLTAGE 0x24
 #define PID_ORIENTATION 0x25
+#define PID_ACC_MIN 0x26
+#define PID_ACC_MAX 0x27
+#define PID_ACC_RMS 0x28
+#define PID_ACC_PEAK 0x29
+#define PID_ACC_JERK 0x2A
+#define PID_ACC_EVENT 0x2B
 
 // custom PIDs for calculated data
 #define PID_TRIP_DISTANCE 0x30
@@ -33,6 +39,7 @@
 #define PID_CSQ 0x81
 #define PID_DEVICE_TEMP 0x82
 #define PID_DEVICE_HALL 0x83
+#define PID_CAN_FRAME 0x84
 #define PID_EXT_SENSOR1 0x90
 #define PID_EXT_SENSOR2 0x91
 
@@ -70,6 +77,14 @@ public:
 	// write data to SPI
 	virtual void send(const char* str) {}
 	virtual int read() { return -1; }
+	// read whatever arrives within timeout, returns number of bytes read
+	virtual int read(char* buffer, int bufsize, unsigned int timeout)
+	{
+		int n = 0;
+		int c;
+		while (n < bufsize && (c = read()) != -1) buffer[n++] = c;
+		return n;
+	}
 };
 
 class CFreematics
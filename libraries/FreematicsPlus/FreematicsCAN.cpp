@@ -0,0 +1,211 @@
+/*************************************************************************
+* CAN frame capture helpers for Freematics ONE+
+* Distributed under BSD license
+* Visit https://freematics.com for more information
+*************************************************************************/
+
+#include <stdio.h>
+#include "FreematicsCAN.h"
+
+bool CCANRing::push(const CAN_FRAME& frame)
+{
+	uint32_t head = m_head;
+	if (head - m_tail >= CAN_RING_SIZE) {
+		dropped++;
+		return false;
+	}
+	m_frames[head & (CAN_RING_SIZE - 1)] = frame;
+	// frame must be stored before consumer can see the new head
+	__sync_synchronize();
+	m_head = head + 1;
+	return true;
+}
+
+int CCANRing::pop(CAN_FRAME* frames, int maxCount)
+{
+	uint32_t tail = m_tail;
+	uint32_t count = m_head - tail;
+	__sync_synchronize();
+	if (count > (uint32_t)maxCount) count = maxCount;
+	for (uint32_t n = 0; n < count; n++) {
+		frames[n] = m_frames[(tail + n) & (CAN_RING_SIZE - 1)];
+	}
+	// slots are released only after frames are copied
+	__sync_synchronize();
+	m_tail = tail + count;
+	return count;
+}
+
+bool CCANFilter::add(uint32_t id, uint32_t mask)
+{
+	if (m_count >= CAN_MAX_FILTERS) return false;
+	m_id[m_count] = id & mask;
+	m_mask[m_count] = mask;
+	m_count++;
+	return true;
+}
+
+bool CCANFilter::match(uint32_t id)
+{
+	if (m_count == 0) return true;
+	id &= CAN_ID_MASK;
+	for (uint8_t i = 0; i < m_count; i++) {
+		if ((id & m_mask[i]) == m_id[i]) return true;
+	}
+	return false;
+}
+
+int CCANFilter::apply(CAN_FRAME* frames, int count)
+{
+	if (m_count == 0) return count;
+	int m = 0;
+	for (int n = 0; n < count; n++) {
+		if (match(frames[n].id)) {
+			if (m != n) frames[m] = frames[n];
+			m++;
+		}
+	}
+	return m;
+}
+
+static int hexDigit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+bool parseCANLine(const char* line, int len, bool extended, CAN_FRAME& frame)
+{
+	uint8_t bytes[12];
+	int count = 0;
+	uint32_t id = 0;
+	int n = 0;
+	// skip leading spaces
+	while (n < len && line[n] == ' ') n++;
+	if (!extended) {
+		// 11-bit identifier printed as 3 hex digits
+		for (int i = 0; i < 3; i++, n++) {
+			int d = n < len ? hexDigit(line[n]) : -1;
+			if (d < 0) return false;
+			id = (id << 4) | d;
+		}
+		if (n < len && line[n] != ' ') return false;
+	}
+	while (n < len) {
+		if (line[n] == ' ') {
+			n++;
+			continue;
+		}
+		if (n + 1 >= len || count == sizeof(bytes)) return false;
+		int h = hexDigit(line[n]);
+		int l = hexDigit(line[n + 1]);
+		if (h < 0 || l < 0) return false;
+		bytes[count++] = (h << 4) | l;
+		n += 2;
+	}
+	if (extended) {
+		// 29-bit identifier printed as 4 bytes
+		if (count < 4) return false;
+		id = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+		id = (id & CAN_ID_MASK) | CAN_ID_EXTENDED;
+		count -= 4;
+		memmove(bytes, bytes + 4, count);
+	}
+	if (count > 8) return false;
+	frame.id = id;
+	frame.len = count;
+	memcpy(frame.data, bytes, count);
+	return true;
+}
+
+int writeCANLogHeader(uint8_t* buf)
+{
+	memcpy(buf, CAN_LOG_MAGIC, 4);
+	buf[4] = CAN_LOG_VERSION;
+	buf[5] = buf[6] = buf[7] = 0;
+	return CAN_LOG_HEADER_SIZE;
+}
+
+bool checkCANLogHeader(const uint8_t* buf, int len)
+{
+	return len >= CAN_LOG_HEADER_SIZE && !memcmp(buf, CAN_LOG_MAGIC, 4) && buf[4] == CAN_LOG_VERSION;
+}
+
+/*
+ record layout:
+ byte 0: bit 7 set for 29-bit identifier, bits 0-3 data length
+ timestamp delta from previous record in ms, LEB128 varint
+ identifier, 2 bytes (11-bit) or 4 bytes (29-bit), little endian
+ data bytes
+*/
+int encodeCANFrame(const CAN_FRAME& frame, uint32_t& lastTs, uint8_t* buf)
+{
+	bool ext = (frame.id & CAN_ID_EXTENDED) != 0;
+	uint8_t len = frame.len > 8 ? 8 : frame.len;
+	int n = 0;
+	buf[n++] = (ext ? 0x80 : 0) | len;
+	uint32_t delta = frame.ts - lastTs;
+	lastTs = frame.ts;
+	do {
+		uint8_t b = delta & 0x7f;
+		delta >>= 7;
+		buf[n++] = delta ? (b | 0x80) : b;
+	} while (delta);
+	uint32_t id = frame.id & CAN_ID_MASK;
+	buf[n++] = id;
+	buf[n++] = id >> 8;
+	if (ext) {
+		buf[n++] = id >> 16;
+		buf[n++] = id >> 24;
+	}
+	memcpy(buf + n, frame.data, len);
+	return n + len;
+}
+
+int decodeCANFrame(const uint8_t* buf, int len, uint32_t& lastTs, CAN_FRAME& frame)
+{
+	if (len < 1) return 0;
+	uint8_t flags = buf[0];
+	bool ext = (flags & 0x80) != 0;
+	uint8_t dlen = flags & 0xf;
+	if ((flags & 0x70) || dlen > 8) return 0;
+	int n = 1;
+	uint32_t delta = 0;
+	for (int shift = 0; ; shift += 7) {
+		if (n >= len || shift > 28) return 0;
+		uint8_t b = buf[n++];
+		delta |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) break;
+	}
+	int idlen = ext ? 4 : 2;
+	if (n + idlen + dlen > len) return 0;
+	uint32_t id = buf[n] | ((uint32_t)buf[n + 1] << 8);
+	if (ext) id |= ((uint32_t)buf[n + 2] << 16) | ((uint32_t)buf[n + 3] << 24);
+	n += idlen;
+	lastTs += delta;
+	frame.ts = lastTs;
+	frame.id = ext ? ((id & CAN_ID_MASK) | CAN_ID_EXTENDED) : (id & 0x7FF);
+	frame.len = dlen;
+	memcpy(frame.data, buf + n, dlen);
+	return n + dlen;
+}
+
+int formatCandump(const CAN_FRAME& frame, char* buf, const char* ifname)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	int n;
+	if (frame.id & CAN_ID_EXTENDED) {
+		n = sprintf(buf, "(%u.%03u000) %s %08X#", (unsigned int)(frame.ts / 1000), (unsigned int)(frame.ts % 1000), ifname, (unsigned int)(frame.id & CAN_ID_MASK));
+	} else {
+		n = sprintf(buf, "(%u.%03u000) %s %03X#", (unsigned int)(frame.ts / 1000), (unsigned int)(frame.ts % 1000), ifname, (unsigned int)(frame.id & 0x7FF));
+	}
+	for (uint8_t i = 0; i < frame.len && i < 8; i++) {
+		buf[n++] = hex[frame.data[i] >> 4];
+		buf[n++] = hex[frame.data[i] & 0xf];
+	}
+	buf[n++] = '\n';
+	buf[n] = 0;
+	return n;
+}
@@ -0,0 +1,87 @@
+/*************************************************************************
+* CAN frame capture helpers for Freematics ONE+
+* Frame ring, header filters and binary log encoding, free of Arduino
+* dependencies so they can be built and tested on host
+* Distributed under BSD license
+* Visit https://freematics.com for more information
+*************************************************************************/
+
+#ifndef FREEMATICS_CAN
+#define FREEMATICS_CAN
+
+#include <stdint.h>
+#include <string.h>
+
+#define CAN_ID_EXTENDED 0x80000000 /* set in CAN_FRAME.id for 29-bit identifiers */
+#define CAN_ID_MASK 0x1FFFFFFF
+
+#ifndef CAN_RING_SIZE
+#define CAN_RING_SIZE 256 /* frames, must be power of 2 */
+#endif
+#define CAN_MAX_FILTERS 8
+
+// binary log: 8-byte file header followed by variable length records
+#define CAN_LOG_MAGIC "FCAN"
+#define CAN_LOG_VERSION 1
+#define CAN_LOG_HEADER_SIZE 8
+#define CAN_MAX_RECORD_SIZE 18 /* flags + ts delta (5) + id (4) + data (8) */
+#define CAN_CANDUMP_SIZE 64
+
+typedef struct {
+	uint32_t ts; /* ms */
+	uint32_t id;
+	uint8_t len;
+	uint8_t data[8];
+} CAN_FRAME;
+
+// single producer single consumer frame ring, safe between two tasks without locking
+class CCANRing
+{
+public:
+	// producer: store one frame, false (and counted as dropped) when full
+	bool push(const CAN_FRAME& frame);
+	// consumer: copy up to maxCount frames out, returns number of frames copied
+	int pop(CAN_FRAME* frames, int maxCount);
+	int available() { return (int)(m_head - m_tail); }
+	void clear() { m_tail = m_head; }
+	// frames lost to overflow
+	uint32_t dropped = 0;
+private:
+	CAN_FRAME m_frames[CAN_RING_SIZE];
+	volatile uint32_t m_head = 0; // only written by producer
+	volatile uint32_t m_tail = 0; // only written by consumer
+};
+
+// accepts frames whose (id & mask) == (filter & mask) for any entry, or all frames when empty
+class CCANFilter
+{
+public:
+	bool add(uint32_t id, uint32_t mask = CAN_ID_MASK);
+	void clear() { m_count = 0; }
+	uint8_t count() { return m_count; }
+	bool match(uint32_t id);
+	// drop non-matching frames from a batch in place, returns frames left
+	int apply(CAN_FRAME* frames, int count);
+	uint32_t id(uint8_t index) { return m_id[index]; }
+	uint32_t mask(uint8_t index) { return m_mask[index]; }
+private:
+	uint32_t m_id[CAN_MAX_FILTERS];
+	uint32_t m_mask[CAN_MAX_FILTERS];
+	uint8_t m_count = 0;
+};
+
+// parse one monitor output line with headers on (ATH1), e.g. "7E8 03 41 0D 00"
+// or "18 DA F1 10 03 41 0D 00" for 29-bit identifiers
+bool parseCANLine(const char* line, int len, bool extended, CAN_FRAME& frame);
+
+// write binary log file header, returns bytes written
+int writeCANLogHeader(uint8_t* buf);
+bool checkCANLogHeader(const uint8_t* buf, int len);
+// encode one frame as log record, lastTs carries the timestamp of the previous record
+int encodeCANFrame(const CAN_FRAME& frame, uint32_t& lastTs, uint8_t* buf);
+// decode one record, returns bytes consumed or 0 if record is incomplete or invalid
+int decodeCANFrame(const uint8_t* buf, int len, uint32_t& lastTs, CAN_FRAME& frame);
+// format frame as candump log line, e.g. "(12.345000) can0 7E8#03410D00\n"
+int formatCandump(const CAN_FRAME& frame, char* buf, const char* ifname = "can0");
+
+#endif
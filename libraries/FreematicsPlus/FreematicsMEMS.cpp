@@ -15,105 +15,200 @@
 #define ACK_VAL           (i2c_ack_type_t)0x0              /*!< I2C ack value */
 #define NACK_VAL          (i2c_ack_type_t)0x1 /*!< I2C nack value */
 
+// 1/sqrt(x) with two Newton steps, within 5 ppm and avoids a division and a square root
+static inline float invSqrt(float x)
+{
+  union {
+    float f;
+    int32_t i;
+  } v;
+  v.f = x;
+  v.i = 0x5f3759df - (v.i >> 1);
+  float y = v.f;
+  y = y * (1.5f - 0.5f * x * y * y);
+  y = y * (1.5f - 0.5f * x * y * y);
+  return y;
+}
+
+// Reference direction of Earth's magnetic field from normalised magnetometer reading m,
+// as b[0] = 2 * bx and b[1] = 2 * bz
+void CQuaterion::earthField(const float* m, float* b)
+{
+  float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];
+  float mx = m[0], my = m[1], mz = m[2];
+  float q1q1 = q1 * q1;
+  float q2q2 = q2 * q2;
+  float q3q3 = q3 * q3;
+  float q4q4 = q4 * q4;
+  float _2q2 = 2.0f * q2;
+  float _2q3 = 2.0f * q3;
+  float _2q1mx = 2.0f * q1 * mx;
+  float _2q1my = 2.0f * q1 * my;
+  float _2q1mz = 2.0f * q1 * mz;
+  float _2q2mx = 2.0f * q2 * mx;
+  float hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
+  float hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
+  float hxy = hx * hx + hy * hy;
+  b[0] = hxy > 0.0f ? hxy * invSqrt(hxy) : 0.0f;
+  b[1] = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
+}
+
 // Implementation of Sebastian Madgwick's "...efficient orientation filter for... inertial/magnetic sensor arrays"
 // (see http://www.x-io.co.uk/category/open-source/ for examples and more details)
 // which fuses acceleration, rotation rate, and magnetic moments to produce a quaternion-based estimate of absolute
 // device orientation
-void CQuaterion::MadgwickQuaternionUpdate(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz)
+// g is scaled to rad by halfDt (0.5 * dt, times PI / 180 for deg/s), m is normalised or null
+void CQuaterion::step(const float* a, const float* g, const float* m, const float* b, float halfDt, float betaDt)
 {
-  uint32_t now = millis();
-  deltat = ((float)(now - lastUpdate)/1000.0f); // set integration time by time elapsed since last filter update
-  lastUpdate = now;
-
   float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
   float norm;
-  float hx, hy, _2bx, _2bz;
   float s1, s2, s3, s4;
-  float qDot1, qDot2, qDot3, qDot4;
-
-  // Auxiliary variables to avoid repeated arithmetic
-  float _2q1mx;
-  float _2q1my;
-  float _2q1mz;
-  float _2q2mx;
-  float _4bx;
-  float _4bz;
-  float _2q1 = 2.0f * q1;
-  float _2q2 = 2.0f * q2;
-  float _2q3 = 2.0f * q3;
-  float _2q4 = 2.0f * q4;
-  float _2q1q3 = 2.0f * q1 * q3;
-  float _2q3q4 = 2.0f * q3 * q4;
-  float q1q1 = q1 * q1;
-  float q1q2 = q1 * q2;
-  float q1q3 = q1 * q3;
-  float q1q4 = q1 * q4;
-  float q2q2 = q2 * q2;
-  float q2q3 = q2 * q3;
-  float q2q4 = q2 * q4;
-  float q3q3 = q3 * q3;
-  float q3q4 = q3 * q4;
-  float q4q4 = q4 * q4;
 
-  // Normalise accelerometer measurement
-  norm = sqrtf(ax * ax + ay * ay + az * az);
-  if (norm == 0.0f) return; // handle NaN
-  norm = 1.0f/norm;
-  ax *= norm;
-  ay *= norm;
-  az *= norm;
-
-  // Normalise magnetometer measurement
-  norm = sqrtf(mx * mx + my * my + mz * mz);
-  if (norm == 0.0f) return; // handle NaN
-  norm = 1.0f/norm;
-  mx *= norm;
-  my *= norm;
-  mz *= norm;
-
-  // Reference direction of Earth's magnetic field
-  _2q1mx = 2.0f * q1 * mx;
-  _2q1my = 2.0f * q1 * my;
-  _2q1mz = 2.0f * q1 * mz;
-  _2q2mx = 2.0f * q2 * mx;
-  hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
-  hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
-  _2bx = sqrtf(hx * hx + hy * hy);
-  _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
-  _4bx = 2.0f * _2bx;
-  _4bz = 2.0f * _2bz;
-
-  // Gradient decent algorithm corrective step
-  s1 = -_2q3 * (2.0f * q2q4 - _2q1q3 - ax) + _2q2 * (2.0f * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-  s2 = _2q4 * (2.0f * q2q4 - _2q1q3 - ax) + _2q1 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q2 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + _2bz * q4 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-  s3 = -_2q1 * (2.0f * q2q4 - _2q1q3 - ax) + _2q4 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q3 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-  s4 = _2q2 * (2.0f * q2q4 - _2q1q3 - ax) + _2q3 * (2.0f * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-  norm = sqrtf(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
-  norm = 1.0f/norm;
-  s1 *= norm;
-  s2 *= norm;
-  s3 *= norm;
-  s4 *= norm;
-
-  // Compute rate of change of quaternion
-  qDot1 = 0.5f * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
-  qDot2 = 0.5f * (q1 * gx + q3 * gz - q4 * gy) - beta * s2;
-  qDot3 = 0.5f * (q1 * gy - q2 * gz + q4 * gx) - beta * s3;
-  qDot4 = 0.5f * (q1 * gz + q2 * gy - q3 * gx) - beta * s4;
+  // Rate of change of quaternion from gyroscope, already multiplied by dt
+  float gx = g[0] * halfDt, gy = g[1] * halfDt, gz = g[2] * halfDt;
+  float qDot1 = -q2 * gx - q3 * gy - q4 * gz;
+  float qDot2 = q1 * gx + q3 * gz - q4 * gy;
+  float qDot3 = q1 * gy - q2 * gz + q4 * gx;
+  float qDot4 = q1 * gz + q2 * gy - q3 * gx;
+
+  float ax = a[0], ay = a[1], az = a[2];
+  norm = ax * ax + ay * ay + az * az;
+  // without valid acceleration only gyroscope is integrated
+  if (norm > 0.0f) {
+    // Normalise accelerometer measurement
+    norm = invSqrt(norm);
+    ax *= norm;
+    ay *= norm;
+    az *= norm;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    float _2q1 = 2.0f * q1;
+    float _2q2 = 2.0f * q2;
+    float _2q3 = 2.0f * q3;
+    float _2q4 = 2.0f * q4;
+    float q1q1 = q1 * q1;
+    float q2q2 = q2 * q2;
+    float q3q3 = q3 * q3;
+    float q4q4 = q4 * q4;
+
+    if (m) {
+      float mx = m[0], my = m[1], mz = m[2];
+      float _2bx = b[0];
+      float _2bz = b[1];
+      float _4bx = 2.0f * _2bx;
+      float _4bz = 2.0f * _2bz;
+      float _2q1q3 = 2.0f * q1 * q3;
+      float _2q3q4 = 2.0f * q3 * q4;
+      float q1q2 = q1 * q2;
+      float q1q3 = q1 * q3;
+      float q1q4 = q1 * q4;
+      float q2q3 = q2 * q3;
+      float q2q4 = q2 * q4;
+      float q3q4 = q3 * q4;
+
+      // Residuals shared by all four components of the gradient
+      float fa1 = 2.0f * q2q4 - _2q1q3 - ax;
+      float fa2 = 2.0f * q1q2 + _2q3q4 - ay;
+      float fa3 = 1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az;
+      float fm1 = _2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx;
+      float fm2 = _2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my;
+      float fm3 = _2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz;
+
+      // Gradient decent algorithm corrective step
+      s1 = -_2q3 * fa1 + _2q2 * fa2 - _2bz * q3 * fm1 + (-_2bx * q4 + _2bz * q2) * fm2 + _2bx * q3 * fm3;
+      s2 = _2q4 * fa1 + _2q1 * fa2 - 4.0f * q2 * fa3 + _2bz * q4 * fm1 + (_2bx * q3 + _2bz * q1) * fm2 + (_2bx * q4 - _4bz * q2) * fm3;
+      s3 = -_2q1 * fa1 + _2q4 * fa2 - 4.0f * q3 * fa3 + (-_4bx * q3 - _2bz * q1) * fm1 + (_2bx * q2 + _2bz * q4) * fm2 + (_2bx * q1 - _4bz * q3) * fm3;
+      s4 = _2q2 * fa1 + _2q3 * fa2 + (-_4bx * q4 + _2bz * q2) * fm1 + (-_2bx * q1 + _2bz * q3) * fm2 + _2bx * q2 * fm3;
+    } else {
+      // Gradient decent algorithm corrective step, gravity only
+      float _4q1 = 4.0f * q1;
+      float _4q2 = 4.0f * q2;
+      float _4q3 = 4.0f * q3;
+      float _8q2 = 8.0f * q2;
+      float _8q3 = 8.0f * q3;
+      s1 = _4q1 * q3q3 + _2q3 * ax + _4q1 * q2q2 - _2q2 * ay;
+      s2 = _4q2 * q4q4 - _2q4 * ax + 4.0f * q1q1 * q2 - _2q1 * ay - _4q2 + _8q2 * q2q2 + _8q2 * q3q3 + _4q2 * az;
+      s3 = 4.0f * q1q1 * q3 + _2q1 * ax + _4q3 * q4q4 - _2q4 * ay - _4q3 + _8q3 * q2q2 + _8q3 * q3q3 + _4q3 * az;
+      s4 = 4.0f * q2q2 * q4 - _2q2 * ax + 4.0f * q3q3 * q4 - _2q3 * ay;
+    }
+    norm = s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4;    // normalise step magnitude
+    if (norm > 0.0f) {
+      norm = invSqrt(norm) * betaDt;
+      qDot1 -= s1 * norm;
+      qDot2 -= s2 * norm;
+      qDot3 -= s3 * norm;
+      qDot4 -= s4 * norm;
+    }
+  }
 
   // Integrate to yield quaternion
-  q1 += qDot1 * deltat;
-  q2 += qDot2 * deltat;
-  q3 += qDot3 * deltat;
-  q4 += qDot4 * deltat;
-  norm = sqrtf(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
-  norm = 1.0f/norm;
+  q1 += qDot1;
+  q2 += qDot2;
+  q3 += qDot3;
+  q4 += qDot4;
+  norm = invSqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
   q[0] = q1 * norm;
   q[1] = q2 * norm;
   q[2] = q3 * norm;
   q[3] = q4 * norm;
 }
 
+static bool normalise(const float* v, float* r)
+{
+  float norm = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+  if (norm == 0.0f) return false;
+  norm = invSqrt(norm);
+  r[0] = v[0] * norm;
+  r[1] = v[1] * norm;
+  r[2] = v[2] * norm;
+  return true;
+}
+
+void CQuaterion::update(const float* acc, const float* gyr, const float* mag, float dt)
+{
+  float m[3];
+  float b[2];
+  if (mag) {
+    if (!normalise(mag, m)) return; // handle NaN
+    earthField(m, b);
+  }
+  deltat = dt;
+  step(acc, gyr, mag ? m : 0, b, 0.5f * dt, beta * dt);
+}
+
+void CQuaterion::updateBatch(const float (*acc)[3], const float (*gyr)[3], int count, float dt, const float* mag)
+{
+  // magnetometer, field reference and per-step constants are worked out once for the whole block,
+  // field reference is fixed in earth frame and hardly moves within a block
+  float m[3];
+  float b[2];
+  if (mag) {
+    if (normalise(mag, m)) {
+      earthField(m, b);
+    } else {
+      mag = 0;
+    }
+  }
+  const float halfDt = 0.5f * dt * PI / 180.0f;
+  const float betaDt = beta * dt;
+  for (int n = 0; n < count; n++) {
+    step(acc[n], gyr[n], mag ? m : 0, b, halfDt, betaDt);
+  }
+  deltat = dt;
+}
+
+void CQuaterion::MadgwickQuaternionUpdate(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz)
+{
+  // microsecond clock keeps integration time accurate at high update rates
+  uint32_t now = micros();
+  float dt = lastUpdate ? (float)(now - lastUpdate) / 1000000.0f : 0.0f; // set integration time by time elapsed since last filter update
+  lastUpdate = now;
+  float a[3] = {ax, ay, az};
+  float g[3] = {gx, gy, gz};
+  float m[3] = {mx, my, mz};
+  update(a, g, m, dt);
+}
+
 void CQuaterion::getOrientation(ORIENTATION* ori)
 {
      ori->yaw  = atan2(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]) * 180.0f / PI;
@@ -204,7 +299,7 @@ bool MPU9250_9DOF::initAK8963(float * destination)
 // loads the resulting offsets into accelerometer and gyro bias registers.
 void MPU9250_9DOF::calibrateMPU9250(float * gyroBias, float * accelBias)
 {
-  uint8_t data[12]; // data array to hold accelerometer and gyro x, y, z, data
+  uint8_t data[12] = {0}; // data array to hold accelerometer and gyro x, y, z, data
   uint16_t ii, packet_count, fifo_count;
   int32_t gyro_bias[3]  = {0, 0, 0}, accel_bias[3] = {0, 0, 0};
 
@@ -665,6 +760,77 @@ bool MPU9250_ACC::read(float* acc, float* gyr, float* mag, int16_t* temp, ORIENT
   return true;
 }
 
+bool MPU9250_ACC::beginFIFO(uint16_t odr, bool gyro)
+{
+  if (odr < 4 || odr > 1000) return false;
+  // internal sample rate is 1 kHz with DLPF enabled, divided down to ODR
+  writeByte(SMPLRT_DIV, 1000 / odr - 1);
+  // widen accelerometer bandwidth to 218 or 99 Hz so short peaks are kept
+  uint8_t c = readByte(ACCEL_CONFIG2);
+  c = (c & ~0x0F) | (odr >= 400 ? 0x01 : 0x02);
+  writeByte(ACCEL_CONFIG2, c);
+  if (gyro) {
+    // gyroscope bandwidth to 184 or 92 Hz, fusion would otherwise lag by 5.9 ms
+    c = readByte(CONFIG);
+    writeByte(CONFIG, (c & ~0x07) | (odr >= 400 ? 0x01 : 0x02));
+  }
+  fifoSampleSize = gyro ? FIFO_SAMPLE_SIZE_GYRO : FIFO_SAMPLE_SIZE;
+  writeByte(FIFO_EN, 0x00);
+  writeByte(USER_CTRL, 0x04); // reset FIFO
+  delay(1);
+  writeByte(USER_CTRL, 0x40); // enable FIFO
+  writeByte(FIFO_EN, gyro ? 0x78 : 0x08); // accelerometer data, followed by gyroscope x/y/z
+  return true;
+}
+
+void MPU9250_ACC::endFIFO()
+{
+  writeByte(FIFO_EN, 0x00);
+  writeByte(USER_CTRL, 0x04);
+  // back to 200 Hz and 41 Hz bandwidth as set by initMPU9250
+  writeByte(SMPLRT_DIV, 0x04);
+  uint8_t c = readByte(ACCEL_CONFIG2);
+  writeByte(ACCEL_CONFIG2, (c & ~0x0F) | 0x03);
+  if (fifoSampleSize == FIFO_SAMPLE_SIZE_GYRO) {
+    c = readByte(CONFIG);
+    writeByte(CONFIG, (c & ~0x07) | 0x03);
+  }
+  fifoSampleSize = FIFO_SAMPLE_SIZE;
+}
+
+int MPU9250_ACC::readFIFO(float (*acc)[3], float (*gyr)[3], int maxSamples)
+{
+  uint8_t data[FIFO_READ_SIZE];
+  if (readByte(INT_STATUS) & 0x10) {
+    // samples are lost, start over
+    writeByte(USER_CTRL, 0x44);
+    return -1;
+  }
+  if (!readBytes(FIFO_COUNTH, 2, data)) return 0;
+  int count = (((uint16_t)(data[0] & 0x1F) << 8) | data[1]) / fifoSampleSize;
+  if (count > maxSamples) count = maxSamples;
+  // drain in bursts, each burst is a single I2C transaction
+  int burst = FIFO_READ_SIZE / fifoSampleSize;
+  for (int n = 0; n < count; ) {
+    int m = count - n;
+    if (m > burst) m = burst;
+    if (!readBytes(FIFO_R_W, m * fifoSampleSize, data)) return n;
+    for (int i = 0; i < m; i++) {
+      uint8_t* p = data + i * fifoSampleSize;
+      acc[n + i][0] = (float)(int16_t)(((int16_t)p[0] << 8) | p[1]) * aRes;
+      acc[n + i][1] = (float)(int16_t)(((int16_t)p[2] << 8) | p[3]) * aRes;
+      acc[n + i][2] = (float)(int16_t)(((int16_t)p[4] << 8) | p[5]) * aRes;
+      if (gyr && fifoSampleSize == FIFO_SAMPLE_SIZE_GYRO) {
+        gyr[n + i][0] = (float)(int16_t)(((int16_t)p[6] << 8) | p[7]) * gRes;
+        gyr[n + i][1] = (float)(int16_t)(((int16_t)p[8] << 8) | p[9]) * gRes;
+        gyr[n + i][2] = (float)(int16_t)(((int16_t)p[10] << 8) | p[11]) * gRes;
+      }
+    }
+    n += m;
+  }
+  return count;
+}
+
 byte MPU9250_9DOF::begin(bool fusion)
 {
   if (!initI2C()) return 0;
@@ -215,6 +215,11 @@ enum {
   #define gRes (2000.0/32768.0)
 #endif
 
+#define FIFO_SAMPLE_SIZE 6 /* accelerometer x/y/z */
+#define FIFO_SAMPLE_SIZE_GYRO 12 /* accelerometer and gyroscope x/y/z */
+#define FIFO_READ_SIZE 252 /* bytes per I2C transaction */
+#define FIFO_READ_SAMPLES (FIFO_READ_SIZE / FIFO_SAMPLE_SIZE)
+
 // 2 for 8 Hz, 6 for 100 Hz continuous magnetometer data read
 #define Mmode 0x02
 
@@ -224,17 +229,30 @@ enum {
 class CQuaterion
 {
 public:
+  // single update integrated over time elapsed since last call
   void MadgwickQuaternionUpdate(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz);
+  // single update over dt seconds, gyroscope in rad/s, mag may be null for 6 DOF fusion
+  void update(const float* acc, const float* gyr, const float* mag, float dt);
+  // block of samples taken at fixed interval dt (e.g. 1/ODR of sensor FIFO), gyroscope in deg/s
+  // magnetometer is much slower and one reading (or none) is applied to the whole block
+  void updateBatch(const float (*acc)[3], const float (*gyr)[3], int count, float dt, const float* mag = 0);
   void getOrientation(ORIENTATION* ori);
+  void reset()
+  {
+    q[0] = 1.0f;
+    q[1] = q[2] = q[3] = 0.0f;
+    lastUpdate = 0;
+  }
 private:
+  void earthField(const float* m, float* b);
+  void step(const float* a, const float* g, const float* m, const float* b, float halfDt, float betaDt);
   float q[4] = {1.0f, 0.0f, 0.0f, 0.0f};    // vector to hold quaternion
   // global constants for 9 DoF fusion and AHRS (Attitude and Heading Reference System)
   float GyroMeasError = PI * (40.0f / 180.0f);   // gyroscope measurement error in rads/s (start at 40 deg/s)
   float GyroMeasDrift = PI * (0.0f  / 180.0f);   // gyroscope measurement drift in rad/s/s (start at 0.0 deg/s/s)
   float beta = sqrt(3.0f / 4.0f) * GyroMeasError;   // compute beta
   float zeta = sqrt(3.0f / 4.0f) * GyroMeasDrift;   // compute zeta, the other free parameter in the Madgwick scheme usually set to a small or zero value
-  uint32_t firstUpdate = 0; // used to calculate integration interval
-  uint32_t lastUpdate = 0;
+  uint32_t lastUpdate = 0; // us, used to calculate integration interval
   float deltat = 0.0f;
 };
 
@@ -244,6 +262,13 @@ public:
   virtual byte begin(bool fusion = false);
   virtual void end() { uninitI2C(); }
   virtual bool read(float* acc, float* gyr = 0, float* mag = 0, int16_t* temp = 0, ORIENTATION* ori = 0);
+  // buffer accelerometer (and gyroscope) samples in hardware FIFO at given output data rate (4-1000 Hz)
+  bool beginFIFO(uint16_t odr, bool gyro = false);
+  void endFIFO();
+  // read buffered samples, acceleration in g and rotation in deg/s (gyr may be null)
+  // returns number of samples or -1 if FIFO overflowed
+  int readFIFO(float (*acc)[3], float (*gyr)[3], int maxSamples);
+  int readFIFO(float (*acc)[3], int maxSamples) { return readFIFO(acc, 0, maxSamples); }
 protected:
   bool initI2C();
   void uninitI2C();
@@ -255,6 +280,7 @@ protected:
   uint8_t readByte(uint8_t);
   bool readBytes(uint8_t, uint8_t, uint8_t *);
   int16_t accelCount[3] = {0};
+  uint8_t fifoSampleSize = FIFO_SAMPLE_SIZE;
 };
 
 class MPU9250_9DOF : public MPU9250_ACC
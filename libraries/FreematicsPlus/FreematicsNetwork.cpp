@@ -8,6 +8,7 @@
 #include <Arduino.h>
 #include "FreematicsBase.h"
 #include "FreematicsNetwork.h"
+#include "FreematicsOBD.h"
 
 #define XBEE_BAUDRATE 115200
 
@@ -146,7 +147,7 @@ int HTTPClientWIFI::send(HTTP_METHOD method, const char* path, bool keepAlive, c
     return 0;
   }
   if (payloadSize) {
-    if (client.write(payload, payloadSize) != payloadSize) {
+    if (client.write(payload, payloadSize) != (size_t)payloadSize) {
       m_state = HTTP_ERROR;
       return -1;
     }
@@ -412,9 +413,10 @@ int HTTPClientSIM800::send(HTTP_METHOD method, const char* path, bool keepAlive,
   } else {
     sprintf(m_buffer, "AT+HTTPDATA=%u,10000\r", payloadSize);
     if (sendCommand(m_buffer)) {
-      if (sendCommand("AT+HTTPACTION=1\r", HTTP_CONN_TIMEOUT))
+      if (sendCommand("AT+HTTPACTION=1\r", HTTP_CONN_TIMEOUT)) {
         m_state = HTTP_SENT;
         return payloadSize;
+      }
     }
   }
   m_state = HTTP_ERROR;
@@ -452,6 +454,239 @@ char* HTTPClientSIM800::receive(int* pbytes, unsigned int timeout)
   return 0;  
 }
 
+/*******************************************************************************
+  Incremental AT command engine
+*******************************************************************************/
+
+void CATEngine::begin(CFreematics* device)
+{
+  m_device = device;
+  reset();
+}
+
+void CATEngine::reset()
+{
+  m_head = 0;
+  m_count = 0;
+  m_lineLen = 0;
+  m_payloadURC = -1;
+  m_active = false;
+  m_queued = false;
+  m_resp = 0;
+  m_failures = 0;
+}
+
+bool CATEngine::addURC(const char* prefix, AT_URC_CALLBACK callback, void* context, bool payload)
+{
+  byte i;
+  for (i = 0; i < m_urcCount && strcmp(m_urc[i].prefix, prefix); i++);
+  if (i == AT_MAX_URC) return false;
+  if (i == m_urcCount) m_urcCount++;
+  m_urc[i].prefix = prefix;
+  m_urc[i].callback = callback;
+  m_urc[i].context = context;
+  m_urc[i].payload = payload;
+  return true;
+}
+
+void CATEngine::activate(const char* expected, unsigned int timeout)
+{
+  if (!expected) expected = "\r\nOK\r\n";
+  // expected string is matched per line, a trailing line break means whole line
+  while (*expected == '\r' || *expected == '\n') expected++;
+  int len = strlen(expected);
+  m_wholeLine = false;
+  while (len > 0 && (expected[len - 1] == '\r' || expected[len - 1] == '\n')) {
+    len--;
+    m_wholeLine = true;
+  }
+  m_expected = expected;
+  m_expectedLen = len;
+  // an error result only ends commands awaiting OK, other patterns may follow it
+  m_errorFinal = m_wholeLine && len == 2 && !memcmp(expected, "OK", 2);
+  m_result = 0;
+  m_started = millis();
+  m_timeout = timeout;
+  m_active = true;
+}
+
+bool CATEngine::match(const char* line, int len)
+{
+  if (m_wholeLine) {
+    return len == m_expectedLen && !memcmp(line, m_expected, len);
+  }
+  for (int i = 0; i + m_expectedLen <= len; i++) {
+    if (!memcmp(line + i, m_expected, m_expectedLen)) return true;
+  }
+  return false;
+}
+
+void CATEngine::complete(bool success)
+{
+  m_active = false;
+  m_result = success ? 1 : -1;
+  m_event = true;
+  if (m_queued) {
+    m_queued = false;
+    if (!success) m_failures++;
+    m_head = (m_head + 1) % AT_MAX_PENDING;
+    m_count--;
+    issue();
+  }
+}
+
+void CATEngine::issue()
+{
+  if (m_active || m_count == 0) return;
+  AT_PENDING* p = m_queue + m_head;
+  m_resp = 0;
+  activate(p->expected, p->timeout);
+  m_queued = true;
+  if (p->cmd[0]) m_device->xbWrite(p->cmd);
+}
+
+bool CATEngine::post(const char* cmd, unsigned int timeout, const char* expected)
+{
+  if (cmd && strlen(cmd) >= AT_CMD_SIZE) return false;
+  // wait for a free slot, queued commands time out on their own
+  while (m_count == AT_MAX_PENDING) poll(AT_READ_SLICE);
+  AT_PENDING* p = m_queue + (m_head + m_count) % AT_MAX_PENDING;
+  if (cmd) {
+    strcpy(p->cmd, cmd);
+  } else {
+    p->cmd[0] = 0;
+  }
+  p->expected = expected;
+  p->timeout = timeout;
+  m_count++;
+  issue();
+  return true;
+}
+
+bool CATEngine::flush(unsigned int timeout)
+{
+  for (uint32_t t = millis(); m_count && millis() - t < timeout; ) {
+    poll(AT_READ_SLICE);
+  }
+  return m_count == 0;
+}
+
+bool CATEngine::command(const char* cmd, unsigned int timeout, const char* expected, char* buffer, int bufsize)
+{
+  // responses are in order, so queued commands have to complete first
+  while (m_count) poll(AT_READ_SLICE);
+  activate(expected, timeout);
+  if (cmd) {
+    m_device->xbWrite(cmd);
+  }
+  // cmd may reside in buffer
+  m_resp = buffer;
+  m_respSize = bufsize;
+  m_respLen = 0;
+  m_respLine = 0;
+  buffer[0] = 0;
+  while (m_active) poll(AT_READ_SLICE);
+  m_resp = 0;
+  return m_result > 0;
+}
+
+void CATEngine::processLine()
+{
+  for (byte i = 0; i < m_urcCount; i++) {
+    AT_URC* urc = m_urc + i;
+    int n = strlen(urc->prefix);
+    if (strncmp(m_line, urc->prefix, n)) continue;
+    if (urc->payload) {
+      int len = atoi(m_line + n);
+      if (len > 0) {
+        // payload bytes follow and are not part of any response
+        strncpy(m_payloadLine, m_line, sizeof(m_payloadLine) - 1);
+        m_payloadLine[sizeof(m_payloadLine) - 1] = 0;
+        m_payloadURC = i;
+        m_payloadLen = len;
+        m_payloadRecv = 0;
+        if (m_resp) {
+          m_respLen = m_respLine;
+          m_resp[m_respLen] = 0;
+        }
+        return;
+      }
+    }
+    urc->callback(urc->context, m_line, 0, 0);
+    m_event = true;
+    if (m_resp && m_errorFinal) {
+      // keep URC out of a response ended by OK
+      m_respLen = m_respLine;
+      m_resp[m_respLen] = 0;
+    }
+    break;
+  }
+  if (!m_active) return;
+  if (match(m_line, m_lineLen)) {
+    complete(true);
+  } else if (m_errorFinal && (!strcmp(m_line, "ERROR") || !strncmp(m_line, "+CME ERROR", 10) || !strncmp(m_line, "+CMS ERROR", 10))) {
+    complete(false);
+  }
+}
+
+void CATEngine::feed(char c)
+{
+  if (m_payloadURC >= 0) {
+    if (m_payloadRecv < AT_PAYLOAD_SIZE - 1) m_payload[m_payloadRecv] = c;
+    if (++m_payloadRecv == m_payloadLen) {
+      int len = m_payloadRecv < AT_PAYLOAD_SIZE - 1 ? m_payloadRecv : AT_PAYLOAD_SIZE - 1;
+      m_payload[len] = 0;
+      AT_URC* urc = m_urc + m_payloadURC;
+      m_payloadURC = -1;
+      urc->callback(urc->context, m_payloadLine, m_payload, len);
+      m_event = true;
+    }
+    return;
+  }
+  if (m_resp) {
+    // keep raw response for callers parsing it
+    if (m_respLen >= m_respSize - 16) {
+      int n = dumpLine(m_resp, m_respLen);
+      m_respLen -= n;
+      m_respLine = m_respLine > n ? m_respLine - n : 0;
+    }
+    m_resp[m_respLen++] = c;
+    m_resp[m_respLen] = 0;
+  }
+  if (c == '\n') {
+    m_line[m_lineLen] = 0;
+    if (m_lineLen) processLine();
+    m_lineLen = 0;
+    if (m_resp) m_respLine = m_respLen;
+  } else if (c != '\r' && m_lineLen < AT_LINE_SIZE - 1) {
+    m_line[m_lineLen++] = c;
+  }
+}
+
+bool CATEngine::poll(unsigned int timeout)
+{
+  char buf[64];
+  uint32_t t = millis();
+  m_event = false;
+  for (;;) {
+    unsigned int elapsed = millis() - t;
+    unsigned int slice = elapsed < timeout ? timeout - elapsed : 0;
+    if (slice > AT_READ_SLICE) slice = AT_READ_SLICE;
+    int n = m_device->xbRead(buf, sizeof(buf), slice);
+    for (int i = 0; i < n; i++) feed(buf[i]);
+    if (n > 0 && m_active && m_lineLen > 0 && !m_wholeLine && m_payloadURC < 0) {
+      // prompts such as '>' are not followed by a line break
+      m_line[m_lineLen] = 0;
+      if (match(m_line, m_lineLen)) complete(true);
+    }
+    if (m_active && millis() - m_started >= m_timeout) {
+      complete(false);
+    }
+    if (m_event) return true;
+    if (n <= 0 && millis() - t >= timeout) return false;
+  }
+}
+
 /*******************************************************************************
   Implementation for SIM5360
 *******************************************************************************/
@@ -459,6 +694,12 @@ char* HTTPClientSIM800::receive(int* pbytes, unsigned int timeout)
 bool ClientSIM5360::begin(CFreematics* device)
 {
   m_device = device;
+  m_engine.begin(device);
+  m_engine.addURC("+IPD", onIPD, this, true);
+  m_engine.addURC("RECV FROM:", onRecvFrom, this);
+  m_engine.addURC("+CGPSINFO:", onGPSInfo, this);
+  m_engine.addURC("+CPSI:", onNetInfo, this);
+  m_engine.addURC("+CHTTPS: RECV EVENT", onHTTPEvent, this);
   if (m_stage == 0) {
     device->xbBegin(XBEE_BAUDRATE);
     m_stage = 1;
@@ -469,6 +710,8 @@ bool ClientSIM5360::begin(CFreematics* device)
     delay(3000);
     // discard any stale data
     device->xbPurge();
+    m_engine.reset();
+    m_incomingCount = 0;
     for (byte m = 0; m < 5; m++) {
       if (sendCommand("AT\r") && sendCommand("ATE0\r") && sendCommand("ATI\r")) {
         m_stage = 2;
@@ -477,7 +720,7 @@ bool ClientSIM5360::begin(CFreematics* device)
         if (p) p = strchr(p, '_');
         if (p++) {
           int i = 0;
-          while (i < sizeof(m_model) - 1 && p[i] && p[i] != '\r' && p[i] != '\n') {
+          while (i < (int)sizeof(m_model) - 1 && p[i] && p[i] != '\r' && p[i] != '\n') {
             m_model[i] = p[i];
             i++;
           }
@@ -552,15 +795,16 @@ bool ClientSIM5360::setup(const char* apn, bool gps, unsigned int timeout)
 
     //sendCommand("AT+CSOCKAUTH=1,1,\"APN_PASSWORD\",\"APN_USERNAME\"\r");
 
-    sendCommand("AT+CSOCKSETPN=1\r");
-    sendCommand("AT+CIPMODE=0\r");
-    sendCommand("AT+NETOPEN\r");
+    // pipelined, results are collected before next command
+    m_engine.post("AT+CSOCKSETPN=1\r");
+    m_engine.post("AT+CIPMODE=0\r");
+    m_engine.post("AT+NETOPEN\r");
   } while(0);
   if (!success) Serial.println(m_buffer);
   // enable internal GPS if required
   if (gps) {
-    sendCommand("AT+CVAUXV=61\r");
-    sendCommand("AT+CVAUXS=1\r");
+    m_engine.post("AT+CVAUXV=61\r");
+    m_engine.post("AT+CVAUXS=1\r");
     if (sendCommand("AT+CGPS=1\r") && sendCommand("AT+CGPSINFO=1\r")) {
       if (!m_gps) {
         m_gps = new GPS_DATA;
@@ -568,6 +812,11 @@ bool ClientSIM5360::setup(const char* apn, bool gps, unsigned int timeout)
       }
     }
   }
+  // results of pipelined commands are collected here, not by the first send
+  // AT+NETOPEN also reports an error when the network is already open
+  if (!m_engine.flush(5000) || m_engine.failures()) {
+    Serial.println("Setup command failed");
+  }
   return success;
 }
 
@@ -647,21 +896,12 @@ String ClientSIM5360::queryIP(const char* host)
 
 bool ClientSIM5360::sendCommand(const char* cmd, unsigned int timeout, const char* expected)
 {
-  if (cmd) {
-    m_device->xbWrite(cmd);
-  }
-  m_buffer[0] = 0;
-  byte ret = m_device->xbReceive(m_buffer, sizeof(m_buffer), timeout, &expected, 1);
-  if (ret) {
-    return true;
-  } else {
-    return false;
-  }
+  return m_engine.command(cmd, timeout, expected, m_buffer, sizeof(m_buffer));
 }
 
 float ClientSIM5360::parseDegree(const char* s)
 {
-  char *p;
+  const char *p;
   unsigned long left = atol(s);
   unsigned long tenk_minutes = (left % 100UL) * 100000UL;
   if ((p = strchr(s, '.')))
@@ -676,12 +916,12 @@ float ClientSIM5360::parseDegree(const char* s)
   return (left / 100) + (float)tenk_minutes / 6 / 1000000;
 }
 
-void ClientSIM5360::checkGPS()
+void ClientSIM5360::checkGPS(const char* s)
 {
-  // check and parse GPS data
-  char *p;
-  if (m_gps && (p = strstr(m_buffer, "+CGPSINFO:"))) do {
-    if (!(p = strchr(p, ':'))) break;
+  // parse +CGPSINFO report
+  const char *p;
+  if (m_gps) do {
+    if (!(p = strchr(s, ':'))) break;
     if (*(++p) == ',') break;
     m_gps->lat = parseDegree(p);
     if (!(p = strchr(p, ','))) break;
@@ -704,6 +944,52 @@ void ClientSIM5360::checkGPS()
   } while (0);
 }
 
+char* ClientSIM5360::checkIncoming(int* pbytes)
+{
+  if (m_incomingCount == 0) return 0;
+  byte i = m_incomingHead;
+  m_incomingHead = (m_incomingHead + 1) % SIM5360_MAX_DATAGRAMS;
+  m_incomingCount--;
+  if (pbytes) *pbytes = m_incomingLen[i];
+  return m_incoming[i];
+}
+
+void ClientSIM5360::onIPD(void* context, const char* line, const char* payload, int len)
+{
+  ClientSIM5360* client = (ClientSIM5360*)context;
+  if (client->m_incomingCount == SIM5360_MAX_DATAGRAMS) {
+    // drop oldest datagram
+    client->m_incomingHead = (client->m_incomingHead + 1) % SIM5360_MAX_DATAGRAMS;
+    client->m_incomingCount--;
+  }
+  byte i = (client->m_incomingHead + client->m_incomingCount) % SIM5360_MAX_DATAGRAMS;
+  memcpy(client->m_incoming[i], payload, len + 1);
+  client->m_incomingLen[i] = len;
+  client->m_incomingCount++;
+}
+
+void ClientSIM5360::onRecvFrom(void* context, const char* line, const char* payload, int len)
+{
+  ClientSIM5360* client = (ClientSIM5360*)context;
+  strncpy(client->m_peer, line + 10, sizeof(client->m_peer) - 1);
+}
+
+void ClientSIM5360::onGPSInfo(void* context, const char* line, const char* payload, int len)
+{
+  ((ClientSIM5360*)context)->checkGPS(line);
+}
+
+void ClientSIM5360::onNetInfo(void* context, const char* line, const char* payload, int len)
+{
+  ClientSIM5360* client = (ClientSIM5360*)context;
+  strncpy(client->m_netInfo, line + 7, sizeof(client->m_netInfo) - 1);
+}
+
+void ClientSIM5360::onHTTPEvent(void* context, const char* line, const char* payload, int len)
+{
+  ((ClientSIM5360*)context)->m_httpEvent = true;
+}
+
 bool UDPClientSIM5360::open(const char* host, uint16_t port)
 {
   if (host) {
@@ -732,36 +1018,23 @@ bool UDPClientSIM5360::send(const char* data, unsigned int len)
   sprintf(m_buffer, "AT+CIPSEND=0,%u,\"%s\",%u\r", len, udpIP.c_str(), udpPort);
   if (sendCommand(m_buffer, 100, ">")) {
     m_device->xbWrite(data, len);
-    return sendCommand(0, 1000);
+    // result of this datagram is awaited so that a failure is reported for it
+    m_engine.failures();
+    return m_engine.post(0, 1000) && m_engine.flush(1000) && !m_engine.failures();
   }
   return false;
 }
 
 char* UDPClientSIM5360::receive(int* pbytes, unsigned int timeout)
 {
-	char *data = checkIncoming(pbytes);
-	if (data) return data;
-  if (sendCommand(0, timeout, "+IPD")) {
-		return checkIncoming(pbytes);
-  }
-  return 0;
-}
-
-char* UDPClientSIM5360::checkIncoming(int* pbytes)
-{
-  checkGPS();
-  char *p = strstr(m_buffer, "+IPD");
-	if (p) {
-    *p = '-'; // mark this datagram as checked
-    int len = atoi(p + 4);
-    if (pbytes) *pbytes = len;
-    p = strchr(p, '\n');
-    if (p) {
-      if (strlen(++p) > len) *(p + len) = 0;
-      return p;
-    }
+  // datagrams are queued by the +IPD handler whenever data is polled
+  char *data;
+  uint32_t t = millis();
+  while (!(data = checkIncoming(pbytes))) {
+    unsigned int elapsed = millis() - t;
+    if (!m_engine.poll(elapsed < timeout ? timeout - elapsed : 0) && elapsed >= timeout) break;
   }
-	return 0;
+  return data;
 }
 
 bool HTTPClientSIM5360::open(const char* host, uint16_t port)
@@ -787,6 +1060,7 @@ int HTTPClientSIM5360::send(HTTP_METHOD method, const char* path, bool keepAlive
 {
   unsigned int headerSize = genHeader(m_buffer, method, path, keepAlive, payload, payloadSize);
   // issue HTTP send command
+  m_httpEvent = false;
   sprintf(m_buffer, "AT+CHTTPSSEND=%u\r", headerSize + payloadSize);
   if (!sendCommand(m_buffer, 100, ">")) {
     m_state = HTTP_DISCONNECTED;
@@ -810,13 +1084,9 @@ int HTTPClientSIM5360::send(HTTP_METHOD method, const char* path, bool keepAlive
 
 char* HTTPClientSIM5360::receive(int* pbytes, unsigned int timeout)
 {
-  const char* expected = "+CHTTPS: RECV EVENT";
-  checkGPS();
-  if (!strstr(m_buffer, expected)) {
-    bool hasEvent = sendCommand(0, timeout, expected);
-    checkGPS();
-    if (!hasEvent) return 0;
-  }
+  // the event may have been dispatched during an earlier command
+  if (!m_httpEvent && !sendCommand(0, timeout, "+CHTTPS: RECV EVENT")) return 0;
+  m_httpEvent = false;
 
   // start receiving
   int received = 0;
@@ -826,9 +1096,8 @@ char* HTTPClientSIM5360::receive(int* pbytes, unsigned int timeout)
     [XX bytes from server]\r\n
     +CHTTPSRECV: 0\r\n
   */
-  sprintf(m_buffer, "AT+CHTTPSRECV=%u\r", sizeof(m_buffer) - 36);
+  sprintf(m_buffer, "AT+CHTTPSRECV=%u\r", (unsigned int)(sizeof(m_buffer) - 36));
   bool success = sendCommand(m_buffer, HTTP_CONN_TIMEOUT, "\r\n+CHTTPSRECV: 0");
-  checkGPS();
   if (success) {
     char *p = strstr(m_buffer, "+CHTTPSRECV:");
     if (p) {
@@ -901,9 +1170,10 @@ bool ClientSIM7600::setup(const char* apn, bool gps, unsigned int timeout)
 
     //sendCommand("AT+CSOCKAUTH=1,1,\"APN_PASSWORD\",\"APN_USERNAME\"\r");
 
-    sendCommand("AT+CSOCKSETPN=1\r");
-    sendCommand("AT+CIPMODE=0\r");
-    sendCommand("AT+NETOPEN\r");
+    // pipelined, results are collected before next command
+    m_engine.post("AT+CSOCKSETPN=1\r");
+    m_engine.post("AT+CIPMODE=0\r");
+    m_engine.post("AT+NETOPEN\r");
   } while(0);
   // enable internal GPS if required
   if (gps) {
@@ -913,8 +1183,13 @@ bool ClientSIM7600::setup(const char* apn, bool gps, unsigned int timeout)
         memset(m_gps, 0, sizeof(GPS_DATA));
       }
     }
-    sendCommand("AT+CVAUXV=3050\r");
-    sendCommand("AT+CVAUXS=1\r");
+    m_engine.post("AT+CVAUXV=3050\r");
+    m_engine.post("AT+CVAUXS=1\r");
+  }
+  // results of pipelined commands are collected here, not by the first send
+  // AT+NETOPEN also reports an error when the network is already open
+  if (!m_engine.flush(5000) || m_engine.failures()) {
+    Serial.println("Setup command failed");
   }
   return success;
 }
@@ -947,36 +1222,23 @@ bool UDPClientSIM7600::send(const char* data, unsigned int len)
   sprintf(m_buffer, "AT+CIPSEND=0,%u,\"%s\",%u\r", len, udpIP.c_str(), udpPort);
   if (sendCommand(m_buffer, 100, ">")) {
     m_device->xbWrite(data, len);
-    return sendCommand(0, 1000);
+    // result of this datagram is awaited so that a failure is reported for it
+    m_engine.failures();
+    return m_engine.post(0, 1000) && m_engine.flush(1000) && !m_engine.failures();
   }
   return false;
 }
 
 char* UDPClientSIM7600::receive(int* pbytes, unsigned int timeout)
 {
-	char *data = checkIncoming(pbytes);
-	if (data) return data;
-  if (sendCommand(0, timeout, "+IPD")) {
-		return checkIncoming(pbytes);
-  }
-  return 0;
-}
-
-char* UDPClientSIM7600::checkIncoming(int* pbytes)
-{
-  checkGPS();
-  char *p = strstr(m_buffer, "+IPD");
-	if (p) {
-    *p = '-'; // mark this datagram as checked
-    int len = atoi(p + 4);
-    if (pbytes) *pbytes = len;
-    p = strchr(p, '\n');
-    if (p) {
-      if (strlen(++p) > len) *(p + len) = 0;
-      return p;
-    }
+  // datagrams are queued by the +IPD handler whenever data is polled
+  char *data;
+  uint32_t t = millis();
+  while (!(data = checkIncoming(pbytes))) {
+    unsigned int elapsed = millis() - t;
+    if (!m_engine.poll(elapsed < timeout ? timeout - elapsed : 0) && elapsed >= timeout) break;
   }
-	return 0;
+  return data;
 }
 
 bool HTTPClientSIM7600::open(const char* host, uint16_t port)
@@ -1019,7 +1281,6 @@ char* HTTPClientSIM7600::receive(int* pbytes, unsigned int timeout)
   int received = 0;
   char* payload = 0;
   bool success = sendCommand(0, HTTP_CONN_TIMEOUT, "\r\n+CHTTPACT: 0");
-  checkGPS();
   if (success) {
     char *p = strstr(m_buffer, "\r\n+CHTTPACT: DATA,");
     if (p) {
@@ -133,6 +133,97 @@ protected:
     uint16_t m_port;
 };
 
+#define AT_LINE_SIZE 128
+#define AT_PAYLOAD_SIZE 256
+#define AT_CMD_SIZE 96
+#define AT_MAX_URC 6
+#define AT_MAX_PENDING 4
+#define AT_READ_SLICE 10 /* ms */
+
+// called with the URC line and, for payload URCs, the raw bytes following it
+typedef void (*AT_URC_CALLBACK)(void* context, const char* line, const char* payload, int len);
+
+typedef struct {
+    const char* prefix;
+    AT_URC_CALLBACK callback;
+    void* context;
+    bool payload;
+} AT_URC;
+
+typedef struct {
+    char cmd[AT_CMD_SIZE];
+    const char* expected;
+    uint16_t timeout;
+} AT_PENDING;
+
+// incremental AT response parser, lines are handled as they arrive from the module
+class CATEngine
+{
+public:
+    void begin(CFreematics* device);
+    // drop pending commands and any partially received line
+    void reset();
+    // register handler for unsolicited lines starting with prefix
+    // a payload URC (e.g. +IPD<len>) carries <len> raw bytes after its line
+    bool addURC(const char* prefix, AT_URC_CALLBACK callback, void* context, bool payload = false);
+    // queue command without waiting for its result (cmd 0 only awaits expected)
+    bool post(const char* cmd, unsigned int timeout = 1000, const char* expected = 0);
+    // send command once queued ones are done and wait for expected response
+    bool command(const char* cmd, unsigned int timeout, const char* expected, char* buffer, int bufsize);
+    // wait until all queued commands are completed
+    bool flush(unsigned int timeout);
+    // process incoming data, returns true once a URC or command result is handled
+    bool poll(unsigned int timeout = 0);
+    byte pending() { return m_count; }
+    // number of failed queued commands since last call
+    uint16_t failures()
+    {
+        uint16_t n = m_failures;
+        m_failures = 0;
+        return n;
+    }
+private:
+    void feed(char c);
+    void processLine();
+    bool match(const char* line, int len);
+    void activate(const char* expected, unsigned int timeout);
+    void complete(bool success);
+    void issue();
+    CFreematics* m_device = 0;
+    AT_URC m_urc[AT_MAX_URC];
+    byte m_urcCount = 0;
+    AT_PENDING m_queue[AT_MAX_PENDING];
+    byte m_head = 0;
+    byte m_count = 0;
+    uint16_t m_failures = 0;
+    // line assembly
+    char m_line[AT_LINE_SIZE];
+    int m_lineLen = 0;
+    // payload URC being received
+    char m_payload[AT_PAYLOAD_SIZE];
+    int8_t m_payloadURC = -1;
+    char m_payloadLine[16];
+    int m_payloadLen = 0;
+    int m_payloadRecv = 0;
+    // command being executed
+    bool m_active = false;
+    bool m_queued = false;
+    bool m_errorFinal = false;
+    int8_t m_result = 0;
+    bool m_event = false;
+    const char* m_expected = 0;
+    int m_expectedLen = 0;
+    bool m_wholeLine = false;
+    uint32_t m_started = 0;
+    unsigned int m_timeout = 0;
+    char* m_resp = 0;
+    int m_respSize = 0;
+    int m_respLen = 0;
+    int m_respLine = 0;
+};
+
+#define SIM5360_MAX_DATAGRAMS 2
+
 class ClientSIM5360
 {
 public:
@@ -147,6 +238,8 @@ public:
     bool getLocation(GPS_DATA** pgd)
     {
         if (m_gps) {
+            // +CGPSINFO reports are dispatched while polling
+            m_engine.poll();
             if (pgd) *pgd = m_gps;
             return m_gps->ts != 0;
         } else {
@@ -155,17 +248,36 @@ public:
     }
     char* getBuffer() { return m_buffer; }
     const char* deviceName() { return m_model; }
+    // last +CPSI report
+    const char* getNetworkInfo() { return m_netInfo; }
+    // source of last received datagram (RECV FROM)
+    const char* getPeer() { return m_peer; }
     char IMEI[16] = {0};
 protected:
     // send command and check for expected response
     bool sendCommand(const char* cmd, unsigned int timeout = 1000, const char* expected = "\r\nOK\r\n");
-    void checkGPS();
+    void checkGPS(const char* s);
     float parseDegree(const char* s);
+    char* checkIncoming(int* pbytes);
+    static void onIPD(void* context, const char* line, const char* payload, int len);
+    static void onRecvFrom(void* context, const char* line, const char* payload, int len);
+    static void onGPSInfo(void* context, const char* line, const char* payload, int len);
+    static void onNetInfo(void* context, const char* line, const char* payload, int len);
+    static void onHTTPEvent(void* context, const char* line, const char* payload, int len);
+    CATEngine m_engine;
     char m_buffer[384] = {0};
     uint8_t m_stage = 0;
     char m_model[12] = {0};
+    char m_netInfo[48] = {0};
+    char m_peer[24] = {0};
     CFreematics* m_device = 0;
     GPS_DATA* m_gps = 0;
+    // received datagrams, valid until next call into the client
+    char m_incoming[SIM5360_MAX_DATAGRAMS][AT_PAYLOAD_SIZE];
+    int m_incomingLen[SIM5360_MAX_DATAGRAMS];
+    byte m_incomingHead = 0;
+    byte m_incomingCount = 0;
+    bool m_httpEvent = false;
 };
 
 class UDPClientSIM5360 : public ClientSIM5360
@@ -176,7 +288,6 @@ public:
     bool send(const char* data, unsigned int len);
     char* receive(int* pbytes = 0, unsigned int timeout = 5000);
 protected:
-    char* checkIncoming(int* pbytes);
     String udpIP;
     uint16_t udpPort = 0;
 };
@@ -204,7 +315,6 @@ public:
     bool send(const char* data, unsigned int len);
     char* receive(int* pbytes = 0, unsigned int timeout = 5000);
 protected:
-    char* checkIncoming(int* pbytes);
     String udpIP;
     uint16_t udpPort = 0;
 };
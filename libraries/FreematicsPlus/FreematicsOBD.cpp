@@ -106,13 +106,133 @@ bool COBD::readPID(byte pid, int& result)
 	return true;
 }
 
-byte COBD::readPID(const byte pid[], byte count, int result[])
+// data bytes of mode 01 PIDs as defined in SAE J1979
+static const byte pidDataSize[] = {
+	4, 4, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, // 00-0F
+	2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, // 10-1F
+	4, 2, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1, 1, // 20-2F
+	1, 2, 2, 1, 4, 4, 4, 4, 4, 4, 4, 4, 2, 2, 2, 2, // 30-3F
+	4, 4, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 4, // 40-4F
+	4, 1, 1, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 1, // 50-5F
+	4, 1, 1, 2, 5, 2, 5, 3, // 60-67
+};
+
+byte COBD::readPID(const byte pid[], byte count, int result[], bool obtained[])
 {
 	byte results = 0;
+	for (byte n = 0; n < count; ) {
+		byte batch = count - n;
+		if (batch > OBD_MAX_MULTI_PIDS) batch = OBD_MAX_MULTI_PIDS;
+		bool ok[OBD_MAX_MULTI_PIDS] = {0};
+		byte got = 0;
+		bool multi = batch > 1 && m_multiPID && dataMode == 1;
+		if (multi) {
+			got = readMultiPID(pid + n, batch, result + n, ok);
+		}
+		if (got < 2) {
+			// request failed or ECU only answered one PID, retry with single PID requests
+			byte single = 0;
+			for (byte i = 0; i < batch; i++) {
+				if (!ok[i] && readPID(pid[n + i], result[n + i])) {
+					ok[i] = true;
+					single++;
+				}
+			}
+			// values missed by multi-PID request are available, so ECU (e.g. non-CAN) does not support it
+			if (multi && single) m_multiPID = false;
+			got += single;
+		}
+		if (obtained) memcpy(obtained + n, ok, batch * sizeof(bool));
+		results += got;
+		n += batch;
+	}
+	return results;
+}
+
+byte COBD::readMultiPID(const byte pid[], byte count, int result[], bool obtained[])
+{
+	/*
+	Response example (ISO 15765, 2 frames):
+	00A
+	0: 41 0C 1A F8 0D 00
+	1: 11 26 00 00 00 00 00
+	*/
+	char buffer[256];
+	char *p = buffer + sprintf(buffer, "%02X", dataMode);
 	for (byte n = 0; n < count; n++) {
-		if (readPID(pid[n], result[n])) {
-			results++;
+		p += sprintf(p, "%02X", pid[n]);
+	}
+	strcpy(p, "\r");
+	link->send(buffer);
+	idleTasks();
+	int ret = link->receive(buffer, sizeof(buffer), OBD_TIMEOUT_SHORT);
+	if (ret <= 0 || checkErrorMessage(buffer)) return 0;
+
+	byte data[64];
+	int len = 0;
+	int expected = 0;
+	byte results = 0;
+	for (p = buffer; *p; ) {
+		char *eol = p + strcspn(p, "\r\n");
+		char c = *eol;
+		*eol = 0;
+		char *colon = strchr(p, ':');
+		if (colon && colon - p <= 2) {
+			// frame of a multi-frame message, frame 0 starts a new message
+			if (*p == '0' && colon == p + 1) {
+				results += parseMultiPID(data, len, pid, count, result, obtained);
+				len = 0;
+			}
+			p = colon + 1;
+		} else if (isxdigit(p[0]) && eol - p == 3) {
+			// byte count of the coming multi-frame message
+			results += parseMultiPID(data, len, pid, count, result, obtained);
+			len = 0;
+			expected = hex2uint16(p);
+			p = eol;
+		} else {
+			// single frame message
+			results += parseMultiPID(data, len, pid, count, result, obtained);
+			len = 0;
+			expected = 0;
+		}
+		for (; p < eol; p++) {
+			if (isxdigit(*p) && isxdigit(*(p + 1)) && len < (int)sizeof(data)) {
+				data[len++] = hex2uint8(p++);
+			}
+		}
+		if (expected && len > expected) len = expected;
+		*eol = c;
+		p = eol + strspn(eol, "\r\n");
+	}
+	results += parseMultiPID(data, len, pid, count, result, obtained);
+	if (results) errors = 0;
+	return results;
+}
+
+byte COBD::parseMultiPID(const byte* data, int len, const byte pid[], byte count, int result[], bool obtained[])
+{
+	if (len < 3 || data[0] != 0x40 + dataMode) return 0;
+	byte results = 0;
+	for (int i = 1; i < len; ) {
+		byte curpid = data[i++];
+		byte size = curpid < sizeof(pidDataSize) ? pidDataSize[curpid] : 0;
+		// unknown data size, remaining PIDs can not be located
+		if (size == 0 || i + size > len) break;
+		for (byte n = 0; n < count; n++) {
+			if (pid[n] == curpid && !obtained[n]) {
+				// values are normalized from hex text as for single PID responses
+				char hex[16];
+				for (byte k = 0; k < size; k++) {
+					sprintf(hex + k * 3, "%02X ", data[i + k]);
+				}
+				result[n] = normalizeData(curpid, hex);
+				obtained[n] = true;
+				results++;
+				break;
+			}
 		}
+		i += size;
 	}
 	return results;
 }
@@ -352,6 +472,7 @@ bool COBD::init(OBD_PROTOCOLS protocol)
 
 	if (!link) return false;
 	m_state = OBD_DISCONNECTED;
+	m_multiPID = true;
 	for (byte n = 0; n < 3; n++) {
 		stage = 0;
 		for (byte i = 0; i < sizeof(initcmd) / sizeof(initcmd[0]); i++) {
@@ -9,6 +9,7 @@
 
 #define OBD_TIMEOUT_SHORT 1000 /* ms */
 #define OBD_TIMEOUT_LONG 10000 /* ms */
+#define OBD_MAX_MULTI_PIDS 6 /* PIDs per mode 01 request (CAN only) */
 
 int dumpLine(char* buffer, int len);
 uint16_t hex2uint16(const char *p);
@@ -31,7 +32,8 @@ public:
 	// read specified OBD-II PID value
 	bool readPID(byte pid, int& result);
 	// read multiple OBD-II PID values, return number of values obtained
-	byte readPID(const byte pid[], byte count, int result[]);
+	// obtained[] (optional) flags which of the PIDs have been read
+	byte readPID(const byte pid[], byte count, int result[], bool obtained[] = 0);
 	// set device into low power mode
 	void enterLowPowerMode();
 	// wake up device from low power mode
@@ -67,6 +69,8 @@ public:
 protected:
 	virtual void idleTasks() { delay(5); }
 	char* getResponse(byte& pid, char* buffer, byte bufsize);
+	byte readMultiPID(const byte pid[], byte count, int result[], bool obtained[]);
+	byte parseMultiPID(const byte* data, int len, const byte pid[], byte count, int result[], bool obtained[]);
 	uint8_t getPercentageValue(char* data);
 	uint16_t getLargeValue(char* data);
 	uint8_t getSmallValue(char* data);
@@ -76,5 +80,7 @@ protected:
 	char* getResultValue(char* buf);
 	void recover();
 	OBD_STATES m_state = OBD_DISCONNECTED;
+	// cleared once ECU is found not to answer multi-PID requests
+	bool m_multiPID = true;
 };
 
@@ -24,15 +24,20 @@
 #include "soc/sens_reg.h"
 #include "FreematicsPlus.h"
 #include "FreematicsGPS.h"
+#include "FreematicsUBX.h"
 
 #define VERBOSE_LINK 0
 #define VERBOSE_XBEE 0
 
 static TinyGPS gps;
+static CUBXDecoder ubx;
+// receiver outputs UBX instead of NMEA
+static volatile bool gpsBinary = false;
 static byte gpsPendingData = 0;
+// NMEA ring filled by GPS task and drained by gpsGetNMEA, one writer and one reader
 static char* nmeaBuffer = 0;
-static int nmeaBytes = 0;
-Mutex nmeaBufferMutex;
+static volatile uint32_t nmeaHead = 0;
+static volatile uint32_t nmeaTail = 0;
 static Task taskGPS;
 static GPS_DATA* gpsData = 0;
 static SPISettings settings = SPISettings(SPI_FREQ, MSBFIRST, SPI_MODE0);
@@ -53,19 +58,44 @@ static uint8_t inline readRxPin()
 #endif
 }
 
+static void nmeaWrite(const uint8_t* data, int len)
+{
+    uint32_t head = nmeaHead;
+    int room = NMEA_BUF_SIZE - (int)(head - nmeaTail);
+    // bytes not fitting are discarded
+    if (len > room) len = room;
+    for (int i = 0; i < len; i++) {
+        nmeaBuffer[(head + i) & (NMEA_BUF_SIZE - 1)] = data[i];
+    }
+    __sync_synchronize();
+    nmeaHead = head + len;
+}
+
 static void gps_decode_task(void* inst)
 {
+    uint8_t buf[GPS_READ_SIZE];
     for (;;) {
-        uint8_t c = 0;
-        int len = uart_read_bytes(GPS_UART_NUM, &c, 1, 60000 / portTICK_RATE_MS);
+        // sleep until data arrives, then take everything buffered by UART driver in one go
+        int len = uart_read_bytes(GPS_UART_NUM, buf, 1, 60000 / portTICK_RATE_MS);
         if (len != 1) continue;
-        if (nmeaBuffer && nmeaBytes < NMEA_BUF_SIZE) {
-            nmeaBufferMutex.lock();
-            nmeaBuffer[nmeaBytes++] = c;
-            nmeaBufferMutex.unlock();
+        size_t avail = 0;
+        uart_get_buffered_data_len(GPS_UART_NUM, &avail);
+        if (avail > sizeof(buf) - 1) avail = sizeof(buf) - 1;
+        if (avail > 0) {
+            int n = uart_read_bytes(GPS_UART_NUM, buf + 1, avail, 0);
+            if (n > 0) len += n;
         }
-        if (gps.encode(c)) {
-            gpsPendingData++;
+        if (gpsBinary) {
+            for (int i = 0; i < len; i++) {
+                if (ubx.encode(buf[i])) gpsPendingData++;
+            }
+            continue;
+        }
+        if (nmeaBuffer) nmeaWrite(buf, len);
+        for (int i = 0; i < len; i++) {
+            if (gps.encode(buf[i])) {
+                gpsPendingData++;
+            }
         }
     }
 }
@@ -212,6 +242,94 @@ void Mutex::unlock()
   xSemaphoreGive(xSemaphore);
 }
 
+bool CCANCapture::start(COBD* obd, CCANRing* ring, CCANFilter* filter, bool extended)
+{
+	if (m_running) return false;
+	m_obd = obd;
+	m_ring = ring;
+	m_filter = filter;
+	m_extended = extended;
+	m_lineLen = 0;
+	m_batchCount = 0;
+	m_stop = false;
+	char buf[32];
+	// identifiers are needed for filtering and logging
+	obd->link->sendCommand("ATH1\r", buf, sizeof(buf), 1000);
+	if (filter && filter->count() == 1) {
+		// let co-processor discard unwanted frames before they reach the link
+		obd->setHeaderFilter(filter->id(0));
+		obd->setHeaderMask(filter->mask(0));
+	}
+	obd->sniff(true);
+	m_running = true;
+	if (!m_task.create(taskCapture, "CAN", 2, 2048)) {
+		m_running = false;
+		obd->sniff(false);
+		return false;
+	}
+	return true;
+}
+
+void CCANCapture::stop()
+{
+	if (!m_running) return;
+	m_stop = true;
+	for (int n = 0; n < 20 && m_running; n++) delay(10);
+	m_task.destroy();
+	m_running = false;
+	char buf[32];
+	m_obd->sniff(false);
+	m_obd->link->sendCommand("ATH0\r", buf, sizeof(buf), 1000);
+}
+
+void CCANCapture::taskCapture(void* inst)
+{
+	CCANCapture* cap = (CCANCapture*)inst;
+	char buf[CAN_CAPTURE_READ_SIZE];
+	while (!cap->m_stop) {
+		int len = cap->m_obd->link->read(buf, sizeof(buf), 5);
+		if (len > 0) {
+			cap->process(buf, len, millis());
+		}
+		// hand over batch once link goes idle or batch is full
+		if (len < (int)sizeof(buf)) cap->flush();
+	}
+	cap->flush();
+	cap->m_running = false;
+	for (;;) cap->m_task.sleep(1000);
+}
+
+void CCANCapture::process(const char* data, int len, uint32_t ts)
+{
+	for (int i = 0; i < len; i++) {
+		char c = data[i];
+		if (c != '\r' && c != '\n') {
+			if (m_lineLen < (int)sizeof(m_line)) m_line[m_lineLen] = c;
+			m_lineLen++;
+			continue;
+		}
+		if (m_lineLen == 0) continue;
+		CAN_FRAME& frame = m_batch[m_batchCount];
+		if (m_lineLen <= (int)sizeof(m_line) && parseCANLine(m_line, m_lineLen, m_extended, frame)) {
+			frame.ts = ts;
+			if (++m_batchCount == CAN_CAPTURE_BATCH) flush();
+		} else {
+			errors++;
+		}
+		m_lineLen = 0;
+	}
+}
+
+void CCANCapture::flush()
+{
+	if (m_batchCount == 0) return;
+	int count = m_filter ? m_filter->apply(m_batch, m_batchCount) : m_batchCount;
+	for (int n = 0; n < count; n++) {
+		if (m_ring->push(m_batch[n])) frames++;
+	}
+	m_batchCount = 0;
+}
+
 bool CLink_UART::begin(unsigned int baudrate, int rxPin, int txPin)
 {
 #if VERBOSE_LINK
@@ -298,6 +416,23 @@ int CLink_UART::read()
         return -1;
 }
 
+int CLink_UART::read(char* buffer, int bufsize, unsigned int timeout)
+{
+    size_t len = 0;
+    uart_get_buffered_data_len(LINK_UART_NUM, &len);
+    // block for first byte only when nothing is buffered
+    if (len == 0) {
+        int n = uart_read_bytes(LINK_UART_NUM, (uint8_t*)buffer, 1, timeout / portTICK_RATE_MS);
+        if (n <= 0) return 0;
+        uart_get_buffered_data_len(LINK_UART_NUM, &len);
+        if (len > (size_t)bufsize - 1) len = bufsize - 1;
+        return len ? 1 + uart_read_bytes(LINK_UART_NUM, (uint8_t*)buffer + 1, len, 0) : 1;
+    }
+    if (len > (size_t)bufsize) len = bufsize;
+    int n = uart_read_bytes(LINK_UART_NUM, (uint8_t*)buffer, len, 0);
+    return n > 0 ? n : 0;
+}
+
 bool CLink_UART::changeBaudRate(unsigned int baudrate)
 {
 	char buf[32];
@@ -445,11 +580,12 @@ void FreematicsESP32::gpsEnd()
     if (!(m_flags & GNSS_USE_LINK)) {
         taskGPS.destroy();
         if (!(m_flags & GNSS_SOFT_SERIAL)) uart_driver_delete(GPS_UART_NUM);
+        // receiver configuration is lost with power
+        gpsBinary = false;
+        // decoding task is gone, nothing else touches the buffer
         if (nmeaBuffer) {
-            nmeaBufferMutex.lock();
-            delete nmeaBuffer;
+            delete[] nmeaBuffer;
             nmeaBuffer = 0;
-            nmeaBufferMutex.unlock();
         }
     }
 	//turn off GPS power
@@ -486,10 +622,11 @@ bool FreematicsESP32::gpsBegin(int baudrate, bool buffered)
         // set UART pins
         uart_set_pin(GPS_UART_NUM, PIN_GPS_UART_TXD, PIN_GPS_UART_RXD, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
         // install UART driver
-        uart_driver_install(GPS_UART_NUM, UART_BUF_SIZE, 0, 0, NULL, 0);
+        uart_driver_install(GPS_UART_NUM, GPS_UART_BUF_SIZE, 0, 0, NULL, 0);
         // turn on GPS power
         if (m_pinGPSPower) digitalWrite(m_pinGPSPower, HIGH);
         delay(100);
+        m_gpsBaudrate = baudrate;
         // start decoding task
         taskGPS.create(gps_decode_task, "GPS", 1);
     } else {
@@ -527,10 +664,10 @@ bool FreematicsESP32::gpsBegin(int baudrate, bool buffered)
                 // data is coming in
                 if (!gpsData) gpsData = new GPS_DATA;
                 memset(gpsData, 0, sizeof(GPS_DATA));
+                nmeaTail = nmeaHead;
                 if (buffered) {
                     if (!nmeaBuffer) nmeaBuffer = new char[NMEA_BUF_SIZE];
-                } 
-                nmeaBytes = 0;
+                }
                 return true;
             }
         }
@@ -606,17 +743,32 @@ bool FreematicsESP32::gpsGetData(GPS_DATA** pgd)
         if (pgd) *pgd = gpsData;
         return true;
     } else {
-        gps.stats(&gpsData->sentences, &gpsData->errors);
+        if (gpsBinary) {
+            ubx.stats(&gpsData->sentences, &gpsData->errors);
+        } else {
+            gps.stats(&gpsData->sentences, &gpsData->errors);
+        }
         if (!gpsPendingData) return false;
         long lat, lng;
         bool good = true;
-        gps.get_position(&lat, &lng, 0);
+        if (gpsBinary) {
+            lat = ubx.pvt.lat / 10;
+            lng = ubx.pvt.lon / 10;
+        } else {
+            gps.get_position(&lat, &lng, 0);
+        }
         if (gpsData->lat || gpsData->lng) {
             // filter out invalid coordinates
             good = (abs(lat - gpsData->lat * 1000000) < 100000 && abs(lng - gpsData->lng * 1000000) < 100000);
         }
         if (!good) return false;
         gpsData->ts = millis();
+        if (gpsBinary) {
+            ubx.getData(gpsData);
+            gpsPendingData = 0;
+            if (pgd) *pgd = gpsData;
+            return true;
+        }
         gpsData->lat = (float)lat / 1000000;
         gpsData->lng = (float)lng / 1000000;
         gps.get_datetime((unsigned long*)&gpsData->date, (unsigned long*)&gpsData->time, 0);
@@ -641,24 +793,62 @@ int FreematicsESP32::gpsGetNMEA(char* buffer, int bufsize)
     if (m_flags & GNSS_USE_LINK) {
         return link->sendCommand("ATGRR\r", buffer, bufsize, 200);
     } else {
-        int bytes = 0;
-        if (nmeaBytes > 0) {
-            if (bufsize < nmeaBytes) {
-                nmeaBufferMutex.lock();
-                memcpy(buffer, nmeaBuffer, bytes = bufsize);
-                memmove(nmeaBuffer, nmeaBuffer + bufsize, nmeaBytes -= bufsize);
-                nmeaBufferMutex.unlock();
-            } else {
-                nmeaBufferMutex.lock();
-                memcpy(buffer, nmeaBuffer, bytes = nmeaBytes);
-                nmeaBytes = 0;
-                nmeaBufferMutex.unlock();
-            }
-        }
+        if (!nmeaBuffer) return 0;
+        uint32_t tail = nmeaTail;
+        int bytes = (int)(nmeaHead - tail);
+        __sync_synchronize();
+        if (bytes > bufsize) bytes = bufsize;
+        // copy out in up to two pieces when wrapping around
+        int offset = tail & (NMEA_BUF_SIZE - 1);
+        int first = NMEA_BUF_SIZE - offset;
+        if (first > bytes) first = bytes;
+        memcpy(buffer, nmeaBuffer + offset, first);
+        memcpy(buffer + first, nmeaBuffer, bytes - first);
+        __sync_synchronize();
+        nmeaTail = tail + bytes;
         return bytes;
     }
 }
 
+bool FreematicsESP32::gpsSetBinary(uint16_t interval)
+{
+    // soft serial receives 7 bits only and co-processor GNSS forwards text
+    if ((m_flags & (GNSS_USE_LINK | GNSS_SOFT_SERIAL)) || !taskGPS.running()) return false;
+    uint8_t packet[32];
+    int len;
+    gpsBinary = true;
+    // enable NAV-PVT and set solution rate while NMEA is still on, each is acknowledged
+    for (int i = 0; i < 2; i++) {
+        len = i == 0 ? CUBXDecoder::buildMessageRate(UBX_CLASS_NAV, UBX_NAV_PVT, 1, packet) : CUBXDecoder::buildNavRate(interval, packet);
+        ubx.clearAck();
+        gpsSendCommand((const char*)packet, len);
+        for (int n = 0; n < 50 && !ubx.ack(); n++) delay(10);
+        if (ubx.ack() != 1) {
+            gpsBinary = false;
+            return false;
+        }
+    }
+    // stop NMEA output, port settings take effect right away so no ACK is waited for
+    len = CUBXDecoder::buildPortConfig(m_gpsBaudrate, packet);
+    gpsSendCommand((const char*)packet, len);
+    // check UBX messages are coming in
+    uint16_t s1 = 0, s2 = 0;
+    ubx.stats(&s1, 0);
+    for (int n = 0; n < 20; n++) {
+        delay(100);
+        ubx.stats(&s2, 0);
+        if (s2 != s1) return true;
+    }
+    // no UBX coming through, bring NMEA output back and stop NAV-PVT
+    len = CUBXDecoder::buildPortConfig(m_gpsBaudrate, packet, UBX_PROTO_UBX | UBX_PROTO_NMEA);
+    gpsSendCommand((const char*)packet, len);
+    delay(100);
+    len = CUBXDecoder::buildMessageRate(UBX_CLASS_NAV, UBX_NAV_PVT, 0, packet);
+    gpsSendCommand((const char*)packet, len);
+    gpsBinary = false;
+    return false;
+}
+
 void FreematicsESP32::gpsSendCommand(const char* string, int len)
 {
 #if !GPS_SOFT_SERIAL
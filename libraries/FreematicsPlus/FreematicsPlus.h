@@ -17,6 +17,8 @@
 #include "FreematicsMEMS.h"
 #include "FreematicsDMP.h"
 #include "FreematicsOBD.h"
+#include "FreematicsCAN.h"
+#include "FreematicsUBX.h"
 
 #define PIN_LED 4
 #define PIN_SD_CS 5
@@ -52,7 +54,10 @@
 #define PIN_BUZZER 25
 
 #define UART_BUF_SIZE 256
-#define NMEA_BUF_SIZE 512
+#define GPS_UART_BUF_SIZE 1024
+#define GPS_READ_SIZE 128
+#define NMEA_BUF_SIZE 512 /* must be power of 2 */
+#define GPS_UBX_INTERVAL 100 /* ms */
 
 #define GNSS_SOFT_SERIAL 0x1
 #define GNSS_USE_LINK 0x2
@@ -96,6 +101,8 @@ public:
 	void send(const char* str);
   // read one byte from UART
   int read();
+  // read available bytes from UART
+  int read(char* buffer, int bufsize, unsigned int timeout);
   // change serial baudrate
   bool changeBaudRate(unsigned int baudrate);
 };
@@ -114,12 +121,46 @@ private:
 	const uint8_t header[4] = {0x24, 0x4f, 0x42, 0x44};
 };
 
+#define CAN_CAPTURE_BATCH 16
+#define CAN_CAPTURE_READ_SIZE 128
+
+// drains CAN sniffing output of co-processor into a frame ring from a dedicated task
+class CCANCapture
+{
+public:
+	// start sniffing, a single filter is also programmed into co-processor
+	bool start(COBD* obd, CCANRing* ring, CCANFilter* filter = 0, bool extended = false);
+	void stop();
+	bool running() { return m_running; }
+	// frames passed filters
+	uint32_t frames = 0;
+	// unparsable lines
+	uint32_t errors = 0;
+private:
+	static void taskCapture(void* inst);
+	void process(const char* data, int len, uint32_t ts);
+	void flush();
+	Task m_task;
+	COBD* m_obd = 0;
+	CCANRing* m_ring = 0;
+	CCANFilter* m_filter = 0;
+	bool m_extended = false;
+	volatile bool m_running = false;
+	volatile bool m_stop = false;
+	char m_line[48];
+	int m_lineLen = 0;
+	CAN_FRAME m_batch[CAN_CAPTURE_BATCH];
+	int m_batchCount = 0;
+};
+
 class FreematicsESP32 : public CFreematics
 {
 public:
   bool begin(int cpuMHz = 0);
   // start GPS
   bool gpsBegin(int baudrate = 115200, bool buffered = false);
+  // switch u-blox receiver on hardware UART to UBX NAV-PVT output at given interval
+  bool gpsSetBinary(uint16_t interval = GPS_UBX_INTERVAL);
   // turn off GPS
   void gpsEnd();
   // get parsed GPS data (returns the number of data parsed since last invoke)
@@ -155,4 +196,5 @@ public:
 private:
   byte m_flags = 0;
   byte m_pinGPSPower = 0;
+  int m_gpsBaudrate = 0;
 };
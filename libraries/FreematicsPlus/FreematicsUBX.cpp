@@ -0,0 +1,179 @@
+/*************************************************************************
+* u-blox UBX binary protocol decoder for Freematics ONE+
+* Distributed under BSD license
+* Visit https://freematics.com for more information
+*************************************************************************/
+
+#include "FreematicsUBX.h"
+
+enum {
+	UBX_WAIT_SYNC1 = 0,
+	UBX_WAIT_SYNC2,
+	UBX_READ_CLASS,
+	UBX_READ_ID,
+	UBX_READ_LEN1,
+	UBX_READ_LEN2,
+	UBX_READ_PAYLOAD,
+	UBX_READ_CK_A,
+	UBX_READ_CK_B,
+};
+
+static inline uint16_t getU2(const uint8_t* p)
+{
+	return p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t getU4(const uint8_t* p)
+{
+	return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool CUBXDecoder::encode(uint8_t c)
+{
+	switch (m_state) {
+	case UBX_WAIT_SYNC1:
+		if (c == UBX_SYNC_CHAR1) m_state = UBX_WAIT_SYNC2;
+		return false;
+	case UBX_WAIT_SYNC2:
+		m_state = (c == UBX_SYNC_CHAR2) ? UBX_READ_CLASS : (c == UBX_SYNC_CHAR1 ? UBX_WAIT_SYNC2 : UBX_WAIT_SYNC1);
+		m_ckA = m_ckB = 0;
+		return false;
+	case UBX_READ_CK_A:
+		if (c == m_ckA) {
+			m_state = UBX_READ_CK_B;
+		} else {
+			m_failed++;
+			m_state = UBX_WAIT_SYNC1;
+		}
+		return false;
+	case UBX_READ_CK_B:
+		m_state = UBX_WAIT_SYNC1;
+		if (c != m_ckB) {
+			m_failed++;
+			return false;
+		}
+		m_good++;
+		return process();
+	}
+	// 8-bit Fletcher checksum over class, id, length and payload
+	m_ckA += c;
+	m_ckB += m_ckA;
+	switch (m_state) {
+	case UBX_READ_CLASS:
+		m_class = c;
+		m_state = UBX_READ_ID;
+		break;
+	case UBX_READ_ID:
+		m_id = c;
+		m_state = UBX_READ_LEN1;
+		break;
+	case UBX_READ_LEN1:
+		m_len = c;
+		m_state = UBX_READ_LEN2;
+		break;
+	case UBX_READ_LEN2:
+		m_len |= (uint16_t)c << 8;
+		m_pos = 0;
+		m_state = m_len ? UBX_READ_PAYLOAD : UBX_READ_CK_A;
+		break;
+	case UBX_READ_PAYLOAD:
+		// oversized payloads are only checksummed
+		if (m_pos < UBX_MAX_PAYLOAD) m_payload[m_pos] = c;
+		if (++m_pos == m_len) m_state = UBX_READ_CK_A;
+		break;
+	}
+	return false;
+}
+
+bool CUBXDecoder::process()
+{
+	if (m_class == UBX_CLASS_ACK && m_len == 2 && m_payload[0] == UBX_CLASS_CFG) {
+		m_ack = m_id == 1 ? 1 : -1;
+		return false;
+	}
+	if (m_class != UBX_CLASS_NAV || m_id != UBX_NAV_PVT || m_len < UBX_NAV_PVT_LEN) return false;
+	const uint8_t* p = m_payload;
+	pvt.year = getU2(p + 4);
+	pvt.month = p[6];
+	pvt.day = p[7];
+	pvt.hour = p[8];
+	pvt.minute = p[9];
+	pvt.second = p[10];
+	pvt.valid = p[11];
+	pvt.nano = (int32_t)getU4(p + 16);
+	pvt.fixType = p[20];
+	pvt.flags = p[21];
+	pvt.numSV = p[23];
+	pvt.lon = (int32_t)getU4(p + 24);
+	pvt.lat = (int32_t)getU4(p + 28);
+	pvt.hMSL = (int32_t)getU4(p + 36);
+	pvt.gSpeed = (int32_t)getU4(p + 60);
+	pvt.headMot = (int32_t)getU4(p + 64);
+	pvt.pDOP = getU2(p + 76);
+	// 2D/3D fix with gnssFixOK set
+	return pvt.fixType >= 2 && pvt.fixType <= 4 && (pvt.flags & 1);
+}
+
+void CUBXDecoder::getData(GPS_DATA* gd)
+{
+	gd->lat = (float)pvt.lat / 10000000;
+	gd->lng = (float)pvt.lon / 10000000;
+	gd->alt = (float)pvt.hMSL / 1000;
+	// same units as NMEA path, date as ddmmyy and time as hhmmsscc
+	if (pvt.valid & 0x3) {
+		gd->date = (uint32_t)pvt.day * 10000 + pvt.month * 100 + pvt.year % 100;
+		gd->time = (uint32_t)pvt.hour * 1000000 + pvt.minute * 10000 + pvt.second * 100 + (pvt.nano > 0 ? pvt.nano / 10000000 : 0);
+	}
+	gd->speed = (float)pvt.gSpeed / 514.444f;
+	int32_t heading = pvt.headMot / 100000;
+	gd->heading = heading < 0 ? heading + 360 : heading;
+	gd->sat = pvt.numSV;
+	// NAV-PVT only reports position DOP
+	gd->hdop = pvt.pDOP > 2550 ? 255 : pvt.pDOP / 10;
+}
+
+int CUBXDecoder::buildPacket(uint8_t cls, uint8_t id, const uint8_t* payload, uint16_t len, uint8_t* buf)
+{
+	buf[0] = UBX_SYNC_CHAR1;
+	buf[1] = UBX_SYNC_CHAR2;
+	buf[2] = cls;
+	buf[3] = id;
+	buf[4] = (uint8_t)len;
+	buf[5] = (uint8_t)(len >> 8);
+	if (len) memcpy(buf + 6, payload, len);
+	uint8_t a = 0, b = 0;
+	for (int i = 2; i < 6 + len; i++) {
+		a += buf[i];
+		b += a;
+	}
+	buf[6 + len] = a;
+	buf[7 + len] = b;
+	return len + UBX_OVERHEAD;
+}
+
+int CUBXDecoder::buildPortConfig(uint32_t baudrate, uint8_t* buf, uint8_t out)
+{
+	uint8_t payload[20] = {0};
+	payload[0] = 1; // UART1
+	// 8N1
+	payload[4] = 0xD0;
+	payload[5] = 0x08;
+	for (int i = 0; i < 4; i++) payload[8 + i] = (uint8_t)(baudrate >> (i * 8));
+	payload[12] = UBX_PROTO_UBX | UBX_PROTO_NMEA;
+	payload[14] = out;
+	return buildPacket(UBX_CLASS_CFG, UBX_CFG_PRT, payload, sizeof(payload), buf);
+}
+
+int CUBXDecoder::buildMessageRate(uint8_t cls, uint8_t id, uint8_t rate, uint8_t* buf)
+{
+	// rates for I2C, UART1, UART2, USB, SPI and reserved port
+	uint8_t payload[8] = {cls, id, 0, rate, 0, 0, 0, 0};
+	return buildPacket(UBX_CLASS_CFG, UBX_CFG_MSG, payload, sizeof(payload), buf);
+}
+
+int CUBXDecoder::buildNavRate(uint16_t interval, uint8_t* buf)
+{
+	// one solution per measurement, aligned to GPS time
+	uint8_t payload[6] = {(uint8_t)interval, (uint8_t)(interval >> 8), 1, 0, 1, 0};
+	return buildPacket(UBX_CLASS_CFG, UBX_CFG_RATE, payload, sizeof(payload), buf);
+}
@@ -0,0 +1,88 @@
+/*************************************************************************
+* u-blox UBX binary protocol decoder for Freematics ONE+
+* Distributed under BSD license
+* Visit https://freematics.com for more information
+*************************************************************************/
+
+#ifndef FREEMATICS_UBX
+#define FREEMATICS_UBX
+
+#include "FreematicsBase.h"
+
+#define UBX_SYNC_CHAR1 0xB5
+#define UBX_SYNC_CHAR2 0x62
+#define UBX_CLASS_NAV 0x01
+#define UBX_CLASS_ACK 0x05
+#define UBX_CLASS_CFG 0x06
+#define UBX_NAV_PVT 0x07
+#define UBX_CFG_PRT 0x00
+#define UBX_CFG_MSG 0x01
+#define UBX_CFG_RATE 0x08
+#define UBX_PROTO_UBX 0x1
+#define UBX_PROTO_NMEA 0x2
+#define UBX_NAV_PVT_LEN 92
+#define UBX_MAX_PAYLOAD 100
+#define UBX_OVERHEAD 8 /* sync, class, id, length and checksum */
+
+// navigation solution from last NAV-PVT message
+typedef struct {
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hour;
+	uint8_t minute;
+	uint8_t second;
+	uint8_t valid;
+	int32_t nano;
+	uint8_t fixType;
+	uint8_t flags;
+	uint8_t numSV;
+	int32_t lon; /* 1e-7 degree */
+	int32_t lat; /* 1e-7 degree */
+	int32_t hMSL; /* mm */
+	int32_t gSpeed; /* mm/s */
+	int32_t headMot; /* 1e-5 degree */
+	uint16_t pDOP; /* 0.01 */
+} UBX_NAV_PVT_DATA;
+
+class CUBXDecoder
+{
+public:
+	// process one byte, returns true when a NAV-PVT message with a fix has been decoded
+	bool encode(uint8_t c);
+	// fill in GPS_DATA from last decoded NAV-PVT (ts is left to caller)
+	void getData(GPS_DATA* gd);
+	// messages with good and bad checksums
+	void stats(uint16_t* good, uint16_t* failed)
+	{
+		if (good) *good = m_good;
+		if (failed) *failed = m_failed;
+	}
+	// ACK-ACK (1) or ACK-NAK (-1) last received for a CFG message, 0 if none yet
+	int8_t ack() { return m_ack; }
+	void clearAck() { m_ack = 0; }
+	// build a complete UBX packet in buf (payload size + UBX_OVERHEAD bytes), returns its length
+	static int buildPacket(uint8_t cls, uint8_t id, const uint8_t* payload, uint16_t len, uint8_t* buf);
+	// CFG-PRT for UART1 at given baudrate, UBX+NMEA in and given protocols out
+	static int buildPortConfig(uint32_t baudrate, uint8_t* buf, uint8_t out = UBX_PROTO_UBX);
+	// CFG-MSG setting output rate of a message on UART1 (in navigation solutions)
+	static int buildMessageRate(uint8_t cls, uint8_t id, uint8_t rate, uint8_t* buf);
+	// CFG-RATE setting measurement interval
+	static int buildNavRate(uint16_t interval, uint8_t* buf);
+	UBX_NAV_PVT_DATA pvt = {0};
+private:
+	bool process();
+	uint8_t m_state = 0;
+	uint8_t m_class = 0;
+	uint8_t m_id = 0;
+	uint16_t m_len = 0;
+	uint16_t m_pos = 0;
+	uint8_t m_ckA = 0;
+	uint8_t m_ckB = 0;
+	uint8_t m_payload[UBX_MAX_PAYLOAD];
+	uint16_t m_good = 0;
+	uint16_t m_failed = 0;
+	int8_t m_ack = 0;
+};
+
+#endif
@@ -0,0 +1,48 @@
+// minimal Arduino environment for building the library on host, time is
+// simulated and only advances by delay() or when a test moves it
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+typedef uint8_t byte;
+using std::min;
+using std::max;
+
+#define PI 3.1415926535897932384626433832795
+#define TWO_PI 6.283185307179586476925286766559
+#define radians(x) ((x) * 0.017453292519943295)
+#define degrees(x) ((x) * 57.29577951308232)
+#define sq(x) ((x) * (x))
+
+extern uint32_t hostMillis;
+extern uint32_t hostMicros;
+inline unsigned long millis() { return hostMillis; }
+inline unsigned long micros() { return hostMicros; }
+inline void delay(unsigned long ms)
+{
+    hostMillis += ms;
+    hostMicros += ms * 1000;
+}
+
+class String : public std::string {
+public:
+    String(const char* s = "") : std::string(s) {}
+    String(const std::string& s) : std::string(s) {}
+};
+
+struct HostSerial {
+    void print(const char* s) { fputs(s, stdout); }
+    void print(int v) { printf("%d", v); }
+    void print(unsigned int v) { printf("%u", v); }
+    void print(const String& s) { fputs(s.c_str(), stdout); }
+    void println(const char* s = "") { puts(s); }
+    void println(int v) { printf("%d\n", v); }
+    void println(unsigned int v) { printf("%u\n", v); }
+};
+extern HostSerial Serial;
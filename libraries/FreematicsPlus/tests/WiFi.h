@@ -0,0 +1,32 @@
+// Arduino WiFi library with no network, so that WiFi clients build on host
+#pragma once
+#include "Arduino.h"
+
+#define WL_CONNECTED 3
+
+struct IPAddress {
+    String toString() const { return String("0.0.0.0"); }
+};
+
+class HostWiFi {
+public:
+    int status() { return 0; }
+    IPAddress localIP() { return IPAddress(); }
+    void begin(const char* ssid, const char* password) {}
+    void disconnect(bool wifiOff = false) {}
+    int scanNetworks() { return 0; }
+    String SSID(int i) { return String(); }
+    int RSSI(int i) { return 0; }
+};
+extern HostWiFi WiFi;
+
+class WiFiClient {
+public:
+    int connect(const char* host, uint16_t port) { return 0; }
+    void stop() {}
+    size_t write(const char* buf, size_t size) { return 0; }
+    int available() { return 0; }
+    int read() { return -1; }
+};
+
+class WiFiClientSecure : public WiFiClient {};
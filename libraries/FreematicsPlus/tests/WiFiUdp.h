@@ -0,0 +1,14 @@
+#pragma once
+#include "WiFi.h"
+
+class WiFiUDP {
+public:
+    int beginPacket(const char* host, uint16_t port) { return 0; }
+    int beginPacket(IPAddress ip, uint16_t port) { return 0; }
+    int endPacket() { return 0; }
+    IPAddress remoteIP() { return IPAddress(); }
+    size_t write(const uint8_t* buf, size_t size) { return 0; }
+    int parsePacket() { return 0; }
+    int read(char* buf, size_t len) { return 0; }
+    void stop() {}
+};
@@ -0,0 +1,210 @@
+/*
+  AT command engine of cellular clients against a scripted modem: responses
+  split in chunks of any size, URCs (datagrams, GNSS, network info) arriving
+  during commands and while idle, pipelined commands and datagram results
+*/
+#include "Arduino.h"
+#include "FreematicsBase.h"
+#include "FreematicsNetwork.h"
+#include "test.h"
+#include <vector>
+#include <string>
+
+struct Chunk {
+    unsigned long at;
+    std::string data;
+};
+
+struct Rule {
+    std::string prefix;
+    std::string resp;
+    unsigned latency;
+};
+
+// responses become readable after a per command latency (simulated ms)
+class ScriptedModem : public CFreematics {
+public:
+    bool xbBegin(unsigned long baudrate) { return true; }
+    void schedule(unsigned long at, const std::string& data)
+    {
+        out.push_back({at, data});
+        std::stable_sort(out.begin(), out.end(), [](const Chunk& a, const Chunk& b) { return a.at < b.at; });
+    }
+    void xbWrite(const char* cmd) { xbWrite(cmd, strlen(cmd)); }
+    void xbWrite(const char* data, int len)
+    {
+        std::string s(data, len);
+        written.push_back(s);
+        if (s.compare(0, 2, "AT")) {
+            // datagram payload
+            if (rejectData) {
+                schedule(millis() + dataLatency, "\r\nERROR\r\n");
+            } else {
+                schedule(millis() + dataLatency, "\r\n+CIPSEND: 0," + std::to_string(len) + "," + std::to_string(len) + "\r\n\r\nOK\r\n");
+            }
+            return;
+        }
+        for (auto& r : rules) {
+            if (!s.compare(0, r.prefix.size(), r.prefix)) {
+                schedule(millis() + r.latency, r.resp);
+                return;
+            }
+        }
+        schedule(millis() + 5, "\r\nOK\r\n");
+    }
+    int xbRead(char* buffer, int bufsize, unsigned int timeout)
+    {
+        if (bufsize > chunkMax) bufsize = chunkMax;
+        unsigned long deadline = millis() + timeout;
+        if (out.empty() || out[0].at > millis()) {
+            if (out.empty() || out[0].at > deadline) {
+                hostMillis = deadline;
+                return 0;
+            }
+            hostMillis = out[0].at;
+        }
+        int n = 0;
+        while (n < bufsize && !out.empty() && out[0].at <= millis()) {
+            Chunk& c = out[0];
+            int k = std::min((int)c.data.size(), bufsize - n);
+            memcpy(buffer + n, c.data.data(), k);
+            n += k;
+            c.data.erase(0, k);
+            if (c.data.empty()) out.erase(out.begin());
+        }
+        return n;
+    }
+    int xbReceive(char* buffer, int bufsize, unsigned int timeout, const char** expected, byte expectedCount) { return 0; }
+    void xbPurge() { out.clear(); }
+    void xbTogglePower() {}
+    std::vector<Rule> rules;
+    std::vector<Chunk> out;
+    std::vector<std::string> written;
+    int chunkMax = 64;
+    unsigned dataLatency = 150;
+    bool rejectData = false;
+};
+
+class TestClient : public UDPClientSIM7600 {
+public:
+    bool command(const char* cmd, unsigned int timeout = 1000, const char* expected = "\r\nOK\r\n")
+    {
+        return sendCommand(cmd, timeout, expected);
+    }
+    CATEngine& engine() { return m_engine; }
+    void enableGPS()
+    {
+        m_gps = new GPS_DATA;
+        memset(m_gps, 0, sizeof(GPS_DATA));
+    }
+    void target()
+    {
+        udpIP = "1.2.3.4";
+        udpPort = 8081;
+    }
+};
+
+int main()
+{
+    for (int chunk : {64, 7, 1}) {
+        ScriptedModem m;
+        m.chunkMax = chunk;
+        m.rules.push_back({"ATI", "\r\nManufacturer: SIMCOM\r\nModel: SIMCOM_SIM7600E\r\nIMEI: 861234567890123\r\n\r\nOK\r\n", 20});
+        TestClient c;
+        hostMillis = 0;
+        CHECK(c.begin(&m));
+        CHECK(!strcmp(c.deviceName(), "SIM7600E"));
+        CHECK(!strcmp(c.IMEI, "861234567890123"));
+
+        // response parsing with a datagram interleaved
+        m.rules.push_back({"AT+CSQ", "\r\n+CSQ: 20,99\r\n\r\nRECV FROM:1.2.3.4:8081\r\n+IPD12\r\nEV=1,TS=123\r\nOK\r\n", 30});
+        CHECK(c.getSignal() == 200);
+        int len = 0;
+        char* data = c.receive(&len, 0);
+        CHECK(data && len == 12 && !memcmp(data, "EV=1,TS=123\r", 12));
+        CHECK(!strcmp(c.getPeer(), "1.2.3.4:8081"));
+        CHECK(c.receive(&len, 0) == 0);
+
+        // error ends a command early, other patterns wait for their match
+        m.rules.push_back({"AT+FAIL", "\r\nERROR\r\n", 10});
+        unsigned long t = millis();
+        CHECK(!c.command("AT+FAIL\r", 1000));
+        CHECK(millis() - t < 100);
+        m.rules.push_back({"AT+CHTTPSRECV", "\r\nOK\r\n\r\n+CHTTPSRECV: DATA,5\r\nhello\r\n+CHTTPSRECV: 0\r\n", 10});
+        CHECK(c.command("AT+CHTTPSRECV=100\r", 1000, "\r\n+CHTTPSRECV: 0"));
+        CHECK(strstr(c.getBuffer(), "hello"));
+        t = millis();
+        CHECK(!c.command("AT+SILENT\r", 300, "NEVER"));
+        CHECK(millis() - t >= 300 && millis() - t < 320);
+
+        // unsolicited reports while idle
+        c.enableGPS();
+        m.schedule(millis() + 10, "\r\n+CGPSINFO: 3113.343286,N,12121.234064,E,250311,072809.3,44.1,0.0,0\r\n");
+        m.schedule(millis() + 10, "\r\n+CPSI: LTE,Online,460-00,0x1816,61002,7\r\n");
+        m.schedule(millis() + 10, "\r\n+CHTTPS: RECV EVENT\r\n");
+        hostMillis += 20;
+        GPS_DATA* gd = 0;
+        for (int i = 0; i < 100 && !c.getLocation(&gd); i++);
+        CHECK(gd && gd->ts && gd->date == 250311 && gd->lat > 31.2 && gd->lat < 31.3);
+        c.engine().poll(0);
+        CHECK(!strncmp(c.getNetworkInfo(), "LTE,Online", 10));
+
+        // datagram arriving while waiting in receive
+        m.schedule(millis() + 200, "\r\n+IPD5\r\nEV=2,");
+        t = millis();
+        data = c.receive(&len, 1000);
+        CHECK(data && len == 5 && !strcmp(data, "EV=2,"));
+        CHECK(millis() - t >= 200 && millis() - t < 250);
+        t = millis();
+        CHECK(c.receive(&len, 100) == 0 && millis() - t >= 100);
+
+        // long response wraps the buffer, URC inside is dispatched and dropped
+        std::string big = "\r\n";
+        for (int i = 0; i < 30; i++) big += "+LINE: " + std::to_string(i) + ",abcdefghij\r\n";
+        big += "+IPD3\r\nabc\r\n+LINE: last\r\n\r\nOK\r\n";
+        m.rules.push_back({"AT+BIG", big, 10});
+        CHECK(c.command("AT+BIG\r"));
+        CHECK(strstr(c.getBuffer(), "+LINE: last") && !strstr(c.getBuffer(), "+IPD") && strlen(c.getBuffer()) < 384);
+        data = c.receive(&len, 0);
+        CHECK(data && len == 3 && !strcmp(data, "abc"));
+
+        // pipelined commands are written back to back as results arrive
+        size_t w = m.written.size();
+        c.engine().post("AT+CSOCKSETPN=1\r");
+        c.engine().post("AT+CIPMODE=0\r");
+        c.engine().post("AT+NETOPEN\r");
+        CHECK(c.engine().pending() == 3);
+        CHECK(c.command("AT+CSQ\r"));
+        CHECK(c.engine().pending() == 0);
+        CHECK(m.written.size() == w + 4 && m.written[w + 2] == "AT+NETOPEN\r" && m.written[w + 3] == "AT+CSQ\r");
+
+        // setup collects results of its pipelined commands, a network already
+        // open does not fail the first send
+        // registration replies are parsed as soon as their prefix is seen, so
+        // only with reads not splitting such short lines as a module sends them
+        if (chunk == 64) {
+            m.rules.push_back({"AT+CPSI?", "\r\n+CPSI: LTE,Online,460-00,0x1816,61002,7\r\n\r\nOK\r\n", 10});
+            m.rules.push_back({"AT+CREG?", "\r\n+CREG: 0,1\r\n\r\nOK\r\n", 10});
+            m.rules.push_back({"AT+CGREG?", "\r\n+CGREG: 0,1\r\n\r\nOK\r\n", 10});
+            m.rules.push_back({"AT+NETOPEN", "\r\n+IP ERROR: Network is already opened\r\n\r\nERROR\r\n", 10});
+            CHECK(c.setup("internet"));
+            CHECK(c.engine().pending() == 0);
+        }
+
+        // the result of each datagram is reported by its own send
+        m.rules.push_back({"AT+CIPSEND", "\r\n>", 15});
+        c.target();
+        for (int i = 0; i < 3; i++) {
+            t = millis();
+            CHECK(c.send("0123456789", 10));
+            CHECK(millis() - t >= 15 + 150);
+        }
+        m.dataLatency = 10;
+        m.rejectData = true;
+        CHECK(!c.send("x", 1));
+        m.rejectData = false;
+        CHECK(c.send("y", 1));
+        CHECK(c.engine().pending() == 0);
+    }
+    return report("at_engine_test");
+}
@@ -0,0 +1,99 @@
+/*
+  CAN capture helpers: ELM327 line parsing, header filters, binary log
+  records, candump output and the frame ring, including a producer and a
+  consumer thread running concurrently
+*/
+#include "FreematicsCAN.h"
+#include "test.h"
+#include <atomic>
+#include <thread>
+#include <string>
+
+CCANRing ring;
+
+int main()
+{
+    CAN_FRAME f;
+    // line parser
+    CHECK(parseCANLine("7E8 03 41 0D 00", 15, false, f));
+    CHECK(f.id == 0x7E8 && f.len == 4 && f.data[1] == 0x41);
+    CHECK(parseCANLine("18 DA F1 10 03 41 0D 00", 23, true, f));
+    CHECK(f.id == (0x18DAF110 | CAN_ID_EXTENDED) && f.len == 4);
+    CHECK(!parseCANLine("NO DATA", 7, false, f));
+    CHECK(!parseCANLine("7E8 03 41 0D 00 11 22 33 44 55", 30, false, f));
+    CHECK(parseCANLine("123", 3, false, f) && f.len == 0);
+    CHECK(!parseCANLine("7E8 0", 5, false, f));
+
+    // filter
+    CCANFilter filter;
+    CAN_FRAME frames[4] = {};
+    frames[0].id = 0x7E8;
+    frames[1].id = 0x123;
+    frames[2].id = 0x7E0;
+    frames[3].id = 0x18DAF110 | CAN_ID_EXTENDED;
+    CHECK(filter.apply(frames, 4) == 4);
+    filter.add(0x7E0, 0x7F0);
+    CHECK(filter.apply(frames, 4) == 2 && frames[0].id == 0x7E8 && frames[1].id == 0x7E0);
+
+    // log records and candump output
+    uint8_t buf[64];
+    uint32_t ts = 0, ts2 = 0;
+    CAN_FRAME g;
+    f.ts = 123456;
+    f.id = 0x7E8;
+    f.len = 3;
+    f.data[0] = 1;
+    f.data[1] = 2;
+    f.data[2] = 0xAB;
+    int n = encodeCANFrame(f, ts, buf);
+    CHECK(decodeCANFrame(buf, n, ts2, g) == n);
+    CHECK(g.ts == f.ts && g.id == f.id && g.len == 3 && g.data[2] == 0xAB);
+    CHECK(decodeCANFrame(buf, n - 1, ts2, g) == 0);
+    char line[CAN_CANDUMP_SIZE];
+    formatCandump(g, line);
+    CHECK(std::string(line) == "(123.456000) can0 7E8#0102AB\n");
+    f.id = 0x18DAF110 | CAN_ID_EXTENDED;
+    f.ts = 0xFFFFFFFF;
+    f.len = 8;
+    ts = 0;
+    n = encodeCANFrame(f, ts, buf);
+    CHECK(n == CAN_MAX_RECORD_SIZE);
+    ts2 = 0;
+    CHECK(decodeCANFrame(buf, n, ts2, g) == n && g.id == f.id && g.ts == f.ts);
+    formatCandump(g, line);
+    CHECK(strlen(line) < CAN_CANDUMP_SIZE);
+    CHECK(writeCANLogHeader(buf) == 8 && checkCANLogHeader(buf, 8));
+
+    // ring overflow drops newest frames
+    for (int i = 0; i < CAN_RING_SIZE + 5; i++) {
+        f.ts = i;
+        ring.push(f);
+    }
+    CHECK(ring.dropped == 5 && ring.available() == CAN_RING_SIZE);
+    CAN_FRAME out[64];
+    CHECK(ring.pop(out, 64) == 64 && out[0].ts == 0 && out[63].ts == 63);
+    ring.clear();
+    ring.dropped = 0;
+
+    // single producer and single consumer, frames arrive complete and in order
+    const uint32_t N = 500000;
+    std::thread producer([&] {
+        CAN_FRAME x = {};
+        for (uint32_t i = 0; i < N; ) {
+            x.ts = i;
+            x.id = i & 0x7FF;
+            if (ring.push(x)) i++;
+        }
+    });
+    uint32_t expect = 0;
+    bool ordered = true;
+    while (expect < N) {
+        int count = ring.pop(out, 64);
+        for (int i = 0; i < count; i++, expect++) {
+            if (out[i].ts != expect || out[i].id != (expect & 0x7FF)) ordered = false;
+        }
+    }
+    producer.join();
+    CHECK(ordered && ring.available() == 0);
+    return report("can_capture_test");
+}
@@ -0,0 +1,7 @@
+#include "Arduino.h"
+#include "WiFi.h"
+
+HostSerial Serial;
+HostWiFi WiFi;
+uint32_t hostMillis = 0;
+uint32_t hostMicros = 0;
@@ -0,0 +1,155 @@
+/*
+  Madgwick filter of CQuaterion on a simulated drive with known orientation:
+  per sample and batched FIFO updates at several output data rates, 6 DOF
+  tilt, the legacy update API and gyroscope only integration
+*/
+#include "Arduino.h"
+#include "FreematicsBase.h"
+#include "test.h"
+#include <random>
+#include <vector>
+// quaternion and integration time are checked directly
+#define private public
+#include "FreematicsMEMS.h"
+#undef private
+
+// ground truth trace: integrated from smooth body rates, sensor readings derived from it
+struct Trace {
+  int n; double odr;
+  std::vector<double> q; // 4 per sample
+  std::vector<float> acc, gyr, mag; // 3 per sample, gyr in deg/s
+};
+static void quatMul(const double* a, const double* b, double* r)
+{
+  r[0] = a[0]*b[0]-a[1]*b[1]-a[2]*b[2]-a[3]*b[3];
+  r[1] = a[0]*b[1]+a[1]*b[0]+a[2]*b[3]-a[3]*b[2];
+  r[2] = a[0]*b[2]-a[1]*b[3]+a[2]*b[0]+a[3]*b[1];
+  r[3] = a[0]*b[3]+a[1]*b[2]-a[2]*b[1]+a[3]*b[0];
+}
+static Trace makeTrace(double odr, double seconds, double accNoise, double gyrNoise, double magNoise, unsigned seed)
+{
+  Trace t; t.odr = odr; t.n = (int)(odr * seconds);
+  std::mt19937 rng(seed); std::normal_distribution<double> nd(0, 1);
+  double q[4] = {1,0,0,0};
+  const double bx = 0.6, bz = 0.8; // earth field, inclined
+  for (int i = 0; i < t.n; i++) {
+    double ts = i / odr;
+    // driving manoeuvres: yaw turns, pitch/roll sway and a vibration component
+    double w[3] = {0.6*sin(2*M_PI*0.3*ts) + 0.2*sin(2*M_PI*13*ts), 0.4*sin(2*M_PI*0.17*ts+1) + 0.2*sin(2*M_PI*17*ts), 0.8*sin(2*M_PI*0.05*ts)}; // rad/s
+    double q1=q[0],q2=q[1],q3=q[2],q4=q[3];
+    float a[3] = {(float)(2*(q2*q4-q1*q3) + accNoise*nd(rng)), (float)(2*(q1*q2+q3*q4) + accNoise*nd(rng)), (float)(1-2*q2*q2-2*q3*q3 + accNoise*nd(rng))};
+    float m[3] = {(float)(2*bx*(0.5-q3*q3-q4*q4)+2*bz*(q2*q4-q1*q3) + magNoise*nd(rng)),
+                  (float)(2*bx*(q2*q3-q1*q4)+2*bz*(q1*q2+q3*q4) + magNoise*nd(rng)),
+                  (float)(2*bx*(q1*q3+q2*q4)+2*bz*(0.5-q2*q2-q3*q3) + magNoise*nd(rng))};
+    for (int k = 0; k < 4; k++) t.q.push_back(q[k]);
+    for (int k = 0; k < 3; k++) {
+      t.acc.push_back(a[k]); t.mag.push_back(m[k]);
+      t.gyr.push_back((float)((w[k] + gyrNoise*nd(rng)) * 180 / M_PI));
+    }
+    // exact rotation over one interval
+    double wn = sqrt(w[0]*w[0]+w[1]*w[1]+w[2]*w[2]);
+    double h = wn / odr / 2;
+    double dq[4] = {cos(h), 0, 0, 0};
+    if (wn > 0) for (int k = 0; k < 3; k++) dq[k+1] = sin(h) * w[k] / wn;
+    double r[4]; quatMul(q, dq, r);
+    memcpy(q, r, sizeof(q));
+  }
+  return t;
+}
+static double angErr(const float* f, const double* t)
+{
+  // compare directions, acos is very sensitive to norm near 1
+  double n = sqrt((double)f[0]*f[0]+(double)f[1]*f[1]+(double)f[2]*f[2]+(double)f[3]*f[3]);
+  double d = fabs(f[0]*t[0]+f[1]*t[1]+f[2]*t[2]+f[3]*t[3]) / n;
+  if (d > 1) d = 1;
+  return 2 * acos(d) * 180 / M_PI;
+}
+// tilt error only (gravity direction), for 6 DOF
+static double tiltErr(const float* f, const double* t)
+{
+  double g1[3] = {2*(f[1]*f[3]-f[0]*f[2]), 2*(f[0]*f[1]+f[2]*f[3]), 1-2*f[1]*f[1]-2*f[2]*f[2]};
+  double g2[3] = {2*(t[1]*t[3]-t[0]*t[2]), 2*(t[0]*t[1]+t[2]*t[3]), 1-2*t[1]*t[1]-2*t[2]*t[2]};
+  double d = g1[0]*g2[0]+g1[1]*g2[1]+g1[2]*g2[2];
+  if (d > 1) d = 1;
+  return acos(d) * 180 / M_PI;
+}
+struct Res { double rms, max; };
+static Res stats(std::vector<double>& e, int skip)
+{
+  double s = 0, mx = 0; int n = 0;
+  for (size_t i = skip; i < e.size(); i++) { s += e[i]*e[i]; if (e[i] > mx) mx = e[i]; n++; }
+  return {sqrt(s / n), mx};
+}
+int main()
+{
+  const int BATCH = 20; // FIFO drained every 20 ms
+  for (int odr : {200, 500, 1000}) {
+    Trace t = makeTrace(odr, 60, 0.01, 0.005, 0.01, 7);
+    int skip = odr * 10; // convergence from identity
+    int batch = odr * BATCH / 1000;
+    // batched, one magnetometer reading per block
+    {
+      CQuaterion f;
+      std::vector<double> e;
+      for (int i = 0; i + batch <= t.n; i += batch) {
+        f.updateBatch((const float(*)[3])&t.acc[i*3], (const float(*)[3])&t.gyr[i*3], batch, 1.0f / odr, &t.mag[i*3]);
+        int j = i + batch; if (j >= t.n) j = t.n - 1;
+        e.push_back(angErr(f.q, &t.q[j*4]));
+      }
+      CHECK(stats(e, skip / batch).rms < 1.5);
+    }
+    // per sample with magnetometer at every sample
+    {
+      CQuaterion f;
+      std::vector<double> e;
+      for (int i = 0; i < t.n; i++) {
+        float g[3]; for (int k = 0; k < 3; k++) g[k] = t.gyr[i*3+k] * PI / 180;
+        f.update(&t.acc[i*3], g, &t.mag[i*3], 1.0f / odr);
+        e.push_back(angErr(f.q, &t.q[(i+1)*4 < (int)t.q.size() ? (i+1)*4 : i*4]));
+      }
+      CHECK(stats(e, skip).rms < 0.3);
+    }
+    // 6 DOF batch, tilt only
+    {
+      CQuaterion f;
+      std::vector<double> e;
+      for (int i = 0; i + batch <= t.n; i += batch) {
+        f.updateBatch((const float(*)[3])&t.acc[i*3], (const float(*)[3])&t.gyr[i*3], batch, 1.0f / odr);
+        int j = i + batch; if (j >= t.n) j = t.n - 1;
+        e.push_back(tiltErr(f.q, &t.q[j*4]));
+      }
+      CHECK(stats(e, skip / batch).rms < 1.5);
+    }
+    // single update (rad/s) matches a batch of one (deg/s)
+    {
+      CQuaterion a, b;
+      double maxd = 0;
+      for (int i = 0; i < 2000 && i < t.n; i++) {
+        float g[3]; for (int k = 0; k < 3; k++) g[k] = t.gyr[i*3+k] * PI / 180;
+        a.update(&t.acc[i*3], g, &t.mag[i*3], 1.0f / odr);
+        b.updateBatch((const float(*)[3])&t.acc[i*3], (const float(*)[3])&t.gyr[i*3], 1, 1.0f / odr, &t.mag[i*3]);
+        for (int k = 0; k < 4; k++) maxd = fmax(maxd, fabs(a.q[k] - b.q[k]));
+      }
+      CHECK(maxd < 1e-4);
+    }
+  }
+  // first call of MadgwickQuaternionUpdate does not integrate over time since boot
+  {
+    CQuaterion f;
+    hostMicros = 50000000;
+    f.MadgwickQuaternionUpdate(0, 0, 1, 1, 0, 0, 0.6, 0, 0.8);
+    CHECK(fabs(f.q[0]) > 0.99);
+    hostMicros += 1000;
+    f.MadgwickQuaternionUpdate(0, 0, 1, 1, 0, 0, 0.6, 0, 0.8);
+    CHECK(fabs(f.deltat - 0.001f) < 1e-6);
+  }
+  // zero acceleration only integrates gyroscope
+  {
+    CQuaterion f;
+    float a[3] = {0, 0, 0}, g[3] = {0, 0, 1};
+    for (int i = 0; i < 1000; i++) f.update(a, g, 0, 0.001f);
+    double yaw = 2 * atan2(f.q[3], f.q[0]);
+    CHECK(!isnan(f.q[0]) && fabs(yaw - 1.0) < 1e-3);
+  }
+  return report("madgwick_test");
+}
@@ -0,0 +1,134 @@
+/*
+    Multi-PID requests of COBD against a simulated ELM327: single and
+    multi-frame responses, several ECUs answering, unsupported PIDs and
+    fallback to single requests for ECUs answering the first PID only
+*/
+#include "Arduino.h"
+#include "FreematicsBase.h"
+#include "FreematicsOBD.h"
+#include "test.h"
+#include <string>
+#include <map>
+
+// ELM327 style link with simulated ECU(s), ATH0/ATCAF1 output
+class SimLink : public CLink {
+public:
+    std::map<int, std::string> ecu = {{0x0D, "3C"}, {0x0C, "1A F8"}, {0x11, "26"}, {0x04, "33"}, {0x05, "5A"}, {0x0F, "40"}, {0x10, "01 F4"}, {0x0E, "90"}};
+    bool can = true;       // false: K-line ECU answering first PID only
+    bool twoECUs = false;  // second ECU answering too
+    unsigned rtt = 40;     // request to response time
+    int requests = 0;
+    std::string resp;
+    void send(const char* str) {
+        requests++;
+        hostMillis += rtt;
+        std::string req(str);
+        resp.clear();
+        unsigned mode = strtoul(req.substr(0, 2).c_str(), 0, 16);
+        std::string bytes = "41";
+        for (size_t i = 2; i + 1 < req.size() && req[i] != '\r'; i += 2) {
+            int pid = strtoul(req.substr(i, 2).c_str(), 0, 16);
+            if (ecu.count(pid)) bytes += " " + std::string(buf(pid)) + " " + ecu[pid];
+            if (!can) break;
+        }
+        if (mode != 1 || bytes == "41") { resp = "NO DATA\r\r>"; return; }
+        resp = frames(bytes);
+        if (twoECUs) resp = frames("41 0D 3C") + resp;
+        resp += "\r>";
+    }
+    const char* buf(int pid) { static char b[4]; sprintf(b, "%02X", pid); return b; }
+    std::string frames(const std::string& text) {
+        std::string hex;
+        for (char c : text) if (c != ' ') hex += c;
+        int n = hex.size() / 2;
+        if (n <= 7 || !can) return text + " \r";
+        char tmp[16];
+        sprintf(tmp, "%03X\r", n);
+        std::string out = tmp;
+        int pos = 0;
+        for (int f = 0; pos < n; f++) {
+            out += std::to_string(f & 0xf) + ": ";
+            int k = f == 0 ? 6 : 7;
+            for (int j = 0; j < k; j++, pos++) {
+                out += pos < n ? hex.substr(pos * 2, 2) : "00";
+                out += " ";
+            }
+            out += "\r";
+        }
+        return out;
+    }
+    int receive(char* buffer, int bufsize, unsigned int timeout) {
+        int n = std::min((int)resp.size(), bufsize - 1);
+        memcpy(buffer, resp.data(), n);
+        buffer[n] = 0;
+        return n;
+    }
+    int sendCommand(const char* cmd, char* b, int bufsize, unsigned int timeout) { if (b) strcpy(b, "OK\r>"); return 4; }
+};
+
+class TestOBD : public COBD {
+public:
+    bool multi() { return m_multiPID; }
+    void resetMulti() { m_multiPID = true; }
+};
+
+int main()
+{
+    SimLink link;
+    TestOBD obd;
+    obd.begin(&link);
+    const byte tier1[] = {PID_SPEED, PID_RPM, PID_THROTTLE, PID_ENGINE_LOAD};
+    int ref[4], val[4];
+    bool ok[4];
+    for (int i = 0; i < 4; i++) CHECK(obd.readPID(tier1[i], ref[i]));
+    CHECK(ref[0] == 0x3C && ref[1] == 0x1AF8 / 4 && ref[2] == 0x26 * 100 / 255 && ref[3] == 0x33 * 100 / 255);
+
+    // single request, multi-frame response with padding
+    link.requests = 0;
+    CHECK(obd.readPID(tier1, 4, val, ok) == 4);
+    CHECK(link.requests == 1 && !memcmp(val, ref, sizeof(ref)) && ok[0] && ok[1] && ok[2] && ok[3]);
+
+    // single frame response
+    const byte two[] = {PID_SPEED, PID_COOLANT_TEMP};
+    link.requests = 0;
+    CHECK(obd.readPID(two, 2, val, ok) == 2 && link.requests == 1 && val[0] == 0x3C && val[1] == 0x5A - 40);
+
+    // eight PIDs in two requests, one unsupported by the ECU
+    const byte eight[] = {0x0D, 0x0C, 0x11, 0x04, 0x05, 0x0F, 0x10, 0x1F};
+    int v8[8] = {0}; bool ok8[8];
+    link.requests = 0;
+    CHECK(obd.readPID(eight, 8, v8, ok8) == 7 && link.requests == 3 && obd.multi());
+    CHECK(ok8[6] && v8[6] == 5 && !ok8[7] && v8[5] == 0x40 - 40);
+
+    // two ECUs answering
+    link.twoECUs = true;
+    memset(val, 0, sizeof(val));
+    CHECK(obd.readPID(tier1, 4, val, ok) == 4 && !memcmp(val, ref, sizeof(ref)));
+    link.twoECUs = false;
+
+    // timing, tier 1 sampling as in processOBD
+    link.requests = 0;
+    unsigned long t = hostMillis;
+    for (int r = 0; r < 100; r++) for (int i = 0; i < 4; i++) obd.readPID(tier1[i], val[i]);
+    unsigned long single = hostMillis - t;
+    t = hostMillis;
+    for (int r = 0; r < 100; r++) obd.readPID(tier1, 4, val, ok);
+    unsigned long multi = hostMillis - t;
+    CHECK(multi * 3 < single);
+
+    // K-line ECU only answering the first PID: falls back and stays with single requests
+    link.can = false;
+    link.requests = 0;
+    memset(val, 0, sizeof(val));
+    CHECK(obd.readPID(tier1, 4, val, ok) == 4 && !memcmp(val, ref, sizeof(ref)));
+    CHECK(!obd.multi() && link.requests == 4);
+    link.requests = 0;
+    CHECK(obd.readPID(tier1, 4, val, ok) == 4 && link.requests == 4);
+
+    // no answer at all does not disable multi-PID requests
+    link.can = true;
+    obd.resetMulti();
+    link.ecu.clear();
+    CHECK(obd.readPID(tier1, 4, val, ok) == 0 && obd.multi() && !ok[0]);
+    return report("obd_multi_pid_test");
+}
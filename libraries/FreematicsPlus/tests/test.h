@@ -0,0 +1,17 @@
+#pragma once
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static int report(const char* name)
+{
+    printf("%s: %s\n", name, failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
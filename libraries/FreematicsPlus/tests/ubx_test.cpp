@@ -0,0 +1,104 @@
+/*
+  UBX decoder on a receiver stream mixed with NMEA, corrupted packets and
+  stray sync bytes, and configuration packets against u-blox reference bytes
+*/
+#include "FreematicsUBX.h"
+#include "test.h"
+#include <math.h>
+#include <string>
+#include <vector>
+
+static void put4(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+// NAV-PVT of 2018-10-18 with given time and position
+static int pvt(uint8_t* out, int h, int m, int s, int32_t nano, int32_t lat, int32_t lon, int32_t hmsl, int32_t gs, int32_t head, uint8_t fix)
+{
+    uint8_t p[92] = {0};
+    p[4] = 0xE2;
+    p[5] = 0x07;
+    p[6] = 10;
+    p[7] = 18;
+    p[8] = h;
+    p[9] = m;
+    p[10] = s;
+    p[11] = 0x7;
+    put4(p + 16, nano);
+    p[20] = fix;
+    p[21] = 1;
+    p[23] = 14;
+    put4(p + 24, lon);
+    put4(p + 28, lat);
+    put4(p + 36, hmsl);
+    put4(p + 60, gs);
+    put4(p + 64, head);
+    p[76] = 0x8C;
+    return CUBXDecoder::buildPacket(1, 7, p, sizeof(p), out);
+}
+
+static std::string nmea(const char* body)
+{
+    unsigned char c = 0;
+    for (const char* q = body; *q; q++) c ^= *q;
+    char buf[128];
+    sprintf(buf, "$%s*%02X\r\n", body, c);
+    return buf;
+}
+
+int main()
+{
+    uint8_t buf[128];
+    std::vector<uint8_t> stream;
+    // NMEA output, ACK, PVT, corrupted PVT, stray sync byte, PVT without fix
+    std::string n = nmea("GPRMC,083559.00,A,4717.11437,N,00833.91522,E,0.004,77.52,181018,,,A");
+    stream.insert(stream.end(), n.begin(), n.end());
+    uint8_t ack[2] = {6, 1};
+    int len = CUBXDecoder::buildPacket(5, 1, ack, 2, buf);
+    stream.insert(stream.end(), buf, buf + len);
+    len = pvt(buf, 8, 35, 59, 123456789, -338688000, 1512093000, 45123, 13889, 27012345, 3);
+    stream.insert(stream.end(), buf, buf + len);
+    len = pvt(buf, 8, 36, 0, 0, 1, 1, 1, 1, 1, 3);
+    buf[50] ^= 0xFF;
+    stream.insert(stream.end(), buf, buf + len);
+    stream.push_back(0xB5);
+    len = pvt(buf, 8, 36, 1, 0, 1, 1, 1, 1, 1, 0);
+    stream.insert(stream.end(), buf, buf + len);
+
+    CUBXDecoder d;
+    int fixes = 0;
+    for (uint8_t c : stream) {
+        if (d.encode(c)) fixes++;
+    }
+    uint16_t good, failed;
+    d.stats(&good, &failed);
+    CHECK(fixes == 1 && good == 3 && failed == 1);
+    CHECK(d.ack() == 1);
+
+    // fields of a fix
+    CUBXDecoder e;
+    len = pvt(buf, 8, 35, 59, 123456789, -338688000, 1512093000, 45123, 13889, 27012345, 3);
+    bool ok = false;
+    for (int i = 0; i < len; i++) ok = e.encode(buf[i]);
+    CHECK(ok);
+    GPS_DATA gd = {0};
+    e.getData(&gd);
+    CHECK(fabs(gd.lat + 33.8688) < 1e-5 && fabs(gd.lng - 151.2093) < 1e-4);
+    CHECK(gd.date == 181018 && gd.time == 8355912);
+    CHECK(fabs(gd.alt - 45.123) < 1e-3 && fabs(gd.speed - 27.0) < 0.01);
+    CHECK(gd.heading == 270 && gd.sat == 14 && gd.hdop == 14);
+
+    // configuration packets
+    const uint8_t navRate[] = {0xB5, 0x62, 0x06, 0x08, 0x06, 0x00, 0x64, 0x00, 0x01, 0x00, 0x01, 0x00, 0x7A, 0x12};
+    len = CUBXDecoder::buildNavRate(100, buf);
+    CHECK(len == sizeof(navRate) && !memcmp(buf, navRate, len));
+    const uint8_t msgRate[] = {0xB5, 0x62, 0x06, 0x01, 0x08, 0x00, 0x01, 0x07, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x18, 0xE1};
+    len = CUBXDecoder::buildMessageRate(1, 7, 1, buf);
+    CHECK(len == sizeof(msgRate) && !memcmp(buf, msgRate, len));
+    len = CUBXDecoder::buildPortConfig(115200, buf);
+    CHECK(len == 28 && buf[14] == 0x00 && buf[15] == 0xC2 && buf[16] == 0x01 && buf[18] == 3 && buf[20] == 1);
+    len = CUBXDecoder::buildPortConfig(115200, buf, UBX_PROTO_UBX | UBX_PROTO_NMEA);
+    CHECK(len == 28 && buf[18] == 3 && buf[20] == 3);
+    return report("ubx_test");
+}
@@ -288,7 +288,9 @@ int ConvertToKML(KML_DATA* kd, FILE* fp, const char* kmlfile, uint32_t startpos,
 
 	fprintf(kd->fp, "<gx:Track>");
 
-	while (fscanf(fp, "%1024s\n", line) > 0) {
+	DATA_READER rd;
+	openDataReader(&rd, fp);
+	while (readDataLine(&rd, line, sizeof(line)) > 0) {
 		for (char* p = strtok(line, ","); p; p = strtok(0, ",")) {
 			pid = hex2uint16(p);
 			if (!(p = strchr(p, ':'))) break;
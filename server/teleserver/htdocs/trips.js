@@ -140,6 +140,13 @@ var TRIPS = {
 	histroy: null,
 	series: [],
 	tripID: null,
+	// level of detail shown, reaching meta.lods once the full trip is loaded
+	lod: 0,
+	lods: 0,
+	fitZoom: null,
+	zoomHooked: false,
+	info: null,
+	xhrLOD: new XMLHttpRequest(),
 	loadTrip: function(tripIndex)
 	{
 		this.xhr.onreadystatechange = function () {
@@ -172,31 +179,21 @@ var TRIPS = {
 				type: "Feature", properties: { name: "Finish", info: finishTime }, geometry: { type: "Point", coordinates: data.trip.coordinates[length - 1] }
 			});
 
-			var index;
-			var indexTopSpeed;
-			var topSpeed = 0;
+			// stops are detected by server on the full trip, the line may be a reduced level of detail
+			var topSpeed = data.stats.topSpeed;
 			var longestStopping = 0;
 			var totalStopping = 0;
-			for (var i = 0; i < length; i++) {
-				var speed = data.trip.speeds[i];
-				if (index == null && speed == 0) {
-					index = i;
-				} else if (index != null && speed > 1) {
-					var duration = Math.floor((data.trip.timestamps[i] - data.trip.timestamps[index]) / 1000);
-					if (duration > longestStopping) longestStopping = duration;
-					if (duration >= STOP_TIME_MIN) {
-						// stopped
-						features.push({
-							type: "Feature", properties: { name: "Stopping", info: duration + " seconds" }, geometry: { type: "Point", coordinates: data.trip.coordinates[index] }
-						});
-					}
-					totalStopping += duration;
-					index = null;
-				}
-				if (speed > topSpeed) {
-					topSpeed = speed;
-					indexTopSpeed = i;
+			for (var i = 0; i < data.stats.stops.length; i++) {
+				var stop = data.stats.stops[i];
+				var duration = stop[3];
+				if (duration > longestStopping) longestStopping = duration;
+				if (duration >= STOP_TIME_MIN) {
+					// stopped
+					features.push({
+						type: "Feature", properties: { name: "Stopping", info: duration + " seconds" }, geometry: { type: "Point", coordinates: [stop[0], stop[1]] }
+					});
 				}
+				totalStopping += duration;
 			}
 			/*
 			features.push({
@@ -262,6 +259,13 @@ var TRIPS = {
 			OSMAP.line(data.trip, myStyle, info);
 			OSMAP.map.fitBounds(data.bounds);
 			OSMAP.features(features, myStyle);
+			TRIPS.info = info;
+			TRIPS.lods = data.meta.lods ? data.meta.lods : 0;
+			TRIPS.fitZoom = OSMAP.map.getZoom();
+			if (!TRIPS.zoomHooked) {
+				OSMAP.map.on("zoomend", function () { TRIPS.refine(); });
+				TRIPS.zoomHooked = true;
+			}
 
 			//TRIPS.series = [TRIPS.getTimestampedArray(data.trip.speeds, data.trip.timestamps),
 			//	TRIPS.getTimestampedArray(data.trip.altitudes, data.trip.timestamps)];
@@ -292,10 +296,33 @@ var TRIPS = {
 		document.getElementById("toolbar").innerHTML = html;
 
 		document.getElementById("chart").style.display = "block";
-		var url = serverURL + "trip?devid=" + USER.devid + "&tripid=" + this.tripID;
+		// start with the overview, finer levels are loaded on zooming in
+		this.lod = 0;
+		this.lods = 0;
+		var url = serverURL + "trip?devid=" + USER.devid + "&tripid=" + this.tripID + "&lod=0";
 		this.xhr.open('GET', url, true);
 		this.xhr.send(null);
 	},
+	refine: function()
+	{
+		if (this.lod >= this.lods || this.fitZoom == null) return;
+		var lod = this.lod + Math.max(OSMAP.map.getZoom() - this.fitZoom, 0);
+		if (lod <= this.lod) return;
+		if (lod > this.lods) lod = this.lods;
+		this.lod = lod;
+		var tripID = this.tripID;
+		this.xhrLOD.onreadystatechange = function () {
+			if (this.readyState != 4 || this.status != 200 || tripID != TRIPS.tripID) return;
+			var data = JSON.parse(this.responseText);
+			if (!data || !data.trip) return;
+			if (OSMAP.layerLine) OSMAP.map.removeLayer(OSMAP.layerLine);
+			OSMAP.line(data.trip, myStyle, TRIPS.info);
+		}
+		var url = serverURL + "trip?devid=" + USER.devid + "&tripid=" + tripID;
+		if (lod < this.lods) url += "&lod=" + lod;
+		this.xhrLOD.open('GET', url, true);
+		this.xhrLOD.send(null);
+	},
 	loadChart: function(pids)
 	{
 		var offset = this.startTimeEpoc - this.startDeviceTick;
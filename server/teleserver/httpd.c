@@ -238,7 +238,9 @@ void mwInitParam(HttpParam* hp, int port, const char* webPath, unsigned int flag
 			memcpy(&hp->proxy_addr.sin_addr.s_addr, (void*)target_host->h_addr, target_host->h_length);
 			hp->proxy_addr.sin_port = htons(proxyPort);
 			hp->flags |= FLAG_ENABLE_PROXY;
-			hp->proxyBuffer = malloc(PROXY_TX_BUF_SIZE);
+			for (int i = 0; i < PROXY_CONNECTIONS; i++) {
+				hp->proxyConn[i].buffer = malloc(PROXY_TX_BUF_SIZE);
+			}
 			SYSLOG(LOG_INFO, "Proxy server: %s:%u\n", proxyHost, proxyPort);
 		}
 	}
@@ -343,6 +345,34 @@ int mwGetLocalFileName(HttpFilePath* hfp)
 // Internal (private) helper functions
 ////////////////////////////////////////////////////////////////////////////
 
+static int _mwProxyConnect(HttpParam* hp, HttpProxyConn* pc)
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(s, (struct sockaddr*)&hp->proxy_addr, sizeof(hp->proxy_addr)) < 0) {
+		closesocket(s);
+		// do not hold up the server loop retrying an unreachable proxy server
+		pc->retryTime = time(NULL) + PROXY_RECONNECT_INTERVAL;
+		return 0;
+	}
+	_mwSetSocketOpts(s);
+	pc->socket = s;
+	pc->bytes = 0;
+	pc->sent = 0;
+	return 1;
+}
+
+static void _mwProxyClose(HttpParam* hp, int conn)
+{
+	HttpProxyConn* pc = hp->proxyConn + conn;
+	closesocket(pc->socket);
+	pc->socket = 0;
+	// data not yet sent is discarded along with the connection
+	pc->bytes = 0;
+	pc->sent = 0;
+	pc->retryTime = 0;
+	if (hp->pfnProxyData) (*hp->pfnProxyData)(hp, conn, PROXY_CONN_CLOSED, 0, 0);
+}
+
 SOCKET _mwStartListening(HttpParam* hp)
 {
 	SOCKET listenSocket;
@@ -395,17 +425,16 @@ SOCKET _mwStartListening(HttpParam* hp)
 	}
 
 	if (hp->flags & FLAG_ENABLE_PROXY) {
-		hp->proxySocket = socket(AF_INET, SOCK_STREAM, 0);
-		if (connect(hp->proxySocket, (struct sockaddr*)&hp->proxy_addr, sizeof(hp->proxy_addr)) < 0) {
+		int connected = 0;
+		for (int i = 0; i < PROXY_CONNECTIONS; i++) {
+			connected += _mwProxyConnect(hp, hp->proxyConn + i);
+		}
+		if (!connected) {
 			SYSLOG(LOG_INFO, "Unable to connect to proxy server. Disable proxying.\n");
-			closesocket(hp->proxySocket);
-			hp->proxySocket = 0;
 			hp->flags &= ~FLAG_ENABLE_PROXY;
 		}
 		else {
-			SYSLOG(LOG_INFO, "[%d] Proxy server connected\n", hp->proxySocket);
-			_mwSetSocketOpts(hp->proxySocket);
-			hp->flags |= FLAG_PROXY_CONNECTED;
+			SYSLOG(LOG_INFO, "Proxy server connected (%d connections)\n", connected);
 		}
 	}
 	return listenSocket;
@@ -460,9 +489,11 @@ void _mwCloseAllConnections(HttpParam* hp)
 		closesocket(hp->udpSocket);
 		hp->udpSocket = 0;
 	}
-	if (hp->proxySocket) {
-		closesocket(hp->proxySocket);
-		hp->proxySocket = 0;
+	for (i = 0; i < PROXY_CONNECTIONS; i++) {
+		if (hp->proxyConn[i].socket) {
+			closesocket(hp->proxyConn[i].socket);
+			hp->proxyConn[i].socket = 0;
+		}
 	}
 	for (i = 0; i < hp->maxClients; i++) {
 		if (hp->hsSocketQueue[i].socket) {
@@ -499,42 +530,45 @@ void mwHttpLoop(HttpParam *hp, uint32_t timeout)
 		FD_SET(hp->udpSocket, &fdsSelectRead);
 		if (hp->udpSocket > iSelectMaxFds) iSelectMaxFds = hp->udpSocket;
 	}
-	if (hp->flags & FLAG_ENABLE_PROXY) {
-		int iError = 0;
-		socklen_t iOptSize = sizeof(int);
-		if (getsockopt(hp->proxySocket, SOL_SOCKET, SO_ERROR, (char*)&iError, &iOptSize)) {
-			// if a socket contains a error, close it
-			SYSLOG(LOG_INFO, "[%d] Proxy socket no longer vaild.\n", hp->proxySocket);
-			hp->flags &= ~FLAG_PROXY_CONNECTED;
-		}
+
+	// get current time
+	tmCurrentTime=time(NULL);
+
+	if ((hp->flags & FLAG_ENABLE_PROXY) && hp->pfnProxyData) {
 		// proxy enabled
-		if (!(hp->flags & FLAG_PROXY_CONNECTED)) {
-			closesocket(hp->proxySocket);
-			hp->proxySocket = socket(AF_INET, SOCK_STREAM, 0);
-			if (connect(hp->proxySocket, (struct sockaddr*)&hp->proxy_addr, sizeof(hp->proxy_addr)) >= 0) {
-				hp->flags |= FLAG_PROXY_CONNECTED;
-				SYSLOG(LOG_INFO, "[%d] Proxy server reconnected\n", hp->proxySocket);
-			}
-		}
-		if (hp->flags & FLAG_PROXY_CONNECTED) {
-			if (hp->proxyBufferBytes <= 0) {
-				hp->proxyBufferBytes = (*hp->pfnProxyData)(hp, PROXY_DATA_REQUESTED, hp->proxyBuffer, PROXY_TX_BUF_SIZE);
-				if (hp->proxyBufferBytes < 0) {
-					hp->flags &= ~FLAG_PROXY_CONNECTED;
+		for (i = 0; i < PROXY_CONNECTIONS; i++) {
+			HttpProxyConn* pc = hp->proxyConn + i;
+			if (pc->socket) {
+				int iError = 0;
+				socklen_t iOptSize = sizeof(int);
+				if (getsockopt(pc->socket, SOL_SOCKET, SO_ERROR, (char*)&iError, &iOptSize)) {
+					// if a socket contains a error, close it
+					SYSLOG(LOG_INFO, "[%d] Proxy socket no longer vaild.\n", pc->socket);
+					_mwProxyClose(hp, i);
 				}
 			}
-			if (hp->proxyBufferBytes > 0) {
-				FD_SET(hp->proxySocket, &fdsSelectWrite);
+			if (!pc->socket) {
+				if (tmCurrentTime < pc->retryTime || !_mwProxyConnect(hp, pc)) continue;
+				SYSLOG(LOG_INFO, "[%d] Proxy server reconnected\n", pc->socket);
+			}
+			if (pc->bytes == 0) {
+				// each connection is filled with its own batch of requests
+				int bytes = (*hp->pfnProxyData)(hp, i, PROXY_DATA_REQUESTED, pc->buffer, PROXY_TX_BUF_SIZE);
+				if (bytes < 0) {
+					_mwProxyClose(hp, i);
+					continue;
+				}
+				pc->bytes = bytes;
 			}
-			else {
-				FD_SET(hp->proxySocket, &fdsSelectRead);
+			if (pc->bytes > pc->sent) {
+				FD_SET(pc->socket, &fdsSelectWrite);
 			}
-			if (hp->proxySocket > iSelectMaxFds) iSelectMaxFds = hp->proxySocket;
+			// responses are read while further requests are being sent
+			FD_SET(pc->socket, &fdsSelectRead);
+			if (pc->socket > iSelectMaxFds) iSelectMaxFds = pc->socket;
 		}
 	}
 
-	// get current time
-	tmCurrentTime=time(NULL);
 	// build descriptor sets and close timed out sockets
 	for (i = 0; i < hp->maxClients; i++) {
 		phsSocketCur = hp->hsSocketQueue + i;
@@ -557,9 +591,22 @@ void mwHttpLoop(HttpParam *hp, uint32_t timeout)
 		// check expiration timer (for non-listening, in-use sockets)
 		if (tmCurrentTime > phsSocketCur->tmExpirationTime) {
 			// close connection
-			phsSocketCur->flags=FLAG_CONN_CLOSE;
+			phsSocketCur->flags=FLAG_CONN_CLOSE | (phsSocketCur->flags & FLAG_TO_FREE);
 			_mwCloseSocket(hp, phsSocketCur);
 		} else {
+			if (ISFLAGSET(phsSocketCur,FLAG_DATA_WAIT)) {
+				// give handler of a waiting request another chance to respond
+				iRc = _mwProcessWaitingSocket(hp, phsSocketCur);
+				if (iRc) {
+					if (iRc == -1) {
+						SETFLAG(phsSocketCur, FLAG_CONN_CLOSE);
+					}
+					_mwCloseSocket(hp, phsSocketCur);
+					continue;
+				}
+				// nothing to select until the handler responds
+				if (ISFLAGSET(phsSocketCur,FLAG_DATA_WAIT)) continue;
+			}
 			if (ISFLAGSET(phsSocketCur,FLAG_SENDING)) {
 				// add to write descriptor set
 				FD_SET(sock,&fdsSelectWrite);
@@ -596,22 +643,32 @@ void mwHttpLoop(HttpParam *hp, uint32_t timeout)
 
 	// check proxy server
 	if ((hp->flags & FLAG_ENABLE_PROXY) && hp->pfnProxyData) {
-		if (FD_ISSET(hp->proxySocket, &fdsSelectRead)) {
-			char data[PROXY_RX_BUF_SIZE];
-			int len = recv(hp->proxySocket, data, sizeof(data) - 1, 0);
-			if (len > 0) {
+		for (i = 0; i < PROXY_CONNECTIONS; i++) {
+			HttpProxyConn* pc = hp->proxyConn + i;
+			if (!pc->socket) continue;
+			if (FD_ISSET(pc->socket, &fdsSelectRead)) {
+				char data[PROXY_RX_BUF_SIZE];
+				int len = recv(pc->socket, data, sizeof(data) - 1, 0);
+				if (len <= 0) {
+					SYSLOG(LOG_INFO, "[%d] Proxy server disconnected\n", pc->socket);
+					_mwProxyClose(hp, i);
+					continue;
+				}
 				data[len] = 0;
-				(*hp->pfnProxyData)(hp, PROXY_DATA_RECEIVED, data, len);
+				(*hp->pfnProxyData)(hp, i, PROXY_DATA_RECEIVED, data, len);
 			}
-		}
-		if (FD_ISSET(hp->proxySocket, &fdsSelectWrite)) {
-			if (hp->proxyBufferBytes > 0) {
-				if (send(hp->proxySocket, hp->proxyBuffer, hp->proxyBufferBytes, 0) == hp->proxyBufferBytes) {
-					// sent
-					SYSLOG(LOG_INFO, "[%d] %d bytes sent to proxy server\n", hp->proxySocket, hp->proxyBufferBytes);
-					hp->proxyBufferBytes = 0;
-				} else {
-					hp->flags &= ~FLAG_PROXY_CONNECTED;
+			if (FD_ISSET(pc->socket, &fdsSelectWrite) && pc->bytes > pc->sent) {
+				int bytes = send(pc->socket, pc->buffer + pc->sent, pc->bytes - pc->sent, 0);
+				if (bytes <= 0) {
+					_mwProxyClose(hp, i);
+					continue;
+				}
+				// a partial send is resumed when the socket is writable again
+				pc->sent += bytes;
+				if (pc->sent == pc->bytes) {
+					SYSLOG(LOG_INFO, "[%d] %d bytes sent to proxy server\n", pc->socket, pc->bytes);
+					pc->bytes = 0;
+					pc->sent = 0;
 				}
 			}
 		}
@@ -717,9 +774,11 @@ void mwServerExit(HttpParam* hp)
 		free(hp->hsSocketQueue);
 		hp->hsSocketQueue = 0;
 	}
-	if (hp->proxyBuffer) {
-		free(hp->proxyBuffer);
-		hp->proxyBuffer = 0;
+	for (i = 0; i < PROXY_CONNECTIONS; i++) {
+		if (hp->proxyConn[i].buffer) {
+			free(hp->proxyConn[i].buffer);
+			hp->proxyConn[i].buffer = 0;
+		}
 	}
 
 	// clear state vars
@@ -1201,7 +1260,10 @@ int _mwProcessReadSocket(HttpParam* hp, HttpSocket* phsSocket)
 	if (phsSocket->request.iHttpVer == 0) {
 		CLRFLAG(phsSocket, FLAG_CHUNK);
 	}
-	if (ISFLAGSET(phsSocket,FLAG_DATA_RAW | FLAG_DATA_STREAM)) {
+	if (ISFLAGSET(phsSocket,FLAG_DATA_WAIT)) {
+		// response is generated later by _mwProcessWaitingSocket
+		return 0;
+	} else if (ISFLAGSET(phsSocket,FLAG_DATA_RAW | FLAG_DATA_STREAM)) {
 		SETFLAG(phsSocket,FLAG_SENDING);
 		return _mwStartSendRawData(hp, phsSocket);
 	} else if (ISFLAGSET(phsSocket,FLAG_DATA_FILE)) {
@@ -1215,6 +1277,37 @@ int _mwProcessReadSocket(HttpParam* hp, HttpSocket* phsSocket)
 	return -1;
 } // end of _mwProcessReadSocket
 
+////////////////////////////////////////////////////////////////////////////
+// _mwProcessWaitingSocket
+// Call handler of a request which returned FLAG_DATA_WAIT again
+// The handler keeps its state in phsSocket->ptr (with FLAG_TO_FREE) and
+// returns FLAG_DATA_WAIT until the response is ready as FLAG_DATA_RAW
+////////////////////////////////////////////////////////////////////////////
+int _mwProcessWaitingSocket(HttpParam* hp, HttpSocket* phsSocket)
+{
+	UrlHandlerParam up;
+	UrlHandler* pfnHandler = (UrlHandler*)phsSocket->handler;
+	int ret;
+	if (!pfnHandler) return -1;
+	memset(&up, 0, sizeof(up));
+	up.hs = phsSocket;
+	up.hp = hp;
+	up.pucBuffer = phsSocket->buffer;
+	up.bufSize = HTTP_BUFFER_SIZE;
+	up.iVarCount = -1;
+	ret = (pfnHandler->pfnUrlHandler)(&up);
+	if (ret & FLAG_DATA_WAIT) return 0;
+	CLRFLAG(phsSocket, FLAG_DATA_WAIT);
+	if (!(ret & FLAG_DATA_RAW)) return -1;
+	SETFLAG(phsSocket, FLAG_DATA_RAW);
+	phsSocket->response.fileType = up.contentType;
+	phsSocket->pucData = up.pucBuffer;
+	phsSocket->contentLength = up.contentLength;
+	phsSocket->response.contentLength = up.contentLength;
+	SETFLAG(phsSocket, FLAG_SENDING);
+	return _mwStartSendRawData(hp, phsSocket);
+} // end of _mwProcessWaitingSocket
+
 ////////////////////////////////////////////////////////////////////////////
 // _mwProcessWriteSocket
 // Process a socket (write)
@@ -96,6 +96,7 @@ typedef enum {
 #define FLAG_DATA_STREAM	0x100000
 #define FLAG_CUSTOM_HEADER	0x200000
 #define FLAG_MULTIPART		0x400000
+#define FLAG_DATA_WAIT		0x800000
 
 #define FLAG_RECEIVING		0x40000000
 #define FLAG_SENDING		0x80000000
@@ -207,7 +208,7 @@ typedef struct {
 // Callback function protos
 typedef int (*PFNURLCALLBACK)(UrlHandlerParam*);
 typedef int (*PFN_UDP_CALLBACK)(void* hp);
-typedef int (*PFN_PROXY_CALLBACK)(void* hp, int op, char* buf, int len);
+typedef int (*PFN_PROXY_CALLBACK)(void* hp, int conn, int op, char* buf, int len);
 
 typedef struct {
 	const char* pchUrlPrefix;
@@ -232,13 +233,25 @@ typedef struct {
 #define FLAG_DIR_LISTING 1
 #define FLAG_DISABLE_RANGE 2
 #define FLAG_ENABLE_PROXY 4
-#define FLAG_PROXY_CONNECTED 8
 
 #define PROXY_DATA_REQUESTED 0
 #define PROXY_DATA_RECEIVED 1
+#define PROXY_CONN_CLOSED 2
 
 #define PROXY_RX_BUF_SIZE 1024
-#define PROXY_TX_BUF_SIZE 1024
+#define PROXY_TX_BUF_SIZE 16384
+#ifndef PROXY_CONNECTIONS
+#define PROXY_CONNECTIONS 4
+#endif
+#define PROXY_RECONNECT_INTERVAL 5 /* seconds */
+
+typedef struct {
+	SOCKET socket;
+	char* buffer;
+	int bytes;		/* bytes of request data in buffer */
+	int sent;		/* bytes of buffer already sent */
+	time_t retryTime;
+} HttpProxyConn;
 
 typedef struct _httpParam {
 	HttpSocket* hsSocketQueue;				/* socket queue*/
@@ -256,11 +269,9 @@ typedef struct _httpParam {
 	PFN_UDP_CALLBACK pfnIncomingUDP;
 	// proxy
 	struct sockaddr_in proxy_addr;
-	SOCKET proxySocket;
+	HttpProxyConn proxyConn[PROXY_CONNECTIONS];
 	const char* pchProxyUrl;
 	PFN_PROXY_CALLBACK pfnProxyData;
-	char* proxyBuffer;
-	int proxyBufferBytes;
 	// misc
 	uint32_t dwAuthenticatedNode;
 	time_t tmAuthExpireTime;
@@ -91,6 +91,7 @@ SOCKET _mwAcceptSocket(HttpParam* hp, struct sockaddr_in *sinaddr);
 void _mwDenySocket(HttpParam* hp,struct sockaddr_in *sinaddr);
 int _mwProcessReadSocket(HttpParam* hp, HttpSocket* phsSocket);
 int _mwProcessWriteSocket(HttpParam *hp, HttpSocket* phsSocket);
+int _mwProcessWaitingSocket(HttpParam* hp, HttpSocket* phsSocket);
 void _mwCloseSocket(HttpParam* hp, HttpSocket* phsSocket);
 int _mwStartSendFile(HttpParam* hp, HttpSocket* phsSocket);
 int _mwSendFileChunk(HttpParam *hp, HttpSocket* phsSocket);
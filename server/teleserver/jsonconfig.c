@@ -2,13 +2,120 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include "cJSON.h"
 
 #ifdef WIN32
 #define strcasecmp _stricmp
 #endif
 
+#define CONFIG_CHECK_INTERVAL 5 /* seconds between checks of users.json for changes */
+
+typedef struct {
+	const char* key;
+	void* value;
+} HASH_SLOT;
+
+// open addressing hash table of strings owned by the cJSON tree
+typedef struct {
+	HASH_SLOT* slots;
+	unsigned int mask;
+} HASH_TABLE;
+
 cJSON* users = 0;
+// user ID to user entry, device ID to user ID
+static HASH_TABLE userIndex = { 0 };
+static HASH_TABLE deviceIndex = { 0 };
+
+static unsigned int hashString(const char* s)
+{
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*(s++);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int hashInit(HASH_TABLE* t, int count)
+{
+	// at most half full
+	unsigned int size = 16;
+	while (size < (unsigned int)count * 2) size <<= 1;
+	t->slots = calloc(size, sizeof(HASH_SLOT));
+	t->mask = t->slots ? size - 1 : 0;
+	return t->slots != 0;
+}
+
+static void hashFree(HASH_TABLE* t)
+{
+	free(t->slots);
+	t->slots = 0;
+	t->mask = 0;
+}
+
+static HASH_SLOT* hashFind(HASH_TABLE* t, const char* key)
+{
+	for (unsigned int i = hashString(key) & t->mask; ; i = (i + 1) & t->mask) {
+		HASH_SLOT* slot = t->slots + i;
+		if (!slot->key || !strcmp(slot->key, key)) return slot;
+	}
+}
+
+static void* hashGet(HASH_TABLE* t, const char* key)
+{
+	if (!t->slots) return 0;
+	return hashFind(t, key)->value;
+}
+
+// first value stored for a key is kept
+static void hashPut(HASH_TABLE* t, const char* key, void* value)
+{
+	HASH_SLOT* slot = hashFind(t, key);
+	if (!slot->key) {
+		slot->key = key;
+		slot->value = value;
+	}
+}
+
+static int buildIndex(cJSON* root)
+{
+	int userCount = 0;
+	int deviceCount = 0;
+	for (cJSON* entry = root->child; entry; entry = entry->next) {
+		cJSON* devid = cJSON_GetObjectItem(entry, "devid");
+		userCount++;
+		if (cJSON_IsArray(devid)) deviceCount += cJSON_GetArraySize(devid);
+		else if (devid) deviceCount++;
+	}
+	HASH_TABLE userTable;
+	HASH_TABLE deviceTable;
+	if (!hashInit(&userTable, userCount)) return 0;
+	if (!hashInit(&deviceTable, deviceCount)) {
+		hashFree(&userTable);
+		return 0;
+	}
+	for (cJSON* entry = root->child; entry; entry = entry->next) {
+		cJSON* id = cJSON_GetObjectItem(entry, "id");
+		cJSON* devid = cJSON_GetObjectItem(entry, "devid");
+		if (!cJSON_IsString(id) || !devid) continue;
+		hashPut(&userTable, id->valuestring, entry);
+		if (cJSON_IsArray(devid)) {
+			for (cJSON* item = devid->child; item; item = item->next) {
+				if (cJSON_IsString(item)) hashPut(&deviceTable, item->valuestring, id->valuestring);
+			}
+		}
+		else if (cJSON_IsString(devid)) {
+			hashPut(&deviceTable, devid->valuestring, id->valuestring);
+		}
+	}
+	hashFree(&userIndex);
+	hashFree(&deviceIndex);
+	userIndex = userTable;
+	deviceIndex = deviceTable;
+	return 1;
+}
 
 char* loadFile(const char* fn)
 {
@@ -26,55 +133,46 @@ char* loadFile(const char* fn)
 
 int getUserInfo(const char* username, char** ppassword, char* pdevid[], int maxdev)
 {
-	if (!users) return 0;
-	for (cJSON* entry = users->child; entry; entry = entry->next) {
-		cJSON* id = cJSON_GetObjectItem(entry, "id");
-		if (!id || !cJSON_IsString(id) || strcmp(id->valuestring, username)) {
-			continue;
-		}
-		cJSON* devid = cJSON_GetObjectItem(entry, "devid");
-		if (!devid) continue;
-		cJSON* traccar = cJSON_GetObjectItem(entry, "traccar");
-		if (traccar) *ppassword = traccar->valuestring;
-		if (cJSON_IsArray(devid)) {
-			int length = cJSON_GetArraySize(devid);
-			if (length > maxdev) length = maxdev;
-			for (int n = 0; n < length; n++) {
-				cJSON* item = cJSON_GetArrayItem(devid, n);
-				if (item) pdevid[n] = item->valuestring;
-			}
-			return length;
-		}
-		else if (cJSON_IsString(devid)) {
-			pdevid[0] = devid->valuestring;
-			return 1;
+	cJSON* entry = hashGet(&userIndex, username);
+	if (!entry) return 0;
+	cJSON* devid = cJSON_GetObjectItem(entry, "devid");
+	cJSON* traccar = cJSON_GetObjectItem(entry, "traccar");
+	if (traccar) *ppassword = traccar->valuestring;
+	if (cJSON_IsArray(devid)) {
+		int length = 0;
+		for (cJSON* item = devid->child; item && length < maxdev; item = item->next) {
+			pdevid[length++] = item->valuestring;
 		}
+		return length;
+	}
+	else if (cJSON_IsString(devid)) {
+		pdevid[0] = devid->valuestring;
+		return 1;
 	}
 	return 0;
 }
 
 char* getUserByDeviceID(const char* devid)
 {
-	if (!users) return 0;
-	for (cJSON *entry = users->child; entry; entry = entry->next) {
-		cJSON *item = entry->child;
-		if (item->next && item->next->valuestring && !strcmp(devid, item->next->valuestring)) {
-			return item->valuestring;
-		}
-	}
-	return 0;
+	return hashGet(&deviceIndex, devid);
 }
 
 int loadConfig()
 {
 	static time_t m_time = 0;
+	static time_t checkTime = 0;
+	// file is checked for changes at most once per interval however often called
+	time_t now = time(NULL);
+	if (checkTime && now >= checkTime && now - checkTime < CONFIG_CHECK_INTERVAL)
+		return 0;
+	checkTime = now;
+
 	struct stat st = { 0 };
 	const char* fn = "config/users.json";
 	if (stat(fn, &st) != 0)
 		return -1;
 	if (st.st_mtime == m_time)
 		return 0;
-	m_time = st.st_mtime;
 	
 	FILE* fp = fopen(fn, "r");
 	if (!fp) return -1;
@@ -84,8 +182,15 @@ int loadConfig()
 	content[n] = 0;
 	fclose(fp);
 
-	if (users) cJSON_Delete(users);
-	users = cJSON_Parse(content);
+	cJSON* root = cJSON_Parse(content);
 	free(content);
+	// previous users stay in effect if file is being edited or broken, checked again later
+	if (!root || !buildIndex(root)) {
+		if (root) cJSON_Delete(root);
+		return -1;
+	}
+	if (users) cJSON_Delete(users);
+	users = root;
+	m_time = st.st_mtime;
 	return 0;
 }
\ No newline at end of file
@@ -34,3 +34,21 @@
 #define PID_CSQ 0x81
 #define PID_DEVICE_TEMP 0x82
 
+
+// binary log file written by device
+#define LOG_BIN_MAGIC "FLB\x01"
+#define LOG_BIN_HEADER_SIZE 4
+#define LOG_MAX_RECORD_SIZE 24
+
+// reads data file line by line, text or binary log file
+typedef struct {
+	FILE* fp;
+	int binary;
+	uint32_t ts;
+	int len;
+	int pos;
+	uint8_t buf[1024];
+} DATA_READER;
+
+void openDataReader(DATA_READER* rd, FILE* fp);
+int readDataLine(DATA_READER* rd, char* buf, int bufsize);
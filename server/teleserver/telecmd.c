@@ -0,0 +1,352 @@
+/******************************************************************************
+* Freematics Hub Server - Command Delivery
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "httpd.h"
+#include "teleserver.h"
+
+extern CHANNEL_DATA ld[];
+
+int addChecksump(char* data);
+
+/*
+* Commands are queued per channel, each tagged with the next token of the
+* channel by which the device recognizes a retransmission. For devices which
+* announced CQ=1 at login, due commands are appended as "TK=,CMD=" lines to
+* the EV=3 sync reply of the next incoming data packet, or sent in an EV=5
+* datagram from the channel timer if no data packet arrives within
+* CMD_PIGGYBACK_WAIT. An unacknowledged command is retransmitted with doubled
+* interval until CMD_MAX_RETRIES runs out. Other devices get a single EV=5
+* datagram per command, as they would execute a retransmission again.
+*/
+
+typedef struct {
+	char devid[32];
+	int16_t channel; /* -1 if device unknown */
+	uint32_t token; /* 0 if not queued */
+} COMMAND_REF;
+
+typedef struct {
+	uint64_t deadline;
+	uint8_t fleet;
+	uint16_t count;
+	COMMAND_REF ref[MAX_CHANNELS];
+} COMMAND_WAIT;
+
+static int isPending(const COMMAND_BLOCK* cb)
+{
+	return cb->token && !(cb->flags & (CMD_FLAG_RESPONDED | CMD_FLAG_EXPIRED));
+}
+
+static COMMAND_BLOCK* findCommand(CHANNEL_DATA* pld, uint32_t token)
+{
+	for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
+		if (pld->cmd[i].token && pld->cmd[i].token == token) return pld->cmd + i;
+	}
+	return 0;
+}
+
+static COMMAND_BLOCK* allocCommand(CHANNEL_DATA* pld)
+{
+	// unused or checked slot first, then the oldest completed command
+	COMMAND_BLOCK* cb = 0;
+	for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
+		COMMAND_BLOCK* p = pld->cmd + i;
+		if (p->token == 0 || (p->flags & CMD_FLAG_CHECKED)) return p;
+		if (!isPending(p) && (!cb || p->tick < cb->tick)) cb = p;
+	}
+	return cb;
+}
+
+static int isDue(const COMMAND_BLOCK* cb, uint64_t tick)
+{
+	return isPending(cb) && cb->retries <= CMD_MAX_RETRIES && tick >= cb->sendTick;
+}
+
+int hasDueCommands(CHANNEL_DATA* pld, uint64_t tick)
+{
+	if (!pld->cmdQueue) return 0;
+	for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
+		if (isDue(pld->cmd + i, tick)) return 1;
+	}
+	return 0;
+}
+
+int appendCommands(CHANNEL_DATA* pld, char* buf, int len, uint64_t tick)
+{
+	if (!pld->cmdQueue) return len;
+	for (;;) {
+		// commands go out in the order they were issued
+		COMMAND_BLOCK* cb = 0;
+		for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
+			COMMAND_BLOCK* p = pld->cmd + i;
+			if (isDue(p, tick) && (!cb || p->tick < cb->tick || (p->tick == cb->tick && p->token < cb->token))) cb = p;
+		}
+		if (!cb) break;
+		char line[MAX_COMMAND_MSG_LEN + 24];
+		int n = sprintf(line, "\nTK=%u,CMD=%s", cb->token, cb->command);
+		// the rest waits for next datagram
+		if (len + n > CMD_DATAGRAM_SIZE) break;
+		memcpy(buf + len, line, n + 1);
+		len += n;
+		cb->sendTick = tick + ((uint64_t)CMD_RETRANSMIT_INTERVAL << cb->retries);
+		cb->retries++;
+		fprintf(stderr, "Command sent: %s (%u, #%u)\n", cb->command, cb->token, cb->retries);
+	}
+	return len;
+}
+
+void flushCommands(HttpParam* hp, CHANNEL_DATA* pld, uint64_t tick)
+{
+	// running device is given a chance to collect commands with sync reply
+	uint64_t wait = (pld->cmdQueue && (pld->flags & FLAG_RUNNING)) ? CMD_PIGGYBACK_WAIT : 0;
+	int due = 0;
+	for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
+		COMMAND_BLOCK* cb = pld->cmd + i;
+		if (!isPending(cb) || tick < cb->sendTick + wait) continue;
+		if (!pld->cmdQueue || cb->retries > CMD_MAX_RETRIES) {
+			fprintf(stderr, "Command expired: %s (%u)\n", cb->command, cb->token);
+			cb->flags |= CMD_FLAG_EXPIRED;
+			continue;
+		}
+		due = 1;
+	}
+	if (!due) return;
+
+	char buf[CMD_DATAGRAM_SIZE + 8];
+	int len = sprintf(buf, "%X#EV=%u", pld->id, EVENT_COMMAND);
+	len = appendCommands(pld, buf, len, tick);
+	len = addChecksump(buf);
+	if (sendto(hp->udpSocket, buf, len, 0, (struct sockaddr *)&pld->udpPeer, sizeof(struct sockaddr)) != len) {
+		fprintf(stderr, "Command unsent\n");
+	}
+}
+
+uint32_t issueCommand(HttpParam* hp, CHANNEL_DATA *pld, const char* cmd, uint32_t token)
+{
+	if (strlen(cmd) >= MAX_COMMAND_MSG_LEN || strchr(cmd, '\n')) return 0;
+	COMMAND_BLOCK* cb = allocCommand(pld);
+	if (!cb) {
+		fprintf(stderr, "Command queue full\n");
+		return 0;
+	}
+	uint64_t tick = GetTickCount64();
+	if (token == 0) token = ++pld->cmdCount;
+	cb->token = token;
+	cb->tick = tick;
+	cb->sendTick = tick;
+	cb->flags = 0;
+	cb->retries = 0;
+	strcpy(cb->command, cmd);
+	if (pld->cmdQueue) {
+		// a device not sending data has no sync reply to carry the command
+		if (!(pld->flags & FLAG_RUNNING)) flushCommands(hp, pld, tick);
+		return token;
+	}
+
+	char buf[MAX_COMMAND_MSG_LEN + 48];
+	sprintf(buf, "%X#EV=%u,TK=%u,CMD=%s", pld->id, EVENT_COMMAND, token, cmd);
+	int len = addChecksump(buf);
+	if (sendto(hp->udpSocket, buf, len, 0, (struct sockaddr *)&pld->udpPeer, sizeof(struct sockaddr)) == len) {
+		fprintf(stderr, "Command sent: %s (%u)\n", cmd, token);
+		// not retransmitted, expires when no response within the time allowed for retransmissions
+		cb->retries = 1;
+		cb->sendTick = tick + ((uint64_t)CMD_RETRANSMIT_INTERVAL << CMD_MAX_RETRIES);
+		return token;
+	}
+	else {
+		fprintf(stderr, "Command unsent\n");
+		cb->token = 0;
+		return 0;
+	}
+}
+
+void ackCommand(CHANNEL_DATA* pld, uint32_t token, const char* msg)
+{
+	COMMAND_BLOCK* cb = findCommand(pld, token);
+	if (!cb) return;
+	if (msg) {
+		cb->flags &= ~CMD_FLAG_DUP;
+	}
+	else if (cb->flags & CMD_FLAG_RESPONDED) {
+		// response of the first execution already received
+		return;
+	}
+	else {
+		// executed before but its response was lost
+		cb->flags |= CMD_FLAG_DUP;
+		msg = "";
+	}
+	cb->flags = (cb->flags & ~CMD_FLAG_EXPIRED) | CMD_FLAG_RESPONDED;
+	uint64_t elapsed = GetTickCount64() - cb->tick;
+	cb->elapsed = (uint16_t)(elapsed < 0xffff ? elapsed : 0xffff);
+	// store received message
+	int len = strlen(msg);
+	if (cb->message) {
+		if (len > cb->len) {
+			free(cb->message);
+			cb->message = malloc(len + 1);
+		}
+	}
+	else {
+		cb->message = malloc(len + 1);
+	}
+	cb->len = len < 0xff ? len : 0xff;
+	strcpy(cb->message, msg);
+}
+
+static int isCompleted(const COMMAND_WAIT* w)
+{
+	for (int i = 0; i < w->count; i++) {
+		const COMMAND_REF* ref = w->ref + i;
+		if (ref->channel < 0 || !ref->token) continue;
+		COMMAND_BLOCK* cb = findCommand(ld + ref->channel, ref->token);
+		if (cb && isPending(cb)) return 0;
+	}
+	return 1;
+}
+
+static int genStatus(char* buf, int bufsize, const COMMAND_REF* ref)
+{
+	if (ref->channel < 0) {
+		return snprintf(buf, bufsize, "\"result\":\"failed\",\"error\":\"Invalid device\"");
+	}
+	if (!ref->token) {
+		return snprintf(buf, bufsize, "\"result\":\"failed\",\"error\":\"Command unsent\"");
+	}
+	CHANNEL_DATA* pld = ld + ref->channel;
+	COMMAND_BLOCK* cb = findCommand(pld, ref->token);
+	if (!cb) {
+		return snprintf(buf, bufsize, "\"result\":\"failed\",\"error\":\"Invalid token\"");
+	}
+	if (cb->flags & CMD_FLAG_RESPONDED) {
+		cb->flags |= CMD_FLAG_CHECKED;
+		return snprintf(buf, bufsize, "\"result\":\"done\",\"token\":%u,\"idx\":%u,\"elapsed\":%u,\"dup\":%u,\"data\":\"%s\"",
+			cb->token, (unsigned int)(cb - pld->cmd), (unsigned int)cb->elapsed, (cb->flags & CMD_FLAG_DUP) ? 1 : 0, cb->message);
+	}
+	if (cb->flags & CMD_FLAG_EXPIRED) {
+		return snprintf(buf, bufsize, "\"result\":\"expired\",\"token\":%u,\"retries\":%u", cb->token, cb->retries);
+	}
+	return snprintf(buf, bufsize, "\"result\":\"pending\",\"token\":%u,\"elapsed\":%u,\"retries\":%u",
+		cb->token, (unsigned int)(GetTickCount64() - cb->tick), cb->retries);
+}
+
+static int genResults(char* buf, int bufsize, const COMMAND_WAIT* w)
+{
+	int l;
+	if (!w->fleet) {
+		l = snprintf(buf, bufsize, "{");
+		l += genStatus(buf + l, bufsize - l, w->ref);
+		l += snprintf(buf + l, bufsize - l, "}");
+		return l;
+	}
+	l = snprintf(buf, bufsize, "{\"result\":\"%s\",\"commands\":[", isCompleted(w) ? "done" : "pending");
+	for (int i = 0; i < w->count; i++) {
+		l += snprintf(buf + l, bufsize - l, "%s{\"devid\":\"%s\",", i ? "," : "", w->ref[i].devid);
+		l += genStatus(buf + l, bufsize - l, w->ref + i);
+		l += snprintf(buf + l, bufsize - l, "}");
+	}
+	l += snprintf(buf + l, bufsize - l, "]}");
+	return l;
+}
+
+static void addRef(COMMAND_WAIT* w, const char* devid, int len)
+{
+	if (w->count >= MAX_CHANNELS) return;
+	COMMAND_REF* ref = w->ref + w->count++;
+	if (len >= (int)sizeof(ref->devid)) len = sizeof(ref->devid) - 1;
+	memcpy(ref->devid, devid, len);
+	ref->devid[len] = 0;
+	CHANNEL_DATA* pld = findChannelByDeviceID(ref->devid);
+	ref->channel = pld ? (int16_t)(pld - ld) : -1;
+	ref->token = 0;
+}
+
+/*
+* api/command?id=DEVID&cmd=COMMAND
+* api/command?id=DEVID&token=TOKEN
+* api/command?id=DEVID1,DEVID2&cmd=COMMAND (* for all running devices)
+* With wait=SECONDS the response is held back until all commands are
+* responded or expired, or the time is up.
+*/
+int uhCommand(UrlHandlerParam* param)
+{
+	COMMAND_WAIT* w;
+	if (ISFLAGSET(param->hs, FLAG_DATA_WAIT)) {
+		// called again by web server while request is waiting
+		w = (COMMAND_WAIT*)param->hs->ptr;
+		if (!isCompleted(w) && GetTickCount64() < w->deadline) return FLAG_DATA_WAIT;
+		param->contentType = HTTPFILETYPE_JSON;
+		param->contentLength = genResults(param->pucBuffer, param->bufSize, w);
+		return FLAG_DATA_RAW;
+	}
+
+	const char* sid = param->pucRequest[0] == '/' ? param->pucRequest + 1 : mwGetVarValue(param->pxVars, "id", "");
+	char* cmd = mwGetVarValue(param->pxVars, "cmd", "");
+	uint32_t token = mwGetVarValueInt(param->pxVars, "token", 0);
+	int wait = mwGetVarValueInt(param->pxVars, "wait", 0);
+	param->contentType = HTTPFILETYPE_JSON;
+
+	COMMAND_WAIT cw = { 0 };
+	if (!strcmp(sid, "*")) {
+		cw.fleet = 1;
+		for (int i = 0; i < MAX_CHANNELS; i++) {
+			if (ld[i].id && (ld[i].flags & FLAG_RUNNING)) addRef(&cw, ld[i].devid, strlen(ld[i].devid));
+		}
+	}
+	else if (strchr(sid, ',')) {
+		cw.fleet = 1;
+		for (const char* s = sid; *s; ) {
+			const char* e = strchr(s, ',');
+			if (!e) e = s + strlen(s);
+			if (e > s) addRef(&cw, s, (int)(e - s));
+			s = *e ? e + 1 : e;
+		}
+	}
+	else {
+		addRef(&cw, sid, strlen(sid));
+		if (cw.ref[0].channel < 0) {
+			param->hs->response.statusCode = 403;
+			param->contentLength = 0;
+			return FLAG_DATA_RAW;
+		}
+	}
+
+	if ((!*cmd && (!token || cw.fleet)) || strlen(cmd) >= MAX_COMMAND_MSG_LEN) {
+		param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"failed\",\"error\":\"Invalid request\"}");
+		return FLAG_DATA_RAW;
+	}
+	for (int i = 0; i < cw.count; i++) {
+		COMMAND_REF* ref = cw.ref + i;
+		if (ref->channel < 0) continue;
+		// token = 0: no token
+		ref->token = *cmd ? issueCommand(param->hp, ld + ref->channel, cmd, cw.fleet ? 0 : token) : token;
+	}
+
+	if (wait > 0 && !isCompleted(&cw)) {
+		if (wait > CMD_MAX_WAIT) wait = CMD_MAX_WAIT;
+		w = malloc(sizeof(COMMAND_WAIT));
+		memcpy(w, &cw, sizeof(COMMAND_WAIT));
+		w->deadline = GetTickCount64() + wait * 1000;
+		// freed by web server when connection is done
+		param->hs->ptr = w;
+		return FLAG_DATA_WAIT | FLAG_TO_FREE;
+	}
+	param->contentLength = genResults(param->pucBuffer, param->bufSize, &cw);
+	return FLAG_DATA_RAW;
+}
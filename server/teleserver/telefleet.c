@@ -0,0 +1,436 @@
+/******************************************************************************
+* Freematics Hub Server - Fleet Aggregates
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "httpd.h"
+#include "teleserver.h"
+#include "logdata.h"
+
+extern CHANNEL_DATA ld[];
+
+/*
+* Channel state counts and per-PID sum/count/min/max over running channels
+* are maintained as data is received (fleetUpdate) and as channels change
+* state (fleetSync), so that api/fleet does not visit every channel. Each
+* channel's contributed values are kept here to be withdrawn when replaced
+* or when the channel stops running. Extremes are kept in a min heap and a
+* max heap of channels per PID, which each channel knows its positions in,
+* so a changed or withdrawn value is resettled in O(log N).
+*
+* Last known positions are indexed in a grid of GRID_CELL_SIZE degree cells,
+* hashed into GRID_BUCKETS chains, so that a bounding box query visits only
+* the cells it covers and the vehicles in them.
+*/
+
+#define FLEET_PIDS (PID_MODES * 256)
+
+#define FLEET_STATE_NONE 0
+#define FLEET_STATE_RUNNING 1
+#define FLEET_STATE_PARKED 2
+#define FLEET_STATE_SLEEPING 3
+
+#define GRID_CELL_SIZE 0.1f /* degrees */
+#define GRID_BUCKETS 4096 /* power of 2 */
+#define NEARBY_MAX_RADIUS 100000 /* meters */
+
+#define HEAP_MIN 0
+#define HEAP_MAX 1
+
+typedef struct {
+	double sum;
+	uint32_t count;
+	int* heap[2]; /* channel indexes, allocated with first value */
+} FLEET_PID;
+
+typedef struct {
+	uint8_t state;
+	uint8_t located;
+	uint8_t indexed;
+	float lat;
+	float lng;
+	// grid cell and chain (channel index + 1, 0 for none)
+	int32_t cellLat;
+	int32_t cellLng;
+	int next;
+	int prev;
+	uint8_t has[FLEET_PIDS / 8];
+	float value[FLEET_PIDS];
+	int heapPos[2][FLEET_PIDS];
+} FLEET_CHANNEL;
+
+static FLEET_PID pids[FLEET_PIDS];
+static FLEET_CHANNEL fleet[MAX_CHANNELS];
+static uint32_t stateCount[4];
+static int grid[GRID_BUCKETS]; /* first channel index + 1 in each chain */
+
+static int parseValue(const char* s, float* v)
+{
+	char* end;
+	if (!*s) return 0;
+	*v = (float)strtod(s, &end);
+	return *end == 0;
+}
+
+// whether channel a goes above channel b in heap h of pid
+static int heapAbove(int pid, int h, int a, int b)
+{
+	float va = fleet[a].value[pid];
+	float vb = fleet[b].value[pid];
+	return h == HEAP_MIN ? va < vb : va > vb;
+}
+
+static void heapSet(int pid, int h, int pos, int ch)
+{
+	pids[pid].heap[h][pos] = ch;
+	fleet[ch].heapPos[h][pid] = pos;
+}
+
+// moves entry at pos to its place in heap of n entries
+static void heapSettle(int pid, int h, int pos, int n)
+{
+	int* heap = pids[pid].heap[h];
+	int ch = heap[pos];
+	while (pos > 0 && heapAbove(pid, h, ch, heap[(pos - 1) / 2])) {
+		heapSet(pid, h, pos, heap[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+	for (;;) {
+		int child = pos * 2 + 1;
+		if (child >= n) break;
+		if (child + 1 < n && heapAbove(pid, h, heap[child + 1], heap[child])) child++;
+		if (!heapAbove(pid, h, heap[child], ch)) break;
+		heapSet(pid, h, pos, heap[child]);
+		pos = child;
+	}
+	heapSet(pid, h, pos, ch);
+}
+
+static void addValue(FLEET_CHANNEL* fc, int pid, float v)
+{
+	FLEET_PID* fp = pids + pid;
+	int ch = (int)(fc - fleet);
+	if (!fp->heap[HEAP_MIN]) {
+		fp->heap[HEAP_MIN] = malloc(MAX_CHANNELS * sizeof(int));
+		fp->heap[HEAP_MAX] = malloc(MAX_CHANNELS * sizeof(int));
+	}
+	fp->sum += v;
+	fc->value[pid] = v;
+	fc->has[pid >> 3] |= 1 << (pid & 7);
+	for (int h = 0; h < 2; h++) {
+		heapSet(pid, h, fp->count, ch);
+		heapSettle(pid, h, fp->count, fp->count + 1);
+	}
+	fp->count++;
+}
+
+static void replaceValue(FLEET_CHANNEL* fc, int pid, float v)
+{
+	FLEET_PID* fp = pids + pid;
+	fp->sum += v - fc->value[pid];
+	fc->value[pid] = v;
+	for (int h = 0; h < 2; h++) {
+		heapSettle(pid, h, fc->heapPos[h][pid], fp->count);
+	}
+}
+
+static void withdrawValue(FLEET_CHANNEL* fc, int pid)
+{
+	FLEET_PID* fp = pids + pid;
+	fc->has[pid >> 3] &= ~(1 << (pid & 7));
+	if (--fp->count == 0) {
+		fp->sum = 0;
+		return;
+	}
+	fp->sum -= fc->value[pid];
+	for (int h = 0; h < 2; h++) {
+		// last entry takes the place of withdrawn one
+		int pos = fc->heapPos[h][pid];
+		if (pos == (int)fp->count) continue;
+		heapSet(pid, h, pos, fp->heap[h][fp->count]);
+		heapSettle(pid, h, pos, fp->count);
+	}
+}
+
+static void withdrawAll(FLEET_CHANNEL* fc)
+{
+	for (int pid = 0; pid < FLEET_PIDS; pid++) {
+		if (fc->has[pid >> 3] & (1 << (pid & 7))) withdrawValue(fc, pid);
+	}
+}
+
+static int32_t cellOf(float deg)
+{
+	return (int32_t)floorf(deg / GRID_CELL_SIZE);
+}
+
+static uint32_t cellHash(int32_t cellLat, int32_t cellLng)
+{
+	return ((uint32_t)cellLat * 73856093u ^ (uint32_t)cellLng * 19349663u) & (GRID_BUCKETS - 1);
+}
+
+static void gridRemove(int i)
+{
+	FLEET_CHANNEL* fc = fleet + i;
+	if (!fc->indexed) return;
+	if (fc->prev) {
+		fleet[fc->prev - 1].next = fc->next;
+	}
+	else {
+		grid[cellHash(fc->cellLat, fc->cellLng)] = fc->next;
+	}
+	if (fc->next) fleet[fc->next - 1].prev = fc->prev;
+	fc->indexed = 0;
+}
+
+static void gridPlace(int i)
+{
+	FLEET_CHANNEL* fc = fleet + i;
+	int32_t cellLat = cellOf(fc->lat);
+	int32_t cellLng = cellOf(fc->lng);
+	if (fc->indexed && fc->cellLat == cellLat && fc->cellLng == cellLng) return;
+	gridRemove(i);
+	uint32_t h = cellHash(cellLat, cellLng);
+	fc->cellLat = cellLat;
+	fc->cellLng = cellLng;
+	fc->prev = 0;
+	fc->next = grid[h];
+	if (fc->next) fleet[fc->next - 1].prev = i + 1;
+	grid[h] = i + 1;
+	fc->indexed = 1;
+}
+
+static int inBox(const FLEET_CHANNEL* fc, float minLat, float minLng, float maxLat, float maxLng)
+{
+	return fc->lat >= minLat && fc->lat <= maxLat && fc->lng >= minLng && fc->lng <= maxLng;
+}
+
+int fleetLocate(float minLat, float minLng, float maxLat, float maxLng, int* result, int maxResults)
+{
+	int32_t y0 = cellOf(minLat), y1 = cellOf(maxLat);
+	int32_t x0 = cellOf(minLng), x1 = cellOf(maxLng);
+	int n = 0;
+	if (y1 < y0 || x1 < x0) return 0;
+	if ((int64_t)(y1 - y0 + 1) * (x1 - x0 + 1) > GRID_BUCKETS) {
+		// box covers more cells than there are chains, each chain is visited once instead
+		for (int h = 0; h < GRID_BUCKETS && n < maxResults; h++) {
+			for (int i = grid[h]; i && n < maxResults; i = fleet[i - 1].next) {
+				if (ld[i - 1].id && inBox(fleet + i - 1, minLat, minLng, maxLat, maxLng)) result[n++] = i - 1;
+			}
+		}
+		return n;
+	}
+	for (int32_t y = y0; y <= y1; y++) {
+		for (int32_t x = x0; x <= x1; x++) {
+			for (int i = grid[cellHash(y, x)]; i && n < maxResults; i = fleet[i - 1].next) {
+				FLEET_CHANNEL* fc = fleet + i - 1;
+				// chain is shared with other cells of same hash
+				if (fc->cellLat != y || fc->cellLng != x) continue;
+				if (ld[i - 1].id && inBox(fc, minLat, minLng, maxLat, maxLng)) result[n++] = i - 1;
+			}
+		}
+	}
+	return n;
+}
+
+void fleetUpdate(CHANNEL_DATA* pld, int pid, const char* value)
+{
+	FLEET_CHANNEL* fc = fleet + (pld - ld);
+	float v;
+	int valid = parseValue(value, &v);
+	if (valid) {
+		if (pid == PID_GPS_LATITUDE) {
+			fc->lat = v;
+			fc->located |= 1;
+		}
+		else if (pid == PID_GPS_LONGITUDE) {
+			fc->lng = v;
+			fc->located |= 2;
+		}
+		if (fc->located == 3 && (pid == PID_GPS_LATITUDE || pid == PID_GPS_LONGITUDE)) {
+			gridPlace((int)(pld - ld));
+		}
+	}
+	// only running channels are aggregated
+	if (fc->state != FLEET_STATE_RUNNING || pid < 0 || pid >= FLEET_PIDS) return;
+	if (fc->has[pid >> 3] & (1 << (pid & 7))) {
+		if (valid) {
+			replaceValue(fc, pid, v);
+		}
+		else {
+			withdrawValue(fc, pid);
+		}
+	}
+	else if (valid) {
+		addValue(fc, pid, v);
+	}
+}
+
+void fleetSync(CHANNEL_DATA* pld)
+{
+	FLEET_CHANNEL* fc = fleet + (pld - ld);
+	uint8_t state = FLEET_STATE_NONE;
+	if (pld->id) {
+		if (pld->flags & FLAG_RUNNING) state = FLEET_STATE_RUNNING;
+		else if (pld->flags & FLAG_SLEEPING) state = FLEET_STATE_SLEEPING;
+		else state = FLEET_STATE_PARKED;
+	}
+	if (state == fc->state) return;
+	if (fc->state == FLEET_STATE_RUNNING) withdrawAll(fc);
+	if (fc->state != FLEET_STATE_NONE) stateCount[fc->state]--;
+	fc->state = state;
+	if (state != FLEET_STATE_NONE) stateCount[state]++;
+	if (state == FLEET_STATE_RUNNING) {
+		// values received before channel started running
+		for (int pid = 0; pid < FLEET_PIDS; pid++) {
+			PID_DATA* pd = &pld->mode[pid >> 8][pid & 0xff];
+			float v;
+			if (pd->ts && parseValue(pd->data, &v)) addValue(fc, pid, v);
+		}
+	}
+}
+
+void fleetRemove(CHANNEL_DATA* pld)
+{
+	FLEET_CHANNEL* fc = fleet + (pld - ld);
+	if (fc->state == FLEET_STATE_RUNNING) withdrawAll(fc);
+	if (fc->state != FLEET_STATE_NONE) stateCount[fc->state]--;
+	fc->state = FLEET_STATE_NONE;
+	fc->located = 0;
+	gridRemove((int)(pld - ld));
+}
+
+/*
+* api/fleet[?pid=10D,10C][&bbox=minLat,minLng,maxLat,maxLng]
+*/
+int uhFleet(UrlHandlerParam* param)
+{
+	int bs = param->bufSize;
+	char* buf = param->pucBuffer;
+	int l = 0;
+	const char* pidlist = mwGetVarValue(param->pxVars, "pid", 0);
+	const char* bbox = mwGetVarValue(param->pxVars, "bbox", 0);
+
+	l += snprintf(buf + l, bs - l, "{\"channels\":%u,\"running\":%u,\"parked\":%u,\"sleeping\":%u,\"pids\":[",
+		stateCount[FLEET_STATE_RUNNING] + stateCount[FLEET_STATE_PARKED] + stateCount[FLEET_STATE_SLEEPING],
+		stateCount[FLEET_STATE_RUNNING], stateCount[FLEET_STATE_PARKED] + stateCount[FLEET_STATE_SLEEPING],
+		stateCount[FLEET_STATE_SLEEPING]);
+	int n = 0;
+	for (int pid = 0; pid < FLEET_PIDS; pid++) {
+		if (pidlist) {
+			// only listed PIDs
+			const char* s = pidlist;
+			for (; *s; s++) {
+				if ((s == pidlist || *(s - 1) == ',') && hex2uint16(s) == pid) break;
+			}
+			if (!*s) continue;
+		}
+		FLEET_PID* fp = pids + pid;
+		if (fp->count == 0) continue;
+		float min = fleet[fp->heap[HEAP_MIN][0]].value[pid];
+		float max = fleet[fp->heap[HEAP_MAX][0]].value[pid];
+		l += snprintf(buf + l, bs - l, "%s[%u,%u,%.7g,%.7g,%.7g]", n++ ? "," : "", pid, fp->count, min, max, fp->sum / fp->count);
+	}
+	l += snprintf(buf + l, bs - l, "]");
+
+	float minLat, minLng, maxLat, maxLng;
+	if (bbox && sscanf(bbox, "%f,%f,%f,%f", &minLat, &minLng, &maxLat, &maxLng) == 4) {
+		uint32_t running = 0;
+		uint32_t parked = 0;
+		int* sel = malloc(MAX_CHANNELS * sizeof(int));
+		int count = fleetLocate(minLat, minLng, maxLat, maxLng, sel, MAX_CHANNELS);
+		l += snprintf(buf + l, bs - l, ",\"region\":{\"vehicles\":[");
+		for (int k = 0; k < count; k++) {
+			FLEET_CHANNEL* fc = fleet + sel[k];
+			if (fc->state == FLEET_STATE_RUNNING) running++; else parked++;
+			l += snprintf(buf + l, bs - l, "%s[\"%s\",%.6f,%.6f,%u]", k ? "," : "",
+				ld[sel[k]].devid, fc->lat, fc->lng, fc->state == FLEET_STATE_RUNNING ? 1 : 0);
+		}
+		free(sel);
+		l += snprintf(buf + l, bs - l, "],\"running\":%u,\"parked\":%u}", running, parked);
+	}
+	l += snprintf(buf + l, bs - l, "}");
+	param->contentLength = l;
+	param->contentType = HTTPFILETYPE_JSON;
+	return FLAG_DATA_RAW;
+}
+
+typedef struct {
+	int channel;
+	float distance;
+} NEARBY_ITEM;
+
+static int cmpDistance(const void* a, const void* b)
+{
+	float d = ((const NEARBY_ITEM*)a)->distance - ((const NEARBY_ITEM*)b)->distance;
+	return d < 0 ? -1 : (d > 0 ? 1 : 0);
+}
+
+/*
+* api/nearby?lat=LAT&lng=LNG[&radius=METERS][&limit=N]
+*/
+int uhNearby(UrlHandlerParam* param)
+{
+	int bs = param->bufSize;
+	char* buf = param->pucBuffer;
+	int l = 0;
+	const char* slat = mwGetVarValue(param->pxVars, "lat", 0);
+	const char* slng = mwGetVarValue(param->pxVars, "lng", 0);
+	int radius = mwGetVarValueInt(param->pxVars, "radius", 1000);
+	int limit = mwGetVarValueInt(param->pxVars, "limit", 100);
+	param->contentType = HTTPFILETYPE_JSON;
+	if (!slat || !slng || radius <= 0) {
+		param->contentLength = snprintf(buf, bs, "{\"error\":\"Invalid request\"}");
+		return FLAG_DATA_RAW;
+	}
+	if (radius > NEARBY_MAX_RADIUS) radius = NEARBY_MAX_RADIUS;
+	float lat = (float)atof(slat);
+	float lng = (float)atof(slng);
+	// bounding box of the circle, then exact distance (equirectangular approximation)
+	float scale = cosf(lat * (float)M_PI / 180);
+	float dlat = radius / 111320.0f;
+	float dlng = scale > 0.01f ? dlat / scale : 180;
+	int* sel = malloc(MAX_CHANNELS * sizeof(int));
+	NEARBY_ITEM* items = malloc(MAX_CHANNELS * sizeof(NEARBY_ITEM));
+	int count = fleetLocate(lat - dlat, lng - dlng, lat + dlat, lng + dlng, sel, MAX_CHANNELS);
+	int n = 0;
+	for (int k = 0; k < count; k++) {
+		FLEET_CHANNEL* fc = fleet + sel[k];
+		float dy = (fc->lat - lat) * 111320.0f;
+		float dx = (fc->lng - lng) * 111320.0f * scale;
+		float distance = sqrtf(dx * dx + dy * dy);
+		if (distance > radius) continue;
+		items[n].channel = sel[k];
+		items[n].distance = distance;
+		n++;
+	}
+	qsort(items, n, sizeof(NEARBY_ITEM), cmpDistance);
+	if (limit > 0 && n > limit) n = limit;
+	l += snprintf(buf + l, bs - l, "{\"vehicles\":[");
+	for (int k = 0; k < n; k++) {
+		FLEET_CHANNEL* fc = fleet + items[k].channel;
+		CHANNEL_DATA* pld = ld + items[k].channel;
+		l += snprintf(buf + l, bs - l, "%s{\"id\":%u,\"devid\":\"%s\",\"lat\":%.6f,\"lng\":%.6f,\"distance\":%u,\"parked\":%u}", k ? "," : "",
+			pld->id, pld->devid, fc->lat, fc->lng, (unsigned int)items[k].distance, fc->state == FLEET_STATE_RUNNING ? 0 : 1);
+	}
+	l += snprintf(buf + l, bs - l, "]}");
+	free(items);
+	free(sel);
+	param->contentLength = l;
+	return FLAG_DATA_RAW;
+}
@@ -0,0 +1,420 @@
+/******************************************************************************
+* Freematics Hub Server - Trip Catalogue
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "httpd.h"
+#include "teleserver.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <dirent.h>
+#endif
+
+extern CHANNEL_DATA ld[];
+extern char dataDir[];
+
+int loadMetaInfo(const char* file, uint32_t* duration, uint32_t* size);
+
+/*
+* Each device directory holds trips.idx, a header followed by one fixed-size
+* TRIP_ENTRY per data file sorted by start time, so a history query of any
+* length is a binary search and one read. An entry is appended when a data
+* file is created and stays open until the file is closed. Meta info (size
+* and duration) of a closed trip is filled in the first time it is listed
+* and served from the catalogue from then on.
+*
+* Devices with no catalogue yet, or one written for another META_REVISION,
+* get theirs rebuilt by crawling the device directory. Day directories are
+* shared out to a few threads which only list files and read existing meta
+* info; anything that still needs converting is left to the history query.
+*/
+
+#define TRIP_INDEX_FILE "trips.idx"
+#define TRIP_INDEX_MAGIC "TIDX"
+#define TRIP_CRAWL_THREADS 4
+#define TRIP_DAY_MAX_FILES 256
+#define TRIP_PATH_LEN 512
+
+typedef struct {
+	char magic[4];
+	uint32_t rev;
+} TRIP_INDEX_HEADER;
+
+typedef struct {
+	char path[TRIP_PATH_LEN];
+	uint32_t date;
+	TRIP_ENTRY* entries;
+	int count;
+} CRAWL_DAY;
+
+typedef struct {
+	CRAWL_DAY* days;
+	int count;
+	int next;
+#ifdef WIN32
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+} CRAWL_JOB;
+
+static uint64_t entryKey(uint32_t date, uint32_t time)
+{
+	return (uint64_t)date * 1000000 + time;
+}
+
+static int compareEntry(const void* a, const void* b)
+{
+	uint64_t x = entryKey(((const TRIP_ENTRY*)a)->date, ((const TRIP_ENTRY*)a)->time);
+	uint64_t y = entryKey(((const TRIP_ENTRY*)b)->date, ((const TRIP_ENTRY*)b)->time);
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static FILE* openIndex(const char* devid, const char* mode)
+{
+	char path[TRIP_PATH_LEN];
+	if (!checkDeviceID(devid)) return 0;
+	snprintf(path, sizeof(path), "%s/%s/%s", dataDir, devid, TRIP_INDEX_FILE);
+	FILE* fp = fopen(path, mode);
+	if (!fp) return 0;
+	TRIP_INDEX_HEADER hdr;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRIP_INDEX_MAGIC, 4) || hdr.rev != META_REVISION) {
+		fclose(fp);
+		return 0;
+	}
+	return fp;
+}
+
+static int entryCount(FILE* fp)
+{
+	fseek(fp, 0, SEEK_END);
+	return (ftell(fp) - sizeof(TRIP_INDEX_HEADER)) / sizeof(TRIP_ENTRY);
+}
+
+static int readEntry(FILE* fp, int index, TRIP_ENTRY* entry)
+{
+	fseek(fp, sizeof(TRIP_INDEX_HEADER) + index * sizeof(TRIP_ENTRY), SEEK_SET);
+	return fread(entry, sizeof(TRIP_ENTRY), 1, fp) == 1;
+}
+
+static void writeEntry(FILE* fp, int index, const TRIP_ENTRY* entry)
+{
+	fseek(fp, sizeof(TRIP_INDEX_HEADER) + index * sizeof(TRIP_ENTRY), SEEK_SET);
+	fwrite(entry, sizeof(TRIP_ENTRY), 1, fp);
+}
+
+// first entry starting at or after key
+static int lowerBound(FILE* fp, int count, uint64_t key)
+{
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		TRIP_ENTRY e;
+		if (!readEntry(fp, mid, &e)) break;
+		if (entryKey(e.date, e.time) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int saveIndex(const char* devid, TRIP_ENTRY* entries, int count)
+{
+	char path[TRIP_PATH_LEN];
+	char tmp[TRIP_PATH_LEN + 4];
+	if (!checkDeviceID(devid)) return -1;
+	snprintf(path, sizeof(path), "%s/%s/%s", dataDir, devid, TRIP_INDEX_FILE);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE* fp = fopen(tmp, "wb");
+	if (!fp) return -1;
+	TRIP_INDEX_HEADER hdr;
+	memcpy(hdr.magic, TRIP_INDEX_MAGIC, 4);
+	hdr.rev = META_REVISION;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	if (count) fwrite(entries, sizeof(TRIP_ENTRY), count, fp);
+	fclose(fp);
+	remove(path);
+	return rename(tmp, path);
+}
+
+// lists entries of a directory that are named with digits only and have the given length
+static int listDir(const char* path, int len, char names[][20], int max)
+{
+	int count = 0;
+#ifdef WIN32
+	char pattern[TRIP_PATH_LEN];
+	WIN32_FIND_DATA fd;
+	snprintf(pattern, sizeof(pattern), "%s\\*.*", path);
+	HANDLE h = FindFirstFile(pattern, &fd);
+	if (h == INVALID_HANDLE_VALUE) return 0;
+	do {
+		const char* name = fd.cFileName;
+#else
+	DIR* dir = opendir(path);
+	if (!dir) return 0;
+	struct dirent* de;
+	while (count < max && (de = readdir(dir))) {
+		const char* name = de->d_name;
+#endif
+		if ((int)strlen(name) != len) continue;
+		int i;
+		for (i = 0; i < len && name[i] >= '0' && name[i] <= '9'; i++);
+		if (i == len) strcpy(names[count++], name);
+#ifdef WIN32
+	} while (count < max && FindNextFile(h, &fd));
+	FindClose(h);
+#else
+	}
+	closedir(dir);
+#endif
+	return count;
+}
+
+static void crawlDay(CRAWL_DAY* day)
+{
+	day->entries = malloc(sizeof(TRIP_ENTRY) * TRIP_DAY_MAX_FILES);
+	day->count = 0;
+#ifdef WIN32
+	char pattern[TRIP_PATH_LEN];
+	WIN32_FIND_DATA fd;
+	snprintf(pattern, sizeof(pattern), "%s\\*.txt", day->path);
+	HANDLE h = FindFirstFile(pattern, &fd);
+	if (h == INVALID_HANDLE_VALUE) return;
+	do {
+		const char* name = fd.cFileName;
+#else
+	DIR* dir = opendir(day->path);
+	if (!dir) return;
+	struct dirent* de;
+	while (day->count < TRIP_DAY_MAX_FILES && (de = readdir(dir))) {
+		const char* name = de->d_name;
+#endif
+		// YYYYMMDD-HHMMSS.txt
+		if (strlen(name) != 19 || name[8] != '-' || strcmp(name + 15, ".txt")) continue;
+		if ((uint32_t)atoi(name) != day->date) continue;
+		TRIP_ENTRY* e = day->entries + day->count;
+		memset(e, 0, sizeof(TRIP_ENTRY));
+		e->date = day->date;
+		e->time = atoi(name + 9);
+		char path[TRIP_PATH_LEN];
+		struct stat st;
+		if (snprintf(path, sizeof(path), "%s/%s", day->path, name) >= (int)sizeof(path) || stat(path, &st) < 0) continue;
+		// meta info is only taken when it was generated from the file as it is now
+		uint32_t size = 0, duration = 0;
+		if (snprintf(path, sizeof(path), "%s/%.15s.json", day->path, name) < (int)sizeof(path) && loadMetaInfo(path, &duration, &size) == META_REVISION && size == (uint32_t)st.st_size) {
+			e->size = size;
+			e->duration = duration;
+			e->flags = TRIP_FLAG_META;
+		}
+		day->count++;
+#ifdef WIN32
+	} while (day->count < TRIP_DAY_MAX_FILES && FindNextFile(h, &fd));
+	FindClose(h);
+#else
+	}
+	closedir(dir);
+#endif
+}
+
+#ifdef WIN32
+static DWORD WINAPI crawlThread(LPVOID arg)
+#else
+static void* crawlThread(void* arg)
+#endif
+{
+	CRAWL_JOB* job = arg;
+	for (;;) {
+#ifdef WIN32
+		EnterCriticalSection(&job->lock);
+		int i = job->next++;
+		LeaveCriticalSection(&job->lock);
+#else
+		pthread_mutex_lock(&job->lock);
+		int i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+#endif
+		if (i >= job->count) break;
+		crawlDay(job->days + i);
+	}
+	return 0;
+}
+
+int tripIndexRebuild(const char* devid)
+{
+	char path[TRIP_PATH_LEN];
+	char years[64][20], months[12][20], days[31][20];
+	CRAWL_JOB job = { 0 };
+	int size = 0;
+
+	if (!checkDeviceID(devid)) return -1;
+	// collect day directories, the files in them are crawled by threads
+	if (snprintf(path, sizeof(path), "%s/%s", dataDir, devid) >= (int)sizeof(path)) return -1;
+	int ny = listDir(path, 4, years, 64);
+	for (int y = 0; y < ny; y++) {
+		if (snprintf(path, sizeof(path), "%s/%s/%s", dataDir, devid, years[y]) >= (int)sizeof(path)) continue;
+		int nm = listDir(path, 2, months, 12);
+		for (int m = 0; m < nm; m++) {
+			if (snprintf(path, sizeof(path), "%s/%s/%s/%s", dataDir, devid, years[y], months[m]) >= (int)sizeof(path)) continue;
+			int nd = listDir(path, 2, days, 31);
+			for (int d = 0; d < nd; d++) {
+				if (job.count == size) {
+					size += 64;
+					job.days = realloc(job.days, sizeof(CRAWL_DAY) * size);
+				}
+				CRAWL_DAY* day = job.days + job.count;
+				// skip directories whose path would be truncated
+				if (snprintf(day->path, sizeof(day->path), "%s/%s", path, days[d]) >= (int)sizeof(day->path)) continue;
+				day->date = atoi(years[y]) * 10000 + atoi(months[m]) * 100 + atoi(days[d]);
+				day->entries = 0;
+				day->count = 0;
+				job.count++;
+			}
+		}
+	}
+
+	int threads = job.count < TRIP_CRAWL_THREADS ? job.count : TRIP_CRAWL_THREADS;
+#ifdef WIN32
+	HANDLE tid[TRIP_CRAWL_THREADS];
+	InitializeCriticalSection(&job.lock);
+	for (int i = 0; i < threads; i++) tid[i] = CreateThread(NULL, 0, crawlThread, &job, 0, NULL);
+	for (int i = 0; i < threads; i++) {
+		WaitForSingleObject(tid[i], INFINITE);
+		CloseHandle(tid[i]);
+	}
+	DeleteCriticalSection(&job.lock);
+#else
+	pthread_t tid[TRIP_CRAWL_THREADS];
+	pthread_mutex_init(&job.lock, NULL);
+	for (int i = 0; i < threads; i++) pthread_create(&tid[i], NULL, crawlThread, &job);
+	for (int i = 0; i < threads; i++) pthread_join(tid[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+#endif
+
+	int count = 0;
+	for (int i = 0; i < job.count; i++) count += job.days[i].count;
+	TRIP_ENTRY* entries = malloc(sizeof(TRIP_ENTRY) * (count ? count : 1));
+	count = 0;
+	for (int i = 0; i < job.count; i++) {
+		if (job.days[i].count) memcpy(entries + count, job.days[i].entries, sizeof(TRIP_ENTRY) * job.days[i].count);
+		count += job.days[i].count;
+		free(job.days[i].entries);
+	}
+	free(job.days);
+	qsort(entries, count, sizeof(TRIP_ENTRY), compareEntry);
+
+	// the latest file is still being written if the device has one open
+	CHANNEL_DATA* pld = findChannelByDeviceID(devid);
+	if (count && pld && pld->fp) {
+		entries[count - 1].flags = TRIP_FLAG_OPEN;
+	}
+
+	saveIndex(devid, entries, count);
+	free(entries);
+	return count;
+}
+
+void tripIndexAdd(const char* devid, uint32_t date, uint32_t time)
+{
+	FILE* fp = openIndex(devid, "r+b");
+	// devices without catalogue get one built on first query, including this trip
+	if (!fp) return;
+	int count = entryCount(fp);
+	TRIP_ENTRY last;
+	TRIP_ENTRY e = { date, time, 0, 0, TRIP_FLAG_OPEN };
+	if (count == 0 || !readEntry(fp, count - 1, &last)) {
+		writeEntry(fp, 0, &e);
+		fclose(fp);
+		return;
+	}
+	uint64_t key = entryKey(date, time);
+	uint64_t lastKey = entryKey(last.date, last.time);
+	if (key == lastKey) {
+		// same file reopened
+		last.flags = TRIP_FLAG_OPEN;
+		writeEntry(fp, count - 1, &last);
+	} else if (key > lastKey) {
+		// previous trip has ended with the new one started
+		if (last.flags & TRIP_FLAG_OPEN) {
+			last.flags &= ~TRIP_FLAG_OPEN;
+			writeEntry(fp, count - 1, &last);
+		}
+		writeEntry(fp, count, &e);
+	} else {
+		// clock has gone backwards, keep entries in order
+		TRIP_ENTRY* entries = malloc(sizeof(TRIP_ENTRY) * (count + 1));
+		fseek(fp, sizeof(TRIP_INDEX_HEADER), SEEK_SET);
+		count = fread(entries, sizeof(TRIP_ENTRY), count, fp);
+		fclose(fp);
+		entries[count++] = e;
+		qsort(entries, count, sizeof(TRIP_ENTRY), compareEntry);
+		saveIndex(devid, entries, count);
+		free(entries);
+		return;
+	}
+	fclose(fp);
+}
+
+void tripIndexClose(const char* devid)
+{
+	FILE* fp = openIndex(devid, "r+b");
+	if (!fp) return;
+	int count = entryCount(fp);
+	TRIP_ENTRY e;
+	if (count > 0 && readEntry(fp, count - 1, &e) && (e.flags & TRIP_FLAG_OPEN)) {
+		e.flags &= ~TRIP_FLAG_OPEN;
+		writeEntry(fp, count - 1, &e);
+	}
+	fclose(fp);
+}
+
+int tripIndexRange(const char* devid, uint32_t beginDate, uint32_t beginTime, uint32_t endDate, uint32_t endTime, TRIP_ENTRY** entries, int* first)
+{
+	FILE* fp = openIndex(devid, "rb");
+	if (!fp) {
+		tripIndexRebuild(devid);
+		if (!(fp = openIndex(devid, "rb"))) return -1;
+	}
+	int count = entryCount(fp);
+	int lo = lowerBound(fp, count, entryKey(beginDate, beginTime));
+	int hi = lowerBound(fp, count, entryKey(endDate, endTime) + 1);
+	int n = hi - lo;
+	*first = lo;
+	*entries = 0;
+	if (n > 0) {
+		*entries = malloc(sizeof(TRIP_ENTRY) * n);
+		fseek(fp, sizeof(TRIP_INDEX_HEADER) + lo * sizeof(TRIP_ENTRY), SEEK_SET);
+		n = fread(*entries, sizeof(TRIP_ENTRY), n, fp);
+	}
+	fclose(fp);
+	return n > 0 ? n : 0;
+}
+
+void tripIndexUpdate(const char* devid, int index, const TRIP_ENTRY* entry)
+{
+	FILE* fp = openIndex(devid, "r+b");
+	if (!fp) return;
+	TRIP_ENTRY e;
+	// entry must not have been moved by a concurrent insertion
+	if (readEntry(fp, index, &e) && e.date == entry->date && e.time == entry->time) {
+		writeEntry(fp, index, entry);
+	}
+	fclose(fp);
+}
@@ -0,0 +1,353 @@
+/******************************************************************************
+* Freematics Hub Server - Proxy Forwarding (OsmAnd protocol, e.g. Traccar)
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "httpd.h"
+#include "teleserver.h"
+#include "telesink.h"
+#include "logdata.h"
+
+extern CHANNEL_DATA ld[];
+
+/*
+* Each channel keeps its own cursor into its data cache, so that every cache
+* entry is visited once no matter how many times the proxy server is served.
+* Channels with data not yet forwarded are kept in a FIFO queue and served in
+* turns of up to PROXY_BATCH_SIZE requests, which are pipelined as keep-alive
+* HTTP requests over all upstream connections. A channel always goes through
+* the same connection while it is up, so that its data arrives in order.
+*/
+
+#define PROXY_QUEUE_SIZE (MAX_CHANNELS * 2)
+#define PROXY_FIX_COMPLETE 0x7f
+
+typedef struct {
+	uint32_t inflight; /* requests sent or buffered but not yet responded */
+	uint64_t tick; /* time of last response or of first request when idle */
+	uint8_t connected;
+	uint8_t match; /* progress of matching response status line */
+	uint16_t status;
+} PROXY_CONN_STATE;
+
+typedef struct {
+	uint32_t requests;
+	uint32_t fixes;
+	uint32_t heartbeats;
+	uint32_t responses;
+	uint32_t errors; /* responses other than 2xx */
+	uint32_t lost; /* requests not responded when connection closed */
+	uint32_t stalls; /* turns deferred as pipeline was full */
+	uint32_t timeouts;
+} PROXY_STATS;
+
+static uint16_t queue[PROXY_QUEUE_SIZE]; /* channel indexes */
+static int queueHead = 0;
+static int queueCount = 0;
+static PROXY_CONN_STATE connState[PROXY_CONNECTIONS];
+static PROXY_STATS stats;
+
+void proxyNotify(CHANNEL_DATA* pld)
+{
+	if (pld->proxyQueued) return;
+	if (queueCount == PROXY_QUEUE_SIZE) return;
+	queue[(queueHead + queueCount) % PROXY_QUEUE_SIZE] = (uint16_t)(pld - ld);
+	queueCount++;
+	pld->proxyQueued = 1;
+}
+
+static int proxySinkWrite(SINK* sink, const SINK_BATCH* batch)
+{
+	proxyNotify(ld + batch->channel);
+	return 0;
+}
+
+// cache holds the data to forward, ingest only needs to queue the channel
+SINK proxySink = {
+	.name = "proxy",
+	.write = proxySinkWrite,
+	.flags = SINK_FLAG_INLINE,
+};
+
+void proxyReset(CHANNEL_DATA* pld)
+{
+	pld->proxyReadPos = pld->cacheReadPos;
+	memset(&pld->proxyFix, 0, sizeof(PROXY_FIX));
+}
+
+static CHANNEL_DATA* popChannel()
+{
+	CHANNEL_DATA* pld = ld + queue[queueHead];
+	queueHead = (queueHead + 1) % PROXY_QUEUE_SIZE;
+	queueCount--;
+	// entry left behind by a removed channel
+	if (!pld->proxyQueued) return 0;
+	pld->proxyQueued = 0;
+	return pld->id ? pld : 0;
+}
+
+static uint32_t ringDistance(CHANNEL_DATA* pld, uint32_t from, uint32_t to)
+{
+	return (to + pld->cacheSize - from) % pld->cacheSize;
+}
+
+static int hasPending(CHANNEL_DATA* pld)
+{
+	return pld->proxyReadPos != pld->cacheWritePos || pld->proxyFix.mask == PROXY_FIX_COMPLETE || (pld->flags & FLAG_PINGED);
+}
+
+static void updateFix(PROXY_FIX* fix, CACHE_DATA* d)
+{
+	switch (d->pid) {
+	case PID_GPS_DATE:
+		fix->date = atol(d->data);
+		fix->mask |= 0x1;
+		break;
+	case PID_GPS_TIME:
+		fix->time = atol(d->data);
+		fix->mask |= 0x2;
+		break;
+	case PID_GPS_LATITUDE:
+		fix->lat = (float)atof(d->data);
+		fix->mask |= 0x4;
+		break;
+	case PID_GPS_LONGITUDE:
+		fix->lng = (float)atof(d->data);
+		fix->mask |= 0x8;
+		break;
+	case PID_GPS_ALTITUDE:
+		fix->alt = (float)atof(d->data);
+		fix->mask |= 0x10;
+		break;
+	case PID_GPS_SPEED:
+		fix->speed = (float)atof(d->data);
+		fix->mask |= 0x20;
+		break;
+	case PID_GPS_HEADING:
+		fix->heading = atoi(d->data);
+		fix->mask |= 0x40;
+		break;
+	case PID_GPS_HDOP:
+		fix->hdop = atoi(d->data);
+		break;
+	}
+}
+
+static int genFixRequest(char* buf, int bufsize, CHANNEL_DATA* pld)
+{
+	PROXY_FIX* fix = &pld->proxyFix;
+	char isoTime[26];
+	char* p = isoTime + sprintf(isoTime, "%04u-%02u-%02uT%02u:%02u:%02u",
+		(unsigned int)(fix->date % 100) + 2000, (unsigned int)(fix->date / 100) % 100, (unsigned int)(fix->date / 10000),
+		(unsigned int)(fix->time / 1000000), (unsigned int)(fix->time % 1000000) / 10000, (unsigned int)(fix->time % 10000) / 100);
+	unsigned char tenth = (fix->time % 100) / 10;
+	if (tenth) p += sprintf(p, ".%c00", '0' + tenth);
+	*p = 'Z';
+	*(p + 1) = 0;
+	stats.fixes++;
+	return snprintf(buf, bufsize, "GET ?id=%s&timestamp=%s&lat=%f&lon=%f&altitude=%.1f&speed=%.2f&heading=%d&hdop=%.1f HTTP/1.1\r\nConnection: keep-alive\r\n\r\n",
+		pld->devid, isoTime, fix->lat, fix->lng, fix->alt, fix->speed / 1.852f, fix->heading, (float)fix->hdop / 10);
+}
+
+static int genHeartbeatRequest(char* buf, int bufsize, CHANNEL_DATA* pld)
+{
+	stats.heartbeats++;
+	return snprintf(buf, bufsize, "GET ?id=%s HTTP/1.1\r\nConnection: keep-alive\r\n\r\n", pld->devid);
+}
+
+static int forwardChannel(CHANNEL_DATA* pld, char* buf, int bufsize, int maxRequests, int* requests)
+{
+	PROXY_FIX* fix = &pld->proxyFix;
+	uint32_t readPos = pld->proxyReadPos;
+	int consumed = 0;
+	int len = 0;
+	int n = 0;
+
+	if (ringDistance(pld, pld->cacheReadPos, readPos) > ringDistance(pld, pld->cacheReadPos, pld->cacheWritePos)) {
+		// cursor no longer within cached data
+		readPos = pld->cacheReadPos;
+		fix->mask = 0;
+	}
+	while (n < maxRequests && bufsize - len >= PROXY_MAX_REQUEST_LEN) {
+		if (readPos == pld->cacheWritePos) {
+			// end of cached data
+			if (fix->mask == PROXY_FIX_COMPLETE) {
+				len += genFixRequest(buf + len, bufsize - len, pld);
+				fix->mask = 0;
+				n++;
+			}
+			break;
+		}
+		CACHE_DATA* d = pld->cache + readPos;
+		if (d->ts != fix->ts) {
+			// new time stamp, forward complete set of GPS data
+			if (fix->mask == PROXY_FIX_COMPLETE) {
+				len += genFixRequest(buf + len, bufsize - len, pld);
+				fix->mask = 0;
+				n++;
+			}
+			fix->ts = d->ts;
+		}
+		updateFix(fix, d);
+		readPos = (readPos + 1) % pld->cacheSize;
+		consumed++;
+	}
+	pld->proxyReadPos = readPos;
+
+	if (n == 0 && (consumed || (pld->flags & FLAG_PINGED)) && bufsize - len >= PROXY_MAX_REQUEST_LEN) {
+		// no complete set of GPS data but device is alive
+		len += genHeartbeatRequest(buf + len, bufsize - len, pld);
+		n++;
+	}
+	if (n) pld->flags &= ~FLAG_PINGED;
+	*requests = n;
+	return len;
+}
+
+static int servedBy(CHANNEL_DATA* pld, int conn)
+{
+	int home = (int)(pld - ld) % PROXY_CONNECTIONS;
+	return home == conn || !connState[home].connected;
+}
+
+static int genRequests(int conn, char* buf, int bufsize, uint64_t tick)
+{
+	PROXY_CONN_STATE* pc = connState + conn;
+	int len = 0;
+	int total = 0;
+	// each queued channel is served at most once in a turn
+	for (int i = queueCount; i > 0 && queueCount > 0; i--) {
+		int budget = PROXY_MAX_PIPELINE - (int)pc->inflight - total;
+		if (budget <= 0 || bufsize - len < PROXY_MAX_REQUEST_LEN) break;
+		CHANNEL_DATA* pld = popChannel();
+		if (!pld) continue;
+		if (!servedBy(pld, conn)) {
+			proxyNotify(pld);
+			continue;
+		}
+		int requests = 0;
+		len += forwardChannel(pld, buf + len, bufsize - len, budget < PROXY_BATCH_SIZE ? budget : PROXY_BATCH_SIZE, &requests);
+		total += requests;
+		// channel with more data goes to the end of queue
+		if (hasPending(pld)) proxyNotify(pld);
+	}
+	if (total) {
+		if (pc->inflight == 0) pc->tick = tick;
+		pc->inflight += total;
+		stats.requests += total;
+	}
+	return len;
+}
+
+static void parseResponses(PROXY_CONN_STATE* pc, const char* buf, int len, uint64_t tick)
+{
+	// count status lines ("HTTP/1.x nnn") which may be split across receptions
+	static const char prefix[] = "HTTP/1.";
+	for (int i = 0; i < len; i++) {
+		char c = buf[i];
+		if (pc->match < sizeof(prefix) - 1) {
+			pc->match = (c == prefix[pc->match]) ? pc->match + 1 : (c == prefix[0]);
+		}
+		else if (pc->match == sizeof(prefix) - 1) {
+			// minor version
+			pc->match++;
+		}
+		else if (pc->match == sizeof(prefix)) {
+			pc->match = (c == ' ') ? pc->match + 1 : 0;
+			pc->status = 0;
+		}
+		else if (isdigit(c)) {
+			pc->status = pc->status * 10 + (c - '0');
+			if (++pc->match == sizeof(prefix) + 4) {
+				stats.responses++;
+				if (pc->inflight) pc->inflight--;
+				pc->tick = tick;
+				if (pc->status < 200 || pc->status >= 300) {
+					stats.errors++;
+					fprintf(stderr, "Proxy server responded %u\n", pc->status);
+				}
+				pc->match = 0;
+			}
+		}
+		else {
+			pc->match = 0;
+		}
+	}
+}
+
+int phData(void* _hp, int conn, int op, char* buf, int len)
+{
+	PROXY_CONN_STATE* pc = connState + conn;
+	uint64_t tick = GetTickCount64();
+	switch (op) {
+	case PROXY_DATA_REQUESTED:
+		pc->connected = 1;
+		if (pc->inflight && tick - pc->tick > PROXY_RESPONSE_TIMEOUT) {
+			// proxy server not responding, have the connection reset
+			fprintf(stderr, "Proxy server response timeout (%u pending)\n", pc->inflight);
+			stats.timeouts++;
+			return -1;
+		}
+		if (pc->inflight >= PROXY_MAX_PIPELINE) {
+			if (queueCount) stats.stalls++;
+			return 0;
+		}
+		return genRequests(conn, buf, len, tick);
+	case PROXY_DATA_RECEIVED:
+		parseResponses(pc, buf, len, tick);
+		break;
+	case PROXY_CONN_CLOSED:
+		stats.lost += pc->inflight;
+		memset(pc, 0, sizeof(PROXY_CONN_STATE));
+		break;
+	}
+	return 0;
+}
+
+int uhProxy(UrlHandlerParam* param)
+{
+	HttpParam* hp = param->hp;
+	uint64_t tick = GetTickCount64();
+	int bs = param->bufSize;
+	char* buf = param->pucBuffer;
+	int l = 0;
+
+	l += snprintf(buf + l, bs - l, "{\"enabled\":%u,\"connections\":[", (hp->flags & FLAG_ENABLE_PROXY) ? 1 : 0);
+	for (int i = 0; i < PROXY_CONNECTIONS; i++) {
+		PROXY_CONN_STATE* pc = connState + i;
+		l += snprintf(buf + l, bs - l, "%s{\"connected\":%u,\"inflight\":%u,\"age\":%u}", i ? "," : "",
+			hp->proxyConn[i].socket ? 1 : 0, pc->inflight, pc->inflight ? (unsigned int)(tick - pc->tick) : 0);
+	}
+	l += snprintf(buf + l, bs - l, "],\"queued\":%d,\"requests\":%u,\"fixes\":%u,\"heartbeats\":%u,\"responses\":%u,\"errors\":%u,\"lost\":%u,\"stalls\":%u,\"timeouts\":%u,\"channels\":[",
+		queueCount, stats.requests, stats.fixes, stats.heartbeats, stats.responses, stats.errors, stats.lost, stats.stalls, stats.timeouts);
+	int n = 0;
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		CHANNEL_DATA* pld = ld + i;
+		if (!pld->id || !pld->cache) continue;
+		uint32_t readPos = pld->proxyReadPos;
+		uint32_t pending = ringDistance(pld, readPos, pld->cacheWritePos);
+		if (ringDistance(pld, pld->cacheReadPos, readPos) > ringDistance(pld, pld->cacheReadPos, pld->cacheWritePos)) {
+			pending = ringDistance(pld, pld->cacheReadPos, pld->cacheWritePos);
+		}
+		l += snprintf(buf + l, bs - l, "%s{\"id\":%u,\"devid\":\"%s\",\"pending\":%u,\"dropped\":%u}", n++ ? "," : "",
+			pld->id, pld->devid, pending, pld->proxyDropped);
+	}
+	l += snprintf(buf + l, bs - l, "]}");
+	param->contentLength = l;
+	param->contentType = HTTPFILETYPE_JSON;
+	return FLAG_DATA_RAW;
+}
@@ -23,6 +23,7 @@
 #include "data2kml.h"
 #include "httpd.h"
 #include "teleserver.h"
+#include "telesink.h"
 #include "logdata.h"
 #include "processpil.h"
 #include "revision.h"
@@ -41,7 +42,11 @@ int uhTrip(UrlHandlerParam* param);
 int uhHistory(UrlHandlerParam* param);
 int uhData(UrlHandlerParam* param);
 int uhQuery(UrlHandlerParam* param);
-int phData(void* _hp, int op, char* buf, int len);
+int uhProxy(UrlHandlerParam* param);
+int uhSinks(UrlHandlerParam* param);
+int uhFleet(UrlHandlerParam* param);
+int uhNearby(UrlHandlerParam* param);
+int phData(void* _hp, int conn, int op, char* buf, int len);
 
 UrlHandler urlHandlerList[]={
 	{"api/post", uhPost},
@@ -56,6 +61,10 @@ UrlHandler urlHandlerList[]={
 	{"api/data", uhData},
 	{"api/trip", uhTrip },
 	{"api/history", uhHistory },
+	{"api/proxy", uhProxy },
+	{"api/sinks", uhSinks },
+	{"api/fleet", uhFleet },
+	{"api/nearby", uhNearby },
 	{"api/test", uhTest},
 	{NULL},
 };
@@ -154,6 +163,17 @@ int checkVIN(const char* vin)
 	return n >= 8;
 }
 
+// device ID is used in data file paths so only letters and digits are accepted
+int checkDeviceID(const char* devid)
+{
+	if (!devid) return 0;
+	int n = 0;
+	for (const char *p = devid; *p; p++, n++) {
+		if (!isalpha(*p) && !isdigit(*p)) return 0;
+	}
+	return n >= MIN_DEVID_LEN && n <= MAX_DEVID_LEN;
+}
+
 CHANNEL_DATA* findChannelByID(uint32_t id)
 {
 	if (id) {
@@ -191,8 +211,14 @@ void initChannel(CHANNEL_DATA* pld, int cacheSize)
 	pld->recvCount = 0;
 	pld->txCount = 0;
 	pld->dataReceived = 0;
-	pld->proxyTick = 0;
+	pld->proxyDropped = 0;
+	pld->proxyQueued = 0;
+	proxyReset(pld);
+	// delta references are not kept across restarts
+	pld->delta.valid = 0;
 	memset(pld->cmd, 0, sizeof(pld->cmd));
+	// devices remember recent command tokens, a recreated channel must not reuse them
+	pld->cmdCount = ((uint32_t)(rand() & 0x7fff) << 15) | (rand() & 0x7fff);
 }
 
 CHANNEL_DATA* findEmptyChannel()
@@ -223,8 +249,12 @@ CHANNEL_DATA* findEmptyChannel()
 
 void removeChannel(CHANNEL_DATA* pld)
 {
+	fleetRemove(pld);
 	if (pld->cache) free(pld->cache);
-	if (pld->fp) fclose(pld->fp);
+	if (pld->fp) {
+		fclose(pld->fp);
+		tripIndexClose(pld->devid);
+	}
 	memset(pld, 0, sizeof(CHANNEL_DATA));
 }
 
@@ -285,6 +315,10 @@ FILE* createDataFile(CHANNEL_DATA* pld)
 			btm->tm_min,
 			btm->tm_sec);
 		pld->fp = fopen(filename, "a+");
+		if (pld->fp) {
+			tripIndexAdd(pld->devid, (btm->tm_year + 1900) * 10000 + (btm->tm_mon + 1) * 100 + btm->tm_mday,
+				btm->tm_hour * 10000 + btm->tm_min * 100 + btm->tm_sec);
+		}
 		return pld->fp;
 	}
 	return NULL;
@@ -294,7 +328,8 @@ void deviceLogin(CHANNEL_DATA* pld)
 {
 	pld->flags |= FLAG_RUNNING;
 	pld->flags &= ~FLAG_SLEEPING;
-	pld->proxyTick = 0;
+	// GPS values of previous session are not combined with new ones
+	pld->proxyFix.mask = 0;
 	// clear stats
 	pld->dataReceived = 0;
 	pld->recvCount = 0;
@@ -314,6 +349,7 @@ void deviceLogout(CHANNEL_DATA* pld)
 		fclose(pld->fp);
 		pld->fp = 0;
 	}
+	tripIndexClose(pld->devid);
 	fprintf(getLogFile(), " LOGOUT:%s\n", pld->devid);
 }
 
@@ -331,6 +367,7 @@ int processPayload(char* payload, CHANNEL_DATA* pld, int store)
 	char *p = payload;
 	uint32_t ts = 0;
 	int count = 0;
+	uint32_t stored = 0; /* samples cached since start or last cache reset */
 	do {
 		int pid = hex2uint16(p);
 		if (pid == -1) {
@@ -361,6 +398,8 @@ int processPayload(char* payload, CHANNEL_DATA* pld, int store)
 		if (m < PID_MODES) {
 			pld->mode[m][index].ts = ts;
 			memcpy(pld->mode[m][index].data, value, len + 1);
+			pld->mode[m][index].data[len] = 0;
+			fleetUpdate(pld, pid, pld->mode[m][index].data);
 			// collect some stats
 			switch (pid) {
 			case PID_CSQ: /* signal strength */
@@ -377,6 +416,8 @@ int processPayload(char* payload, CHANNEL_DATA* pld, int store)
 			// clear cache as data looks staled
 			pld->cacheReadPos = 0;
 			pld->cacheWritePos = 0;
+			proxyReset(pld);
+			stored = 0;
 		}
 		CACHE_DATA *d = &pld->cache[pld->cacheWritePos];
 		d->ts = ts;
@@ -384,14 +425,32 @@ int processPayload(char* payload, CHANNEL_DATA* pld, int store)
 		d->len = (uint8_t)len;
 		memcpy(d->data, value, len);
 		d->data[len] = 0;
+		stored++;
 		// adjust cache pointers
 		pld->cacheWritePos = (pld->cacheWritePos + 1) % pld->cacheSize;
 		if (pld->cacheWritePos == pld->cacheReadPos) {
 			// if write pos catch up with read pos (one lap ahead)
 			// move forward read pos to discard just overwrited data
+			if (pld->proxyReadPos == pld->cacheReadPos) {
+				// the discarded data has not been forwarded yet
+				pld->proxyReadPos = (pld->proxyReadPos + 1) % pld->cacheSize;
+				pld->proxyDropped++;
+			}
 			pld->cacheReadPos = (pld->cacheReadPos + 1) % pld->cacheSize;
 		}
 	} while (p && *p);
+	// hand newly cached data to sinks
+	if (stored) sinkPublish(pld, stored);
+	if (ts && pld->protocol >= 3 && pld->delta.valid) {
+		// values omitted by delta encoding remain as last received
+		for (int i = 0; i < pld->delta.count; i++) {
+			uint16_t pid = pld->delta.ref[i].pid;
+			int m = pid >> 8;
+			if (m < PID_MODES && pld->mode[m][(uint8_t)pid].ts) {
+				pld->mode[m][(uint8_t)pid].ts = ts;
+			}
+		}
+	}
 	if (ts == 0) ts = pld->deviceTick;
 	int interval = ts - pld->deviceTick;
 	if (ts) pld->deviceTick = ts;
@@ -416,6 +475,7 @@ int processPayload(char* payload, CHANNEL_DATA* pld, int store)
 	}
 
 	pld->recvCount++;
+	fleetSync(pld);
 
 	printf("[%u] #%u %u bytes | Samples:%u | Device Tick:%u\n", pld->id, pld->recvCount, pld->dataReceived, count, pld->deviceTick);
 	return count;
@@ -425,6 +485,7 @@ void __inline setPIDData(CHANNEL_DATA* pld, int mode, int pid, uint32_t ts, cons
 {
 	pld->mode[mode][pid].ts = ts;
 	strncpy(pld->mode[mode][pid].data, data, MAX_PID_DATA_LEN - 1);
+	fleetUpdate(pld, (mode << 8) | pid, pld->mode[mode][pid].data);
 }
 
 void SaveChannels()
@@ -489,6 +550,9 @@ void CheckChannels()
 				pld->flags &= ~FLAG_RUNNING;
 			}
 		}
+		fleetSync(pld);
+		// retransmit or expire pending commands
+		flushCommands(&httpParam, pld, tick);
 	}
 }
 
@@ -611,13 +675,13 @@ int uhChannels(UrlHandlerParam* param)
 	int bs = param->bufSize;
 	char* buf = param->pucBuffer;
 	int l = 0;
-	int n = 0;
 	const char *cmd = mwGetVarValue(param->pxVars, "cmd", 0);
 	int data = mwGetVarValueInt(param->pxVars, "data", 0);
 	int extend = mwGetVarValueInt(param->pxVars, "extend", 0);
 	int id = mwGetVarValueInt(param->pxVars, "id", 0);
 	unsigned int refresh = mwGetVarValueInt(param->pxVars, "refresh", MAX_CHANNEL_AGE);
 	const char *devid = mwGetVarValue(param->pxVars, "devid", 0);
+	const char *bbox = mwGetVarValue(param->pxVars, "bbox", 0);
 
 	const char *req = param->pucRequest;
 	if (!strncmp(req, "/data", 5)) {
@@ -644,8 +708,16 @@ int uhChannels(UrlHandlerParam* param)
 	if (!devid) {
 		l += snprintf(buf + l, bs - l, "{\"channels\":[");
 	}
-	for (n = 0; n < MAX_CHANNELS; n++) {
-		CHANNEL_DATA* pld = ld + n;
+	int* sel = 0;
+	int count = MAX_CHANNELS;
+	float minLat, minLng, maxLat, maxLng;
+	if (bbox && sscanf(bbox, "%f,%f,%f,%f", &minLat, &minLng, &maxLat, &maxLng) == 4) {
+		// only channels last located in bounding box
+		sel = malloc(MAX_CHANNELS * sizeof(int));
+		count = fleetLocate(minLat, minLng, maxLat, maxLng, sel, MAX_CHANNELS);
+	}
+	for (int k = 0; k < count; k++) {
+		CHANNEL_DATA* pld = ld + (sel ? sel[k] : k);
 		if (!pld->id) continue;
 		if (devid && strcmp(pld->devid, devid)) continue;
 		if (id == 0 || pld->id == id) {
@@ -689,6 +761,7 @@ int uhChannels(UrlHandlerParam* param)
 			l += snprintf(buf + l, bs - l, "},");
 		}
 	}
+	if (sel) free(sel);
 
 	if (l == 0) {
 		l += snprintf(buf + l, bs - l, "{}");
@@ -733,6 +806,7 @@ CHANNEL_DATA* assignChannel(const char* devid)
 	// clear history data cache
 	pld->cacheReadPos = 0;
 	pld->cacheWritePos = 0;
+	proxyReset(pld);
 	// clear instance data cache
 	memset(pld->mode, 0, sizeof(pld->mode));
 	// clear stats
@@ -925,58 +999,6 @@ int isNum(const char* s)
 	return 1;
 }
 
-int uhCommand(UrlHandlerParam* param)
-{
-	CHANNEL_DATA *pld = locateChannel(param);
-	if (!pld) {
-		param->hs->response.statusCode = 403;
-		param->contentLength = 0;
-		return FLAG_DATA_RAW;
-	}
-
-	char* cmd = mwGetVarValue(param->pxVars, "cmd", "");
-	uint32_t token = mwGetVarValueInt(param->pxVars, "token", 0);
-	param->contentType = HTTPFILETYPE_JSON;
-
-	if (!*cmd && !token) {
-		param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"failed\",\"error\":\"Invalid request\"}");
-		return FLAG_DATA_RAW;
-	}
-	pld->serverDataTick = GetTickCount64();
-	if (*cmd) {
-		// token = 0: no token
-		token = issueCommand(param->hp, pld, cmd, token);
-		if (token) {
-			param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"pending\",\"token\":%u}", token);
-		}
-		else {
-			param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"failed\",\"error\":\"Command unsent\"}");
-		}
-	}
-	else {
-		COMMAND_BLOCK* cb = 0;
-		int i;
-		for (i = 0; i < MAX_PENDING_COMMANDS; i++) {
-			if (pld->cmd[i].token == token) {
-				cb = pld->cmd + i;
-				break;
-			}
-		}
-		if (!cb) {
-			param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"failed\",\"error\":\"Invalid token\"}");
-		}
-		else if (!(cb->flags & CMD_FLAG_RESPONDED)) {
-			param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"pending\",\"elapsed\":%u}", (unsigned int)(cb->tick - pld->serverDataTick));
-		}
-		else {
-			param->contentLength = snprintf(param->pucBuffer, param->bufSize, "{\"result\":\"done\",\"idx\":%u,\"elapsed\":%u,\"data\":\"%s\"}",
-				i, (unsigned int)cb->elapsed, cb->message);
-			cb->flags |= CMD_FLAG_CHECKED;
-		}
-	}
-	return FLAG_DATA_RAW;
-}
-
 int uhNotify(UrlHandlerParam* param)
 {
 	char* vin = mwGetVarValue(param->pxVars, "VIN", 0);
@@ -1019,7 +1041,6 @@ int uhNotify(UrlHandlerParam* param)
 		}
 		pld->devflags = devflags;
 		pld->sessionStartTick = tick;
-		pld->proxyTick = 0;
 		pld->serverDataTick = tick;
 		pld->ip = param->hs->ipAddr;
 		deviceLogin(pld);
@@ -1143,6 +1164,7 @@ int main(int argc,char* argv[])
 	signal(SIGTERM, (void *) ServerQuit);
 	signal(SIGPIPE, SIG_IGN);
 #endif
+	srand((unsigned int)time(NULL));
 
 	//fill in default settings
 	char path[256];
@@ -1193,6 +1215,8 @@ int main(int argc,char* argv[])
 						"	-M	: specifiy max clients per IP\n"
 						"	-n	: specifiy HTTP authentication user name for remote access [default: admin]\n"
 						"	-w	: specifiy HTTP authentication password for remote access\n"
+						"	-j	: stream data as JSON lines to subscribers of specified TCP port or Unix socket path\n"
+						"	-c	: write data to CSV files in specified directory\n"
 						"	-g	: do not launch GUI\n\n");
 					fflush(stderr);
 					exit(1);
@@ -1227,6 +1251,12 @@ int main(int argc,char* argv[])
 				case 'w':
 					if (++i < argc) strncpy(password, argv[i], sizeof(password) - 1);
 					break;
+				case 'j':
+					if (++i < argc) jsonSink.target = argv[i];
+					break;
+				case 'c':
+					if (++i < argc) csvSink.target = argv[i];
+					break;
 				}
 			}
 		}
@@ -1250,6 +1280,10 @@ int main(int argc,char* argv[])
 	memset(ld, 0, sizeof(ld));
 	LoadChannels();
 
+	sinkAdd(&proxySink);
+	if (jsonSink.target) sinkAdd(&jsonSink);
+	if (csvSink.target) sinkAdd(&csvSink);
+
 	if (mwServerStart(&httpParam)) {
 		printf("Error starting HTTP server on port %u\nPress ENTER to exit\n", httpParam.httpPort);
 		return -1;
@@ -1280,6 +1314,7 @@ int main(int argc,char* argv[])
 		return 0;
 	}
 
+	sinkCloseAll();
 	mwServerExit(&httpParam);
 	return 0;
 }
@@ -17,10 +17,10 @@
 #define MAX_CHANNELS 16
 #endif
 
-#define META_REVISION 1
+#define META_REVISION 3
 
 #define MAX_CHANNEL_AGE (60* 60 * 1000 * 72)
-#define MAX_PENDING_COMMANDS 4
+#define MAX_PENDING_COMMANDS 16
 #define MAX_COMMAND_MSG_LEN 128
 #define SYNC_INTERVAL 30 /* seconds*/
 #define CHANNEL_TIMEOUT 180 /* seconds */
@@ -37,7 +37,17 @@
 #define CACHE_MAX_SIZE (10 * 1024 * 1024)
 #define MAX_PID_DATA_LEN 24
 #define MIN_LOGIN_INTERVAL 30000
-#define PROXY_MAX_TIME_BEHIND 1000
+// proxy forwarding
+#define PROXY_BATCH_SIZE 16 /* requests per channel before serving next channel */
+#define PROXY_MAX_PIPELINE 64 /* unanswered requests per upstream connection */
+#define PROXY_MAX_REQUEST_LEN 320
+#define PROXY_RESPONSE_TIMEOUT 30000 /* ms */
+// command delivery
+#define CMD_RETRANSMIT_INTERVAL 2000 /* ms, doubled on each retransmission */
+#define CMD_MAX_RETRIES 4
+#define CMD_PIGGYBACK_WAIT 1500 /* ms a command waits for a sync reply to carry it */
+#define CMD_DATAGRAM_SIZE 240 /* device receive buffer is 256 bytes */
+#define CMD_MAX_WAIT 60 /* seconds an HTTP request may wait for command results */
 
 #define EVENT_LOGIN 1
 #define EVENT_LOGOUT 2
@@ -46,6 +56,26 @@
 #define EVENT_COMMAND 5
 #define EVENT_ACK 6
 #define EVENT_PING 7
+#define EVENT_BACKLOG 8
+
+// binary data protocol (v2)
+#define PROTOCOL_V2_MAGIC 0xB2
+#define BIN_TYPE_INT 0 /* zigzag varint */
+#define BIN_TYPE_UINT 1 /* varint */
+#define BIN_TYPE_FIXED2 2 /* zigzag varint of value x 100 */
+#define BIN_TYPE_FIXED6 3 /* zigzag varint of value x 1000000 */
+#define BIN_TYPE_TRIPLE 4 /* 3 zigzag varints */
+#define BIN_TYPE_TS_DELTA 5 /* zigzag varint of delta from previous timestamp */
+#define BIN_TYPE_TEXT 6 /* varint length and characters, never delta encoded */
+
+// delta data protocol (v3)
+#define PROTOCOL_V3_MAGIC 0xB3
+#define DELTA_FLAG_KEYFRAME 0x1
+#define DELTA_MAX_PIDS 64 /* must match device */
+
+// store-and-forward backlog packet
+#define BACKLOG_MAGIC 0xBA
+#define BACKLOG_DEDUP_WINDOW 1024 /* packets */
 
 typedef enum {
 	DEVICE_VEHICLE = 0,
@@ -66,16 +96,47 @@ typedef struct {
 	char data[MAX_PID_DATA_LEN];
 } CACHE_DATA;
 
+typedef struct {
+	uint32_t ts;
+	uint32_t date;
+	uint32_t time;
+	float lat;
+	float lng;
+	float alt;
+	float speed;
+	int heading;
+	int hdop;
+	uint8_t mask;
+} PROXY_FIX;
+
+typedef struct {
+	uint16_t pid;
+	int32_t value[3];
+} DELTA_REF;
+
+typedef struct {
+	uint32_t ts;
+	uint8_t seq;
+	uint8_t valid;
+	uint16_t count;
+	DELTA_REF ref[DELTA_MAX_PIDS];
+} DELTA_STATE;
+
 #define CMD_FLAG_RESPONDED 1
 #define CMD_FLAG_CHECKED 2
+#define CMD_FLAG_EXPIRED 4
+#define CMD_FLAG_DUP 8
 
 typedef struct {
 	uint32_t token;
-	uint64_t tick;
+	uint64_t tick; /* time queued */
+	uint64_t sendTick; /* time next transmission is due */
 	char* message;
 	uint16_t elapsed;
 	uint8_t len;
 	uint8_t flags;
+	uint8_t retries; /* transmissions made */
+	char command[MAX_COMMAND_MSG_LEN];
 } COMMAND_BLOCK;
 
 typedef struct {
@@ -94,18 +155,26 @@ typedef struct {
 	uint32_t cacheSize;
 	uint32_t cacheReadPos;
 	uint32_t cacheWritePos;
+	// last values received in delta protocol
+	DELTA_STATE delta;
 	// command
 	COMMAND_BLOCK cmd[MAX_PENDING_COMMANDS];
 	uint32_t cmdCount;
-	// proxy
-	uint32_t proxyTick;
+	uint8_t cmdQueue; /* device de-duplicates retransmitted and batched commands */
+	// proxy forwarding cursor into cache and GPS fix being assembled
+	uint32_t proxyReadPos;
+	uint32_t proxyDropped; /* cache entries overwritten before forwarded */
+	PROXY_FIX proxyFix;
+	uint8_t proxyQueued;
+	// sequence number of last received backlog packet
+	uint32_t backlogSeq;
 	// stats
 	uint32_t recvCount;
 	uint32_t txCount;
 	uint32_t dataReceived; /* bytes */
 	uint32_t elapsedTime; /* seconds */
 	uint16_t csq;
-	uint8_t unused;
+	uint8_t protocol; /* data protocol version negotiated at login */
 	uint8_t deviceTemp;
 	float sampleRate;
 	char vin[20];
@@ -125,8 +194,37 @@ FILE* getLogFile();
 uint8_t hex2uint8(const char *p);
 int hex2uint16(const char *p);
 int checkVIN(const char* vin);
+int checkDeviceID(const char* devid);
 int processPayload(char* payload, CHANNEL_DATA* pld, int store);
 uint32_t issueCommand(HttpParam* hp, CHANNEL_DATA *pld, const char* cmd, uint32_t token);
+void ackCommand(CHANNEL_DATA* pld, uint32_t token, const char* msg);
+int hasDueCommands(CHANNEL_DATA* pld, uint64_t tick);
+int appendCommands(CHANNEL_DATA* pld, char* buf, int len, uint64_t tick);
+void flushCommands(HttpParam* hp, CHANNEL_DATA* pld, uint64_t tick);
 int incomingUDPCallback(void* _hp);
 void deviceLogin(CHANNEL_DATA* pld);
-void deviceLogout(CHANNEL_DATA* pld);
\ No newline at end of file
+void deviceLogout(CHANNEL_DATA* pld);
+void proxyNotify(CHANNEL_DATA* pld);
+void proxyReset(CHANNEL_DATA* pld);
+void fleetUpdate(CHANNEL_DATA* pld, int pid, const char* value);
+void fleetSync(CHANNEL_DATA* pld);
+void fleetRemove(CHANNEL_DATA* pld);
+int fleetLocate(float minLat, float minLng, float maxLat, float maxLng, int* result, int maxResults);
+
+// trip catalogue entry, one per data file
+typedef struct {
+	uint32_t date; /* YYYYMMDD */
+	uint32_t time; /* HHMMSS */
+	uint32_t size; /* data file size the meta info is generated from */
+	uint32_t duration; /* ms */
+	uint32_t flags;
+} TRIP_ENTRY;
+
+#define TRIP_FLAG_OPEN 0x1 /* data file still being written */
+#define TRIP_FLAG_META 0x2 /* size and duration are valid */
+
+void tripIndexAdd(const char* devid, uint32_t date, uint32_t time);
+void tripIndexClose(const char* devid);
+int tripIndexRebuild(const char* devid);
+int tripIndexRange(const char* devid, uint32_t beginDate, uint32_t beginTime, uint32_t endDate, uint32_t endTime, TRIP_ENTRY** entries, int* first);
+void tripIndexUpdate(const char* devid, int index, const TRIP_ENTRY* entry);
@@ -0,0 +1,484 @@
+/******************************************************************************
+* Freematics Hub Server - Data Sinks
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include "httpd.h"
+#include "teleserver.h"
+#include "telesink.h"
+#ifndef WIN32
+#include <pthread.h>
+#include <sys/un.h>
+#endif
+
+extern CHANNEL_DATA ld[];
+
+/*
+* Every ingested payload is handed to the sinks as batches of decoded samples.
+* Each sink other than inline ones has its own bounded queue drained by its
+* own thread, so a slow consumer only ever costs its own queued batches.
+*/
+
+#ifdef WIN32
+typedef CRITICAL_SECTION SINK_MUTEX;
+typedef CONDITION_VARIABLE SINK_COND;
+typedef HANDLE SINK_THREAD;
+#else
+typedef pthread_mutex_t SINK_MUTEX;
+typedef pthread_cond_t SINK_COND;
+typedef pthread_t SINK_THREAD;
+#endif
+
+typedef struct {
+	SINK_BATCH* batches;
+	uint32_t head;
+	uint32_t count;
+	int running;
+	SINK_MUTEX lock;
+	SINK_COND cond;
+	SINK_THREAD thread;
+} SINK_QUEUE;
+
+static SINK* sinks[MAX_SINKS];
+static int sinkCount = 0;
+
+#ifdef WIN32
+#define lockQueue(q) EnterCriticalSection(&(q)->lock)
+#define unlockQueue(q) LeaveCriticalSection(&(q)->lock)
+#define signalQueue(q) WakeConditionVariable(&(q)->cond)
+#define waitQueue(q, ms) SleepConditionVariableCS(&(q)->cond, &(q)->lock, ms)
+#else
+#define lockQueue(q) pthread_mutex_lock(&(q)->lock)
+#define unlockQueue(q) pthread_mutex_unlock(&(q)->lock)
+#define signalQueue(q) pthread_cond_signal(&(q)->cond)
+
+static void waitQueue(SINK_QUEUE* q, int ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+}
+#endif
+
+#ifdef WIN32
+static DWORD WINAPI sinkThread(LPVOID arg)
+#else
+static void* sinkThread(void* arg)
+#endif
+{
+	SINK* sink = arg;
+	SINK_QUEUE* q = sink->queue;
+	uint64_t idleTick = GetTickCount64();
+	lockQueue(q);
+	// queued batches are still delivered when closing
+	while (q->running || q->count) {
+		if (q->count) {
+			// slot at head is not touched by ingest until released
+			SINK_BATCH* batch = q->batches + q->head;
+			unlockQueue(q);
+			if (sink->write(sink, batch) < 0) sink->errors++;
+			sink->batches++;
+			sink->samples += batch->count;
+			lockQueue(q);
+			q->head = (q->head + 1) % SINK_QUEUE_SIZE;
+			q->count--;
+		}
+		else {
+			waitQueue(q, SINK_IDLE_INTERVAL);
+		}
+		if (sink->idle && GetTickCount64() - idleTick >= SINK_IDLE_INTERVAL) {
+			unlockQueue(q);
+			sink->idle(sink);
+			idleTick = GetTickCount64();
+			lockQueue(q);
+		}
+	}
+	unlockQueue(q);
+	return 0;
+}
+
+int sinkAdd(SINK* sink)
+{
+	if (sinkCount == MAX_SINKS) return -1;
+	if (sink->open && sink->open(sink) < 0) {
+		fprintf(stderr, "Unable to open %s sink (%s)\n", sink->name, sink->target ? sink->target : "");
+		return -1;
+	}
+	if (!(sink->flags & SINK_FLAG_INLINE)) {
+		SINK_QUEUE* q = calloc(1, sizeof(SINK_QUEUE));
+		q->batches = malloc(SINK_QUEUE_SIZE * sizeof(SINK_BATCH));
+		q->running = 1;
+		sink->queue = q;
+#ifdef WIN32
+		InitializeCriticalSection(&q->lock);
+		InitializeConditionVariable(&q->cond);
+		q->thread = CreateThread(NULL, 0, sinkThread, sink, 0, NULL);
+#else
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->cond, NULL);
+		pthread_create(&q->thread, NULL, sinkThread, sink);
+#endif
+	}
+	sinks[sinkCount++] = sink;
+	if (sink->target) printf("Data Sink: %s (%s)\n", sink->name, sink->target);
+	return 0;
+}
+
+static void enqueueBatch(SINK* sink, const SINK_BATCH* batch)
+{
+	SINK_QUEUE* q = sink->queue;
+	lockQueue(q);
+	if (q->count == SINK_QUEUE_SIZE) {
+		// consumer is not keeping up, ingest is never held up
+		sink->dropped++;
+	}
+	else {
+		SINK_BATCH* slot = q->batches + (q->head + q->count) % SINK_QUEUE_SIZE;
+		memcpy(slot, batch, offsetof(SINK_BATCH, samples) + batch->count * sizeof(CACHE_DATA));
+		q->count++;
+		signalQueue(q);
+	}
+	unlockQueue(q);
+}
+
+void sinkPublish(CHANNEL_DATA* pld, uint32_t count)
+{
+	SINK_BATCH batch;
+	if (sinkCount == 0 || pld->cacheSize == 0) return;
+	batch.id = pld->id;
+	batch.channel = (uint16_t)(pld - ld);
+	memcpy(batch.devid, pld->devid, sizeof(batch.devid));
+	// the last count samples stored in cache end at write pos, older ones are overwritten if cache wrapped
+	if (count > pld->cacheSize) count = pld->cacheSize;
+	uint32_t pos = (pld->cacheWritePos + pld->cacheSize - count) % pld->cacheSize;
+	while (count > 0) {
+		batch.count = 0;
+		do {
+			batch.samples[batch.count++] = pld->cache[pos];
+			pos = (pos + 1) % pld->cacheSize;
+			count--;
+		} while (count > 0 && batch.count < SINK_BATCH_SIZE);
+		for (int i = 0; i < sinkCount; i++) {
+			SINK* sink = sinks[i];
+			if (sink->flags & SINK_FLAG_INLINE) {
+				if (sink->write(sink, &batch) < 0) sink->errors++;
+				sink->batches++;
+				sink->samples += batch.count;
+			}
+			else {
+				enqueueBatch(sink, &batch);
+			}
+		}
+	}
+}
+
+void sinkCloseAll()
+{
+	for (int i = 0; i < sinkCount; i++) {
+		SINK* sink = sinks[i];
+		SINK_QUEUE* q = sink->queue;
+		if (q) {
+			lockQueue(q);
+			q->running = 0;
+			signalQueue(q);
+			unlockQueue(q);
+#ifdef WIN32
+			WaitForSingleObject(q->thread, INFINITE);
+			CloseHandle(q->thread);
+			DeleteCriticalSection(&q->lock);
+#else
+			pthread_join(q->thread, NULL);
+			pthread_mutex_destroy(&q->lock);
+			pthread_cond_destroy(&q->cond);
+#endif
+			free(q->batches);
+			free(q);
+			sink->queue = 0;
+		}
+		if (sink->close) sink->close(sink);
+	}
+	sinkCount = 0;
+}
+
+int uhSinks(UrlHandlerParam* param)
+{
+	int bs = param->bufSize;
+	char* buf = param->pucBuffer;
+	int l = 0;
+
+	l += snprintf(buf + l, bs - l, "{\"sinks\":[");
+	for (int i = 0; i < sinkCount; i++) {
+		SINK* sink = sinks[i];
+		SINK_QUEUE* q = sink->queue;
+		l += snprintf(buf + l, bs - l, "%s{\"name\":\"%s\",\"target\":\"%s\",\"queued\":%u,\"batches\":%u,\"samples\":%u,\"dropped\":%u,\"errors\":%u}",
+			i ? "," : "", sink->name, sink->target ? sink->target : "", q ? q->count : 0,
+			sink->batches, sink->samples, sink->dropped, sink->errors);
+	}
+	l += snprintf(buf + l, bs - l, "]}");
+	param->contentLength = l;
+	param->contentType = HTTPFILETYPE_JSON;
+	return FLAG_DATA_RAW;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// newline delimited JSON to subscribers connected to a TCP port or Unix socket
+//////////////////////////////////////////////////////////////////////////
+
+#define JSON_SINK_BUF_SIZE (SINK_BATCH_SIZE * 160)
+
+typedef struct {
+	SOCKET listenSocket;
+	SOCKET subscribers[SINK_MAX_SUBSCRIBERS];
+	char buf[JSON_SINK_BUF_SIZE];
+} JSON_SINK;
+
+static int jsonOpen(SINK* sink)
+{
+	JSON_SINK* js = calloc(1, sizeof(JSON_SINK));
+	const char* target = sink->target;
+	SOCKET s;
+	int ret;
+	if (isdigit(*target)) {
+		struct sockaddr_in addr;
+		int opt = 1;
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(atoi(target));
+		ret = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	else {
+#ifndef WIN32
+		struct sockaddr_un addr;
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, target, sizeof(addr.sun_path) - 1);
+		unlink(target);
+		ret = bind(s, (struct sockaddr*)&addr, sizeof(addr));
+#else
+		free(js);
+		return -1;
+#endif
+	}
+	if (ret < 0 || listen(s, SINK_MAX_SUBSCRIBERS) < 0) {
+		closesocket(s);
+		free(js);
+		return -1;
+	}
+	js->listenSocket = s;
+	sink->ctx = js;
+	return 0;
+}
+
+static void acceptSubscribers(JSON_SINK* js)
+{
+	for (;;) {
+		fd_set fds;
+		struct timeval tv = { 0, 0 };
+		FD_ZERO(&fds);
+		FD_SET(js->listenSocket, &fds);
+		if (select(js->listenSocket + 1, &fds, NULL, NULL, &tv) <= 0) break;
+		SOCKET s = accept(js->listenSocket, NULL, NULL);
+		if (s <= 0) break;
+		int i;
+		for (i = 0; i < SINK_MAX_SUBSCRIBERS && js->subscribers[i]; i++);
+		if (i == SINK_MAX_SUBSCRIBERS) {
+			closesocket(s);
+			continue;
+		}
+		// a stuck subscriber is dropped rather than holding up the others
+#ifdef WIN32
+		DWORD timeout = SINK_SEND_TIMEOUT * 1000;
+#else
+		struct timeval timeout = { SINK_SEND_TIMEOUT, 0 };
+#endif
+		setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+		js->subscribers[i] = s;
+	}
+}
+
+static int isNumber(const char* s)
+{
+	if (*s == '-') s++;
+	if (!isdigit(*s)) return 0;
+	while (isdigit(*s)) s++;
+	if (*s == '.') {
+		if (!isdigit(*(++s))) return 0;
+		while (isdigit(*s)) s++;
+	}
+	return *s == 0;
+}
+
+static int formatJsonValue(char* buf, int bufsize, const char* value)
+{
+	if (isNumber(value)) {
+		return snprintf(buf, bufsize, "%s", value);
+	}
+	int n = 0;
+	buf[n++] = '"';
+	for (const char* p = value; *p && n < bufsize - 3; p++) {
+		if (*p == '"' || *p == '\\') buf[n++] = '\\';
+		buf[n++] = *p;
+	}
+	buf[n++] = '"';
+	return n;
+}
+
+static int jsonWrite(SINK* sink, const SINK_BATCH* batch)
+{
+	JSON_SINK* js = sink->ctx;
+	int ret = 0;
+	int len = 0;
+	int i;
+	acceptSubscribers(js);
+	for (i = 0; i < SINK_MAX_SUBSCRIBERS && !js->subscribers[i]; i++);
+	if (i == SINK_MAX_SUBSCRIBERS) return 0;
+
+	for (i = 0; i < batch->count; i++) {
+		const CACHE_DATA* d = batch->samples + i;
+		if (JSON_SINK_BUF_SIZE - len < 160) break;
+		len += snprintf(js->buf + len, JSON_SINK_BUF_SIZE - len, "{\"devid\":\"%s\",\"ts\":%u,\"pid\":%u,\"value\":",
+			batch->devid, d->ts, d->pid);
+		len += formatJsonValue(js->buf + len, JSON_SINK_BUF_SIZE - len, d->data);
+		len += snprintf(js->buf + len, JSON_SINK_BUF_SIZE - len, "}\n");
+	}
+	for (i = 0; i < SINK_MAX_SUBSCRIBERS; i++) {
+		SOCKET s = js->subscribers[i];
+		if (!s) continue;
+		int sent = 0;
+		while (sent < len) {
+			int n = send(s, js->buf + sent, len - sent, 0);
+			if (n <= 0) break;
+			sent += n;
+		}
+		if (sent < len) {
+			closesocket(s);
+			js->subscribers[i] = 0;
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void jsonIdle(SINK* sink)
+{
+	acceptSubscribers(sink->ctx);
+}
+
+static void jsonClose(SINK* sink)
+{
+	JSON_SINK* js = sink->ctx;
+	if (!js) return;
+	for (int i = 0; i < SINK_MAX_SUBSCRIBERS; i++) {
+		if (js->subscribers[i]) closesocket(js->subscribers[i]);
+	}
+	closesocket(js->listenSocket);
+#ifndef WIN32
+	if (!isdigit(*sink->target)) unlink(sink->target);
+#endif
+	free(js);
+	sink->ctx = 0;
+}
+
+SINK jsonSink = {
+	.name = "json",
+	.open = jsonOpen,
+	.write = jsonWrite,
+	.idle = jsonIdle,
+	.close = jsonClose,
+};
+
+//////////////////////////////////////////////////////////////////////////
+// CSV files rolled over by time and size
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+	FILE* fp;
+	time_t startTime;
+	long size;
+} CSV_SINK;
+
+static int csvOpen(SINK* sink)
+{
+	if (!IsDir(sink->target) && mkdir(sink->target, 0755) < 0) {
+		return -1;
+	}
+	sink->ctx = calloc(1, sizeof(CSV_SINK));
+	return 0;
+}
+
+static int csvWrite(SINK* sink, const SINK_BATCH* batch)
+{
+	CSV_SINK* cs = sink->ctx;
+	time_t now = time(NULL);
+	if (cs->fp && (now - cs->startTime >= SINK_FILE_PERIOD || cs->size >= SINK_FILE_MAX_SIZE)) {
+		fclose(cs->fp);
+		cs->fp = 0;
+	}
+	if (!cs->fp) {
+		char path[MAX_PATH];
+		struct tm *btm = gmtime(&now);
+		snprintf(path, sizeof(path), "%s/%04u%02u%02u-%02u%02u%02u.csv", sink->target,
+			1900 + btm->tm_year, btm->tm_mon + 1, btm->tm_mday, btm->tm_hour, btm->tm_min, btm->tm_sec);
+		cs->fp = fopen(path, "a");
+		if (!cs->fp) return -1;
+		cs->startTime = now;
+		cs->size = fprintf(cs->fp, "devid,ts,pid,value\n");
+	}
+	for (int i = 0; i < batch->count; i++) {
+		const CACHE_DATA* d = batch->samples + i;
+		int n = fprintf(cs->fp, "%s,%u,%X,%s\n", batch->devid, d->ts, d->pid, d->data);
+		if (n < 0) return -1;
+		cs->size += n;
+	}
+	return 0;
+}
+
+static void csvIdle(SINK* sink)
+{
+	CSV_SINK* cs = sink->ctx;
+	if (cs->fp) fflush(cs->fp);
+}
+
+static void csvClose(SINK* sink)
+{
+	CSV_SINK* cs = sink->ctx;
+	if (!cs) return;
+	if (cs->fp) fclose(cs->fp);
+	free(cs);
+	sink->ctx = 0;
+}
+
+SINK csvSink = {
+	.name = "csv",
+	.open = csvOpen,
+	.write = csvWrite,
+	.idle = csvIdle,
+	.close = csvClose,
+};
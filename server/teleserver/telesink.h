@@ -0,0 +1,60 @@
+/******************************************************************************
+* Freematics Hub Server - Data Sinks
+* Developed by Stanley Huang <stanley@freematics.com.au>
+* Distributed under GPL v3.0 license
+* Visit https://freematics.com/hub for more information
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+******************************************************************************/
+
+#define MAX_SINKS 8
+#define SINK_BATCH_SIZE 64 /* samples */
+#define SINK_QUEUE_SIZE 256 /* batches */
+#define SINK_IDLE_INTERVAL 1000 /* ms */
+#define SINK_MAX_SUBSCRIBERS 8
+#define SINK_SEND_TIMEOUT 5 /* seconds */
+#define SINK_FILE_MAX_SIZE (64 * 1024 * 1024) /* bytes */
+#define SINK_FILE_PERIOD 3600 /* seconds */
+
+// sink is called from ingest directly instead of its own thread (must not block)
+#define SINK_FLAG_INLINE 0x1
+
+typedef struct {
+	uint32_t id; /* channel ID */
+	uint16_t channel; /* index in channel table */
+	uint16_t count;
+	char devid[32];
+	CACHE_DATA samples[SINK_BATCH_SIZE];
+} SINK_BATCH;
+
+typedef struct _SINK {
+	const char* name;
+	int (*open)(struct _SINK* sink);
+	int (*write)(struct _SINK* sink, const SINK_BATCH* batch);
+	void (*idle)(struct _SINK* sink);
+	void (*close)(struct _SINK* sink);
+	const char* target; /* address or path the sink delivers to */
+	void* ctx;
+	uint32_t flags;
+	// stats
+	uint32_t batches;
+	uint32_t samples;
+	uint32_t dropped; /* batches discarded as queue was full */
+	uint32_t errors;
+	// queue and thread, managed by sink module
+	void* queue;
+} SINK;
+
+int sinkAdd(SINK* sink);
+void sinkPublish(CHANNEL_DATA* pld, uint32_t count);
+void sinkCloseAll();
+
+extern SINK proxySink;
+extern SINK jsonSink;
+extern SINK csvSink;
@@ -18,6 +18,8 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <math.h>
+#include <float.h>
 #include "cdecode.h"
 #include "httpd.h"
 #include "teleserver.h"
@@ -40,121 +42,6 @@ FILE* fpDest;
 char* xsl;
 extern char dataDir[];
 
-int genRequest(char* buf, int bufsize)
-{
-	int valids = 0;
-	uint32_t date = 0;
-	uint32_t time = 0;
-	float lat = 0;
-	float lng = 0;
-	float alt = 0;
-	float speed = 0;
-	int heading = 0;
-	int hdop = 0;
-	uint8_t mask = 0;
-	int len = 0;
-
-	for (int i = 0; i < MAX_CHANNELS; i++) {
-		if (ld[i].id) {
-			uint32_t startTick = ld[i].proxyTick;
-			CHANNEL_DATA* pld = ld + i;
-			//if (pld->deviceTick > startTick + PROXY_MAX_TIME_BEHIND) startTick = pld->deviceTick - PROXY_MAX_TIME_BEHIND;
-			uint32_t readPos = pld->cacheReadPos;
-			mask = 0;
-			for (; readPos != pld->cacheWritePos; readPos = (readPos + 1) % pld->cacheSize) {
-				CACHE_DATA* d = pld->cache + readPos;
-				if (d->ts <= startTick) continue;
-				if (pld->proxyTick != d->ts) {
-					pld->proxyTick = d->ts;
-					// new time stamp, check validity
-					if (mask == 0xff) {
-						break;
-					}
-				}
-				switch (d->pid) {
-				case PID_GPS_DATE:
-					date = atol(d->data);
-					mask |= 0x1;
-					break;
-				case PID_GPS_TIME:
-					time = atol(d->data);
-					mask |= 0x2;
-					break;
-				case PID_GPS_LATITUDE:
-					lat = (float)atof(d->data);
-					mask |= 0x4;
-					break;
-				case PID_GPS_LONGITUDE:
-					lng = (float)atof(d->data);
-					mask |= 0x8;
-					break;
-				case PID_GPS_ALTITUDE:
-					alt = (float)atof(d->data);
-					mask |= 0x10;
-					break;
-				case PID_GPS_SPEED:
-					speed = (float)atof(d->data);
-					mask |= 0x20;
-					break;
-				case PID_GPS_HEADING:
-					heading = atoi(d->data);
-					mask |= 0x40;
-					break;
-				case PID_GPS_HDOP:
-					hdop = atoi(d->data);
-					break;
-				}
-				mask |= 0x80;
-			}
-			if (mask == 0xff) {
-				// complete set of GPS data available
-				char isoTime[26];
-				char* p = isoTime + sprintf(isoTime, "%04u-%02u-%02uT%02u:%02u:%02u",
-					(unsigned int)(date % 100) + 2000, (unsigned int)(date / 100) % 100, (unsigned int)(date / 10000),
-					(unsigned int)(time / 1000000), (unsigned int)(time % 1000000) / 10000, (unsigned int)(time % 10000) / 100);
-				unsigned char tenth = (time % 100) / 10;
-				if (tenth) p += sprintf(p, ".%c00", '0' + tenth);
-				*p = 'Z';
-				*(p + 1) = 0;
-				len = snprintf(buf, bufsize, "GET ?id=%s&timestamp=%s&lat=%f&lon=%f&altitude=%.1f&speed=%.2f&heading=%d&hdop=%.1f HTTP/1.1\r\nConnection: keep-alive\r\n\r\n",
-					pld->devid, isoTime, lat, lng, alt, speed / 1.852f, heading, (float)hdop / 10);
-				break;
-			}
-			else if (mask) {
-				// no complete set of GPS data but still some new data
-				len = snprintf(buf, bufsize, "GET ?id=%s HTTP/1.1\r\nConnection: keep-alive\r\n\r\n", pld->devid);
-				break;
-			}
-			else if ((pld->flags & FLAG_PINGED)) {
-				len = snprintf(buf, bufsize, "GET ?id=%s HTTP/1.1\r\nConnection: keep-alive\r\n\r\n", pld->devid);
-				pld->flags &= ~FLAG_PINGED;
-				fprintf(stderr, "Ping responded\n");
-				break;
-			}
-		}
-	}
-	if (len > 0) printf("%s", buf);
-	return len;
-}
-
-int phData(void* _hp, int op, char* buf, int len)
-{
-	HttpParam* hp = _hp;
-	static int state = 0;
-	if (op == PROXY_DATA_REQUESTED) {
-		int bytes = genRequest(buf, len);
-		return bytes;
-	}
-	else if (op == PROXY_DATA_RECEIVED) {
-		if (strstr(buf, "HTTP/1.1 200 OK")) {
-		}
-		else {
-			printf("%s", buf);
-		}
-	}
-	return 0;
-}
-
 int uhQuery(UrlHandlerParam* param)
 {
 	param->contentType = HTTPFILETYPE_JSON;
@@ -247,25 +134,207 @@ int UploadCallback(HttpMultipart *pxMP, OCTET *poData, size_t dwDataChunkSize)
 int ConvertToKML(KML_DATA* kd, FILE* fp, const char* kmlfile, uint32_t startpos, uint32_t endpos);
 void CleanupKML(KML_DATA* kd);
 
-void WriteGeoJSON(FILE* fpout, KML_DATA* kd, int size, int count)
+/*
+* Trip level-of-detail
+*
+* A long trip is several megabytes of GeoJSON and tens of thousands of
+* points, most of which are redundant at the zoom level a trip is first
+* shown at. Alongside the full <tripid>.json, CreateDataFiles writes
+* reduced copies <tripid>.lod<N>.json in the same format, LOD 0 being the
+* coarsest with TRIP_LOD_POINTS points and each following level holding
+* TRIP_LOD_SCALE times as many. Levels are only written while they are
+* smaller than the full trip, and meta.lods tells the client how many
+* exist.
+*
+* Points are picked in two passes. The polyline is ranked once with
+* Douglas-Peucker: every point gets the perpendicular distance at which
+* the recursion would keep it, clamped to that of the segment it splits so
+* the rank is monotonic, and a level keeps the points with the highest
+* rank. Between every two kept points the samples with the lowest and
+* highest speed and altitude are then added back if they fall outside the
+* range of the two ends, so stops and peaks survive decimation, and the
+* number of ranked points is adjusted until the total fills the budget.
+* All series are written for the same points and stay index-aligned.
+*/
+
+#define TRIP_LOD_LEVELS 3
+#define TRIP_LOD_POINTS 500
+#define TRIP_LOD_SCALE 4
+
+typedef struct {
+	int first;
+	int last;
+	float limit;
+} DP_SPAN;
+
+static void rankTripPoints(DATASET** pts, int n, float* rank)
+{
+	float* x = malloc(sizeof(float) * n * 2);
+	float* y = x + n;
+	DP_SPAN* stack = malloc(sizeof(DP_SPAN) * n);
+	// equirectangular projection in meters, accurate enough over a trip
+	float k = cosf(pts[0]->lat * (float)M_PI / 180) * 111320;
+	for (int i = 0; i < n; i++) {
+		x[i] = pts[i]->lng * k;
+		y[i] = pts[i]->lat * 111320;
+		rank[i] = 0;
+	}
+	rank[0] = FLT_MAX;
+	rank[n - 1] = FLT_MAX;
+	int sp = 0;
+	stack[sp].first = 0;
+	stack[sp].last = n - 1;
+	stack[sp++].limit = FLT_MAX;
+	while (sp > 0) {
+		DP_SPAN s = stack[--sp];
+		if (s.last - s.first < 2) continue;
+		float dx = x[s.last] - x[s.first];
+		float dy = y[s.last] - y[s.first];
+		float len2 = dx * dx + dy * dy;
+		float dmax = -1;
+		int imax = s.first + 1;
+		for (int i = s.first + 1; i < s.last; i++) {
+			float px = x[i] - x[s.first];
+			float py = y[i] - y[s.first];
+			float d;
+			if (len2 > 0) {
+				float c = px * dy - py * dx;
+				d = c * c / len2;
+			} else {
+				d = px * px + py * py;
+			}
+			if (d > dmax) {
+				dmax = d;
+				imax = i;
+			}
+		}
+		dmax = sqrtf(dmax);
+		if (dmax > s.limit) dmax = s.limit;
+		rank[imax] = dmax;
+		stack[sp].first = s.first;
+		stack[sp].last = imax;
+		stack[sp++].limit = dmax;
+		stack[sp].first = imax;
+		stack[sp].last = s.last;
+		stack[sp++].limit = dmax;
+	}
+	free(stack);
+	free(x);
+}
+
+static int compareRank(const void* a, const void* b)
 {
-	int pos = fprintf(fpout, "{\"meta\":{\"rev\":%u,\"size\":%u,\"samples\":%u,\"duration\":", META_REVISION, size, count);
+	float x = *(const float*)a, y = *(const float*)b;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void keepExtremes(DATASET** pts, int first, int last, uint8_t* keep)
+{
+	int lo[2] = { -1, -1 }, hi[2] = { -1, -1 };
+	for (int m = 0; m < 2; m++) {
+		float a = m ? pts[first]->alt : pts[first]->speed;
+		float b = m ? pts[last]->alt : pts[last]->speed;
+		float vmin = a < b ? a : b;
+		float vmax = a > b ? a : b;
+		for (int i = first + 1; i < last; i++) {
+			float v = m ? pts[i]->alt : pts[i]->speed;
+			if (v < vmin) {
+				vmin = v;
+				lo[m] = i;
+			}
+			if (v > vmax) {
+				vmax = v;
+				hi[m] = i;
+			}
+		}
+	}
+	for (int m = 0; m < 2; m++) {
+		if (lo[m] >= 0) keep[lo[m]] = 2;
+		if (hi[m] >= 0) keep[hi[m]] = 2;
+	}
+}
+
+// select points ranked above the target count, plus extremes between them
+static int selectTripPoints(DATASET** pts, int n, const float* rank, const float* sorted, uint8_t* keep, int target, DATASET** sel)
+{
+	float threshold = target < n ? sorted[target - 1] : 0;
+	int kept = 0;
+	for (int i = 0; i < n; i++) {
+		keep[i] = (rank[i] > threshold || (rank[i] == threshold && kept < target));
+		if (keep[i]) kept++;
+	}
+	for (int i = 1, prev = 0; i < n; i++) {
+		if (keep[i] != 1) continue;
+		if (i - prev > 1) keepExtremes(pts, prev, i, keep);
+		prev = i;
+	}
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (keep[i]) sel[count++] = pts[i];
+	}
+	return count;
+}
+
+// picks as many points as fit in budget, returning the number written to sel
+static int reduceTripPoints(DATASET** pts, int n, const float* rank, const float* sorted, uint8_t* keep, int budget, DATASET** sel)
+{
+	// each gap may add up to 4 extremes, so this first guess always fits
+	int target = budget / 5;
+	if (target < 2) target = 2;
+	int fit = target;
+	for (int tries = 0; tries < 4; tries++) {
+		int count = selectTripPoints(pts, n, rank, sorted, keep, target, sel);
+		if (count <= budget) {
+			fit = target;
+			if (budget - count < budget / 20) return count;
+			target += budget - count;
+		} else {
+			target -= (count - budget) / 2 + 1;
+			if (target <= fit) break;
+		}
+	}
+	return selectTripPoints(pts, n, rank, sorted, keep, fit, sel);
+}
+
+void WriteGeoJSON(FILE* fpout, KML_DATA* kd, int size, int count, DATASET** pts, int n, int lod, int lods)
+{
+	int pos = fprintf(fpout, "{\"meta\":{\"rev\":%u,\"size\":%u,\"samples\":%u,\"points\":%u,\"lods\":%d,", META_REVISION, size, count, n, lods);
+	if (lod >= 0) pos += fprintf(fpout, "\"lod\":%d,", lod);
+	pos += fprintf(fpout, "\"duration\":");
 	fprintf(fpout, "0         }");
 
-	if (!kd->data) {
+	if (n == 0) {
 		return;
 	}
 
 	fprintf(fpout, ",\n");
 
-	DATASET* end;
-	for (end = kd->data; end->next; end = end->next);
+	DATASET* start = pts[0];
+	DATASET* end = pts[n - 1];
 
-	fprintf(fpout, "\"stats\":{\"distance\":%u,\"start\":{\"lat\":%f,\"lng\":%f,\"date\":%u,\"time\":%u,\"ts\":%u},\"end\":{\"lat\":%f,\"lng\":%f,\"date\":%u,\"time\":%u,\"ts\":%u}},\n",
+	fprintf(fpout, "\"stats\":{\"distance\":%u,\"start\":{\"lat\":%f,\"lng\":%f,\"date\":%u,\"time\":%u,\"ts\":%u},\"end\":{\"lat\":%f,\"lng\":%f,\"date\":%u,\"time\":%u,\"ts\":%u},\n",
 		(unsigned int)kd->distance,
-		kd->data->lat, kd->data->lng, kd->data->date, kd->data->time, kd->data->timestamp,
+		start->lat, start->lng, start->date, start->time, start->timestamp,
 		end->lat, end->lng, end->date, end->time, end->timestamp);
 
+	// stops and top speed always come from the full trip as decimation moves them
+	float topSpeed = 0;
+	DATASET* stop = 0;
+	fprintf(fpout, "\"stops\":[");
+	int stops = 0;
+	for (DATASET* pd = kd->data; pd; pd = pd->next) {
+		if (!stop && pd->speed == 0) {
+			stop = pd;
+		} else if (stop && pd->speed > 1) {
+			// [lng,lat,ts,duration in seconds]
+			fprintf(fpout, "%s[%f,%f,%u,%u]", stops++ ? "," : "", stop->lng, stop->lat,
+				stop->timestamp - start->timestamp, (pd->timestamp - stop->timestamp) / 1000);
+			stop = 0;
+		}
+		if (pd->speed > topSpeed) topSpeed = pd->speed;
+	}
+	fprintf(fpout, "],\"topSpeed\":%.1f},\n", topSpeed);
+
 	fprintf(fpout, "\"bounds\":[{\"lat\":%f,\"lng\":%f}, {\"lat\":%f,\"lng\":%f}],\n",
 		kd->bounds[0].lat, kd->bounds[0].lng, kd->bounds[1].lat, kd->bounds[1].lng);
 
@@ -275,42 +344,36 @@ void WriteGeoJSON(FILE* fpout, KML_DATA* kd, int size, int count)
 	}
 	fprintf(fpout, "],\n");
 	fprintf(fpout, "\"trip\":{\"type\":\"LineString\"");
-	DATASET* pd = kd->data;
-	fprintf(fpout, ",\"coordinates\":[[%f,%f]", pd->lng, pd->lat);
-	while (pd = pd->next) fprintf(fpout, ",[%f,%f]", pd->lng, pd->lat);
+	fprintf(fpout, ",\"coordinates\":[[%f,%f]", start->lng, start->lat);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",[%f,%f]", pts[i]->lng, pts[i]->lat);
 	fprintf(fpout, "],\n");
 
-	pd = kd->data;
-	uint32_t t = kd->data->timestamp;
-	fprintf(fpout, "\"timestamps\":[%u", pd->timestamp - t);
-	while (pd = pd->next) fprintf(fpout, ",%u", pd->timestamp - t);
+	uint32_t t = start->timestamp;
+	fprintf(fpout, "\"timestamps\":[%u", 0);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",%u", pts[i]->timestamp - t);
 	fprintf(fpout, "],\n");
 
-	pd = kd->data;
-	fprintf(fpout, "\"altitudes\":[%d", (int)pd->alt);
-	while (pd = pd->next) fprintf(fpout, ",%d", (int)pd->alt);
+	fprintf(fpout, "\"altitudes\":[%d", (int)start->alt);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",%d", (int)pts[i]->alt);
 	fprintf(fpout, "],\n");
 
-	pd = kd->data;
-	fprintf(fpout, "\"accels\":[[%d,%d,%d]", pd->acc[0], pd->acc[1], pd->acc[2]);
-	while (pd = pd->next) fprintf(fpout, ",[%d,%d,%d]", pd->acc[0], pd->acc[1], pd->acc[2]);
+	fprintf(fpout, "\"accels\":[[%d,%d,%d]", start->acc[0], start->acc[1], start->acc[2]);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",[%d,%d,%d]", pts[i]->acc[0], pts[i]->acc[1], pts[i]->acc[2]);
 	fprintf(fpout, "],\n");
 
-	pd = kd->data;
-	fprintf(fpout, "\"battery\":[%.1f", (float)pd->battery / 100);
-	while (pd = pd->next) fprintf(fpout, ",%.1f", (float)pd->battery / 100);
+	fprintf(fpout, "\"battery\":[%.1f", (float)start->battery / 100);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",%.1f", (float)pts[i]->battery / 100);
 	fprintf(fpout, "],\n");
 
-	pd = kd->data;
-	fprintf(fpout, "\"speeds\":[%.1f", pd->speed);
-	while (pd = pd->next) fprintf(fpout, ",%.1f", pd->speed);
+	fprintf(fpout, "\"speeds\":[%.1f", start->speed);
+	for (int i = 1; i < n; i++) fprintf(fpout, ",%.1f", pts[i]->speed);
 	fprintf(fpout, "]\n");
 	fprintf(fpout, "}\n");
 
 	fprintf(fpout, "}");
-	if (end->timestamp > kd->data->timestamp) {
+	if (end->timestamp > start->timestamp) {
 		fseek(fpout, pos, SEEK_SET);
-		fprintf(fpout, "%u", end->timestamp - kd->data->timestamp);
+		fprintf(fpout, "%u", end->timestamp - start->timestamp);
 	}
 }
 
@@ -322,7 +385,7 @@ int CreateDataFiles(KML_DATA* kd, const char* file)
 	int size;
 
 	snprintf(path, sizeof(path), "%s/%s.txt", dataDir, file);
-	fp = fopen(path, "r");
+	fp = fopen(path, "rb");
 	if (!fp) {
 		return -1;
 	}
@@ -332,10 +395,42 @@ int CreateDataFiles(KML_DATA* kd, const char* file)
 	size = ftell(fp);
 	fclose(fp);
 
+	int n = 0;
+	for (DATASET* pd = kd->data; pd; pd = pd->next) n++;
+	DATASET** pts = malloc(sizeof(DATASET*) * (n ? n : 1));
+	n = 0;
+	for (DATASET* pd = kd->data; pd; pd = pd->next) pts[n++] = pd;
+
+	int lods = 0;
+	for (int budget = TRIP_LOD_POINTS; lods < TRIP_LOD_LEVELS && budget < n; budget *= TRIP_LOD_SCALE) lods++;
+
 	snprintf(path, sizeof(path), "%s/%s.json", dataDir, file);
 	fp = fopen(path, "w");
-	WriteGeoJSON(fp, kd, size, count);
+	WriteGeoJSON(fp, kd, size, count, pts, n, -1, lods);
 	fclose(fp);
+
+	if (lods > 0) {
+		float* rank = malloc(sizeof(float) * n * 2);
+		float* sorted = rank + n;
+		uint8_t* keep = malloc(n);
+		DATASET** sel = malloc(sizeof(DATASET*) * n);
+		rankTripPoints(pts, n, rank);
+		memcpy(sorted, rank, sizeof(float) * n);
+		qsort(sorted, n, sizeof(float), compareRank);
+		int budget = TRIP_LOD_POINTS;
+		for (int lod = 0; lod < lods; lod++, budget *= TRIP_LOD_SCALE) {
+			int m = reduceTripPoints(pts, n, rank, sorted, keep, budget, sel);
+			snprintf(path, sizeof(path), "%s/%s.lod%d.json", dataDir, file, lod);
+			fp = fopen(path, "w");
+			if (!fp) break;
+			WriteGeoJSON(fp, kd, size, count, sel, m, lod, lods);
+			fclose(fp);
+		}
+		free(sel);
+		free(keep);
+		free(rank);
+	}
+	free(pts);
 	return count;
 }
 
@@ -391,7 +486,7 @@ int uhData(UrlHandlerParam* param)
 
 	param->contentType = HTTPFILETYPE_JSON;
 	snprintf(param->pucBuffer, param->bufSize, "%s/%s.txt", dataDir, buf);
-	FILE* fp = fopen(param->pucBuffer, "r");
+	FILE* fp = fopen(param->pucBuffer, "rb");
 	if (!fp) {
 		param->contentLength = sprintf(param->pucBuffer, "Data file not found");
 		return FLAG_DATA_RAW;
@@ -400,7 +495,9 @@ int uhData(UrlHandlerParam* param)
 	uint32_t ts = 0;
 	int len = 0;
 	len += snprintf(param->pucBuffer + len, param->bufSize - len, "[");
-	while (fscanf(fp, "%1024s\n", buf) > 0) {
+	DATA_READER rd;
+	openDataReader(&rd, fp);
+	while (readDataLine(&rd, buf, sizeof(buf)) > 0) {
 		for (char* p = strtok(buf, ","); p; p = strtok(0, ",")) {
 			int pid = hex2uint16(p);
 			if (!(p = strchr(p, ':'))) break;
@@ -455,13 +552,14 @@ int processTripData(const char* devid, const char* tripid, int force, char* file
 	uint32_t size = 0, duration = 0;
 	int rev = loadMetaInfo(path, &duration, &size);
 	if (rev == META_REVISION) {
-		snprintf(path, sizeof(path), "%s/%s.txt", dataDir, file);
-		FILE* fp = fopen(path, "r");
+		char txtpath[256];
+		snprintf(txtpath, sizeof(txtpath), "%s/%s.txt", dataDir, file);
+		FILE* fp = fopen(txtpath, "r");
 		if (fp) {
 			fseek(fp, 0, SEEK_END);
 			if (ftell(fp) == size) processed = 1;
+			fclose(fp);
 		}
-		fclose(fp);
 		if (psize)* psize = size;
 		if (pduration)* pduration = duration;
 	}
@@ -489,7 +587,10 @@ int uhTrip(UrlHandlerParam* param)
 	const char* tripid = mwGetVarValue(param->pxVars, "tripid", 0);
 	const char* redir = mwGetVarValue(param->pxVars, "redir", 0);
 	int regen = mwGetVarValueInt(param->pxVars, "regen", 0);
+	int lod = mwGetVarValueInt(param->pxVars, "lod", -1);
+	int points = mwGetVarValueInt(param->pxVars, "points", 0);
 	const char* ext = "json";
+	char lodext[16];
 	param->contentType = HTTPFILETYPE_TEXT;
 
 	int devidlen = strlen(devid);
@@ -517,6 +618,22 @@ int uhTrip(UrlHandlerParam* param)
 	}
 	else {
 		param->contentType = HTTPFILETYPE_JSON;
+		if (points > 0) {
+			// most detailed level within the requested number of points
+			lod = 0;
+			for (int budget = TRIP_LOD_POINTS * TRIP_LOD_SCALE; budget <= points && lod < TRIP_LOD_LEVELS; budget *= TRIP_LOD_SCALE) lod++;
+		}
+		if (lod >= 0 && lod < TRIP_LOD_LEVELS) {
+			// a level is not written when the full trip is already below its size
+			char path[256];
+			snprintf(path, sizeof(path), "%s/%s.lod%d.json", dataDir, file, lod);
+			FILE* fp = fopen(path, "r");
+			if (fp) {
+				fclose(fp);
+				snprintf(lodext, sizeof(lodext), "lod%d.json", lod);
+				ext = lodext;
+			}
+		}
 	}
 
 	if (redir) {
@@ -586,7 +703,7 @@ int uhHistory(UrlHandlerParam* param)
 	char *pb = param->pucBuffer;
 	int bs = param->bufSize;
 
-	if (!szbegin || !szend || !devid) return 0;
+	if (!szbegin || !szend || !checkDeviceID(devid)) return 0;
 	char path[260];
 	snprintf(path, sizeof(path), "%s/%s", dataDir, devid);
 	if (!IsDir(path)) {
@@ -600,72 +717,48 @@ int uhHistory(UrlHandlerParam* param)
 		return 0;
 	}
 
-	int year, month, day, hour, minute, second;
-	getDateTimeBreakdown(szbegin, &year, &month, &day, &hour, &minute, &second);
+	// whole end day is included when no end time is given
+	if (endTime == 0) endTime = 235959;
+	if (mwGetVarValueInt(param->pxVars, "rebuild", 0)) {
+		tripIndexRebuild(devid);
+	}
+	TRIP_ENTRY* entries = 0;
+	int first;
+	int count = tripIndexRange(devid, beginDate, beginTime, endDate, endTime, &entries, &first);
 
-	int eod = 0;
 	int n = 0;
 	n += snprintf(pb + n, bs - n, "[\n");
-	int count = 0;
-	for (unsigned int date = beginDate; date <= endDate && count <= 365; count++) {
-		char *p = path + snprintf(path, sizeof(path), "%s/%s/%04u/%02u/%02u",
-			dataDir, devid, year, month, day);
-		char file[260];
-		if (ReadDir(path, file) == 0) {
-			do {
-				if (strlen(file) != 19 || file[8] != '-') continue;
-				char *q = strchr(file, '.');
-				if (!q || strcmp(q + 1, "txt")) continue;
-				sprintf(p, "/%s", file);
-				*q = 0;
-				unsigned int time = atoi(file + 9);
-				date = atoi(file);
-				if (date < beginDate || date > endDate)
-					continue;
-				if ((date == beginDate && time < beginTime) || (date == endDate && endTime && time > endTime))
-					continue;
-
-
-				// retrieve meta data
-				uint32_t duration = 0;
-				uint32_t size = 0;
-				char filepath[128];
-				if (processTripData(devid, file, 0, filepath, &size, &duration) == -1) {
-					continue;
-				}
-
-				hour = time / 10000;
-				minute = (time / 100) % 100;
-				second = time % 100;
-				struct tm t = { second, minute, hour, day, month - 1, year - 1900 };
-				time_t tm = mktime(&t);
-				n += snprintf(pb + n, bs - n, "{\"id\":\"%s\",\"key\":%u,\"utc\":\"%04u-%02u-%02uT%02u:%02u:%02uZ\",\"size\":%u,\"duration\":%u},",
-					file, (unsigned int)tm,
-					year, month, day, hour, minute, second,
-					size, duration
-				);
-			} while (ReadDir(0, file) == 0);
-		}
-
-		if (!eod) {
-			if (month == 4 || month == 6 || month == 9 || month == 11)
-				eod = 30;
-			else if (month == 2)
-				eod = (year % 4 == 0) ? 29 : 28;
-			else
-				eod = 31;
-		}
-
-		if (++day > eod) {
-			day = 1;
-			if (++month > 12) {
-				month = 1;
-				year++;
+	for (int i = 0; i < count && n < bs - 160; i++) {
+		TRIP_ENTRY* e = entries + i;
+		char file[16];
+		snprintf(file, sizeof(file), "%08u-%06u", e->date, e->time);
+		if (!(e->flags & TRIP_FLAG_META) || (e->flags & TRIP_FLAG_OPEN)) {
+			// retrieve meta data, kept in catalogue once the trip is closed
+			char filepath[128];
+			if (processTripData(devid, file, 0, filepath, &e->size, &e->duration) == -1) {
+				continue;
+			}
+			if (!(e->flags & TRIP_FLAG_OPEN)) {
+				e->flags |= TRIP_FLAG_META;
+				tripIndexUpdate(devid, first + i, e);
 			}
-			eod = 0;
 		}
-		date = year * 10000 + month * 100 + day;
+
+		int year = e->date / 10000;
+		int month = (e->date / 100) % 100;
+		int day = e->date % 100;
+		int hour = e->time / 10000;
+		int minute = (e->time / 100) % 100;
+		int second = e->time % 100;
+		struct tm t = { second, minute, hour, day, month - 1, year - 1900 };
+		time_t tm = mktime(&t);
+		n += snprintf(pb + n, bs - n, "{\"id\":\"%s\",\"key\":%u,\"utc\":\"%04u-%02u-%02uT%02u:%02u:%02uZ\",\"size\":%u,\"duration\":%u},",
+			file, (unsigned int)tm,
+			year, month, day, hour, minute, second,
+			e->size, e->duration
+		);
 	}
+	free(entries);
 	n--;
 	n += snprintf(pb + n, bs - n, "]");
 	param->contentLength = n;
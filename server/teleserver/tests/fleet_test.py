@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+# Fleet aggregates of teleserver: per-PID count, min, max and mean reported by
+# api/fleet follow the latest values of running devices through updates that
+# move extremes in and out and devices logging out and in
+# usage: fleet_test.py <teleserver binary>
+
+import json, os, random, shutil, subprocess, sys, tempfile, time, urllib.request
+
+HTTP_PORT = 18090
+UDP_PORT = 18091
+DEVICES = 12
+ROUNDS = 400
+PIDS = (0x10D, 0x10C)
+
+base = 'http://127.0.0.1:%d/api/' % HTTP_PORT
+
+def get(path, data=None):
+    req = urllib.request.Request(base + path, data=data.encode() if data else None)
+    return urllib.request.urlopen(req).read()
+
+def main():
+    rng = random.Random(1)
+    work = tempfile.mkdtemp()
+    server = subprocess.Popen([os.path.abspath(sys.argv[1]), '-p', str(HTTP_PORT), '-u', str(UDP_PORT), '-d', work],
+                              cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    failures = 0
+    try:
+        time.sleep(1)
+        running = {}
+        ts = 1000
+        for d in range(DEVICES):
+            get('notify/FDEV%04d?EV=1' % d)
+            running[d] = {}
+        for r in range(ROUNDS):
+            d = rng.randrange(DEVICES)
+            if d not in running:
+                get('notify/FDEV%04d?EV=1' % d)
+                running[d] = {}
+            elif rng.random() < 0.05:
+                get('notify/FDEV%04d?EV=2' % d)
+                del running[d]
+                continue
+            values = {pid: rng.randrange(0, 200) for pid in PIDS}
+            ts += 100
+            get('post/FDEV%04d' % d, '0:%d,' % ts + ','.join('%X:%d' % (pid, v) for pid, v in values.items()))
+            running[d].update(values)
+            fleet = json.loads(get('fleet?pid=10D,10C'))
+            reported = {p[0]: p[1:] for p in fleet['pids']}
+            for pid in PIDS:
+                vals = [v[pid] for v in running.values() if pid in v]
+                expect = [len(vals), min(vals), max(vals)] if vals else None
+                got = reported.get(pid)
+                ok = (got is None) if expect is None else (got is not None and got[:3] == expect and abs(got[3] - sum(vals) / len(vals)) < 1e-3)
+                if not ok:
+                    print('check failed: round %d pid %X expected %s got %s' % (r, pid, expect, got))
+                    failures += 1
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(work, ignore_errors=True)
+    print('fleet_test: ' + ('FAILED' if failures else 'OK'))
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Proxy forwarding of teleserver against a mock OsmAnd server on the proxy
+# port: every fix arrives once and in order per device, requests are
+# pipelined over a few keep-alive connections while the upstream is slow
+# usage: proxy_test.py <teleserver binary>
+
+import os, shutil, socket, subprocess, sys, tempfile, threading, time, urllib.request
+from collections import defaultdict
+
+PROXY_PORT = 5055
+HTTP_PORT = 18080
+UDP_PORT = 18081
+DEVICES = 16
+FIXES = 200
+UPSTREAM_DELAY = 0.02
+
+lock = threading.Lock()
+conns = 0
+maxBatch = 0
+fixes = defaultdict(list)
+
+def handle(c):
+    global conns, maxBatch
+    with lock:
+        conns += 1
+    buf = b''
+    while True:
+        d = c.recv(65536)
+        if not d:
+            break
+        buf += d
+        out = b''
+        n = 0
+        while b'\r\n\r\n' in buf:
+            req, buf = buf.split(b'\r\n\r\n', 1)
+            path = req.split(b'\r\n')[0].decode().split(' ')[1]
+            kv = dict(x.split('=', 1) for x in path.split('?', 1)[-1].split('&') if '=' in x)
+            with lock:
+                if 'lat' in kv:
+                    fixes[kv['id']].append(int(round((-33.0 - float(kv['lat'])) * 1e5)))
+            out += b'HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n'
+            n += 1
+        with lock:
+            maxBatch = max(maxBatch, n)
+        # slow upstream, requests queued meanwhile must be pipelined to keep up
+        time.sleep(UPSTREAM_DELAY)
+        c.sendall(out)
+
+def serve(s):
+    while True:
+        c, _ = s.accept()
+        threading.Thread(target=handle, args=(c,), daemon=True).start()
+
+def feed():
+    base = 'http://127.0.0.1:%d/api/' % HTTP_PORT
+    for d in range(DEVICES):
+        urllib.request.urlopen(base + 'notify/TDEV%04d?EV=1' % d).read()
+    for k in range(FIXES // 10):
+        for d in range(DEVICES):
+            body = ''
+            for j in range(10):
+                i = k * 10 + j
+                body += '0:%d,11:181018,10:%d,A:%.6f,B:151.200000,C:10,D:50,E:90,12:9,24:%d,' % (1000 + i * 100, 1200000 + i * 10, -33.0 - i * 1e-5, i)
+            urllib.request.urlopen(urllib.request.Request(base + 'post/TDEV%04d' % d, data=body[:-1].encode())).read()
+
+def main():
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('127.0.0.1', PROXY_PORT))
+    s.listen(16)
+    threading.Thread(target=serve, args=(s,), daemon=True).start()
+
+    work = tempfile.mkdtemp()
+    server = subprocess.Popen([os.path.abspath(sys.argv[1]), '-p', str(HTTP_PORT), '-u', str(UDP_PORT), '-d', work],
+                              cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(1)
+        start = time.time()
+        feed()
+        while time.time() - start < 60:
+            with lock:
+                if sum(len(v) for v in fixes.values()) >= DEVICES * FIXES:
+                    break
+            time.sleep(0.2)
+        elapsed = time.time() - start
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(work, ignore_errors=True)
+
+    failures = 0
+    def check(cond, what):
+        nonlocal failures
+        if not cond:
+            print('check failed: ' + what)
+            failures += 1
+    with lock:
+        check(len(fixes) == DEVICES, 'fixes of every device forwarded')
+        for dev, v in sorted(fixes.items()):
+            check(v == list(range(FIXES)), '%s: %d fixes once and in order' % (dev, FIXES))
+        check(maxBatch > 1, 'requests pipelined')
+        check(conns <= 4, 'keep-alive connections reused')
+    # one request per round trip would take DEVICES * FIXES * UPSTREAM_DELAY
+    check(elapsed < DEVICES * FIXES * UPSTREAM_DELAY / 4, 'forwarded in %.1f s' % elapsed)
+    print('proxy_test: ' + ('FAILED' if failures else 'OK'))
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
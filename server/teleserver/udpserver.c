@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include "httpd.h"
 #include "teleserver.h"
+#include "logdata.h"
 
 CHANNEL_DATA* assignChannel(const char* id);
 FILE* createDataFile(CHANNEL_DATA* pld);
@@ -55,6 +56,240 @@ int addChecksump(char* data)
 	return (int)(s - data);
 }
 
+uint16_t crc16(const uint8_t* data, int len)
+{
+	// CRC-16/CCITT
+	uint16_t crc = 0xffff;
+	for (int i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (int n = 0; n < 8; n++) {
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static int readVarint(const uint8_t** pp, const uint8_t* end, uint32_t* value)
+{
+	const uint8_t* p = *pp;
+	uint32_t v = 0;
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		uint8_t c = *(p++);
+		v |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*value = v;
+			*pp = p;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int readZigzag(const uint8_t** pp, const uint8_t* end, int32_t* value)
+{
+	uint32_t v;
+	if (!readVarint(pp, end, &v)) return 0;
+	*value = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+	return 1;
+}
+
+static int printFixed(char* buf, int bufsize, int32_t value, int32_t scale, int digits)
+{
+	uint32_t v = value < 0 ? -(uint32_t)value : value;
+	return snprintf(buf, bufsize, "%s%u.%0*u", value < 0 ? "-" : "", v / scale, digits, v % scale);
+}
+
+static DELTA_REF* lookupDeltaRef(DELTA_STATE* state, uint16_t pid)
+{
+	for (int i = 0; i < state->count; i++) {
+		if (state->ref[i].pid == pid) return state->ref + i;
+	}
+	if (state->count < DELTA_MAX_PIDS) {
+		// first value since keyframe is absolute
+		DELTA_REF* ref = state->ref + (state->count++);
+		memset(ref, 0, sizeof(DELTA_REF));
+		ref->pid = pid;
+		return ref;
+	}
+	return 0;
+}
+
+static void applyDelta(DELTA_STATE* state, int pid, int32_t* v, int count)
+{
+	if (!state) return;
+	DELTA_REF* ref = lookupDeltaRef(state, pid);
+	if (!ref) return;
+	for (int i = 0; i < count; i++) {
+		v[i] = (int32_t)((uint32_t)ref->value[i] + (uint32_t)v[i]);
+		ref->value[i] = v[i];
+	}
+}
+
+/*
+Binary packet (protocol v2):
+<magic><feed ID (16-bit)>[<varint key><value(s)>]...<CRC16>
+key = (pid << 3) | type
+Delta packet (protocol v3):
+<magic><feed ID (16-bit)><sequence><flags>[<varint key><value(s)>]...<CRC16>
+All values but text are zigzag deltas from the last ones of the same PID, which
+are zero after a keyframe. PIDs not changed beyond device side deadband are omitted.
+Records are converted into text payload of the same form as text protocol.
+*/
+// decodes one record into text of the form "PID:value,", returns its length or -1 if broken
+static int decodeRecord(const uint8_t** pp, const uint8_t* end, char* buf, int bufsize, uint32_t* ts, DELTA_STATE* state)
+{
+	uint32_t key;
+	if (!readVarint(pp, end, &key)) return -1;
+	int pid = key >> 3;
+	int32_t v[3];
+	uint32_t u;
+	int n = 0;
+	switch (key & 0x7) {
+	case BIN_TYPE_INT:
+		if (!readZigzag(pp, end, v)) return -1;
+		applyDelta(state, pid, v, 1);
+		n += sprintf(buf + n, "%X:%d,", pid, v[0]);
+		break;
+	case BIN_TYPE_UINT:
+		if (state) {
+			if (!readZigzag(pp, end, v)) return -1;
+			applyDelta(state, pid, v, 1);
+			u = (uint32_t)v[0];
+		}
+		else if (!readVarint(pp, end, &u)) {
+			return -1;
+		}
+		// absolute timestamp (log files) resets the base of deltas
+		if (pid == 0) *ts = u;
+		n += sprintf(buf + n, "%X:%u,", pid, u);
+		break;
+	case BIN_TYPE_FIXED2:
+		if (!readZigzag(pp, end, v)) return -1;
+		applyDelta(state, pid, v, 1);
+		n += sprintf(buf + n, "%X:", pid);
+		n += printFixed(buf + n, bufsize - n, v[0], 100, 2);
+		buf[n++] = ',';
+		break;
+	case BIN_TYPE_FIXED6:
+		if (!readZigzag(pp, end, v)) return -1;
+		applyDelta(state, pid, v, 1);
+		n += sprintf(buf + n, "%X:", pid);
+		n += printFixed(buf + n, bufsize - n, v[0], 1000000, 6);
+		buf[n++] = ',';
+		break;
+	case BIN_TYPE_TRIPLE:
+		if (!readZigzag(pp, end, v) || !readZigzag(pp, end, v + 1) || !readZigzag(pp, end, v + 2)) return -1;
+		applyDelta(state, pid, v, 3);
+		n += sprintf(buf + n, "%X:%d;%d;%d,", pid, v[0], v[1], v[2]);
+		break;
+	case BIN_TYPE_TS_DELTA:
+		if (!readZigzag(pp, end, v)) return -1;
+		*ts += (uint32_t)v[0];
+		n += sprintf(buf + n, "%X:%u,", pid, *ts);
+		break;
+	case BIN_TYPE_TEXT:
+		if (!readVarint(pp, end, &u) || u > (uint32_t)(end - *pp) || (int)u > bufsize - 16) return -1;
+		n += sprintf(buf + n, "%X:%.*s,", pid, (int)u, (const char*)*pp);
+		*pp += u;
+		break;
+	default:
+		return -1;
+	}
+	return n;
+}
+
+int decodeBinaryPayload(const uint8_t* data, int len, char* buf, int bufsize, DELTA_STATE* state)
+{
+	const uint8_t* p = data;
+	const uint8_t* end = data + len;
+	uint32_t ts = state ? state->ts : 0;
+	int n = 0;
+	while (p < end && n < bufsize - 64) {
+		int m = decodeRecord(&p, end, buf + n, bufsize - n, &ts, state);
+		if (m < 0) return -1;
+		n += m;
+	}
+	if (state) state->ts = ts;
+	if (n > 0 && buf[n - 1] == ',') n--;
+	buf[n] = 0;
+	return n;
+}
+
+/*
+Binary log file written by device (LOG_FORMAT_BIN):
+<"FLB" 0x01>[<varint key><value(s)>]...
+Same records as protocol v2, timestamps are absolute (BIN_TYPE_UINT) or deltas.
+Records are read back as text lines of the same form as stored data, one per
+timestamp, so data files of either format can be processed alike.
+*/
+void openDataReader(DATA_READER* rd, FILE* fp)
+{
+	memset(rd, 0, sizeof(DATA_READER));
+	rd->fp = fp;
+	if (!fp) return;
+	rd->len = fread(rd->buf, 1, LOG_BIN_HEADER_SIZE, fp);
+	if (rd->len == LOG_BIN_HEADER_SIZE && !memcmp(rd->buf, LOG_BIN_MAGIC, LOG_BIN_HEADER_SIZE)) {
+		rd->binary = 1;
+		rd->len = 0;
+	}
+	else {
+		rd->len = 0;
+		rewind(fp);
+	}
+}
+
+// reads one line of data into buf, returns its length or -1 at end of file
+int readDataLine(DATA_READER* rd, char* buf, int bufsize)
+{
+	if (!rd->fp) return -1;
+	if (!rd->binary) {
+		if (fscanf(rd->fp, "%1024s\n", buf) <= 0) return -1;
+		return strlen(buf);
+	}
+	int n = 0;
+	for (;;) {
+		if (rd->len - rd->pos < LOG_MAX_RECORD_SIZE && !feof(rd->fp)) {
+			rd->len -= rd->pos;
+			memmove(rd->buf, rd->buf + rd->pos, rd->len);
+			rd->pos = 0;
+			rd->len += fread(rd->buf + rd->len, 1, sizeof(rd->buf) - rd->len, rd->fp);
+		}
+		// zero byte marks end of data
+		if (rd->pos >= rd->len || rd->buf[rd->pos] == 0) break;
+		// next timestamp starts a new line
+		if (n > 0 && rd->buf[rd->pos] < 8) break;
+		if (n >= bufsize - 64) break;
+		const uint8_t* p = rd->buf + rd->pos;
+		int m = decodeRecord(&p, rd->buf + rd->len, buf + n, bufsize - n, &rd->ts, 0);
+		if (m < 0) {
+			// broken or truncated record
+			rd->pos = rd->len;
+			break;
+		}
+		rd->pos = p - rd->buf;
+		n += m;
+	}
+	if (n == 0) return -1;
+	if (buf[n - 1] == ',') n--;
+	buf[n] = 0;
+	return n;
+}
+
+// checks integrity of data packet without altering it
+static int validPacket(const char* buf, int len)
+{
+	const uint8_t* bin = (const uint8_t*)buf;
+	if (bin[0] == PROTOCOL_V2_MAGIC || bin[0] == PROTOCOL_V3_MAGIC) {
+		int hdrlen = bin[0] == PROTOCOL_V3_MAGIC ? 5 : 3;
+		return len >= hdrlen + 2 && crc16(bin, len - 2) == (((uint16_t)bin[len - 2] << 8) | bin[len - 1]);
+	}
+	const char *p = strrchr(buf, '*');
+	if (!p || !memchr(buf, '#', p - buf)) return 0;
+	uint8_t sum = 0;
+	for (const char *s = buf; s < p; s++) sum += *s;
+	return hex2uint8(p + 1) == sum;
+}
+
 int incomingUDPCallback(void* _hp)
 {
 	HttpParam* hp = (HttpParam*)_hp;
@@ -71,56 +306,145 @@ int incomingUDPCallback(void* _hp)
 	/*
 	Data format:
 	<ID>#<timestamp>:<pid>=<data>[$<checksum>]
+	Backlog packet (data held by device while offline, acknowledged by sequence number):
+	<magic><feed ID (16-bit)><sequence (32-bit)><data packet>
 	*/
 
 	buf[recv] = 0;
 	hostaddr = inet_ntoa(cliaddr.sin_addr);
 	fprintf(stderr, "%u bytes from %s | ", recv, hostaddr);
 
-	// validate checksum
-	if (!verifyChecksum(buf)) {
-		fprintf(stderr, "UDP data checksum mismatch\n%s\n", buf);
-		return -1;
-	}
-
 	int success = 0;
 	CHANNEL_DATA* pld = 0;
 	char *msg = 0;
-	char *data;
+	char *data = 0;
 	char* devid = 0;
+	int resync = 0;
+	int backlog = 0;
+	uint32_t backlogSeq = 0;
 
-	// validate header
-	data = strchr(buf, '#');
-	if (!data) {
-		// invalid header
-		fprintf(stderr, "Invalid data received - %s\n", buf);
-		return -1;
+	if ((uint8_t)buf[0] == BACKLOG_MAGIC && recv > 7) {
+		uint8_t* hdr = (uint8_t*)buf;
+		uint16_t id = ((uint16_t)hdr[1] << 8) | hdr[2];
+		backlogSeq = ((uint32_t)hdr[3] << 24) | ((uint32_t)hdr[4] << 16) | ((uint32_t)hdr[5] << 8) | hdr[6];
+		pld = findChannelByID(id);
+		if (!pld) {
+			fprintf(stderr, "INVALID CHANNEL - %u\n", id);
+			return -1;
+		}
+		backlog = 1;
+		if (backlogSeq <= pld->backlogSeq && pld->backlogSeq - backlogSeq < BACKLOG_DEDUP_WINDOW) {
+			// already received, acknowledge again
+			fprintf(stderr, "Duplicated backlog #%u\n", backlogSeq);
+			recv = 0;
+		}
+		else {
+			// unwrap data packet, which belongs to current feed
+			recv -= 7;
+			memmove(buf, buf + 7, recv);
+			buf[recv] = 0;
+			if ((uint8_t)buf[0] == PROTOCOL_V2_MAGIC || (uint8_t)buf[0] == PROTOCOL_V3_MAGIC) {
+				buf[1] = (char)(id >> 8);
+				buf[2] = (char)id;
+			}
+			if (!validPacket(buf, recv)) {
+				// acknowledged anyway as retransmission won't help
+				fprintf(stderr, "Invalid backlog #%u\n", backlogSeq);
+				recv = 0;
+			}
+		}
 	}
 
-	// parse feed ID or device ID
-	*data = 0;
-	if ((int)(data - buf) > 4) {
-		devid = buf;
-		pld = findChannelByDeviceID(buf);
-		if (pld) {
-			devid = buf;
+	int binary = recv > 0 && ((uint8_t)buf[0] == PROTOCOL_V2_MAGIC || (uint8_t)buf[0] == PROTOCOL_V3_MAGIC);
+
+	if (backlog && recv == 0) {
+		// nothing to process
+	}
+	else if (binary) {
+		// binary data packet
+		static char payload[sizeof(buf) * 8];
+		uint8_t* bin = (uint8_t*)buf;
+		int delta = bin[0] == PROTOCOL_V3_MAGIC;
+		int hdrlen = delta ? 5 : 3;
+		if (recv < hdrlen + 2 || crc16(bin, recv - 2) != (((uint16_t)bin[recv - 2] << 8) | bin[recv - 1])) {
+			fprintf(stderr, "UDP data CRC mismatch\n");
+			return -1;
+		}
+		pld = findChannelByID(((uint16_t)bin[1] << 8) | bin[2]);
+		if (!pld) {
+			return -1;
+		}
+		DELTA_STATE* state = 0;
+		if (delta) {
+			state = &pld->delta;
+			if (bin[4] & DELTA_FLAG_KEYFRAME) {
+				memset(state, 0, sizeof(DELTA_STATE));
+				state->valid = 1;
+			}
+			else if (state->valid && bin[3] != (uint8_t)(state->seq + 1)) {
+				fprintf(stderr, "Delta packet lost (expected %u, received %u)\n", (uint8_t)(state->seq + 1), bin[3]);
+				state->valid = 0;
+			}
+			state->seq = bin[3];
+			if (!state->valid) {
+				// values unknown until next keyframe
+				resync = 1;
+			}
 		}
+		if (!resync && decodeBinaryPayload(bin + hdrlen, recv - hdrlen - 2, payload, sizeof(payload), state) < 0) {
+			fprintf(stderr, "Invalid binary data received\n");
+			if (!state) return -1;
+			state->valid = 0;
+			resync = 1;
+		}
+		data = resync ? 0 : payload;
 	}
 	else {
-		int id = hex2uint16(buf);
-		if (id) pld = findChannelByID(id);
+		// validate checksum
+		if (!verifyChecksum(buf)) {
+			fprintf(stderr, "UDP data checksum mismatch\n%s\n", buf);
+			return -1;
+		}
+
+		// validate header
+		data = strchr(buf, '#');
+		if (!data) {
+			// invalid header
+			fprintf(stderr, "Invalid data received - %s\n", buf);
+			return -1;
+		}
+
+		// parse feed ID or device ID
+		*data = 0;
+		if (backlog) {
+			// feed given by backlog header
+		}
+		else if ((int)(data - buf) > 4) {
+			devid = buf;
+			pld = findChannelByDeviceID(buf);
+			if (pld) {
+				devid = buf;
+			}
+		}
+		else {
+			int id = hex2uint16(buf);
+			if (id) pld = findChannelByID(id);
+		}
+		data++; // now points to the start of data chunks
 	}
-	data++; // now points to the start of data chunks
 
 	uint64_t serverTick = GetTickCount64();
 	uint32_t deviceTick = 0;
 	uint32_t token = 0;
 	int16_t eventID = 0;
+	int dup = 0;
 	uint16_t devflags = 0;
 
-	if (strstr(data, "EV=")) {
+	if (!binary && !backlog && strstr(data, "EV=")) {
 		char* vin = 0;
 		char* key = 0;
+		int protocol = 1;
+		int cmdQueue = 0;
 		char *s = strtok(data, ",");
 		do {
 			if (!strncmp(s, "EV=", 3)) {
@@ -147,6 +471,15 @@ int incomingUDPCallback(void* _hp)
 			else if (!strncmp(s, "SK=", 3)) {
 				key = s + 3;
 			}
+			else if (!strncmp(s, "PV=", 3)) {
+				protocol = atoi(s + 3);
+			}
+			else if (!strncmp(s, "CQ=", 3)) {
+				cmdQueue = atoi(s + 3);
+			}
+			else if (!strncmp(s, "DUP=", 4)) {
+				dup = atoi(s + 4);
+			}
 		} while (s = strtok(0, ","));
 
 
@@ -163,6 +496,8 @@ int incomingUDPCallback(void* _hp)
 				strcpy(pld->vin, vin);
 			}
 			pld->devflags = devflags;
+			pld->protocol = protocol >= 3 ? 3 : (protocol == 2 ? 2 : 1);
+			pld->cmdQueue = cmdQueue ? 1 : 0;
 			// TODO: also check timed out device
 			if (*serverKey) {
 				// match server key
@@ -189,7 +524,9 @@ int incomingUDPCallback(void* _hp)
 			// clear cache
 			pld->cacheReadPos = 0;
 			pld->cacheWritePos = 0;
+			proxyReset(pld);
 			// clear instance data cache
+			fleetRemove(pld);
 			memset(pld->mode, 0, sizeof(pld->mode));
 		}
 	}
@@ -210,41 +547,24 @@ int incomingUDPCallback(void* _hp)
 #endif
 
 	if (eventID == 0) {
-		processPayload(data, pld, 1);
+		if (data) processPayload(data, pld, 1);
 	} else if (eventID == EVENT_PING) {
 		processPayload(data, pld, 0);
 	} else if (eventID == EVENT_ACK) {
-		// pending command executed
-		if (msg) {
-			for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
-				COMMAND_BLOCK *cmd = pld->cmd + i;
-				if (cmd->token && cmd->token == token) {
-					cmd->flags |= CMD_FLAG_RESPONDED;
-					cmd->elapsed = (uint16_t)(pld->serverDataTick - cmd->tick);
-					// store received message
-					int len = strlen(msg);
-					if (cmd->message) {
-						if (len > cmd->len) {
-							free(cmd->message);
-							cmd->message = malloc(len + 1);
-						}
-					}
-					else {
-						cmd->message = malloc(len + 1);
-					}
-					cmd->len = len;
-					strcpy(cmd->message, msg);
-					break;
-				}
-			}
-		}
+		// pending command executed (or executed before if no message)
+		if (msg || dup) ackCommand(pld, token, msg);
 		// no response needed for ACK
 		return 0;
 	}
 
-	if (eventID == 0) {
-		if (serverTick - pld->serverSyncTick >= SYNC_INTERVAL * 1000) {
-			// send sync event
+	if (backlog) {
+		// acknowledge backlog packet
+		if (recv > 0) pld->backlogSeq = backlogSeq;
+		eventID = EVENT_BACKLOG;
+	}
+	else if (eventID == 0) {
+		if (resync || serverTick - pld->serverSyncTick >= SYNC_INTERVAL * 1000 || hasDueCommands(pld, serverTick)) {
+			// send sync event (also carrying due commands)
 			pld->serverSyncTick = serverTick;
 			eventID = EVENT_SYNC;
 		}
@@ -255,6 +575,20 @@ int incomingUDPCallback(void* _hp)
 	}
 	// generate response
 	int len = sprintf(buf, "%X#EV=%u,RX=%u,TX=%u", pld->id, eventID, pld->recvCount, ++pld->txCount);
+	if (eventID == EVENT_LOGIN && pld->protocol >= 2) {
+		// accept binary data protocol
+		len += sprintf(buf + len, ",PV=%u", pld->protocol);
+	}
+	if (eventID == EVENT_BACKLOG) {
+		len += sprintf(buf + len, ",SQ=%u", backlogSeq);
+	}
+	if (resync) {
+		// request keyframe of delta encoded data
+		len += sprintf(buf + len, ",KF=1");
+	}
+	if (eventID == EVENT_SYNC) {
+		len = appendCommands(pld, buf, len, serverTick);
+	}
 	switch (eventID) {
 	case EVENT_LOGOUT:
 		deviceLogout(pld);
@@ -264,6 +598,8 @@ int incomingUDPCallback(void* _hp)
 		pld->serverPingTick = serverTick;
 		pld->flags &= ~FLAG_RUNNING;
 		pld->flags |= (FLAG_SLEEPING | FLAG_PINGED);
+		// ping is relayed to proxy server as heartbeat
+		proxyNotify(pld);
 		break;
 	case EVENT_RECONNECT:
 		fprintf(stderr, "DEVICE RECONNECTED, ID:%s\n", pld->devid);
@@ -278,47 +614,3 @@ int incomingUDPCallback(void* _hp)
 
 	return 0;
 }
-
-uint32_t issueCommand(HttpParam* hp, CHANNEL_DATA *pld, const char* cmd, uint32_t token)
-{
-	if (token == 0) token = ++pld->cmdCount;
-	char buf[128];
-	sprintf(buf, "%X#EV=%u,TK=%u,CMD=%s", pld->id, EVENT_COMMAND, token, cmd);
-	int len = addChecksump(buf);
-	socklen_t socklen = sizeof(struct sockaddr);
-	pld->serverDataTick = GetTickCount64();
-	if (sendto(hp->udpSocket, buf, len, 0, (struct sockaddr *)&pld->udpPeer, socklen) == len) {
-		fprintf(stderr, "Command sent: %s (%u)\n", cmd, token);
-		// find out checked pending command
-		COMMAND_BLOCK *cmd = 0;
-		for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
-			cmd = pld->cmd + i;
-			if (cmd->token == 0 || (cmd->flags & CMD_FLAG_CHECKED)) {
-				break;
-			}
-			cmd = 0;
-		}
-		if (!cmd) {
-			// find out oldest pending command regardless of its status
-			unsigned int maxElapsed = 0;
-			for (int i = 0; i < MAX_PENDING_COMMANDS; i++) {
-				unsigned int elapsed = (unsigned int)(pld->serverDataTick - pld->cmd[i].tick);
-				if (elapsed >= maxElapsed) {
-					cmd = pld->cmd + i;
-					maxElapsed = elapsed;
-				}
-			}
-		}
-		if (cmd) {
-			// place sent command in pending command list
-			cmd->token = token;
-			cmd->tick = pld->serverDataTick;
-			cmd->flags = 0;
-		}
-		return token;
-	}
-	else {
-		fprintf(stderr, "Command unsent\n");
-		return 0;
-	}
-}